@@ -8,6 +8,17 @@
 #include "watdefs.h"
 #include "comets.h"
 #include "afuncs.h"
+#include "threads.h"
+#include "environ.h"
+
+#if defined( __linux) || defined( __unix__) || defined( __APPLE__)
+   #define BC405_MMAP
+   #include <sys/mman.h>
+   #include <sys/stat.h>
+   #include <sys/file.h>
+   #include <fcntl.h>
+   #include <unistd.h>
+#endif
 
 /* BC-405 gives orbital elements for 300 large asteroids at 40-day intervals,
 running from JD 2378495.0 = 1799 Dec 30.5 to JD 2524615.0 = 2200 Jan 22.5.
@@ -30,6 +41,14 @@ in a file of 6 * 300 * 3654 = 52 617 600 bytes.  The input file is called
 int detect_perturbers( const double jd, const double * __restrict xyz,
                        double *accel);          /* bc405.cpp */
 double *get_asteroid_mass( const int astnum);   /* bc405.cpp */
+const double *get_asteroid_masses( int *n_masses);    /* bc405.cpp */
+const void *map_whole_file( FILE *fp, size_t *n_bytes);     /* bc405.cpp */
+void unmap_whole_file( const void *addr, const size_t n_bytes); /* bc405.cpp */
+FILE *lock_data_file( const char *filename);                /* bc405.cpp */
+void unlock_data_file( FILE *fp);                           /* bc405.cpp */
+FILE *create_temp_data_file( const char *filename, char *temp_name);
+FILE *replace_data_file( FILE *locked_fp, const char *filename,
+                                 const char *temp_name);    /* bc405.cpp */
 int generic_message_box( const char *message, const char *box_type);
 int asteroid_position_raw( const int astnum, const double jd,
                               double *posn);       /* bc405.cpp */
@@ -45,11 +64,145 @@ static int bc405_n_asteroids = MAX_BC405_N_ASTEROIDS;
 static double bc405_start_jd = 2378495.;
 static double bc405_chunk_time = 40.;
 
+/* On *nix boxes,  the element file 'bc405.dat' (or 'bc405sub.dat') and
+the precomputed box file 'bc405pre.dat' are mapped into memory read-only,
+so getting the elements for an asteroid is just a matter of pointing into
+the mapping,  instead of an fseek( ) and fread( ) each time.  The box file
+is still written through its FILE pointer when boxes are computed;  the
+mapping is shared,  so it sees what was written.  (map_whole_file( ) is
+also used for the geopotential grid in 'runge.cpp'.)   */
+
+static const double *mapped_elems = NULL;
+static size_t mapped_elems_bytes;
+
+const void *map_whole_file( FILE *fp, size_t *n_bytes)
+{
+#ifdef BC405_MMAP
+   struct stat file_info;
+   void *addr;
+
+   fflush( fp);
+   if( fstat( fileno( fp), &file_info) || !file_info.st_size)
+      return( NULL);
+   addr = mmap( NULL, (size_t)file_info.st_size, PROT_READ, MAP_SHARED,
+                              fileno( fp), 0);
+   if( addr == MAP_FAILED)
+      return( NULL);
+   *n_bytes = (size_t)file_info.st_size;
+   return( addr);
+#else
+   return( NULL);
+#endif
+}
+
+void unmap_whole_file( const void *addr, const size_t n_bytes)
+{
+#ifdef BC405_MMAP
+   if( addr)
+      munmap( (void *)addr, n_bytes);
+#endif
+}
+
+/* 'bc405.dat',  'bc405pre.dat',  'bc405cheb.dat' and 'geo_grid.dat' are
+created by whichever process first needs them,  then mapped.  With 'fo -p',
+several processes may try that at once;  and if one truncates or rewrites
+a file another has mapped,  the latter gets a SIGBUS.  So such files are
+never modified in place,  except for filling in zeroed areas.  Instead :
+
+   lock_data_file( ) opens the file for update (creating it,  empty,  if
+need be) and holds an exclusive flock( ) on it.  With the lock held,  the
+caller checks the size and header.  If they're wrong,  it writes a complete
+new file under the name create_temp_data_file( ) gives,  and calls
+replace_data_file( ) to rename( ) it into place and lock it.  Processes
+that had mapped the old file keep their (now nameless) copy of it;  those
+waiting for the lock on it notice that it's been replaced and start over
+with the new one.  Once the file is mapped,  unlock_data_file( ) lets the
+next process in.
+
+   Elsewhere,  there's no mmap( ) or flock( ),  so we just open the file
+and (after removing the old file) rename the new one.  */
+
+FILE *lock_data_file( const char *filename)
+{
+   FILE *rval = NULL;
+#ifdef BC405_MMAP
+   bool done = false;
+
+   while( !done)
+      {
+      struct stat file_info, name_info;
+      const int fd = open( filename, O_RDWR | O_CREAT, 0644);
+
+      if( fd < 0)
+         return( NULL);
+      flock( fd, LOCK_EX);
+      if( !fstat( fd, &file_info) && !stat( filename, &name_info)
+                  && file_info.st_dev == name_info.st_dev
+                  && file_info.st_ino == name_info.st_ino)
+         {
+         done = true;
+         rval = fdopen( fd, "r+b");
+         }
+      if( !rval)     /* replaced while we waited for it,  or fdopen failed */
+         {
+         flock( fd, LOCK_UN);
+         close( fd);
+         }
+      }
+#else
+   rval = fopen( filename, "r+b");
+   if( !rval)
+      rval = fopen( filename, "w+b");
+#endif
+   return( rval);
+}
+
+void unlock_data_file( FILE *fp)
+{
+#ifdef BC405_MMAP
+   fflush( fp);
+   flock( fileno( fp), LOCK_UN);
+#endif
+}
+
+FILE *create_temp_data_file( const char *filename, char *temp_name)
+{
+#ifdef BC405_MMAP
+   snprintf( temp_name, 255, "%s.%ld", filename, (long)getpid( ));
+#else
+   snprintf( temp_name, 255, "%s.tmp", filename);
+#endif
+   return( fopen( temp_name, "wb"));
+}
+
+FILE *replace_data_file( FILE *locked_fp, const char *filename,
+                                 const char *temp_name)
+{
+#ifdef BC405_MMAP
+   const int rename_failed = rename( temp_name, filename);
+
+   unlock_data_file( locked_fp);    /* rename first,  so waiters see the */
+   fclose( locked_fp);              /* file was replaced */
+   if( rename_failed)
+      {
+      unlink( temp_name);
+      return( NULL);
+      }
+#else
+   fclose( locked_fp);
+   remove( filename);
+   if( rename( temp_name, filename))
+      return( NULL);
+#endif
+   return( lock_data_file( filename));
+}
+
 static FILE *open_bc405_file( void)
 {
    const char *data_file_name = "bc405.dat";
    static FILE *ifile;
    static int failure_detected = 0;
+   static bool map_tried = false;
 
    if( failure_detected)
       return( NULL);
@@ -75,25 +228,37 @@ static FILE *open_bc405_file( void)
             count = fread( &temp, sizeof( int32_t), 1, ifile);
             assert( count);
             n_bc405_chunks = (int)temp;
-            return( ifile);
             }
          }
-      else
-         {
-         char buff[100];
-         FILE *ofile = fopen( data_file_name, "wb");
+      else     /* convert to binary,  unless someone else just did */
+         {        /* (the lock is on the text file;  see above)     */
+         char buff[100], temp_name[255];
+         FILE *ofile;
 
+#ifdef BC405_MMAP
+         flock( fileno( ifile), LOCK_EX);
+#endif
+         ofile = fopen( data_file_name, "rb");
          if( !ofile)
-            return( NULL);
-         while( fgets( buff, sizeof( buff), ifile))
             {
-            const double z = atof( buff);
+            ofile = create_temp_data_file( data_file_name, temp_name);
+            if( !ofile)
+               {
+               fclose( ifile);
+               return( NULL);
+               }
+            while( fgets( buff, sizeof( buff), ifile))
+               {
+               const double z = atof( buff);
 
-            fwrite( &z, 1, sizeof( double), ofile);
+               fwrite( &z, 1, sizeof( double), ofile);
+               }
+            fclose( ofile);
+            rename( temp_name, data_file_name);
+            ofile = fopen( data_file_name, "rb");
             }
-         fclose( ifile);
-         fclose( ofile);
-         ifile = fopen( data_file_name, "rb");
+         fclose( ifile);         /* releases the lock */
+         ifile = ofile;
          assert( ifile != NULL);
          }
       }
@@ -106,18 +271,47 @@ static FILE *open_bc405_file( void)
                   "fix this by downloading the necessary files.  See\n"
                   "https://www.projectpluto.com/ast_pert.htm for details.\n", "o");
       }
+   else if( !map_tried)
+      {
+      map_tried = true;
+      mapped_elems = (const double *)map_whole_file( ifile, &mapped_elems_bytes);
+      }
    return( ifile);
 }
 
 #define GAUSS_K .01720209895
 #define SOLAR_GM (GAUSS_K * GAUSS_K)
 
-static void grab_elems( ELEMENTS *elems, FILE *fp, const int chunk_number)
+/* Returns the six elements for the given asteroid and chunk,  either
+from the mapping or (if there is none) read into 'buff'.   */
+
+static const double *get_elem_array( const int chunk_number,
+                     const int asteroid_number, double *buff)
+{
+   const size_t offset = ((size_t)chunk_number * bc405_n_asteroids
+                                 + asteroid_number) * 6;
+   FILE *fp = open_bc405_file( );
+
+   if( mapped_elems && (offset + 6) * sizeof( double) <= mapped_elems_bytes)
+      return( mapped_elems + offset);
+   memset( buff, 0, 6 * sizeof( double));
+   if( fp)
+      {
+      fseek( fp, offset * sizeof( double), SEEK_SET);
+      if( fread( buff, sizeof( double), 6, fp) != 6)
+         memset( buff, 0, 6 * sizeof( double));
+      }
+   return( buff);
+}
+
+static void grab_elems( ELEMENTS *elems, const int chunk_number,
+                        const int asteroid_number)
 {
-   double array[6];
+   double buff[6];
+   const double *array = get_elem_array( chunk_number, asteroid_number, buff);
 
    memset( elems, 0, sizeof( ELEMENTS));
-   if( fread( array, sizeof( double), 6, fp) == 6)
+   if( array[0])
       {
       elems->major_axis = array[0];
       elems->ecc = array[1];
@@ -134,52 +328,48 @@ static void grab_elems( ELEMENTS *elems, FILE *fp, const int chunk_number)
    assert( array[1] > 0. && array[1] < 1.);
 }
 
-#define N_CACHED_ELEMS 30
+/* Elements (with derived quantities already computed) are cached in a
+table keyed by chunk and asteroid number.  The slot is just their index
+in the element file,  modulo the table size;  since that's at least three
+times the number of asteroids,  the elements for all asteroids in three
+consecutive chunks can be cached at once without collisions.  So an
+object crossing a chunk boundary with all 300 perturbers doesn't evict
+what it'll need in the next step,  as happened with the old 30-entry
+move-to-front list.   */
+
+#define N_CACHED_ELEMS 1024
 
 static void grab_cached_elems( ELEMENTS *elems, const int chunk_number,
                                  const int asteroid_number)
 {
    static int astnums[N_CACHED_ELEMS], chunk_num[N_CACHED_ELEMS];
    static ELEMENTS *cache = NULL;
-   FILE *fp = open_bc405_file( );
    int i;
 
-   assert( fp);
    if( !elems)
       {
       if( cache)
          free( cache);
       cache = NULL;
-      for( i = 0; i < N_CACHED_ELEMS; i++)
-         astnums[i] = chunk_num[i] = -1;
       return;
       }
    if( !cache)
-      cache = (ELEMENTS *)calloc( N_CACHED_ELEMS, sizeof( ELEMENTS));
-   assert( cache);
-   if( !cache)
-      return;
-   for( i = 0; i < N_CACHED_ELEMS && (asteroid_number != astnums[i]
-               || chunk_number != chunk_num[i]); i++)
-      ;
-   if( i == N_CACHED_ELEMS)      /* looked in entire cache,  didn't find it */
       {
-      i--;
-      fseek( fp, (chunk_number * bc405_n_asteroids + asteroid_number)
-                            * 6 * sizeof( double), SEEK_SET);
-      grab_elems( &cache[i], fp, chunk_number);
+      cache = (ELEMENTS *)calloc( N_CACHED_ELEMS, sizeof( ELEMENTS));
+      assert( cache);
+      if( !cache)
+         return;
+      for( i = 0; i < N_CACHED_ELEMS; i++)
+         astnums[i] = chunk_num[i] = -1;
       }
-   *elems = cache[i];
-   while( i > 0)
+   i = (chunk_number * bc405_n_asteroids + asteroid_number) % N_CACHED_ELEMS;
+   if( asteroid_number != astnums[i] || chunk_number != chunk_num[i])
       {
-      cache[i] = cache[i - 1];
-      astnums[i] = astnums[i - 1];
-      chunk_num[i] = chunk_num[i - 1];
-      i--;
+      grab_elems( &cache[i], chunk_number, asteroid_number);
+      astnums[i] = asteroid_number;
+      chunk_num[i] = chunk_number;
       }
-   cache[0] = *elems;
-   astnums[0] = asteroid_number;
-   chunk_num[0] = chunk_number;
+   *elems = cache[i];
 }
 
 /* The idea of using 300 asteroid perturbers routinely is computationally
@@ -207,7 +397,7 @@ to zero,  or sometimes a few.
 
    A few wrinkles to be considered : the scaled-integer xyz ranges are
 stored in the file 'bc405pre.dat'.  This file is created if it does not
-exist,  and filled with zeroes for all the 40-day ranges for all 300
+exist (or is the wrong size),  and filled with zeroes for all the 40-day ranges for all 300
 asteroids.  Then,  as ranges are needed,  they are computed and written
 back out to the file.  This wasn't a big deal to do,  and spared the
 need to distribute a rather large data file.
@@ -220,14 +410,20 @@ situation,  (GM)^-0.5 is actually right.  Currently,  it's set up so
 that (2) Pallas has an effective range of 10 AU,  and all others are
 scaled to this.            */
 
+static const int16_t *mapped_boxes = NULL;
+static size_t mapped_boxes_bytes;
+
 static FILE *get_precomputed_data_fp( void)
 {
    const char *data_file_name = "bc405pre.dat";
-   FILE *ifile = fopen( data_file_name, "r+b");
+   const long n_bytes = 3L * (long)n_bc405_chunks * (long)bc405_n_asteroids
+                              * (long)sizeof( int16_t);
+   FILE *ifile = lock_data_file( data_file_name);
 
-   if( !ifile)             /* Create output binary file if not found, */
-      {                    /* seeding with zeroes :                   */
-      FILE *ofile = fopen( data_file_name, "w+b");
+   if( ifile && (fseek( ifile, 0L, SEEK_END) || ftell( ifile) != n_bytes))
+      {                    /* (Re)create the file,  seeding with zeroes : */
+      char temp_name[255];
+      FILE *ofile = create_temp_data_file( data_file_name, temp_name);
       int16_t posns[MAX_BC405_N_ASTEROIDS];
       int i;
 
@@ -241,9 +437,14 @@ static FILE *get_precomputed_data_fp( void)
          assert( count == (size_t)bc405_n_asteroids);
          }
       fclose( ofile);
-      ifile = fopen( data_file_name, "r+b");
+      ifile = replace_data_file( ifile, data_file_name, temp_name);
       assert( ifile);
       }
+   if( ifile)
+      {
+      mapped_boxes = (const int16_t *)map_whole_file( ifile, &mapped_boxes_bytes);
+      unlock_data_file( ifile);
+      }
    return( ifile);
 }
 
@@ -255,6 +456,7 @@ static int find_and_set_precomputed_data( FILE *precomputed_fp,
                          const int bc_chunk, int16_t *__restrict posns)
 {
    const int chunk_size = bc405_n_asteroids * 3;
+   const size_t offset = (size_t)bc_chunk * (size_t)chunk_size;
    FILE *bc405_elem_file = open_bc405_file( );
    int i;
 
@@ -262,28 +464,33 @@ static int find_and_set_precomputed_data( FILE *precomputed_fp,
    if( bc_chunk < 0 || bc_chunk >= n_bc405_chunks)
       printf( "%d %d\n", bc_chunk, n_bc405_chunks);
    assert( bc_chunk >= 0 && bc_chunk < n_bc405_chunks);
-   fseek( precomputed_fp, (size_t)( bc_chunk * chunk_size) * sizeof( int16_t), SEEK_SET);
-   if( !fread( posns, chunk_size, sizeof( int16_t), precomputed_fp))
-      return( -1);
+   if( mapped_boxes && (offset + chunk_size) * sizeof( int16_t)
+                                 <= mapped_boxes_bytes)
+      memcpy( posns, mapped_boxes + offset, chunk_size * sizeof( int16_t));
+   else
+      {
+      fseek( precomputed_fp, offset * sizeof( int16_t), SEEK_SET);
+      if( !fread( posns, chunk_size, sizeof( int16_t), precomputed_fp))
+         return( -1);
+      }
    if( !posns[0] && !posns[1] && !posns[2])     /* still all zeroes; gotta compute */
       {
       int16_t * __restrict pptr = posns;
 
-      fseek( bc405_elem_file, (size_t)bc_chunk * bc405_n_asteroids
-                    * 6 * sizeof( double), SEEK_SET);
       for( i = 0; i < bc405_n_asteroids; i++)
          {
          ELEMENTS elems;
          double posn[4];
 
-         grab_elems( &elems, bc405_elem_file, bc_chunk);
+         grab_elems( &elems, bc_chunk, i);
          comet_posn( &elems, elems.epoch - bc405_chunk_time / 2., posn);
          *pptr++ = (int16_t)( posn[0] * integer_scale);
          *pptr++ = (int16_t)( posn[1] * integer_scale);
          *pptr++ = (int16_t)( posn[2] * integer_scale);
          }
-      fseek( precomputed_fp, -chunk_size * sizeof( int16_t), SEEK_CUR);
+      fseek( precomputed_fp, offset * sizeof( int16_t), SEEK_SET);
       fwrite( posns, chunk_size, sizeof( int16_t), precomputed_fp);
+      fflush( precomputed_fp);      /* so the mapping sees it */
       }
    return( 0);
 }
@@ -321,11 +528,186 @@ static double *load_asteroid_masses( void)
    return( rval);
 }
 
+/* Two-body propagation from the BC405 elements means solving Kepler's
+equation for every asteroid position.  Instead,  we fit each asteroid's
+position over each chunk (the 40 days centered on the chunk epoch,  the
+span over which asteroid_position_raw( ) uses that chunk's elements) with
+a Chebyshev series of N_BC405_CHEB terms per coordinate,  interpolating
+at the Chebyshev nodes.  That's good to about 1e-10 AU even for the more
+eccentric BC405 asteroids,  and evaluating it takes a few dozen
+multiply-adds.
+
+   The fits are stored in 'bc405cheb.dat',  which is handled much like
+'bc405pre.dat' (including the locking;  see lock_data_file( )):  it starts
+out as all zeroes (created sparse,  so it takes little disk space until
+it's used),  and each chunk is fitted when first needed and written back.  After a short header,  each chunk has a double
+giving its epoch (zero if not yet fitted),  followed by N_BC405_CHEB
+coefficients for each of x,  y,  z for each asteroid.  On *nix,  it's
+mapped read-only;  elsewhere,  coefficients are read with fseek( ) and
+fread( ).  Set BC405_CHEBYSHEV=0 in 'environ.dat' to go back to using the
+elements directly.  */
+
+#define N_BC405_CHEB       10
+#define BC405_CHEB_MAGIC   "BC405ch"
+
+#define BC405_CHEB_HEADER struct bc405_cheb_header
+
+BC405_CHEB_HEADER
+   {
+   char magic[8];
+   int32_t n_asteroids, n_chunks, n_coeffs, reserved;
+   double start_jd, chunk_time;
+   };
+
+static FILE *cheb_fp = NULL;
+static const char *mapped_cheb = NULL;
+static size_t mapped_cheb_bytes;
+static int cheb_available = 0;      /* 0 = not checked yet,  -1 = no */
+
+static size_t cheb_chunk_offset( const int chunk)
+{
+   const size_t chunk_size = 1 + (size_t)bc405_n_asteroids * 3 * N_BC405_CHEB;
+
+   return( sizeof( BC405_CHEB_HEADER)
+                           + (size_t)chunk * chunk_size * sizeof( double));
+}
+
+static bool open_bc405_cheb_file( void)
+{
+   const char *data_file_name = "bc405cheb.dat";
+   BC405_CHEB_HEADER hdr, old_hdr;
+
+   memset( &hdr, 0, sizeof( BC405_CHEB_HEADER));
+   memcpy( hdr.magic, BC405_CHEB_MAGIC, 8);
+   hdr.n_asteroids = bc405_n_asteroids;
+   hdr.n_chunks = n_bc405_chunks;
+   hdr.n_coeffs = N_BC405_CHEB;
+   hdr.start_jd = bc405_start_jd;
+   hdr.chunk_time = bc405_chunk_time;
+   cheb_fp = lock_data_file( data_file_name);
+   if( cheb_fp && (fread( &old_hdr, sizeof( old_hdr), 1, cheb_fp) != 1
+               || memcmp( &old_hdr, &hdr, sizeof( hdr))
+               || fseek( cheb_fp, 0L, SEEK_END)
+               || ftell( cheb_fp) != (long)cheb_chunk_offset( n_bc405_chunks)))
+      {        /* new,  or made for some other element file;  create it, */
+      char temp_name[255];       /* all zeroes after the header */
+      FILE *ofile = create_temp_data_file( data_file_name, temp_name);
+      const char zero = 0;
+
+      if( !ofile)
+         {
+         unlock_data_file( cheb_fp);
+         fclose( cheb_fp);
+         cheb_fp = NULL;
+         return( false);
+         }
+      fwrite( &hdr, sizeof( BC405_CHEB_HEADER), 1, ofile);
+      fseek( ofile, (long)( cheb_chunk_offset( n_bc405_chunks) - 1), SEEK_SET);
+      fwrite( &zero, 1, 1, ofile);
+      fclose( ofile);
+      cheb_fp = replace_data_file( cheb_fp, data_file_name, temp_name);
+      }
+   if( cheb_fp)
+      {
+      mapped_cheb = (const char *)map_whole_file( cheb_fp, &mapped_cheb_bytes);
+      unlock_data_file( cheb_fp);
+      }
+   return( cheb_fp != NULL);
+}
+
+/* Fits all asteroids for the given chunk,  and writes the result to
+'bc405cheb.dat'.  'coeffs' gets the coefficients,  N_BC405_CHEB for x,
+then y,  then z for each asteroid in turn.  */
+
+static void fit_bc405_chunk( const int chunk, double *coeffs)
+{
+   const double half_span = bc405_chunk_time / 2.;
+   const double pi = 3.1415926535897932384626433832795028841971693993751;
+   double cosines[N_BC405_CHEB][N_BC405_CHEB], epoch = 0.;
+   int i, j, k, axis;
+
+   for( j = 0; j < N_BC405_CHEB; j++)
+      for( k = 0; k < N_BC405_CHEB; k++)
+         cosines[j][k] = cos( pi * (double)j * ((double)k + .5)
+                                          / (double)N_BC405_CHEB);
+   for( i = 0; i < bc405_n_asteroids; i++)
+      {
+      ELEMENTS elems;
+      double posn[N_BC405_CHEB][4];
+      double *cptr = coeffs + i * 3 * N_BC405_CHEB;
+
+      grab_elems( &elems, chunk, i);
+      epoch = elems.epoch;
+      for( k = 0; k < N_BC405_CHEB; k++)     /* nodes:  T_1 = cosines[1] */
+         comet_posn( &elems, epoch + half_span * cosines[1][k], posn[k]);
+      for( axis = 0; axis < 3; axis++, cptr += N_BC405_CHEB)
+         for( j = 0; j < N_BC405_CHEB; j++)
+            {
+            double sum = 0.;
+
+            for( k = 0; k < N_BC405_CHEB; k++)
+               sum += posn[k][axis] * cosines[j][k];
+            cptr[j] = sum * (j ? 2. : 1.) / (double)N_BC405_CHEB;
+            }
+      }
+   fseek( cheb_fp, (long)cheb_chunk_offset( chunk) + (long)sizeof( double),
+                           SEEK_SET);
+   fwrite( coeffs, sizeof( double), bc405_n_asteroids * 3 * N_BC405_CHEB,
+                           cheb_fp);
+   fflush( cheb_fp);          /* coefficients first,  then the epoch that */
+   fseek( cheb_fp, (long)cheb_chunk_offset( chunk), SEEK_SET);
+   fwrite( &epoch, sizeof( double), 1, cheb_fp);   /* marks them as valid */
+   fflush( cheb_fp);
+}
+
+/* Returns the 3 * N_BC405_CHEB coefficients for the given asteroid and
+chunk,  fitting the chunk first if need be.  */
+
+static const double *get_cheb_coeffs( const int chunk, const int astnum,
+                                       double *buff)
+{
+   const size_t offset = cheb_chunk_offset( chunk);
+   const size_t n_coeffs = 3 * N_BC405_CHEB;
+   const double epoch = bc405_start_jd + (double)chunk * bc405_chunk_time;
+   double stored_epoch = 0.;
+   const bool use_map = (mapped_cheb
+               && cheb_chunk_offset( chunk + 1) <= mapped_cheb_bytes);
+
+   if( use_map)
+      memcpy( &stored_epoch, mapped_cheb + offset, sizeof( double));
+   else
+      {
+      fseek( cheb_fp, (long)offset, SEEK_SET);
+      if( fread( &stored_epoch, sizeof( double), 1, cheb_fp) != 1)
+         stored_epoch = 0.;
+      }
+   if( stored_epoch != epoch)
+      {
+      double *coeffs = (double *)malloc( bc405_n_asteroids * n_coeffs
+                                          * sizeof( double));
+
+      if( !coeffs)
+         return( NULL);
+      fit_bc405_chunk( chunk, coeffs);
+      memcpy( buff, coeffs + astnum * n_coeffs, n_coeffs * sizeof( double));
+      free( coeffs);
+      return( buff);
+      }
+   if( use_map)
+      return( (const double *)( mapped_cheb + offset) + 1 + astnum * n_coeffs);
+   fseek( cheb_fp, (long)( offset + (1 + astnum * n_coeffs) * sizeof( double)),
+                           SEEK_SET);
+   if( fread( buff, sizeof( double), n_coeffs, cheb_fp) != n_coeffs)
+      return( NULL);
+   return( buff);
+}
+
 int asteroid_position_raw( const int astnum, const double jd,
                               double *posn)
 {
    ELEMENTS elem;
    int chunk;
+   double dt;
 
    open_bc405_file( );
    chunk = (int)( (jd - bc405_start_jd) / bc405_chunk_time + .5);
@@ -333,6 +715,35 @@ int asteroid_position_raw( const int astnum, const double jd,
       chunk = 0;
    else if( chunk >= n_bc405_chunks - 1)
       chunk = n_bc405_chunks - 1;
+   if( !cheb_available && get_settings( )->bc405_chebyshev)
+      cheb_available = (open_bc405_cheb_file( ) ? 1 : -1);
+   dt = jd - (bc405_start_jd + (double)chunk * bc405_chunk_time);
+   if( cheb_available > 0 && get_settings( )->bc405_chebyshev
+                  && fabs( dt) <= bc405_chunk_time / 2.)
+      {                    /* don't extrapolate past either end */
+      double buff[3 * N_BC405_CHEB];
+      const double *coeffs = get_cheb_coeffs( chunk, astnum, buff);
+
+      if( coeffs)
+         {
+         const double t = dt * 2. / bc405_chunk_time;
+         int axis, j;
+
+         for( axis = 0; axis < 3; axis++, coeffs += N_BC405_CHEB)
+            {              /* Clenshaw recurrence */
+            double b1 = 0., b2 = 0., tval;
+
+            for( j = N_BC405_CHEB - 1; j > 0; j--)
+               {
+               tval = 2. * t * b1 - b2 + coeffs[j];
+               b2 = b1;
+               b1 = tval;
+               }
+            posn[axis] = t * b1 - b2 + coeffs[0];
+            }
+         return( 0);
+         }
+      }
    grab_cached_elems( &elem, chunk, astnum);
    comet_posn( &elem, jd, posn);
    return( 0);
@@ -351,10 +762,166 @@ double *get_asteroid_mass( const int astnum)
    return( rval);
 }
 
-const char *get_environment_ptr( const char *env_ptr);     /* mpc_obs.cpp */
+/* Returns all the masses (NULL if they've not been loaded),  so that the
+trajectory cache in 'orb_func.cpp' can tell if any were changed,  as
+happens when an asteroid mass is being fitted.   */
 
-int detect_perturbers( const double jd, const double * __restrict xyz,
-                       double *accel)
+const double *get_asteroid_masses( int *n_masses)
+{
+   *n_masses = (masses ? bc405_n_asteroids : 0);
+   return( masses);
+}
+
+/* Even with the above integer box tests,  looping over all 300 asteroids
+at every step adds up,  especially since (for an object not in the main
+belt) almost all of them fail.  So whenever we load a new pair of chunks
+(or the threshold changes),  we make a grid in x and y of cells
+GRID_CELL_SIZE units (half an AU) on a side,  covering GRID_N_CELLS cells
+in each direction around the sun.  Each cell gets a list of the asteroids
+whose boxes (expanded by their thresholds) overlap it,  so only those in
+the object's cell need be box-tested.  z isn't gridded,  since the
+asteroids don't spread far in z.
+
+   Boxes covering more than GRID_MAX_CELLS cells (those of the few
+massive asteroids with large thresholds) go on a 'big' list that's
+checked for every point,  rather than into hundreds of cells.  Boxes
+reaching outside the grid also go on an 'outside' list,  which is what we
+check for points outside the grid.  Candidates are collected in a bit
+mask and then tested in order of asteroid number,  just as they were
+before the grid,  so the accelerations are summed in the same order and
+come out exactly the same.  */
+
+#define GRID_CELL_SIZE     500
+#define GRID_N_CELLS       48
+#define GRID_ORIGIN        (-GRID_CELL_SIZE * GRID_N_CELLS / 2)
+#define GRID_MAX_CELLS     64
+#define GRID_MAX_ENTRIES   (MAX_BC405_N_ASTEROIDS * GRID_MAX_CELLS)
+#define N_MASK_WORDS       ((MAX_BC405_N_ASTEROIDS + 31) / 32)
+
+static int grid_start[GRID_N_CELLS * GRID_N_CELLS + 1];
+static int16_t grid_entries[GRID_MAX_ENTRIES];
+static uint32_t big_mask[N_MASK_WORDS], outside_mask[N_MASK_WORDS];
+static int16_t ithresh[MAX_BC405_N_ASTEROIDS];
+
+/* Returns the grid cell containing 'coord',  or -1 if it's off the grid. */
+
+static inline int grid_cell( const int coord)
+{
+   const int offset = coord - GRID_ORIGIN;
+
+   if( offset < 0 || offset >= GRID_CELL_SIZE * GRID_N_CELLS)
+      return( -1);
+   return( offset / GRID_CELL_SIZE);
+}
+
+/* Finds the cells overlapped by the range 'lo' to 'hi' (expanded by
+'thresh'),  clipped to the grid.  Returns true if the range reaches off
+the grid.   */
+
+static bool grid_range( int lo, int hi, const int thresh,
+                        int *cell_lo, int *cell_hi)
+{
+   bool off_grid = false;
+
+   if( lo > hi)
+      {
+      const int tval = lo;
+
+      lo = hi;
+      hi = tval;
+      }
+   lo -= thresh;
+   hi += thresh;
+   if( (*cell_lo = grid_cell( lo)) < 0)
+      {
+      *cell_lo = 0;
+      off_grid = true;
+      }
+   if( (*cell_hi = grid_cell( hi)) < 0)
+      {
+      *cell_hi = GRID_N_CELLS - 1;
+      off_grid = true;
+      }
+   if( lo >= GRID_ORIGIN + GRID_CELL_SIZE * GRID_N_CELLS
+                        || hi < GRID_ORIGIN)
+      *cell_lo = GRID_N_CELLS;      /* entirely off the grid */
+   return( off_grid);
+}
+
+static void build_perturber_grid( const int16_t *posns0,
+                  const int16_t *posns1, const int n_asteroids)
+{
+   int x_lo[MAX_BC405_N_ASTEROIDS], x_hi[MAX_BC405_N_ASTEROIDS];
+   int y_lo[MAX_BC405_N_ASTEROIDS], y_hi[MAX_BC405_N_ASTEROIDS];
+   int count[GRID_N_CELLS * GRID_N_CELLS];
+   int i, x, y, pass;
+
+   memset( big_mask, 0, sizeof( big_mask));
+   memset( outside_mask, 0, sizeof( outside_mask));
+   for( i = 0; i < n_asteroids; i++)
+      {
+      const int16_t *p0 = posns0 + i * 3, *p1 = posns1 + i * 3;
+      bool off_grid;
+
+      off_grid = grid_range( p0[0], p1[0], ithresh[i], x_lo + i, x_hi + i);
+      if( grid_range( p0[1], p1[1], ithresh[i], y_lo + i, y_hi + i))
+         off_grid = true;
+      if( off_grid)
+         outside_mask[i >> 5] |= (uint32_t)1 << (i & 31);
+      if( x_lo[i] == GRID_N_CELLS || y_lo[i] == GRID_N_CELLS)
+         x_hi[i] = -1;         /* no cells at all */
+      else if( (x_hi[i] - x_lo[i] + 1) * (y_hi[i] - y_lo[i] + 1)
+                              > GRID_MAX_CELLS)
+         {
+         big_mask[i >> 5] |= (uint32_t)1 << (i & 31);
+         x_hi[i] = -1;
+         }
+      }
+            /* First pass counts entries per cell;  second fills them in */
+   for( pass = 0; pass < 2; pass++)
+      {
+      memset( count, 0, sizeof( count));
+      for( i = 0; i < n_asteroids; i++)
+         for( x = x_lo[i]; x <= x_hi[i]; x++)
+            for( y = y_lo[i]; y <= y_hi[i]; y++)
+               {
+               const int cell = x * GRID_N_CELLS + y;
+
+               if( pass)
+                  grid_entries[grid_start[cell] + count[cell]] = (int16_t)i;
+               count[cell]++;
+               }
+      if( !pass)
+         {
+         grid_start[0] = 0;
+         for( i = 0; i < GRID_N_CELLS * GRID_N_CELLS; i++)
+            grid_start[i + 1] = grid_start[i] + count[i];
+         assert( grid_start[i] <= GRID_MAX_ENTRIES);
+         }
+      }
+}
+
+/* Sets bits in 'mask' for asteroids that may be near 'ixyz'.  */
+
+static void find_grid_candidates( const int16_t *ixyz, uint32_t *mask)
+{
+   const int x = grid_cell( ixyz[0]), y = grid_cell( ixyz[1]);
+   int i;
+
+   if( x < 0 || y < 0)
+      memcpy( mask, outside_mask, sizeof( outside_mask));
+   else
+      {
+      const int cell = x * GRID_N_CELLS + y;
+
+      memcpy( mask, big_mask, sizeof( big_mask));
+      for( i = grid_start[cell]; i < grid_start[cell + 1]; i++)
+         mask[grid_entries[i] >> 5] |= (uint32_t)1 << (grid_entries[i] & 31);
+      }
+}
+
+static int unlocked_detect_perturbers( const double jd,
+                  const double * __restrict xyz, double *accel)
 {
    static int curr_chunk = -1;
    static int16_t posns0[MAX_BC405_N_ASTEROIDS * 3];
@@ -363,7 +930,10 @@ int detect_perturbers( const double jd, const double * __restrict xyz,
    static FILE *precomputed_fp;
    static bool bc405_available = true;
    static int n_asteroids_to_use = 0;
-   double thresh = atof( get_environment_ptr( "ASTEROID_THRESH"));
+   static int grid_generation = -1;
+   const FIND_ORB_SETTINGS *settings = get_settings( );
+   const bool settings_changed = (settings->generation != grid_generation);
+   uint32_t candidates[N_MASK_WORDS];
    int i, load_posn0 = 0, load_posn1 = 0, chunk;
 
    if( !bc405_available)
@@ -372,10 +942,13 @@ int detect_perturbers( const double jd, const double * __restrict xyz,
       {
       if( precomputed_fp)
          fclose( precomputed_fp);
+      unmap_whole_file( mapped_boxes, mapped_boxes_bytes);
+      mapped_boxes = NULL;
       if( masses)
          free( masses);
       precomputed_fp = NULL;
       masses = NULL;
+      grid_generation = -1;
       }
    if( !masses)
       masses = load_asteroid_masses( );
@@ -422,83 +995,113 @@ int detect_perturbers( const double jd, const double * __restrict xyz,
    if( load_posn1)
       find_and_set_precomputed_data( precomputed_fp, chunk + 1, posns1);
    curr_chunk = chunk;
-   if( !n_asteroids_to_use)
-      n_asteroids_to_use = atoi( get_environment_ptr( "BC405_ASTEROIDS"));
-   if( !n_asteroids_to_use)
-      n_asteroids_to_use = bc405_n_asteroids;
-   if( !thresh)
-      thresh = 10.;                              /* Pallas extends 10 AU;  all others */
-   thresh *= integer_scale / sqrt( masses[1]);   /* scaled by sqrt of their masses    */
+   if( settings_changed)
+      {                 /* Pallas extends ASTEROID_THRESH AU;  all others */
+                        /* are scaled by the sqrt of their masses         */
+      const double thresh = settings->asteroid_thresh * integer_scale
+                                          / sqrt( masses[1]);
+
+      n_asteroids_to_use = settings->bc405_asteroids;
+      if( !n_asteroids_to_use || n_asteroids_to_use > bc405_n_asteroids)
+         n_asteroids_to_use = bc405_n_asteroids;
+      for( i = 0; i < n_asteroids_to_use; i++)
+         {
+         const double dthresh = thresh * sqrt( masses[i]) + .1 * integer_scale;
+
+         ithresh[i] = (int16_t)( dthresh > 27000. ? 27000 : dthresh);
+         }
+      }
+   if( load_posn0 || load_posn1 || settings_changed)
+      build_perturber_grid( posns0, posns1, n_asteroids_to_use);
+   grid_generation = settings->generation;
    for( i = 0; i < 3; i++)
       ixyz[i] = (int16_t)( integer_scale * xyz[i]);
+   find_grid_candidates( ixyz, candidates);
    for( i = 0; i < n_asteroids_to_use; i++)
-      {
-      const int16_t *p0 = posns0 + i * 3;
-      const int16_t *p1 = posns1 + i * 3;
-      int j, possible_perturber = 1;
-      const double dthresh = thresh * sqrt( masses[i]) + .1 * integer_scale;
-      const int16_t ithresh = (int16_t)( dthresh > 27000. ? 27000 : dthresh);
-
-      if( *p0 > *p1)
-         possible_perturber = (ixyz[0] + ithresh > *p1 && ixyz[0] - ithresh < *p0);
-      else
-         possible_perturber = (ixyz[0] + ithresh > *p0 && ixyz[0] - ithresh < *p1);
-      if( asteroid_numbers[i] == excluded_asteroid_number)
-         possible_perturber = 0;    /* don't let an asteroid perturb itself! */
-      if( possible_perturber)
+      if( (candidates[i >> 5] >> (i & 31)) & 1)
          {
-         p0++;
-         p1++;
+         const int16_t *p0 = posns0 + i * 3;
+         const int16_t *p1 = posns1 + i * 3;
+         int j, possible_perturber = 1;
+
          if( *p0 > *p1)
-            possible_perturber = (ixyz[1] + ithresh > *p1 && ixyz[1] - ithresh < *p0);
+            possible_perturber = (ixyz[0] + ithresh[i] > *p1 && ixyz[0] - ithresh[i] < *p0);
          else
-            possible_perturber = (ixyz[1] + ithresh > *p0 && ixyz[1] - ithresh < *p1);
+            possible_perturber = (ixyz[0] + ithresh[i] > *p0 && ixyz[0] - ithresh[i] < *p1);
+         if( asteroid_numbers[i] == excluded_asteroid_number)
+            possible_perturber = 0;    /* don't let an asteroid perturb itself! */
          if( possible_perturber)
             {
             p0++;
             p1++;
             if( *p0 > *p1)
-               possible_perturber = (ixyz[2] + ithresh > *p1 && ixyz[2] - ithresh < *p0);
+               possible_perturber = (ixyz[1] + ithresh[i] > *p1 && ixyz[1] - ithresh[i] < *p0);
             else
-               possible_perturber = (ixyz[2] + ithresh > *p0 && ixyz[2] - ithresh < *p1);
+               possible_perturber = (ixyz[1] + ithresh[i] > *p0 && ixyz[1] - ithresh[i] < *p1);
             if( possible_perturber)
                {
-               double asteroid_loc[4], dist2 = 0., delta[3], sun_dist2 = 0.;
-               double factor1, factor2;
-
-               planet_posn( i + 100, jd, asteroid_loc);
-               for( j = 0; j < 3; j++)
-                  {
-                  delta[j] = asteroid_loc[j] - xyz[j];
-                  sun_dist2 += asteroid_loc[j] * asteroid_loc[j];
-                  dist2 += delta[j] * delta[j];
-                  }
-               factor1 = SOLAR_GM * masses[i] / (sun_dist2 * sqrt( sun_dist2));
-               factor2 = SOLAR_GM * masses[i] / (dist2 * sqrt( dist2));
-               for( j = 0; j < 3; j++)
+               p0++;
+               p1++;
+               if( *p0 > *p1)
+                  possible_perturber = (ixyz[2] + ithresh[i] > *p1 && ixyz[2] - ithresh[i] < *p0);
+               else
+                  possible_perturber = (ixyz[2] + ithresh[i] > *p0 && ixyz[2] - ithresh[i] < *p1);
+               if( possible_perturber)
                   {
-                  accel[j + 3] += factor2 * delta[j];
-                  accel[j + 3] -= factor1 * asteroid_loc[j];
-                  }
+                  double asteroid_loc[4], dist2 = 0., delta[3], sun_dist2 = 0.;
+                  double factor1, factor2;
+
+                  planet_posn( i + 100, jd, asteroid_loc);
+                  for( j = 0; j < 3; j++)
+                     {
+                     delta[j] = asteroid_loc[j] - xyz[j];
+                     sun_dist2 += asteroid_loc[j] * asteroid_loc[j];
+                     dist2 += delta[j] * delta[j];
+                     }
+                  factor1 = SOLAR_GM * masses[i] / (sun_dist2 * sqrt( sun_dist2));
+                  factor2 = SOLAR_GM * masses[i] / (dist2 * sqrt( dist2));
+                  for( j = 0; j < 3; j++)
+                     {
+                     accel[j + 3] += factor2 * delta[j];
+                     accel[j + 3] -= factor1 * asteroid_loc[j];
+                     }
 #ifdef DEBUGGING_CODE
-               if( dist2 < .05 * 0.05)
-                  {
-                  FILE *debug_file = fopen( "astpert.txt", "ab");
-                  const double j2000 = 2451545.;
+                  if( dist2 < .05 * 0.05)
+                     {
+                     FILE *debug_file = fopen( "astpert.txt", "ab");
+                     const double j2000 = 2451545.;
 
-                  fprintf( debug_file, "%.5f: %3d, %f: mass %g\n",
-                           (jd - j2000) / 365.25 + 2000.,
-                           i, sqrt( dist2) * AU_IN_KM, masses[i]);
-                  fclose( debug_file);
-                  }
+                     fprintf( debug_file, "%.5f: %3d, %f: mass %g\n",
+                              (jd - j2000) / 365.25 + 2000.,
+                              i, sqrt( dist2) * AU_IN_KM, masses[i]);
+                     fclose( debug_file);
+                     }
 #endif
+                  }
                }
             }
          }
-      }
    return( 0);
 }
 
+/* The chunk positions and the open files above are shared by everyone
+calling detect_perturbers( ),  so callers on different threads take
+turns.  (The box tests themselves are cheap;  the planet_posn( ) calls
+for asteroids that pass them are mostly cache hits.)   */
+
+FIND_ORB_MUTEX( perturber_mutex);
+
+int detect_perturbers( const double jd, const double * __restrict xyz,
+                       double *accel)
+{
+   int rval;
+
+   LOCK_MUTEX( perturber_mutex);
+   rval = unlocked_detect_perturbers( jd, xyz, accel);
+   UNLOCK_MUTEX( perturber_mutex);
+   return( rval);
+}
+
 #ifdef TEST_CODE
 
 /* When I first came up with the idea of filtering possible
@@ -536,14 +1139,11 @@ int main( const int argc, char **argv)
    const int asteroid_number = atoi( argv[1]);
    const double jd = atof( argv[2]);
    const int chunk_number = (int)( (jd - bc405_start_jd) / bc405_chunk_time + .5);
-   FILE *fp = open_bc405_file( );
    ELEMENTS elems;
    double posn[4];
    int16_t precomputed[bc405_n_asteroids * 3];
 
-   fseek( fp, (chunk_number * bc405_n_asteroids + asteroid_number)
-                       * 6 * sizeof( double), SEEK_SET);
-   grab_elems( &elems, fp, chunk_number);
+   grab_elems( &elems, chunk_number, asteroid_number);
    printf( "Chunk %d; epoch %.1f\n", chunk_number, elems.epoch);
    printf( "Semimajor: %f\n", elems.major_axis);
    printf( "Ecc: %f\n", elems.ecc);
@@ -0,0 +1,135 @@
+/* de_sub.cpp: extracts part of a JPL DE file as an 'ephemeris subset'
+
+Copyright (C) 2010, Project Pluto
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+02110-1301, USA.    */
+
+/* Writes the records of a JPL DE file covering a given span of time,
+for a given set of planets,  to a much smaller file that Find_Orb can
+use instead (see EPHEM_SUBSET in 'environ.def',  and the comments about
+subsets in 'pl_cache.cpp').  Usage is
+
+de_sub de_file subset_file jd_start jd_end (-p planets)
+
+   where 'planets' is a list of planet numbers as used by planet_posn( ),
+such as -p 3,5,10 or -p 1-10 (the default,  all of them).  1-9 are
+Mercury to Pluto,  3 being the Earth-Moon barycenter;  10 is the moon.
+The sun is always included.  Build with 'make de_sub'.  */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include "watdefs.h"
+#include "pl_cache.h"
+
+extern int debug_level;
+
+int debug_level = 0;
+
+int inquire( const char *prompt, char *buff, const int max_len,
+                     const int color);          /* de_sub.cpp */
+void refresh_console( void);                    /* de_sub.cpp */
+void move_add_nstr( const int col, const int row, const char *msg,
+                     const int n_bytes);        /* de_sub.cpp */
+
+int inquire( const char *prompt, char *buff, const int max_len,
+                     const int color)
+{
+   printf( "%s\n", prompt);
+   return( 0);
+}
+
+void refresh_console( void)
+{
+}
+
+void move_add_nstr( const int col, const int row, const char *msg, const int n_bytes)
+{
+}
+
+/* Parses planet lists such as '3,5,10' or '1-4,10'.  Returns zero if
+anything's out of range or otherwise odd.  */
+
+static unsigned parse_planet_list( const char *list)
+{
+   unsigned rval = 0;
+
+   while( *list)
+      {
+      int start, end, n_bytes;
+
+      if( sscanf( list, "%d%n", &start, &n_bytes) != 1)
+         return( 0);
+      list += n_bytes;
+      end = start;
+      if( *list == '-')
+         {
+         if( sscanf( list + 1, "%d%n", &end, &n_bytes) != 1)
+            return( 0);
+         list += n_bytes + 1;
+         }
+      if( start < 1 || end > 10 || start > end)
+         return( 0);
+      while( start <= end)
+         rval |= 1u << start++;
+      if( *list == ',')
+         list++;
+      else if( *list)
+         return( 0);
+      }
+   return( rval);
+}
+
+int main( const int argc, const char **argv)
+{
+   unsigned body_mask = 0x7fe;         /* planets 1 to 10 */
+   long n_records;
+   int i;
+
+   if( argc < 5)
+      {
+      printf( "Usage: de_sub de_file subset_file jd_start jd_end (-p planets)\n");
+      return( -1);
+      }
+   for( i = 5; i < argc; i++)
+      if( argv[i][0] == '-' && argv[i][1] == 'p')
+         {
+         const char *list = (argv[i][2] || i == argc - 1) ? argv[i] + 2
+                                                         : argv[++i];
+
+         body_mask = parse_planet_list( list);
+         if( !body_mask)
+            {
+            printf( "Bad planet list '%s'\n", list);
+            return( -1);
+            }
+         }
+      else
+         {
+         printf( "Unrecognized option '%s'\n", argv[i]);
+         return( -1);
+         }
+   n_records = extract_ephemeris_subset( argv[1], argv[2],
+                        atof( argv[3]), atof( argv[4]), body_mask);
+   if( n_records < 0)
+      {
+      printf( "Couldn't extract subset:  error %ld\n", n_records);
+      return( -1);
+      }
+   printf( "%ld records written to %s\n", n_records, argv[2]);
+   return( 0);
+}
@@ -0,0 +1,70 @@
+/* environ.h: settings from 'environ.dat',  parsed once into a structure
+
+Copyright (C) 2010, Project Pluto
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+02110-1301, USA.    */
+
+/* get_environment_ptr( ) looks a setting up by name each time it's
+called,  which is fine for most purposes,  but not in the force model or
+other places where it may be called millions of times.  Settings used in
+such places are instead parsed once into a FIND_ORB_SETTINGS structure,
+and read from there.  Defaults for settings that are blank or zero are
+filled in at that point,  so callers needn't do so.
+
+   The structure is re-parsed after get_environment_ptr( NULL) (which
+set_environment_ptr( ) calls after changing a setting) or reload_settings( ),
+and 'generation' is incremented;  code that derives something from the
+settings can compare that to see if it needs to re-derive it.  A
+re-parse makes a new structure,  so a pointer from get_settings( ) stays
+valid (if perhaps out of date) and never changes underfoot.  See
+get_settings( ) in 'mpc_obs.cpp'.   */
+
+#define FIND_ORB_SETTINGS struct find_orb_settings
+
+FIND_ORB_SETTINGS
+   {
+   int generation;               /* incremented each time we re-parse */
+         /* Force model : */
+   double asteroid_thresh;       /* ASTEROID_THRESH;  default 10 AU */
+   int bc405_asteroids;          /* BC405_ASTEROIDS;  zero = all */
+   int bc405_chebyshev;          /* BC405_CHEBYSHEV */
+   int geo_terms;                /* GEO_TERMS;  default 3 */
+   int drag_shutoff;             /* DRAG_SHUTOFF is non-blank */
+   double geo_grid_min, geo_grid_max;    /* GEO_GRID altitudes,  in km */
+   double geo_grid_spacing;      /* GEO_GRID spacing,  in km;  default 100 */
+   double geo_grid_max_err;      /* GEO_GRID max error,  m/s^2;  def 1e-6 */
+         /* Integration : */
+   int encke;                    /* ENCKE */
+   int double_double;            /* DOUBLE_DOUBLE */
+   int dense_output;             /* DENSE_OUTPUT */
+   double prune_perturbers;      /* PRUNE_PERTURBERS */
+   double fixed_stepsize;        /* FIXED_STEPSIZE */
+   double min_stepsize;          /* MIN_STEPSIZE,  in days;  default 1e-5 */
+   int trajectory_cache;         /* TRAJECTORY_CACHE */
+         /* Least squares : */
+   int stm_partials;             /* STM_PARTIALS */
+   int partials_threads;         /* PARTIALS_THREADS;  zero = one per CPU */
+   int lsquare_qr;               /* LSQUARE_QR */
+   int debug_deltas;             /* DEBUG_DELTAS */
+   int half_steps;               /* HALF_STEPS is non-blank */
+         /* Ephemerides : */
+   double abs_mag;               /* ABS_MAG */
+   double ra_offset, dec_offset; /* RA_OFFSET,  DEC_OFFSET,  in arcsec */
+   int geometric_ground_track;   /* GEOMETRIC_GROUND_TRACK=1 */
+   };
+
+const FIND_ORB_SETTINGS *get_settings( void);          /* mpc_obs.cpp */
+void reload_settings( void);                           /* mpc_obs.cpp */
@@ -31,6 +31,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
 #include "date.h"
 #include "comets.h"
 #include "mpc_obs.h"
+#include "environ.h"
 
 #define J2000 2451545.0
 #define EARTH_MAJOR_AXIS 6378140.
@@ -969,6 +970,8 @@ int ephemeris_in_a_file( const char *filename, const double *orbit,
          const int options, const unsigned n_objects)
 {
    double *orbits_at_epoch, step;
+   int *clone_rvals = NULL;
+   unsigned n_active = n_objects;
    DPT *stored_ra_decs;
    double prev_ephem_t = epoch_jd, prev_radial_vel = 0.;
    int i, hh_mm, n_step_digits;
@@ -1003,10 +1006,15 @@ int ephemeris_in_a_file( const char *filename, const double *orbit,
    if( !ofile)
       return( -1);
    if( !abs_mag)
-      abs_mag = atof( get_environment_ptr( "ABS_MAG"));
+      abs_mag = get_settings( )->abs_mag;
    orbits_at_epoch = (double *)calloc( n_objects, 8 * sizeof( double));
    memcpy( orbits_at_epoch, orbit, n_objects * 6 * sizeof( double));
    stored_ra_decs = (DPT *)( orbits_at_epoch + 6 * n_objects);
+   if( show_uncertainties)
+      {
+      clone_rvals = (int *)calloc( n_objects, sizeof( int));
+      assert( clone_rvals);
+      }
    setvbuf( ofile, NULL, _IONBF, 0);
    switch( step_units)
       {
@@ -1190,7 +1198,28 @@ int ephemeris_in_a_file( const char *filename, const double *orbit,
                 /* we need the observer position in equatorial coords too: */
       memcpy( obs_posn_equatorial, obs_posn, 3 * sizeof( double));
       ecliptic_to_equatorial( obs_posn_equatorial);
-      for( obj_n = 0; obj_n < n_objects && (!obj_n || show_uncertainties); obj_n++)
+      integrate_orbit( orbits_at_epoch, prev_ephem_t, ephemeris_t);
+               /* Variant orbits go in lockstep.  Any that fail (hit a  */
+               /* planet,  say) are dropped from the cloud,  with the    */
+               /* last surviving variant moved into the vacated slot.    */
+      if( show_uncertainties && n_active > 1
+               && integrate_orbits( orbits_at_epoch + 6, n_active - 1,
+                              prev_ephem_t, ephemeris_t, clone_rvals))
+         {
+         unsigned n_left = 1;
+
+         for( obj_n = 1; obj_n < n_active; obj_n++)
+            if( !clone_rvals[obj_n - 1])
+               {
+               memmove( orbits_at_epoch + n_left * 6,
+                        orbits_at_epoch + obj_n * 6, 6 * sizeof( double));
+               n_left++;
+               }
+         debug_printf( "%u of %u variant orbits dropped at JD %f\n",
+                  n_active - n_left, n_objects - 1, ephemeris_t);
+         n_active = n_left;
+         }
+      for( obj_n = 0; obj_n < n_active && (!obj_n || show_uncertainties); obj_n++)
          {
          double *orbi = orbits_at_epoch + obj_n * 6;
          double radial_vel, v_dot_r;
@@ -1203,7 +1232,6 @@ int ephemeris_in_a_file( const char *filename, const double *orbit,
          OBSERVE temp_obs;
          int j;
 
-         integrate_orbit( orbi, prev_ephem_t, ephemeris_t);
          for( j = 0; j < 3; j++)
             {
             topo[j] = orbi[j] - obs_posn[j];
@@ -1356,8 +1384,8 @@ int ephemeris_in_a_file( const char *filename, const double *orbit,
 //          const double span = 0.01512;
 //          const double ra_offset = ((utc - 2457361.64226) * -15. / span - 2342.) * arcsec_to_radians;
 //          const double dec_offset = ((utc - 2457361.64226) * -149. / span + 4563.) * arcsec_to_radians;
-            const double ra_offset = atof( get_environment_ptr( "RA_OFFSET")) * arcsec_to_radians;
-            const double dec_offset = atof( get_environment_ptr( "DEC_OFFSET")) * arcsec_to_radians;
+            const double ra_offset = get_settings( )->ra_offset * arcsec_to_radians;
+            const double dec_offset = get_settings( )->dec_offset * arcsec_to_radians;
 
             strcpy( buff, "Nothing to see here... move along... uninteresting... who cares?...");
             solar_r = vector3_length( orbi_after_light_lag);
@@ -1384,7 +1412,7 @@ int ephemeris_in_a_file( const char *filename, const double *orbit,
 
             ra_dec.y = asin( topo[2] / r) + dec_offset;
             stored_ra_decs[obj_n] = ra_dec;
-            if( n_objects > 1 && obj_n == n_objects - 1 && show_this_line)
+            if( n_active > 1 && obj_n == n_active - 1 && show_this_line)
                {
                double dist, posn_ang;
                unsigned dist_in_arcsec;
@@ -1396,7 +1424,7 @@ int ephemeris_in_a_file( const char *filename, const double *orbit,
                                        (const double *)&ra_dec,
                                        &dist, &posn_ang);
                else
-                  calc_sr_dist_and_posn_ang( stored_ra_decs, n_objects,
+                  calc_sr_dist_and_posn_ang( stored_ra_decs, n_active,
                                        &dist, &posn_ang);
                integer_posn_ang =
                            (int)( floor( -posn_ang * 180. / PI + .5)) % 180;
@@ -1640,7 +1668,7 @@ int ephemeris_in_a_file( const char *filename, const double *orbit,
                double lat_lon_alt[3];
 
                find_lat_lon_alt( ephemeris_t, geo, lat_lon_alt,
-                        *get_environment_ptr( "GEOMETRIC_GROUND_TRACK") == '1');
+                        get_settings( )->geometric_ground_track);
                sprintf( tptr, "%9.4f %+08.4f %10.3f",
                      lat_lon_alt[0] * 180. / PI,
                      lat_lon_alt[1] * 180. / PI,
@@ -1699,11 +1727,15 @@ int ephemeris_in_a_file( const char *filename, const double *orbit,
          if( !obj_n && *buff)
             fprintf( ofile, "%s", buff);
          }
+      if( show_uncertainties && n_active == 1 && show_this_line)
+         fprintf( ofile, (computer_friendly ? "      - ---" : " ---- ---"));
       if( last_line_shown)
          fprintf( ofile, "\n");
       prev_ephem_t = ephemeris_t;
       }
    free( orbits_at_epoch);
+   if( clone_rvals)
+      free( clone_rvals);
    fclose( ofile);
    return( 0);
 }
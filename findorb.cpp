@@ -139,6 +139,8 @@ int find_nth_sr_orbit( double *orbit, OBSERVE FAR *obs, int n_obs,
                             const int orbit_number);       /* orb_func.cpp */
 char *fgets_trimmed( char *buff, size_t max_bytes, FILE *ifile);
 int debug_printf( const char *format, ...);                /* runge.cpp */
+void reset_force_profile( void);                            /* runge.cpp */
+int dump_force_profile( const char *object_name);           /* runge.cpp */
 static void get_mouse_data( int *mouse_x, int *mouse_y, int *mouse_z, unsigned long *button);
 int make_pseudo_mpec( const char *mpec_filename, const char *obj_name);
                                               /* ephem0.cpp */
@@ -2245,6 +2247,7 @@ int main( const int argc, const char **argv)
 
    if( debug_level)
       debug_printf( "%d sigma recs read\n", i);
+   reset_force_profile( );
 
    if( argc < 2)
       {
@@ -2402,6 +2405,8 @@ int main( const int argc, const char **argv)
             FILE *ifile;
             long file_offset;
 
+            if( obs)          /* write out profile for the previous object */
+               dump_force_profile( obj_name);
             strcpy( obj_name, ids[id_number].obj_name);
             sprintf( tbuff, "Loading '%s'...", obj_name);
             put_colored_text( tbuff, getmaxy( stdscr) - 3,
@@ -4177,7 +4182,10 @@ Shutdown_program:
    endwin( );
    curses_running = false;
    if( obs && n_obs)
+      {
       create_obs_file( obs, n_obs, 0);
+      dump_force_profile( obj_name);
+      }
    unload_observations( obs, n_obs);
 
    sprintf( tbuff, "%s %d %d %d", mpc_code,
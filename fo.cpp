@@ -63,6 +63,8 @@ extern const char *sof_filename;
 char *get_file_name( char *filename, const char *template_file_name);
 int sanity_test_observations( const char *filename);
 int debug_printf( const char *format, ...);                /* runge.cpp */
+void reset_force_profile( void);                            /* runge.cpp */
+int dump_force_profile( const char *object_name);           /* runge.cpp */
 int text_search_and_replace( char FAR *str, const char *oldstr,
                                      const char *newstr);   /* ephem0.cpp */
 int get_defaults( int *ephemeris_output_options, int *element_format,
@@ -78,6 +80,7 @@ char *fgets_trimmed( char *buff, size_t max_bytes, FILE *ifile); /*elem_out.c*/
 FILE *fopen_ext( const char *filename, const char *permits);   /* miscell.cpp */
 int make_pseudo_mpec( const char *mpec_filename, const char *obj_name);
                                                /* ephem0.cpp */
+double *get_asteroid_mass( const int astnum);   /* bc405.cpp */
 
 /* In this non-interactive version of Find_Orb,  we just print out warning
 messages such as "3 observations were made in daylight" or "couldn't find
@@ -119,6 +122,109 @@ static int remove_single_observation_objects( OBJECT_INFO *ids, const int n_ids)
    return( j);
 }
 
+/* With -g(number),  once the orbits have been computed one at a time,
+all the objects are fitted together,  along with the mass of that asteroid
+(see full_improvement_multi( ) in 'orb_func.cpp');  so all the objects
+are loaded at once.  An object that is the asteroid itself is left out,
+as are objects observed at only one time.  Each numbered asteroid is
+still kept from perturbing itself,  as it is when fitted alone.
+We iterate until the mass changes by less than a tenth of its sigma,  or
+for at most ten steps.  If that succeeds,  the refitted orbits (which go
+with the new mass) are written to 'vectors.dat',  as Find_Orb does when
+a solution is saved,  so later runs start from them.  */
+
+#define MAX_MASS_FIT_ITERATIONS 10
+
+static int fit_shared_mass( FILE *ifile, OBJECT_INFO *ids, const int n_ids,
+                                 const int asteroid_number)
+{
+   extern int n_obs_actually_loaded;
+   extern int excluded_asteroid_number;
+   OBSERVE FAR **obs = (OBSERVE FAR **)calloc( n_ids, sizeof( OBSERVE FAR *));
+   double **orbits = (double **)calloc( n_ids, sizeof( double *));
+   double *orbit_data = (double *)calloc( n_ids * 13, sizeof( double));
+   double *epochs = orbit_data + n_ids * 12;
+   double *mass = get_asteroid_mass( asteroid_number);
+   double change = 0., sigma = 0.;
+   int *n_obs = (int *)calloc( n_ids * 2, sizeof( int));
+   int *excluded_asteroids = n_obs + n_ids;
+   const int saved_excluded_asteroid = excluded_asteroid_number;
+   int i, n_objects = 0, iter = 0, rval = 0;
+   char limited_orbit[20];
+
+   assert( obs && orbits && orbit_data && n_obs);
+   if( !mass)
+      {
+      printf( "Asteroid %d isn't among the perturbers;  can't fit its mass\n",
+                                       asteroid_number);
+      rval = -1;
+      }
+   for( i = 0; !rval && i < n_ids; i++)
+      if( ids[i].n_obs >= 2 && (ids[i].obj_name[0] != '('
+                     || atoi( ids[i].obj_name + 1) != asteroid_number))
+         {
+         long file_offset = ids[i].file_offset - 40L;
+         double epoch_shown;
+
+         if( file_offset < 0L)
+            file_offset = 0L;
+         fseek( ifile, file_offset, SEEK_SET);
+         orbits[n_objects] = orbit_data + n_objects * 12;
+         obs[n_objects] = load_object( ifile, ids + i, epochs + n_objects,
+                                 &epoch_shown, orbits[n_objects]);
+         if( n_obs_actually_loaded > 1 && epochs[n_objects] > 0.
+                  && obs[n_objects][n_obs_actually_loaded - 1].jd
+                                          > obs[n_objects][0].jd)
+            {
+            excluded_asteroids[n_objects] = excluded_asteroid_number;
+            n_obs[n_objects++] = n_obs_actually_loaded;
+            }
+         else
+            unload_observations( obs[n_objects], n_obs_actually_loaded);
+         }
+   excluded_asteroid_number = saved_excluded_asteroid;
+   sprintf( limited_orbit, "m=%d", asteroid_number);
+   if( !rval)
+      printf( "Fitting the mass of (%d) with %d objects;  initially %.6e\n",
+                     asteroid_number, n_objects, *mass);
+   while( !rval && iter < MAX_MASS_FIT_ITERATIONS
+                        && (!iter || fabs( change) > sigma * .1))
+      {
+      change = *mass;
+      rval = full_improvement_multi( n_objects, obs, n_obs, orbits, epochs,
+                           excluded_asteroids, limited_orbit, &sigma);
+      change = *mass - change;
+      iter++;
+      if( !rval)
+         printf( "Step %d: mass %.6e +/- %.3e solar masses\n",
+                                       iter, *mass, sigma);
+      else
+         printf( "Step %d failed: %d\n", iter, rval);
+      }
+   for( i = 0; !rval && i < n_objects; i++)
+      {
+      extern unsigned perturbers;
+      char obj_name[80];
+
+      get_object_name( obj_name, obs[i]->packed_id);
+      if( store_solution( obs[i], n_obs[i], orbits[i], epochs[i],
+                                          (int)perturbers))
+         {
+         printf( "Couldn't store the refitted orbit for %s\n", obj_name);
+         rval = -2;
+         }
+      else
+         printf( "Refitted orbit for %s stored\n", obj_name);
+      }
+   for( i = 0; i < n_objects; i++)
+      unload_observations( obs[i], n_obs[i]);
+   free( obs);
+   free( orbits);
+   free( orbit_data);
+   free( n_obs);
+   return( rval);
+}
+
 #ifdef FORKING
 static void combine_element_files( const char *filename, const int n_processes)
 {
@@ -272,7 +378,7 @@ int main( const int argc, const char **argv)
    const char *separate_residual_file_name = NULL;
    const char *mpec_path = NULL;
    int n_ids, i, starting_object = 0;
-   int n_processes = 1;
+   int n_processes = 1, mass_fit_asteroid = 0;
    OBJECT_INFO *ids;
    int total_objects = 0;
    FILE *ifile;
@@ -316,6 +422,9 @@ int main( const int argc, const char **argv)
                debug_printf( "fo: debug_level = %d; %s %s\n",
                            debug_level, __DATE__, __TIME__);
                break;
+            case 'g':            /* fit an asteroid mass using all objects */
+               mass_fit_asteroid = atoi( argv[i] + 2);
+               break;
             case 'h':                     /* show planet-centric orbits */
                all_heliocentric = false;
                break;
@@ -400,6 +509,7 @@ int main( const int argc, const char **argv)
    load_up_sigma_records( "sigma.txt");
    if( debug_level)
       debug_printf( "%d sigma recs read\n", i);
+   reset_force_profile( );
 
    if( argc < 2)
       {
@@ -580,12 +690,23 @@ int main( const int argc, const char **argv)
             else
                printf( "; not enough observations\n");
             unload_observations( obs, n_obs_actually_loaded);
+            dump_force_profile( ids[i].obj_name);
             }
          object_comment_text( tbuff, ids + i);
                   /* Abbreviate 'observations:' to 'obs:' */
          text_search_and_replace( tbuff, "ervations", "");
          printf( "  %s\n", tbuff);
          }
+   if( mass_fit_asteroid)
+      {
+      if( n_processes > 1)
+         printf( "Mass fitting (-g) can't be combined with -p\n");
+      else
+         fit_shared_mass( ifile, ids + starting_object,
+                  (n_ids - starting_object < total_objects ?
+                   n_ids - starting_object : total_objects),
+                  mass_fit_asteroid);
+      }
    free( ids);
    if( summary_ofile)
       {
@@ -0,0 +1,197 @@
+/* geo_bm.cpp: benchmark for the geopotential acceleration functions
+
+Copyright (C) 2010, Project Pluto
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+02110-1301, USA.    */
+
+/* Times the three ways 'geo_pot.cpp' has of getting the acceleration
+due to the GGM03C geopotential:  the classical long double recurrence
+(geo_potential_in_au( )),  the same in double precision
+(geo_accel_in_au( )),  and Pines' non-singular formulation
+(geo_accel_pines( )).  Each is evaluated at the same random points,
+between 1.01 and 7 earth radii (low orbit to somewhat past GEO),  for
+degrees 8,  20,  and 70.  Also shown is the largest difference from the
+long double results,  relative to the size of the acceleration.
+
+   The GGM03C terms in 'geo_pot.cpp' only go to degree 50,  and the
+classical functions to degree 48,  so 70 is cut down to 48 for all
+three (as shown in the output).  Finally,  all three are evaluated a
+hair off the polar axis,  where the classical ones are singular (the
+long double one asserts if you try to evaluate it right on the axis),
+and the Pines version on the axis itself.
+
+   Usage is
+
+geo_bm (-n points) (-d degree)
+
+   -d adds a fourth degree to the three standard ones.  Build with
+'make geo_bm'.  */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+double geo_potential_in_au( const double x, const double y, const double z,
+                 double *derivs, const int n_terms);    /* geo_pot.c */
+double geo_accel_in_au( const double x, const double y, const double z,
+                 double *accel, int n_terms);           /* geo_pot.c */
+double geo_accel_pines( const double x, const double y, const double z,
+                 double *accel, int max_degree);        /* geo_pot.c */
+
+#define EARTH_R (6378140. / 1.495978707e+11)
+#define MAX_CLASSICAL_DEGREE 48
+#define N_METHODS 3
+
+static const char *method_names[N_METHODS] = { "long double",
+                     "double", "Pines" };
+
+static void compute_accel( const int method, const double *loc,
+                  double *accel, const int degree)
+{
+   switch( method)
+      {
+      case 0:
+         geo_potential_in_au( loc[0], loc[1], loc[2], accel, degree + 1);
+         break;
+      case 1:
+         geo_accel_in_au( loc[0], loc[1], loc[2], accel, degree + 1);
+         break;
+      case 2:
+         geo_accel_pines( loc[0], loc[1], loc[2], accel, degree);
+         break;
+      }
+}
+
+static double time_method( const int method, const double *locs,
+                  const long n_points, const int degree, double *checksum)
+{
+   const clock_t t_start = clock( );
+   long i;
+
+   for( i = 0; i < n_points; i++)
+      {
+      double accel[3];
+
+      compute_accel( method, locs + i * 3, accel, degree);
+      *checksum += accel[0] + accel[1] + accel[2];
+      }
+   return( (double)( clock( ) - t_start) / (double)CLOCKS_PER_SEC);
+}
+
+static double max_relative_diff( const int method, const double *locs,
+                  const long n_points, const int degree)
+{
+   double rval = 0.;
+   long i;
+   int j;
+
+   for( i = 0; i < n_points; i++)
+      {
+      double ref[3], accel[3], diff = 0., mag = 0.;
+
+      compute_accel( 0, locs + i * 3, ref, degree);
+      compute_accel( method, locs + i * 3, accel, degree);
+      for( j = 0; j < 3; j++)
+         {
+         diff += (accel[j] - ref[j]) * (accel[j] - ref[j]);
+         mag += ref[j] * ref[j];
+         }
+      diff = sqrt( diff / mag);
+      if( rval < diff)
+         rval = diff;
+      }
+   return( rval);
+}
+
+int main( const int argc, const char **argv)
+{
+   long n_points = 100000, i;
+   int degrees[4] = { 8, 20, 70, 0 }, n_degrees = 3;
+   int j, method;
+   double *locs, checksum = 0.;
+
+   for( j = 1; j < argc - 1; j++)
+      if( argv[j][0] == '-')
+         switch( argv[j][1])
+            {
+            case 'n':
+               n_points = atol( argv[++j]);
+               break;
+            case 'd':
+               degrees[n_degrees] = atoi( argv[++j]);
+               if( n_degrees == 3)
+                  n_degrees++;
+               break;
+            default:
+               printf( "Unrecognized option '%s'\n", argv[j]);
+               return( -1);
+            }
+   locs = (double *)malloc( n_points * 3 * sizeof( double));
+   if( !locs)
+      {
+      printf( "Couldn't allocate %ld points\n", n_points);
+      return( -1);
+      }
+   srand( 1);
+   for( i = 0; i < n_points; i++)
+      {
+      double *loc = locs + i * 3, r;
+
+      do
+         {
+         for( j = 0; j < 3; j++)
+            loc[j] = 2. * (double)rand( ) / (double)RAND_MAX - 1.;
+         r = sqrt( loc[0] * loc[0] + loc[1] * loc[1] + loc[2] * loc[2]);
+         }
+         while( r > 1. || r < .01);
+      r = EARTH_R * (1.01 + 5.99 * (double)rand( ) / (double)RAND_MAX) / r;
+      for( j = 0; j < 3; j++)
+         loc[j] *= r;
+      }
+   printf( "%ld points;  times in microseconds per evaluation\n", n_points);
+   printf( "Degree  long double  double   Pines   max diff (double)  (Pines)\n");
+   for( j = 0; j < n_degrees; j++)
+      {
+      const int degree = (degrees[j] > MAX_CLASSICAL_DEGREE ?
+                              MAX_CLASSICAL_DEGREE : degrees[j]);
+      double times[N_METHODS];
+
+      for( method = 0; method < N_METHODS; method++)
+         times[method] = time_method( method, locs, n_points, degree,
+                                 &checksum) * 1e+6 / (double)n_points;
+      printf( "%2d (%2d) %9.3f %9.3f %8.3f %14.3e %12.3e\n",
+               degrees[j], degree, times[0], times[1], times[2],
+               max_relative_diff( 1, locs, n_points, degree),
+               max_relative_diff( 2, locs, n_points, degree));
+      }
+   printf( "Near and on the polar axis,  at 1.1 earth radii (degree 20) :\n");
+   for( method = 0; method <= N_METHODS; method++)
+      {
+      double loc[3], accel[3];
+
+      loc[0] = (method == N_METHODS ? 0. : EARTH_R * 1e-9);
+      loc[1] = 0.;
+      loc[2] = EARTH_R * 1.1;
+      compute_accel( (method == N_METHODS ? 2 : method), loc, accel, 20);
+      printf( "%-12s %17.10e %17.10e %17.10e\n",
+               (method == N_METHODS ? "Pines, axis" : method_names[method]),
+               accel[0], accel[1], accel[2]);
+      }
+   printf( "(checksum %e)\n", checksum);
+   free( locs);
+   return( 0);
+}
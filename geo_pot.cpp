@@ -14,6 +14,10 @@ long double geo_potential( const long double x, const long double y,
                                   int n_terms);   /* geo_pot.c */
 double geo_potential_in_au( const double x, const double y, const double z,
                  double *derivs, const int n_terms);    /* geo_pot.c */
+double geo_accel_in_au( const double x, const double y, const double z,
+                 double *accel, int n_terms);           /* geo_pot.c */
+double geo_accel_pines( const double x, const double y, const double z,
+                 double *accel, int max_degree);        /* geo_pot.c */
 
 #define PI 3.1415926535897932384626433832795028841971693993751058209749445923
 
@@ -1496,11 +1500,17 @@ for each ALP.  The following lets you avoid that... admittedly,  at the
 cost of possibly hitting issues for l >= 877,  if that ever happens.
 (I currently set a stricter assert of l < 800.)  */
 
+static bool renormalized = false;
+static double ggm03c_dterms[sizeof( ggm03c_terms) / sizeof( ggm03c_terms[0])];
+static void init_pines_tables( void);
+
 static void renormalize_terms( void)
 {
    int l, m;
    long double *geo_tptr = ggm03c_terms;
 
+   init_pines_tables( );      /* these need the still-normalized terms */
+
                         /* Find_Orb already handles J2 and "J0": */
 #ifndef TEST_MAIN
 //   ggm03c_terms[0] = ggm03c_terms[6] = 0.;
@@ -1522,6 +1532,9 @@ static void renormalize_terms( void)
             factor /= sqrtl((long double)((l + m + 1) * (l - m)));
          }
       }
+   for( l = 0; l < (int)( geo_tptr - ggm03c_terms); l++)
+      ggm03c_dterms[l] = (double)ggm03c_terms[l];
+   renormalized = true;
 }
 
 /* A note on determining the derivative of an associated Legendre polynomial:
@@ -1581,16 +1594,12 @@ long double geo_potential( const long double x, const long double y,
    long double rval = 0.;
    long double drval_dr = 0., drval_dtheta = 0., drval_dphi = 0.;
    int l, m;
-   static bool renormalized = false;
 
    assert( n_terms < 800);       /* see above comments on limits */
    if( n_terms > N_TERMS - 1)
       n_terms = N_TERMS - 1;
    if( renormalized == false)
-      {
       renormalize_terms( );
-      renormalized = true;
-      }
 
    sin_mtheta[0] = 0.;
    cos_mtheta[0] = 1.;
@@ -1714,6 +1723,277 @@ double geo_potential_in_au( const double x, const double y, const double z,
    return( rval);
 }
 
+/* The force model only wants the acceleration,  in Cartesian coordinates.
+Going through geo_potential_in_au( ) for that means doing the recurrences
+in long double,  which is slow (x87 code,  or software emulation on some
+platforms),  and then converting the spherical partials to Cartesian
+ones.  geo_accel_in_au( ) does the same computation as geo_potential( )
+in double precision,  which (with the terms already renormalized;  see
+above) is ample for the N_TERMS we go up to,  and puts the Cartesian
+acceleration,  in AU/day^2,  into 'accel'.  Input xyz are in AU,  and
+the return value is the potential in AU^2/day^2,  just as for
+geo_potential_in_au( ).  */
+
+double geo_accel_in_au( const double x, const double y, const double z,
+                 double *accel, int n_terms)
+{
+   const double earth_gm_mks = 0.3986004415E+15; /* GGM03 value, in m^3/s^2 */
+   const double earth_gm_aud = earth_gm_mks * seconds_per_day * seconds_per_day
+               / (AU_IN_METERS * AU_IN_METERS * AU_IN_METERS);
+   const double xe = x / EARTH_R, ye = y / EARTH_R, ze = z / EARTH_R;
+   const double r = sqrt( xe * xe + ye * ye + ze * ze);
+   const double r_cyl = sqrt( xe * xe + ye * ye);
+   const double sin_phi = r_cyl / r, cos_phi = ze / r;
+   const double cot_phi = ze / r_cyl;
+   const double sin_lon = ye / r_cyl, cos_lon = xe / r_cyl;
+   const double *geo_tptr = ggm03c_dterms;
+   double p[N_TERMS][N_TERMS];
+   double sin_mtheta[N_TERMS], cos_mtheta[N_TERMS];
+   double rval = 0., rpow;
+   double drval_dr = 0., drval_dtheta = 0., drval_dphi = 0.;
+   int l, m;
+
+   if( n_terms > N_TERMS - 1)
+      n_terms = N_TERMS - 1;
+   if( renormalized == false)
+      renormalize_terms( );
+   sin_mtheta[0] = 0.;
+   cos_mtheta[0] = 1.;
+   sin_mtheta[1] = sin_lon;
+   cos_mtheta[1] = cos_lon;
+   for( m = 1; m < n_terms; m++)
+      {
+      sin_mtheta[m + 1] = sin_mtheta[m] * cos_lon + cos_mtheta[m] * sin_lon;
+      cos_mtheta[m + 1] = cos_mtheta[m] * cos_lon - sin_mtheta[m] * sin_lon;
+      }
+   p[0][0] = 1.;
+   for( m = 0; m < n_terms; m++)
+      {
+      const double tval = (double)( 2 * m + 1) * p[m][m];
+
+      p[m + 1][m + 1] = tval * sin_phi;
+      p[m + 1][m]     = tval * cos_phi;
+      for( l = m + 1; l < n_terms - 1; l++)
+         p[l + 1][m] = ((double)(2 * l + 1) * cos_phi * p[l][m]
+                             - (double)(l + m) * p[l - 1][m])
+                                  / (double)(l - m + 1);
+      }
+
+   rpow = 1. / r;
+   for( l = 0; l < n_terms; l++, rpow /= r)
+      {
+      double contrib_this_l = 0.;
+      double contrib_drval_dtheta = 0.;
+      double contrib_drval_dphi = 0.;
+
+      if( l == 1)       /* terms are all zero;  skip 'em */
+         geo_tptr += 4;
+      else for( m = 0; m <= l; m++, geo_tptr += 2)
+         {
+         const double dp_dphi =
+                p[l][m] * ((double)m * cot_phi) - (l == m ? 0. : p[l][m + 1]);
+         const double contribution =
+                         geo_tptr[0] * cos_mtheta[m] + geo_tptr[1] * sin_mtheta[m];
+
+         contrib_this_l += p[l][m] * contribution;
+         contrib_drval_dphi += dp_dphi * contribution;
+         contrib_drval_dtheta += p[l][m] * (double)m *
+                     (-geo_tptr[0] * sin_mtheta[m] + geo_tptr[1] * cos_mtheta[m]);
+         }
+      rval += contrib_this_l * rpow;
+      drval_dtheta -= contrib_drval_dtheta * rpow;
+      drval_dphi += contrib_drval_dphi * rpow;
+      drval_dr += (double)( l + 1) * contrib_this_l * rpow / r;
+      }
+   drval_dtheta /= r_cyl;
+   drval_dphi /= r;
+   accel[0] = drval_dr * cos_lon * sin_phi       /* sin_phi = cos( lat) */
+            - drval_dtheta * sin_lon
+            - drval_dphi * cos_lon * cos_phi;
+   accel[1] = drval_dr * sin_lon * sin_phi
+            + drval_dtheta * cos_lon
+            - drval_dphi * sin_lon * cos_phi;
+   accel[2] = drval_dr * cos_phi + drval_dphi * sin_phi;
+   for( l = 0; l < 3; l++)
+      accel[l] *= earth_gm_aud / (EARTH_R * EARTH_R);
+   return( -rval * earth_gm_aud / EARTH_R);
+}
+
+/* geo_potential( ) and geo_accel_in_au( ) work in terms of latitude and
+longitude,  and the derivatives with respect to them have to be divided
+by cos(lat) (r_cyl) to get accelerations.  That fails at the poles,  and
+loses precision near them.  Also,  each new (l, m) term depends on
+the previous one in a way that keeps compilers from vectorizing much.
+
+   geo_accel_pines( ) uses Pines' formulation instead,  as in
+
+Pines, S. (1973), "Uniform Representation of the Gravitational Potential
+and its Derivatives", AIAA Journal 11(11), 1508-1511
+
+   with full normalization as described in
+
+Eckman, Brown, Adamo (2014), "Normalization of Gravitational Acceleration
+Models",  NASA/TM-2014-217383 (originally JSC-CN-23097)
+
+   Positions are given by the direction cosines s = x/r,  t = y/r,
+u = z/r.  The associated Legendre functions are replaced by their m-th
+derivatives A(n,m)(u),  and the cos(m*lon) and sin(m*lon) terms by the
+real and imaginary parts of (s + it)^m.  The cos^m(lat) factors that
+got divided out in the classical scheme are absorbed into the latter,
+and nothing is singular anywhere above the surface.
+
+   The A(n,m) are computed a degree at a time,  all orders at once,
+from the two previous degrees.  The sums over each degree are also
+accumulated by order,  in arrays that are summed only at the end.  So all
+the inner loops run over the order index with no dependence between
+one order and the next,  and compilers will use SIMD instructions for
+them.  All of this is in double precision;  normalized A(n,m) stay near
+unity,  so there's no range problem,  and the recurrence factors are
+computed once,  in init_pines_tables( ).
+
+   'max_degree' can be anything up to the degree of the model (N_TERMS).
+Input is in AU and output in AU/day^2,  as for geo_accel_in_au( ),
+except that 'max_degree' is one less than 'n_terms' for the same
+truncation;  the return value is again the potential in AU^2/day^2. */
+
+#define PINES_MAX_DEGREE N_TERMS
+#define TRI( n) ((n) * ((n) + 1) / 2)
+#define N_PINES_TERMS TRI( PINES_MAX_DEGREE + 1)
+
+static double pines_c[N_PINES_TERMS], pines_s[N_PINES_TERMS];
+static double pines_a[N_PINES_TERMS], pines_b[N_PINES_TERMS];
+static double pines_f[N_PINES_TERMS], pines_diag[PINES_MAX_DEGREE + 1];
+
+/* Term (n, m) is at TRI( n) + m in all of the above.  pines_c and pines_s
+are the normalized GGM03C terms.  pines_a and pines_b are the vertical
+recurrence factors,
+
+A(n,m) = a(n,m) * u * A(n-1,m) - b(n,m) * A(n-2,m)
+
+   pines_diag[n] takes A(n-1,n-1) to A(n,n),  and pines_f(n,m) is the
+normalization ratio relating dA(n,m)/du to A(n,m+1).  */
+
+static void init_pines_tables( void)
+{
+   int n, m;
+
+   for( n = 0; n <= PINES_MAX_DEGREE; n++)
+      for( m = 0; m <= n; m++)
+         {
+         const int idx = TRI( n) + m;
+         const double n2 = (double)( n + n);
+
+         pines_c[idx] = (double)ggm03c_terms[idx * 2];
+         pines_s[idx] = (double)ggm03c_terms[idx * 2 + 1];
+         if( m < n)
+            pines_a[idx] = sqrt( (n2 + 1.) * (n2 - 1.)
+                                       / (double)( (n - m) * (n + m)));
+         else
+            pines_a[idx] = 0.;
+         if( m < n - 1)
+            pines_b[idx] = sqrt( (n2 + 1.) * (double)( (n + m - 1) * (n - m - 1))
+                         / ((n2 - 3.) * (double)( (n + m) * (n - m))));
+         else
+            pines_b[idx] = 0.;
+         pines_f[idx] = sqrt( (double)( (n - m) * (n + m + 1)) / (m ? 1. : 2.));
+         }
+   pines_diag[0] = 1.;
+   pines_diag[1] = sqrt( 3.);
+   for( n = 2; n <= PINES_MAX_DEGREE; n++)
+      pines_diag[n] = sqrt( (double)( n + n + 1) / (double)( n + n));
+}
+
+double geo_accel_pines( const double x, const double y, const double z,
+                 double *accel, int max_degree)
+{
+   const double earth_gm_mks = 0.3986004415E+15; /* GGM03 value, in m^3/s^2 */
+   const double earth_gm_aud = earth_gm_mks * seconds_per_day * seconds_per_day
+               / (AU_IN_METERS * AU_IN_METERS * AU_IN_METERS);
+   const double r = sqrt( x * x + y * y + z * z);
+   const double s = x / r, t = y / r, u = z / r, rho = EARTH_R / r;
+   const double mu_over_r = earth_gm_aud / r;
+         /* A(n,m) for the current and previous two degrees,  padded with
+         zeroes so that A(n,n+1) = 0 and the loops needn't special-case it: */
+   double abar[3][PINES_MAX_DEGREE + 2];
+         /* real and imaginary parts of (s + it)^(m-1),  i.e.,  offset by one: */
+   double re[PINES_MAX_DEGREE + 2], im[PINES_MAX_DEGREE + 2];
+         /* per-order sums of the potential and the Pines a1...a4 terms : */
+   double sum_pot[PINES_MAX_DEGREE + 1], sum_a1[PINES_MAX_DEGREE + 1];
+   double sum_a2[PINES_MAX_DEGREE + 1], sum_a3[PINES_MAX_DEGREE + 1];
+   double sum_a4[PINES_MAX_DEGREE + 1];
+   double pot = 0., a1 = 0., a2 = 0., a3 = 0., a4 = 0., rho_n = 1.;
+   double *prev2 = abar[0], *prev1 = abar[1], *curr = abar[2];
+   int n, m;
+
+   if( max_degree > PINES_MAX_DEGREE)
+      max_degree = PINES_MAX_DEGREE;
+   if( renormalized == false)
+      renormalize_terms( );
+   re[0] = im[0] = 0.;
+   re[1] = 1.;
+   im[1] = 0.;
+   for( m = 1; m <= max_degree; m++)
+      {
+      re[m + 1] = re[m] * s - im[m] * t;
+      im[m + 1] = re[m] * t + im[m] * s;
+      }
+   for( m = 0; m <= max_degree; m++)
+      sum_pot[m] = sum_a1[m] = sum_a2[m] = sum_a3[m] = sum_a4[m] = 0.;
+   for( m = 0; m < PINES_MAX_DEGREE + 2; m++)
+      prev2[m] = prev1[m] = 0.;
+   prev1[0] = 1.;                       /* A(0,0) */
+   for( n = 1; n <= max_degree; n++)
+      {
+      const double *a = pines_a + TRI( n), *b = pines_b + TRI( n);
+      double *tptr;
+
+      rho_n *= rho;
+      for( m = 0; m < n; m++)
+         curr[m] = a[m] * u * prev1[m] - b[m] * prev2[m];
+      curr[n] = pines_diag[n] * prev1[n - 1];
+      curr[n + 1] = 0.;
+      if( n >= 2)                /* J0 is handled elsewhere,  J1 is zero */
+         {
+         const double *c = pines_c + TRI( n), *sn = pines_s + TRI( n);
+         const double *f = pines_f + TRI( n);
+         const double np1 = (double)( n + 1);
+
+         for( m = 0; m <= n; m++)
+            {
+            const double ra = rho_n * curr[m];
+            const double g = c[m] * re[m + 1] + sn[m] * im[m + 1];
+            const double dg_ds = c[m] * re[m] + sn[m] * im[m];
+            const double dg_dt = sn[m] * re[m] - c[m] * im[m];
+            const double dg_du = rho_n * f[m] * curr[m + 1] * g;
+
+            sum_pot[m] += ra * g;
+            sum_a1[m] += (double)m * ra * dg_ds;
+            sum_a2[m] += (double)m * ra * dg_dt;
+            sum_a3[m] += dg_du;
+            sum_a4[m] += (np1 + (double)m) * ra * g + u * dg_du;
+            }
+         }
+      tptr = prev2;
+      prev2 = prev1;
+      prev1 = curr;
+      curr = tptr;
+      }
+   for( m = 0; m <= max_degree; m++)
+      {
+      pot += sum_pot[m];
+      a1 += sum_a1[m];
+      a2 += sum_a2[m];
+      a3 += sum_a3[m];
+      a4 += sum_a4[m];
+      }
+            /* Signs are flipped to match geo_accel_in_au( ):  the 'accel'
+            here is the gradient of the negated potential.  */
+   accel[0] = -mu_over_r * (a1 - s * a4) / r;
+   accel[1] = -mu_over_r * (a2 - t * a4) / r;
+   accel[2] = -mu_over_r * (a3 - u * a4) / r;
+   return( -mu_over_r * pot);
+}
+
 #ifdef TEST_MAIN
 
 static double jn_potential( const double x, const double y, const double z,
@@ -0,0 +1,170 @@
+/* integ_bm.cpp: benchmark comparing Find_Orb's numerical integrators
+
+Copyright (C) 2010, Project Pluto
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+02110-1301, USA.    */
+
+/* Integrates a state vector over a long arc (by default,  a Ceres-like
+orbit from J2000 back two centuries,  with all planets and the moon as
+perturbers) using PD89,  the multistep integrator,  and RKF with both
+long double and double-double arithmetic,  each at a range of tolerances.
+For each,  we show the number of force model evaluations,  the time taken,
+and the error relative to a reference integration made with double-double
+RKF at a tolerance of 1e-15.  (Much tighter than that,  and we'd be below
+the precision of the doubles the state is kept in;  the integration would
+crawl,  or fail.)  If the reference integration fails,  there's nothing to
+compare to,  and we stop.  Comparing lines with about the same error shows
+how the methods compare at matched accuracy.
+
+   Usage is
+
+integ_bm (-y years) (-t jd) (x y z vx vy vz)
+
+   where the state vector is heliocentric ecliptic J2000,  in AU and AU/day,
+at time jd (default 2451545.0 = J2000).  Build with 'make integ_bm'.  */
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <time.h>
+#include "watdefs.h"
+#include "afuncs.h"
+#include "comets.h"
+#include "mpc_obs.h"
+#include "runge.h"
+
+extern int debug_level;
+
+int debug_level = 0;
+
+int inquire( const char *prompt, char *buff, const int max_len,
+                     const int color);          /* integ_bm.cpp */
+void refresh_console( void);                    /* integ_bm.cpp */
+void move_add_nstr( const int col, const int row, const char *msg,
+                     const int n_bytes);        /* integ_bm.cpp */
+
+int inquire( const char *prompt, char *buff, const int max_len,
+                     const int color)
+{
+   printf( "%s\n", prompt);
+   return( 0);
+}
+
+void refresh_console( void)
+{
+}
+
+void move_add_nstr( const int col, const int row, const char *msg, const int n_bytes)
+{
+}
+
+/* Returns zero on success,  or the integrate_orbit_in_context( ) error
+code;  the time used,  in seconds,  is stored in 't_used'.  */
+
+static int integrate_and_time( double *state, const double t0,
+            const double t1, const int method, const int double_double,
+            const double tolerance, long *n_evaluations, double *t_used)
+{
+   extern int integration_method;
+   extern double integration_tolerance;
+   INTEGRATION_CONTEXT context;
+   const clock_t t_start = clock( );
+   int rval;
+
+   integration_method = method;
+   integration_tolerance = tolerance;
+   init_integration_context( &context);
+   context.show_messages = 0;
+   context.use_encke = 0;
+   context.double_double = double_double;
+   rval = integrate_orbit_in_context( &context, state, t0, t1);
+   *n_evaluations = context.n_evaluations;
+   *t_used = (double)( clock( ) - t_start) / (double)CLOCKS_PER_SEC;
+   return( rval);
+}
+
+int main( const int argc, const char **argv)
+{
+   extern unsigned perturbers, excluded_perturbers;
+   double state0[6] = { 2.77, 0., 0., 0., 0.0103356, 0.0018 };
+   double ref_state[6], years = -200., t0 = 2451545.0, t_used;
+   const double tolerances[4] = { 1e-8, 1e-10, 1e-12, 1e-14 };
+   const int methods[4] = { 2, 3, 0, 0 };
+   const int double_double[4] = { 0, 0, 0, 1 };
+   const char *method_names[4] = { "PD89", "multistep", "RKF (ld)", "RKF (dd)" };
+   int i, j, n_state = 0, rval;
+   long n_evaluations;
+
+   for( i = 1; i < argc; i++)
+      if( argv[i][0] == '-' && argv[i][1] && !isdigit( argv[i][1])
+                     && argv[i][1] != '.' && i < argc - 1)
+         {
+         switch( argv[i][1])
+            {
+            case 'y':
+               years = atof( argv[i + 1]);
+               break;
+            case 't':
+               t0 = atof( argv[i + 1]);
+               break;
+            default:
+               printf( "Unrecognized option '%s'\n", argv[i]);
+               return( -1);
+            }
+         i++;
+         }
+      else if( n_state < 6)
+         state0[n_state++] = atof( argv[i]);
+   if( n_state && n_state != 6)
+      {
+      printf( "Need all six components of the state vector\n");
+      return( -1);
+      }
+   perturbers = 0x7fe;           /* Mercury through Pluto,  plus moon */
+   excluded_perturbers = 0;
+
+   memcpy( ref_state, state0, 6 * sizeof( double));
+   rval = integrate_and_time( ref_state, t0, t0 + years * 365.25, 0, 1,
+                                  1e-15, &n_evaluations, &t_used);
+   if( rval)
+      {
+      printf( "Reference integration failed (%d)\n", rval);
+      return( -1);
+      }
+   printf( "Reference: %ld evaluations,  %.3f seconds\n",
+                                  n_evaluations, t_used);
+   printf( "Method     tolerance   n_evals   time (s)    err (km)\n");
+   for( i = 0; i < 4; i++)
+      for( j = 0; j < 4; j++)
+         {
+         double state[6];
+
+         memcpy( state, state0, 6 * sizeof( double));
+         rval = integrate_and_time( state, t0, t0 + years * 365.25,
+                           methods[j], double_double[j], tolerances[i],
+                           &n_evaluations, &t_used);
+         if( rval)
+            printf( "%-10s %8.1e   failed (%d)\n", method_names[j],
+                  tolerances[i], rval);
+         else
+            printf( "%-10s %8.1e %9ld %10.3f %12.3e\n", method_names[j],
+                  tolerances[i], n_evaluations, t_used,
+                  vector3_dist( state, ref_state) * AU_IN_KM);
+         }
+   return( 0);
+}
@@ -0,0 +1,147 @@
+/* lsq_bm.cpp: benchmark for the least-squares code
+
+Copyright (C) 2010, Project Pluto
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+02110-1301, USA.    */
+
+/* Fits random linear problems of 1000,  10000,  and 100000 observations
+(rows) with 6,  7,  8,  and 9 parameters,  using the normal equations in
+__float128 or long double (the default) and QR decomposition (LSQUARE_QR),
+and adding rows either one at a time with lsquare_add_observation( ) or
+all at once with lsquare_add_observations( ).  Times include getting the
+solution and covariance matrix.  The largest difference of each solution
+from that of the normal equations with rows added singly,  relative to the
+size of the solution,  is also shown.
+
+   The slopes are made to be somewhat ill-conditioned,  as real orbit
+fitting problems are:  each column is a blend of a random column and the
+one before it.  Usage is
+
+lsq_bm (-n max_rows) (-s seed)
+
+   Build with 'make lsq_bm'.  */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "lsquare.h"
+
+#define MAX_PARAMS 9
+#define N_METHODS 4
+
+static const char *method_names[N_METHODS] = { "normal/single",
+               "normal/batch", "QR/single", "QR/batch" };
+
+static double fit( const int method, const int n_rows, const int n_params,
+                  const double *resids, const double *weights,
+                  const double *slopes, double *soln)
+{
+   const clock_t t_start = clock( );
+   void *lsq;
+   double *covar;
+   int i;
+
+   lsq = lsquare_init( n_params);
+   lsquare_set_method( lsq, method >= 2);
+   if( method & 1)
+      lsquare_add_observations( lsq, n_rows, resids, weights, slopes);
+   else
+      for( i = 0; i < n_rows; i++)
+         lsquare_add_observation( lsq, resids[i], weights[i],
+                                 slopes + i * n_params);
+   if( lsquare_solve( lsq, soln))
+      printf( "Solution failed for %s\n", method_names[method]);
+   covar = lsquare_covariance_matrix( lsq);
+   free( covar);
+   lsquare_free( lsq);
+   return( (double)( clock( ) - t_start) / (double)CLOCKS_PER_SEC);
+}
+
+int main( const int argc, const char **argv)
+{
+   int max_rows = 100000, n_rows, n_params, i, j, method;
+   double *resids, *weights, *slopes;
+   unsigned seed = 1;
+
+   for( i = 1; i < argc - 1; i++)
+      if( argv[i][0] == '-')
+         switch( argv[i][1])
+            {
+            case 'n':
+               max_rows = atoi( argv[++i]);
+               break;
+            case 's':
+               seed = (unsigned)atoi( argv[++i]);
+               break;
+            default:
+               printf( "Unrecognized option '%s'\n", argv[i]);
+               return( -1);
+            }
+   resids = (double *)malloc( max_rows * (MAX_PARAMS + 2) * sizeof( double));
+   if( !resids)
+      {
+      printf( "Couldn't allocate %d rows\n", max_rows);
+      return( -1);
+      }
+   weights = resids + max_rows;
+   slopes = weights + max_rows;
+   printf( "Times in milliseconds;  max diff is relative to normal/single\n");
+   printf( "  Rows  Params");
+   for( method = 0; method < N_METHODS; method++)
+      printf( " %13s", method_names[method]);
+   printf( "   max diff: normal/batch  QR/single  QR/batch\n");
+   for( n_rows = 1000; n_rows <= max_rows; n_rows *= 10)
+      for( n_params = 6; n_params <= MAX_PARAMS; n_params++)
+         {
+         double solns[N_METHODS][MAX_PARAMS], times[N_METHODS];
+         double diffs[N_METHODS], mag = 0.;
+
+         srand( seed);
+         for( i = 0; i < n_rows; i++)
+            {
+            double *row = slopes + i * n_params;
+
+            for( j = 0; j < n_params; j++)
+               {
+               row[j] = (double)rand( ) / (double)RAND_MAX - .5;
+               if( j)
+                  row[j] = .1 * row[j] + row[j - 1];
+               }
+            resids[i] = (double)rand( ) / (double)RAND_MAX - .5;
+            weights[i] = .5 + (double)rand( ) / (double)RAND_MAX;
+            }
+         for( method = 0; method < N_METHODS; method++)
+            times[method] = fit( method, n_rows, n_params, resids, weights,
+                                 slopes, solns[method]) * 1000.;
+         for( j = 0; j < n_params; j++)
+            mag += solns[0][j] * solns[0][j];
+         for( method = 1; method < N_METHODS; method++)
+            {
+            diffs[method] = 0.;
+            for( j = 0; j < n_params; j++)
+               diffs[method] += (solns[method][j] - solns[0][j])
+                              * (solns[method][j] - solns[0][j]);
+            diffs[method] = sqrt( diffs[method] / mag);
+            }
+         printf( "%6d %5d  ", n_rows, n_params);
+         for( method = 0; method < N_METHODS; method++)
+            printf( " %13.3f", times[method]);
+         printf( " %22.3e %10.3e %10.3e\n", diffs[1], diffs[2], diffs[3]);
+         }
+   free( resids);
+   return( 0);
+}
@@ -52,12 +52,55 @@ idea for nearly-singular matrices.  */
 
 #define LSQUARE struct lsquare
 
+ldouble lsquare_determinant;
+
+/* By default,  we use the normal equations.  If lsquare_set_method( ) is
+called with 'use_qr' set (see LSQUARE_QR in 'environ.def'),  we don't form
+the normal equations at all.  Instead,  the problem is solved by
+Householder QR in plain doubles;  see the comments above qr_absorb_rows( ).
+The method has to be set before any observations are added.  */
+
+#define LSQ_BLOCK    32
+
 LSQUARE
    {
    int n_params, n_obs;
    ldouble *wtw, *uw;
+   double *sums;        /* see add_block_to_normal_eqns( ) */
+            /* Used only for the QR method : */
+   int n_pending;
+   double *r, *pending, *lm_diag;
    };
 
+static void alloc_lsquare_arrays( LSQUARE *lsq, const int use_qr)
+{
+   const int n_params = lsq->n_params;
+
+   if( use_qr)
+      {
+      lsq->r = (double *)calloc( (n_params + 1) * (n_params + LSQ_BLOCK + 1),
+                                             sizeof( double));
+      lsq->pending = lsq->r + n_params * (n_params + 1);
+      lsq->lm_diag = lsq->pending + (n_params + 1) * LSQ_BLOCK;
+      }
+   else
+      {
+      lsq->uw = (ldouble *)calloc( (n_params + 1) * n_params, sizeof( ldouble));
+      lsq->wtw = lsq->uw + n_params;
+      lsq->sums = (double *)calloc( (2 * n_params + 3) * (n_params + 1),
+                                             sizeof( double));
+      }
+}
+
+static void free_lsquare_arrays( LSQUARE *lsq)
+{
+   free( lsq->uw);
+   free( lsq->sums);
+   free( lsq->r);
+   lsq->uw = lsq->wtw = NULL;
+   lsq->sums = lsq->r = lsq->pending = lsq->lm_diag = NULL;
+}
+
 void *lsquare_init( const int n_params)
 {
    LSQUARE *rval = (LSQUARE *)calloc( 1, sizeof( LSQUARE));
@@ -66,11 +109,27 @@ void *lsquare_init( const int n_params)
       return( (void *)rval);
    rval->n_params = n_params;
    rval->n_obs = 0;
-   rval->uw = (ldouble *)calloc( (n_params + 1) * n_params, sizeof( ldouble));
-   rval->wtw = rval->uw + n_params;
+   alloc_lsquare_arrays( rval, 0);
    return(( void *)rval);
 }
 
+/* Selects QR (use_qr != 0) or the normal equations.  Returns -1 if
+observations have already been added (in which case nothing changes),
+-2 if memory couldn't be allocated,  zero otherwise.  */
+
+int lsquare_set_method( void *lsquare, const int use_qr)
+{
+   LSQUARE *lsq = (LSQUARE *)lsquare;
+
+   if( lsq->n_obs || lsq->n_pending)
+      return( -1);
+   if( (lsq->r != NULL) == (use_qr != 0))
+      return( 0);                /* already using that method */
+   free_lsquare_arrays( lsq);
+   alloc_lsquare_arrays( lsq, use_qr);
+   return( (use_qr ? lsq->r != NULL : lsq->uw != NULL) ? 0 : -2);
+}
+
 #ifdef LSQUARE_ERROR_DEBUGGING
 static inline ldouble lfabs( ldouble ival)
 {
@@ -103,28 +162,306 @@ static void dump_matrix( const ldouble *matrix, const int xsize, const int ysize
 
 double levenberg_marquardt_lambda = 0.;      /* damping factor */
 
-int lsquare_add_observation( void *lsquare, const double residual,
-                                  const double weight, const double *obs)
+/* Forming the normal equations squares the condition number of the problem,
+which is why the above uses __float128 (or long doubles) for them.  Those
+are slow;  __float128 is done in software.  With QR decomposition,  one
+works with the (weighted) observation matrix A directly.  A = QR,  where Q
+is orthogonal and R is upper triangular,  and the least-squares solution
+to Ax = b is found from Rx = Q^T b by back-substitution.  The condition
+number isn't squared,  and doubles are quite sufficient.
+
+   We never need Q (or A) in full.  Each row of A,  with its residual as
+an extra (n_params + 1)th column,  is stored in a block of pending rows.
+When that block fills up,  it's stacked under the current R (and Q^T b)
+and reduced back to triangular form with Householder reflections.  So the
+memory used doesn't depend on the number of observations,  and the work
+is done a block at a time,  in loops that run down columns of the block.
+The block is stored column by column,  so those loops are over contiguous
+memory and the compiler can vectorize them.
+
+   A Householder reflection zeroes column k of the block,  and alters R's
+k-th diagonal element accordingly;  it's then applied to the remaining
+columns.  (Rows of R above k have zeroes in column k,  so aren't changed.)
+
+   The Levenberg-Marquardt damping that lsquare_add_observation( ) adds to
+the diagonal of W^T W is equivalent to extra rows of A,  each zero except
+for one column.  Their squares are accumulated in 'lm_diag',  and they're
+appended (along with any pending rows) to a copy of R when a solution or
+covariance matrix is needed.  That way,  more observations can still be
+added afterward.   */
+
+static void qr_absorb_rows( double *r, double *rows, const int n_rows,
+                        const int stride, const int n_params)
+{
+   int i, j, k;
+
+   for( k = 0; k < n_params; k++)
+      {
+      double *col_k = rows + k * stride;
+      const double alpha = r[k * (n_params + 1) + k];
+      double norm2 = alpha * alpha, beta, v0, tau;
+
+      for( i = 0; i < n_rows; i++)
+         norm2 += col_k[i] * col_k[i];
+      if( norm2 > alpha * alpha)    /* i.e.,  column isn't already zero */
+         {
+         beta = (alpha > 0. ? -sqrt( norm2) : sqrt( norm2));
+         v0 = alpha - beta;
+         tau = -v0 / beta;
+         for( i = 0; i < n_rows; i++)   /* Householder vector is (1, col_k) */
+            col_k[i] /= v0;
+         r[k * (n_params + 1) + k] = beta;
+         for( j = k + 1; j <= n_params; j++)
+            {
+            double *col_j = rows + j * stride;
+            double *rkj = r + k * (n_params + 1) + j;
+            double dot = *rkj;
+
+            for( i = 0; i < n_rows; i++)
+               dot += col_k[i] * col_j[i];
+            dot *= tau;
+            *rkj -= dot;
+            for( i = 0; i < n_rows; i++)
+               col_j[i] -= dot * col_k[i];
+            }
+         }
+      }
+}
+
+/* Returns a copy of R (and Q^T b,  as the last column) with the pending
+rows and Levenberg-Marquardt damping included.  */
+
+static double *qr_final_r( const LSQUARE *lsq)
 {
-   LSQUARE *lsq = (LSQUARE *)lsquare;
-   int i, j;
    const int n_params = lsq->n_params;
+   const size_t r_size = n_params * (n_params + 1);
+   double *rval = (double *)malloc( (r_size + LSQ_BLOCK * (n_params + 1)
+               + n_params * (n_params + 1)) * sizeof( double));
+   double *rows, *lm_rows;
+   int i, j;
+
+   if( !rval)
+      return( NULL);
+   rows = rval + r_size;
+   lm_rows = rows + LSQ_BLOCK * (n_params + 1);
+   memcpy( rval, lsq->r, r_size * sizeof( double));
+   memcpy( rows, lsq->pending, LSQ_BLOCK * (n_params + 1) * sizeof( double));
+   qr_absorb_rows( rval, rows, lsq->n_pending, LSQ_BLOCK, n_params);
+   for( i = 0; i < n_params; i++)
+      for( j = 0; j <= n_params; j++)
+         lm_rows[i + j * n_params] = (i == j ? sqrt( lsq->lm_diag[i]) : 0.);
+   qr_absorb_rows( rval, lm_rows, n_params, n_params, n_params);
+   return( rval);
+}
+
+/* Sets the determinant (of the inverse of W^T W,  as calc_inverse( )
+does),  and returns true if R is singular.  */
+
+static bool qr_is_singular( const double *r, const int n_params)
+{
+   int i;
+
+   lsquare_determinant = 1.;
+   for( i = 0; i < n_params; i++)
+      {
+      const double diag = r[i * (n_params + 1) + i];
+
+      if( !diag)
+         return( true);
+      lsquare_determinant /= (ldouble)( diag * diag);
+      }
+   return( false);
+}
 
+/* R^-1,  upper triangular,  by back-substitution;  the covariance matrix
+(W^T W)^-1 = (R^T R)^-1 = R^-1 (R^-1)^T.  */
+
+static double *qr_covariance( const double *r, const int n_params)
+{
+   double *rinv = (double *)calloc( n_params * n_params, sizeof( double));
+   double *rval = (double *)calloc( n_params * n_params, sizeof( double));
+   int i, j, k;
+
+   if( !rinv || !rval)
+      {
+      free( rinv);
+      free( rval);
+      return( NULL);
+      }
+   for( j = 0; j < n_params; j++)
+      for( i = j; i >= 0; i--)
+         {
+         double sum = (i == j ? 1. : 0.);
+
+         for( k = i + 1; k <= j; k++)
+            sum -= r[i * (n_params + 1) + k] * rinv[k * n_params + j];
+         rinv[i * n_params + j] = sum / r[i * (n_params + 1) + i];
+         }
    for( i = 0; i < n_params; i++)
+      for( j = i; j < n_params; j++)
+         {
+         double sum = 0.;
+
+         for( k = j; k < n_params; k++)
+            sum += rinv[i * n_params + k] * rinv[j * n_params + k];
+         rval[i * n_params + j] = rval[j * n_params + i] = sum;
+         }
+   free( rinv);
+   return( rval);
+}
+
+/* For the normal equations,  adding a row means adding w^2 a_i a_j to
+each element of W^T W (and w^2 a_i u to W^T u).  Done in __float128,  that's
+slow;  those are emulated in software.  But the products of two doubles can
+be found exactly as the sum of two doubles with Dekker's method,  and sums
+of them kept to about 106 bits as 'double-doubles',  using Knuth's TwoSum.
+That's close to __float128 precision,  and it's all ordinary double
+arithmetic,  with the loop over j independent for each j and therefore
+vectorizable.  So a block of up to LSQ_BLOCK rows is accumulated that way
+(only the upper triangle,  since W^T W is symmetric,  and with W^T u as an
+extra column),  then added to the __float128 sums.  It's the same idea as
+the BLAS routine SYRK,  a rank-k update of a symmetric matrix.  (This
+relies on the compiler not re-arranging floating-point expressions,  so
+don't compile it with -ffast-math.)
+
+   'sums' holds the high parts of the double-doubles for row i of the
+augmented upper triangle,  column j,  at sums[i * (n_params + 1) + j];
+the low parts follow,  then room for the current row and its split.  */
+
+#define SPLITTER  134217729.       /* 2^27 + 1 */
+
+static inline void split_double( const double x, double *x_hi, double *x_lo)
+{
+   const double t = SPLITTER * x;
+
+   *x_hi = t - (t - x);
+   *x_lo = x - *x_hi;
+}
+
+/* Adds the exact product a * b to the double-double (*hi, *lo).  */
+
+static inline void add_product( double *hi, double *lo, const double a,
+            const double a_hi, const double a_lo, const double b,
+            const double b_hi, const double b_lo)
+{
+   const double prod = a * b;
+   const double err = ((a_hi * b_hi - prod) + a_hi * b_lo + a_lo * b_hi)
+                                            + a_lo * b_lo;
+   const double sum = *hi + prod, bv = sum - *hi;
+
+   *lo += (*hi - (sum - bv)) + (prod - bv) + err;
+   *hi = sum;
+}
+
+static void add_block_to_normal_eqns( LSQUARE *lsq, const int n_rows,
+               const double *residuals, const double *weights,
+               const double *slopes)
+{
+   const int n_params = lsq->n_params, n1 = n_params + 1;
+   double *hi = lsq->sums, *lo = hi + n_params * n1;
+   double *aug = lo + n_params * n1, *aug_hi = aug + n1, *aug_lo = aug_hi + n1;
+   int i, j, row;
+
+   for( row = 0; row < n_rows; row++)
       {
-      const ldouble w2_obs_i = (ldouble)( weight * weight * obs[i]);
+      const double weight = (weights ? weights[row] : 1.);
+      const double w2 = weight * weight;
 
-      lsq->uw[i] += (ldouble)residual * w2_obs_i;
       for( j = 0; j < n_params; j++)
-         lsq->wtw[i + j * n_params] += w2_obs_i * (ldouble)obs[j];
-      lsq->wtw[i + i * n_params] +=
-                  w2_obs_i * (ldouble)( obs[i] * levenberg_marquardt_lambda);
+         aug[j] = slopes[row * n_params + j];
+      aug[n_params] = residuals[row];
+      for( j = 0; j <= n_params; j++)
+         split_double( aug[j], aug_hi + j, aug_lo + j);
+      for( i = 0; i < n_params; i++)
+         {
+         const double wa = w2 * aug[i];
+         double wa_hi, wa_lo;
+         double *hi_i = hi + i * n1, *lo_i = lo + i * n1;
+
+         split_double( wa, &wa_hi, &wa_lo);
+         for( j = i; j <= n_params; j++)
+            add_product( hi_i + j, lo_i + j, wa, wa_hi, wa_lo,
+                                    aug[j], aug_hi[j], aug_lo[j]);
+         if( levenberg_marquardt_lambda)
+            {
+            const double damp = aug[i] * levenberg_marquardt_lambda;
+            double damp_hi, damp_lo;
+
+            split_double( damp, &damp_hi, &damp_lo);
+            add_product( hi_i + i, lo_i + i, wa, wa_hi, wa_lo,
+                                    damp, damp_hi, damp_lo);
+            }
+         }
+      }
+   for( i = 0; i < n_params; i++)
+      {
+      for( j = i; j < n_params; j++)
+         lsq->wtw[i * n_params + j] += (ldouble)hi[i * n1 + j]
+                                     + (ldouble)lo[i * n1 + j];
+      lsq->uw[i] += (ldouble)hi[i * n1 + n_params]
+                  + (ldouble)lo[i * n1 + n_params];
       }
-   lsq->n_obs++;
+   memset( lsq->sums, 0, 2 * n_params * n1 * sizeof( double));
+}
+
+/* lsquare_add_observations( ) adds 'n_rows' rows at once.  'slopes' holds
+them one after another (i.e.,  it's an n_rows x n_params matrix in row-major
+order,  as one gets by stacking the 'obs' arrays that would be passed to
+lsquare_add_observation( )).  'weights' can be NULL,  meaning all weights
+are one.  Adding rows one at a time works,  but this is faster:  for the
+QR method,  it saves call overhead;  for the normal equations,  rows are
+added LSQ_BLOCK at a time,  as described above.  */
+
+int lsquare_add_observations( void *lsquare, const int n_rows,
+               const double *residuals, const double *weights,
+               const double *slopes)
+{
+   LSQUARE *lsq = (LSQUARE *)lsquare;
+   int i, j, row;
+   const int n_params = lsq->n_params;
+
+   if( lsq->r)
+      {
+      for( row = 0; row < n_rows; row++)
+         {
+         const double weight = (weights ? weights[row] : 1.);
+         const double *obs = slopes + row * n_params;
+         double *prow = lsq->pending + lsq->n_pending;
+
+         for( i = 0; i < n_params; i++, prow += LSQ_BLOCK)
+            {
+            *prow = weight * obs[i];
+            lsq->lm_diag[i] += *prow * *prow * levenberg_marquardt_lambda;
+            }
+         *prow = weight * residuals[row];
+         if( ++lsq->n_pending == LSQ_BLOCK)
+            {
+            qr_absorb_rows( lsq->r, lsq->pending, LSQ_BLOCK, LSQ_BLOCK,
+                                             n_params);
+            lsq->n_pending = 0;
+            }
+         }
+      lsq->n_obs += n_rows;
+      return( lsq->n_obs);
+      }
+   for( row = 0; row < n_rows; row += LSQ_BLOCK)
+      add_block_to_normal_eqns( lsq,
+               (n_rows - row < LSQ_BLOCK ? n_rows - row : LSQ_BLOCK),
+               residuals + row, (weights ? weights + row : NULL),
+               slopes + row * n_params);
+   for( i = 1; i < n_params; i++)      /* copy upper triangle to lower */
+      for( j = 0; j < i; j++)
+         lsq->wtw[i * n_params + j] = lsq->wtw[j * n_params + i];
+   lsq->n_obs += n_rows;
    return( lsq->n_obs);
 }
 
-ldouble lsquare_determinant;
+int lsquare_add_observation( void *lsquare, const double residual,
+                                  const double weight, const double *obs)
+{
+   return( lsquare_add_observations( lsquare, 1, &residual, &weight, obs));
+}
+
 
    /* A simple Gauss-Jordan matrix inverter,  with partial pivoting.  It
       first extends the size x size square matrix into a size-high by
@@ -430,6 +767,26 @@ int lsquare_solve( const void *lsquare, double *result)
    if( n_params > lsq->n_obs)       /* not enough observations yet */
       return( -1);
 
+   if( lsq->r)
+      {
+      double *r = qr_final_r( lsq);
+
+      if( !r || qr_is_singular( r, n_params))
+         {
+         free( r);
+         return( -2);         /* couldn't invert matrix */
+         }
+      for( i = n_params - 1; i >= 0; i--)
+         {
+         double sum = r[i * (n_params + 1) + n_params];
+
+         for( j = i + 1; j < n_params; j++)
+            sum -= r[i * (n_params + 1) + j] * result[j];
+         result[i] = sum / r[i * (n_params + 1) + i];
+         }
+      free( r);
+      return( 0);
+      }
 // inverse = invert_symmetric_positive_definite_matrix( lsq->wtw, n_params);
    inverse = calc_inverse_improved( lsq->wtw, n_params);
    if( !inverse)
@@ -448,6 +805,242 @@ int lsquare_solve( const void *lsquare, double *result)
    return( 0);
 }
 
+/* lsquare_block_solve( ) solves several least-squares problems at once,
+which share some 'global' parameters but are otherwise independent.  (For
+example,  the orbits of several objects,  all perturbed by an asteroid whose
+mass we're trying to find.)  Each object gets its own lsquare,  with its
+local parameters first and the n_global shared ones last.  'results' gets
+the local parameters for each object in turn,  then the global ones;
+'global_covar',  if non-NULL,  gets the n_global x n_global covariance
+matrix for the global parameters.
+
+   Put all together,  the normal equations have a 'block-arrow' form:
+
+| A1  0   0  ... B1 | | x1 |   | b1 |
+| 0   A2  0  ... B2 | | x2 |   | b2 |
+| ...               | | .. | = | .. |
+| B1' B2' B3'... C  | | g  |   | c  |
+
+   where C is the sum of the global-global parts of all the objects'
+normal equations (and c the sum of their global parts of W^T u).  One
+could solve that as one big system,  but the cost would go up as the
+cube of the number of objects.  Instead,  each object's local block is
+eliminated,  leaving the Schur complement
+
+S = C - sum( Bk' Ak^-1 Bk),   r = c - sum( Bk' Ak^-1 bk)
+
+   for the globals,  g = S^-1 r;  then xk = Ak^-1 (bk - Bk g) for each
+object.  S^-1 is the covariance matrix for the globals.  The cost is
+linear in the number of objects.
+
+   With the QR method,  the same thing happens without forming normal
+equations.  Each object's R is [R11 R12;  0 R22],  and for any given g,
+the best local parameters leave a residual of |R22 g - q2|,  where q2 is
+the corresponding part of Q^T b.  So all the objects' R22 and q2 rows are
+stacked and reduced to one small R for the globals (with qr_absorb_rows( ),
+a block at a time),  and each object's local parameters are found by
+back-substitution in R11 x = q1 - R12 g.   */
+
+static int qr_block_solve( const LSQUARE **lsqs, const int n_objects,
+               const int n_global, double *results, double *global_covar)
+{
+   const int n1 = n_global + 1;
+   double *rg = (double *)calloc( n_global * n1 + n_global * n1,
+                                             sizeof( double));
+   double *rows = rg + n_global * n1, *globals = results;
+   double **rs = (double **)calloc( n_objects, sizeof( double *));
+   int i, j, k, rval = 0;
+
+   assert( rg && rs);
+   for( k = 0; k < n_objects; k++)
+      globals += lsqs[k]->n_params - n_global;
+   for( k = 0; !rval && k < n_objects; k++)
+      {
+      const int n = lsqs[k]->n_params, n_local = n - n_global;
+
+      rs[k] = qr_final_r( lsqs[k]);
+      if( !rs[k])
+         rval = -2;
+      for( i = 0; !rval && i < n_global; i++)
+         for( j = 0; j <= n_global; j++)
+            rows[i + j * n_global] = rs[k][(n_local + i) * (n + 1)
+                                                + n_local + j];
+      if( !rval)
+         qr_absorb_rows( rg, rows, n_global, n_global, n_global);
+      }
+   if( !rval && qr_is_singular( rg, n_global))
+      rval = -2;
+   for( i = n_global - 1; !rval && i >= 0; i--)
+      {
+      double sum = rg[i * n1 + n_global];
+
+      for( j = i + 1; j < n_global; j++)
+         sum -= rg[i * n1 + j] * globals[j];
+      globals[i] = sum / rg[i * n1 + i];
+      }
+   if( !rval && global_covar)
+      {
+      double *covar = qr_covariance( rg, n_global);
+
+      if( covar)
+         {
+         memcpy( global_covar, covar, n_global * n_global * sizeof( double));
+         free( covar);
+         }
+      }
+   for( k = 0; !rval && k < n_objects; k++)
+      {
+      const int n = lsqs[k]->n_params, n_local = n - n_global;
+      const double *r = rs[k];
+
+      for( i = n_local - 1; !rval && i >= 0; i--)
+         {
+         double sum = r[i * (n + 1) + n];
+
+         for( j = i + 1; j < n_local; j++)
+            sum -= r[i * (n + 1) + j] * results[j];
+         for( j = 0; j < n_global; j++)
+            sum -= r[i * (n + 1) + n_local + j] * globals[j];
+         if( !r[i * (n + 1) + i])
+            rval = -2;
+         else
+            results[i] = sum / r[i * (n + 1) + i];
+         }
+      results += n_local;
+      }
+   for( k = 0; k < n_objects; k++)
+      free( rs[k]);
+   free( rs);
+   free( rg);
+   return( rval);
+}
+
+int lsquare_block_solve( void **lsquares, const int n_objects,
+               const int n_global, double *results, double *global_covar)
+{
+   const LSQUARE **lsqs = (const LSQUARE **)lsquares;
+   const int n_g2 = n_global * n_global;
+   ldouble *s = (ldouble *)calloc( n_g2 + 2 * n_global, sizeof( ldouble));
+   ldouble *r = s + n_g2, *lglobals = r + n_global, *s_inverse = NULL;
+   ldouble **ys = (ldouble **)calloc( n_objects, sizeof( ldouble *));
+   double *globals = results;
+   int i, j, k, g, rval = 0;
+
+   assert( s && ys);
+   for( k = 0; k < n_objects; k++)
+      {
+      const int n_local = lsqs[k]->n_params - n_global;
+
+      if( n_local < 1 || lsqs[k]->n_obs < n_local)
+         rval = -1;        /* not enough observations yet */
+      globals += n_local;
+      }
+   if( rval || lsqs[0]->r)
+      {
+      free( s);
+      free( ys);
+      return( rval ? rval : qr_block_solve( lsqs, n_objects, n_global,
+                                          results, global_covar));
+      }
+   for( g = 0; g < n_global; g++)
+      {
+      ldouble *s_row = s + g * n_global;
+
+      for( k = 0; k < n_objects; k++)
+         {
+         const int n = lsqs[k]->n_params, n_local = n - n_global;
+         const ldouble *wtw = lsqs[k]->wtw + (n_local + g) * n + n_local;
+
+         for( j = 0; j < n_global; j++)
+            s_row[j] += wtw[j];
+         r[g] += lsqs[k]->uw[n_local + g];
+         }
+      }
+   for( k = 0; !rval && k < n_objects; k++)
+      {        /* y = A^-1 [B | b],  stored n_local x (n_global + 1) */
+      const int n = lsqs[k]->n_params, n_local = n - n_global;
+      const ldouble *wtw = lsqs[k]->wtw, *uw = lsqs[k]->uw;
+      ldouble *a = (ldouble *)malloc( n_local * n_local * sizeof( ldouble));
+      ldouble *a_inverse, *y;
+
+      assert( a);
+      for( i = 0; i < n_local; i++)
+         for( j = 0; j < n_local; j++)
+            a[i * n_local + j] = wtw[i * n + j];
+      a_inverse = calc_inverse_improved( a, n_local);
+      free( a);
+      if( !a_inverse)
+         rval = -2;
+      else
+         {
+         y = ys[k] = (ldouble *)calloc( n_local * (n_global + 1),
+                                                sizeof( ldouble));
+         assert( y);
+         for( i = 0; i < n_local; i++)
+            for( j = 0; j < n_local; j++)
+               {
+               const ldouble a_ij = a_inverse[i * n_local + j];
+
+               for( g = 0; g < n_global; g++)
+                  y[i * (n_global + 1) + g] += a_ij * wtw[j * n + n_local + g];
+               y[i * (n_global + 1) + n_global] += a_ij * uw[j];
+               }
+         free( a_inverse);
+         for( g = 0; g < n_global; g++)   /* S -= B' A^-1 B,  r -= B' A^-1 b */
+            for( i = 0; i < n_local; i++)
+               {
+               const ldouble b_ig = wtw[i * n + n_local + g];
+
+               for( j = 0; j < n_global; j++)
+                  s[g * n_global + j] -= b_ig * y[i * (n_global + 1) + j];
+               r[g] -= b_ig * y[i * (n_global + 1) + n_global];
+               }
+         }
+      }
+   if( !rval)
+      {
+      s_inverse = calc_inverse_improved( s, n_global);
+      if( !s_inverse)
+         rval = -2;
+      }
+   if( !rval)
+      {
+      for( g = 0; g < n_global; g++)
+         {
+         ldouble sum = 0.;
+
+         for( j = 0; j < n_global; j++)
+            sum += s_inverse[g * n_global + j] * r[j];
+         lglobals[g] = sum;
+         globals[g] = (double)sum;
+         }
+      if( global_covar)
+         for( i = 0; i < n_g2; i++)
+            global_covar[i] = (double)s_inverse[i];
+      for( k = 0; k < n_objects; k++)
+         {
+         const int n_local = lsqs[k]->n_params - n_global;
+         const ldouble *y = ys[k];
+
+         for( i = 0; i < n_local; i++)
+            {
+            ldouble sum = y[i * (n_global + 1) + n_global];
+
+            for( g = 0; g < n_global; g++)
+               sum -= y[i * (n_global + 1) + g] * lglobals[g];
+            results[i] = (double)sum;
+            }
+         results += n_local;
+         }
+      }
+   for( k = 0; k < n_objects; k++)
+      free( ys[k]);
+   free( ys);
+   free( s_inverse);
+   free( s);
+   return( rval);
+}
+
 static double *convert_ldouble_matrix_to_double( const ldouble *matrix,
                               const int size)
 {
@@ -464,6 +1057,18 @@ double *lsquare_covariance_matrix( const void *lsquare)
    const LSQUARE *lsq = (const LSQUARE *)lsquare;
    ldouble *lrval = NULL;
 
+   if( lsq->r)
+      {
+      double *r, *rval = NULL;
+
+      if( lsq->n_params <= lsq->n_obs && (r = qr_final_r( lsq)) != NULL)
+         {
+         if( !qr_is_singular( r, lsq->n_params))
+            rval = qr_covariance( r, lsq->n_params);
+         free( r);
+         }
+      return( rval);
+      }
    if( lsq->n_params <= lsq->n_obs)       /* got enough observations */
       lrval = calc_inverse_improved( lsq->wtw, lsq->n_params);
 //    lrval = invert_symmetric_positive_definite_matrix( lsq->wtw, lsq->n_params);
@@ -482,14 +1087,29 @@ double *lsquare_wtw_matrix( const void *lsquare)
 {
    const LSQUARE *lsq = (const LSQUARE *)lsquare;
 
+   if( lsq->r)          /* W^T W = R^T R */
+      {
+      const int n_params = lsq->n_params;
+      double *r = qr_final_r( lsq), *rval;
+      int i, j, k;
+
+      if( !r)
+         return( NULL);
+      rval = (double *)calloc( n_params * n_params, sizeof( double));
+      for( i = 0; rval && i < n_params; i++)
+         for( j = 0; j < n_params; j++)
+            for( k = 0; k <= i && k <= j; k++)
+               rval[i * n_params + j] += r[k * (n_params + 1) + i]
+                                       * r[k * (n_params + 1) + j];
+      free( r);
+      return( rval);
+      }
    return( convert_ldouble_matrix_to_double( lsq->wtw, lsq->n_params));
 }
 
 void lsquare_free( void *lsquare)
 {
-   const LSQUARE *lsq = (const LSQUARE *)lsquare;
-
-   free( lsq->uw);
+   free_lsquare_arrays( (LSQUARE *)lsquare);
    free( lsquare);
 }
 
@@ -1,7 +1,13 @@
 void *lsquare_init( const int n_params);
+int lsquare_set_method( void *lsquare, const int use_qr);
 int lsquare_add_observation( void *lsquare, const double residual,
                                     const double weight, const double *obs);
+int lsquare_add_observations( void *lsquare, const int n_rows,
+               const double *residuals, const double *weights,
+               const double *slopes);
 int lsquare_solve( const void *lsquare, double *result);
+int lsquare_block_solve( void **lsquares, const int n_objects,
+               const int n_global, double *results, double *global_covar);
 void lsquare_free( void *lsquare);
 double *lsquare_covariance_matrix( const void *lsquare);
 double *lsquare_wtw_matrix( const void *lsquare);
@@ -48,6 +48,8 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
 #include "mpc_obs.h"
 #include "sigma.h"
 #include "date.h"
+#include "environ.h"
+#include "threads.h"
 
 #define PI 3.1415926535897932384626433832795028841971693993751058209749445923
 #define EARTH_MAJOR_AXIS 6378140.
@@ -97,10 +99,18 @@ int snprintf_append( char *string, const size_t max_len,      /* ephem0.cpp */
                                    const char *format, ...);
 char *mpc_station_name( char *station_data);       /* mpc_obs.cpp */
 
+/* debug_printf( ) can be called from the threads computing partials (see
+'orb_func.cpp'),  so the file is opened,  written,  and closed under a
+mutex;  otherwise,  lines from different threads could be interleaved. */
+
+FIND_ORB_MUTEX( debug_printf_mutex);
+
 int debug_printf( const char *format, ...)
 {
-   FILE *ofile = fopen_ext( "debug.txt", "ca");
+   FILE *ofile;
 
+   LOCK_MUTEX( debug_printf_mutex);
+   ofile = fopen_ext( "debug.txt", "ca");
    if( ofile)
       {
       va_list argptr;
@@ -113,6 +123,7 @@ int debug_printf( const char *format, ...)
       va_end( argptr);
       fclose( ofile);
       }
+   UNLOCK_MUTEX( debug_printf_mutex);
    return( 0);
 }
 
@@ -174,6 +185,25 @@ int64_t nanoseconds_since_1970( void)
 #endif
 #endif
 
+/* For timeouts,  we want elapsed wall-clock time that doesn't jump when
+the system clock is reset.  clock( ) won't do:  it's CPU time for the
+whole process,  which runs N times too fast with N threads busy.  Where
+we have POSIX clocks,  we use CLOCK_MONOTONIC;  elsewhere,  we fall back
+to nanoseconds_since_1970( ).  Only differences between the values
+returned are meaningful.   */
+
+int64_t monotonic_nanoseconds( void)
+{
+#if defined( __linux) || defined( __unix__) || defined( __APPLE__)
+   struct timespec t;
+
+   clock_gettime( CLOCK_MONOTONIC, &t);
+   return( (int64_t)t.tv_sec * (int64_t)1000000000 + (int64_t)t.tv_nsec);
+#else
+   return( nanoseconds_since_1970( ));
+#endif
+}
+
 /* At one time,  I was using the following in Linux.  It gives a
 "real" precision of nanoseconds,  instead of getting microseconds
 and multiplying by 1000 (or decimicroseconds and multiplying by 100).
@@ -4151,7 +4181,14 @@ void put_observer_data_in_text( const char FAR *mpc_code, char *buff)
 
 static const char *environ_dot_dat = "environ.dat";
 
-const char *get_environment_ptr( const char *env_ptr)
+static const FIND_ORB_SETTINGS *curr_settings = NULL;
+static bool settings_parsed = false;
+FIND_ORB_MUTEX( settings_mutex);
+
+/* get_environment_ptr( ),  below,  without the locking.  The loading,
+sorting,  and freeing of 'edata' are all done under 'settings_mutex'. */
+
+static const char *find_environment_ptr( const char *env_ptr)
 {
    static char **edata;
    static size_t n_lines;
@@ -4166,6 +4203,7 @@ const char *get_environment_ptr( const char *env_ptr)
       if( edata)
          free( edata);
       edata = NULL;
+      ATOMIC_STORE( &settings_parsed, false);
       return( rval);
       }
 
@@ -4202,6 +4240,94 @@ const char *get_environment_ptr( const char *env_ptr)
    return( rval);
 }
 
+const char *get_environment_ptr( const char *env_ptr)
+{
+   const char *rval;
+
+   LOCK_MUTEX( settings_mutex);
+   rval = find_environment_ptr( env_ptr);
+   UNLOCK_MUTEX( settings_mutex);
+   return( rval);
+}
+
+/* See 'environ.h'.  Settings may be read by the partials threads and the
+force model while the main thread re-parses them.  So a re-parse fills in
+a new structure,  under 'settings_mutex',  and only then publishes it by
+swapping the 'curr_settings' pointer.  A reader sees the old settings or
+the new ones,  never a mix or a half-filled structure.  Old structures
+may still be in use by someone,  so they're never freed;  that costs a
+few hundred bytes each time a setting is changed.  */
+
+static void parse_settings( FIND_ORB_SETTINGS *s)
+{
+   s->asteroid_thresh = atof( find_environment_ptr( "ASTEROID_THRESH"));
+   if( !s->asteroid_thresh)
+      s->asteroid_thresh = 10.;
+   s->bc405_asteroids = atoi( find_environment_ptr( "BC405_ASTEROIDS"));
+   s->bc405_chebyshev = atoi( find_environment_ptr( "BC405_CHEBYSHEV"));
+   s->geo_terms = atoi( find_environment_ptr( "GEO_TERMS"));
+   if( !s->geo_terms)
+      s->geo_terms = 3;
+   s->drag_shutoff = (*find_environment_ptr( "DRAG_SHUTOFF") != '\0');
+   sscanf( find_environment_ptr( "GEO_GRID"), "%lf %lf %lf %lf",
+            &s->geo_grid_min, &s->geo_grid_max, &s->geo_grid_spacing,
+            &s->geo_grid_max_err);
+   if( s->geo_grid_spacing <= 0.)
+      s->geo_grid_spacing = 100.;
+   if( s->geo_grid_max_err <= 0.)
+      s->geo_grid_max_err = 1e-6;
+   s->encke = atoi( find_environment_ptr( "ENCKE"));
+   s->double_double = atoi( find_environment_ptr( "DOUBLE_DOUBLE"));
+   s->dense_output = atoi( find_environment_ptr( "DENSE_OUTPUT"));
+   s->prune_perturbers = atof( find_environment_ptr( "PRUNE_PERTURBERS"));
+   s->fixed_stepsize = atof( find_environment_ptr( "FIXED_STEPSIZE"));
+   s->min_stepsize = atof( find_environment_ptr( "MIN_STEPSIZE"))
+                                          / seconds_per_day;
+   if( !s->min_stepsize)
+      s->min_stepsize = 1e-5;   /* 1e-5 day = 0.864 seconds */
+   s->trajectory_cache = atoi( find_environment_ptr( "TRAJECTORY_CACHE"));
+   s->stm_partials = atoi( find_environment_ptr( "STM_PARTIALS"));
+   s->partials_threads = 1;
+   sscanf( find_environment_ptr( "PARTIALS_THREADS"), "%d", &s->partials_threads);
+   s->lsquare_qr = atoi( find_environment_ptr( "LSQUARE_QR"));
+   s->debug_deltas = atoi( find_environment_ptr( "DEBUG_DELTAS"));
+   s->half_steps = (*find_environment_ptr( "HALF_STEPS") != '\0');
+   s->abs_mag = atof( find_environment_ptr( "ABS_MAG"));
+   s->ra_offset = atof( find_environment_ptr( "RA_OFFSET"));
+   s->dec_offset = atof( find_environment_ptr( "DEC_OFFSET"));
+   s->geometric_ground_track =
+            (*find_environment_ptr( "GEOMETRIC_GROUND_TRACK") == '1');
+}
+
+const FIND_ORB_SETTINGS *get_settings( void)
+{
+   const FIND_ORB_SETTINGS *rval = ATOMIC_LOAD( &curr_settings);
+
+   if( !rval || !ATOMIC_LOAD( &settings_parsed))
+      {
+      LOCK_MUTEX( settings_mutex);
+      if( !curr_settings || !settings_parsed)
+         {
+         FIND_ORB_SETTINGS *s = (FIND_ORB_SETTINGS *)calloc( 1,
+                                          sizeof( FIND_ORB_SETTINGS));
+
+         assert( s);
+         parse_settings( s);
+         s->generation = (curr_settings ? curr_settings->generation + 1 : 1);
+         ATOMIC_STORE( &settings_parsed, true);
+         ATOMIC_STORE( &curr_settings, (const FIND_ORB_SETTINGS *)s);
+         }
+      rval = curr_settings;
+      UNLOCK_MUTEX( settings_mutex);
+      }
+   return( rval);
+}
+
+void reload_settings( void)
+{
+   get_environment_ptr( NULL);
+}
+
 void set_environment_ptr( const char *env_ptr, const char *new_value)
 {
    size_t i;
@@ -146,6 +146,10 @@ void improve_parabolic( OBSERVE FAR *obs, int n_obs, double *orbit, double epoch
 int full_improvement( OBSERVE FAR *obs, int n_obs, double *orbit,
                  const double epoch, const char *limited_orbit,
                  const int sigmas_requested, const double epoch2);
+int full_improvement_multi( const int n_objects, OBSERVE FAR **obs,
+                 const int *n_obs, double **orbits, const double *epochs,
+                 const int *excluded_asteroids, const char *limited_orbit,
+                 double *mass_sigma);
 int set_locs( const double *orbit, const double t0, OBSERVE FAR *obs,
                                    const int n_obs);
 void make_date_range_text( char *obuff, const double jd1, const double jd2);
@@ -174,6 +178,8 @@ int ephemeris_in_a_file_from_mpc_code( const char *filename,
 int find_best_fit_planet( const double jd, const double *ivect,
                      double *rel_vect);     /* runge.cpp */
 int integrate_orbit( double *orbit, const double t0, const double t1);
+int integrate_orbits( double *orbits, const int n_orbits,
+                     const double t0, const double t1, int *rvals);
 int generate_obs_text( const OBSERVE FAR *obs, const int n_obs, char *buff);
 double convenient_gauss( const OBSERVE FAR *obs, int n_obs, double *orbit,
                   const double mu, const int desired_soln); /* gauss.cpp */
@@ -31,6 +31,12 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
 #include "date.h"
 #include "afuncs.h"
 #include "monte0.h"
+#include "runge.h"
+#include "threads.h"
+#include "environ.h"
+#ifdef FIND_ORB_THREADS
+   #include <unistd.h>
+#endif
 
 #ifndef _MSC_VER
          /* All non-Microsoft builds are for the console */
@@ -51,7 +57,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
 #endif
 
 unsigned perturbers = 0;
-int integration_method = 0;
+int integration_method = 0;   /* 0=RKF,  1=symplectic,  2=PD89,  3=multistep */
 extern int debug_level;
 
 int generic_message_box( const char *message, const char *box_type);
@@ -121,6 +127,7 @@ int set_locs( const double *orbit, double t0, OBSERVE FAR *obs, int n_obs);
 int find_best_fit_planet( const double jd, const double *ivect,
                                  double *rel_vect);         /* runge.cpp */
 const char *get_environment_ptr( const char *env_ptr);     /* mpc_obs.cpp */
+int64_t monotonic_nanoseconds( void);                       /* mpc_obs.cpp */
 static int evaluate_limited_orbit( const double *orbit,
                     const int planet_orbiting, const double epoch,
                     const char *limited_orbit, double *constraints);
@@ -137,6 +144,7 @@ void set_distance( OBSERVE FAR *obs, double r);             /* orb_func.c */
 double find_r_given_solar_r( const OBSERVE FAR *obs, const double solar_r);
 static void attempt_extensions( OBSERVE *obs, const int n_obs, double *orbit);
 double *get_asteroid_mass( const int astnum);   /* bc405.cpp */
+const double *get_asteroid_masses( int *n_masses);    /* bc405.cpp */
 char *get_file_name( char *filename, const char *template_file_name);
 int compute_observer_loc( const double jde, const int planet_no,
              const double rho_cos_phi,           /* mpc_obs.cpp */
@@ -303,16 +311,6 @@ int find_parabolic_orbit( OBSERVE FAR *obs, const int n_obs,
    return( rval);
 }
 
-int calc_derivatives( const double jd, const double *ival, double *oval,
-                           const int reference_planet);
-double take_rk_step( const double jd, ELEMENTS *ref_orbit,
-                 const double *ival, double *ovals,
-                 const int n_vals, const double step);      /* runge.cpp */
-double take_pd89_step( const double jd, ELEMENTS *ref_orbit,
-                 const double *ival, double *ovals,
-                 const int n_vals, const double step);      /* runge.cpp */
-int symplectic_6( double jd, ELEMENTS *ref_orbit, double *vect,
-                                          const double dt);
 static int is_unreasonable_orbit( const double *orbit);     /* orb_func.cpp */
 
 double integration_tolerance = 1.e-12;
@@ -325,7 +323,8 @@ int show_runtime_messages = 1;
 // static int reference_planet = 0;
 static unsigned perturbers_automatically_found;
 
-static int reset_auto_perturbers( const double jd, const double *orbit)
+static int reset_auto_perturbers( INTEGRATION_CONTEXT *context,
+                        const double jd, const double *orbit)
 {
    extern int forced_central_body;     /* and include asteroid perts   */
    unsigned mask;
@@ -340,45 +339,207 @@ static int reset_auto_perturbers( const double jd, const double *orbit)
    if( forced_central_body == 100)
       mask |= (1 << 20);
    if( perturbing_planet)
-      perturbers_automatically_found |= mask;
+      context->perturbers_found |= mask;
    if( forced_central_body == 100)
-      perturbers_automatically_found |= (1 << 20);
-   if( perturbers & AUTOMATIC_PERTURBERS)
-      perturbers = mask | AUTOMATIC_PERTURBERS;
+      context->perturbers_found |= (1 << 20);
+   if( context->perturbers & AUTOMATIC_PERTURBERS)
+      context->perturbers = mask | AUTOMATIC_PERTURBERS;
    return( perturbing_planet);
 }
 
-clock_t integration_timeout = (clock_t)0;
+/* A fresh context gets the current user settings for perturbers and
+non-gravitational parameters,  and 'not yet set' step size values. */
+
+void init_integration_context( INTEGRATION_CONTEXT *context)
+{
+   memset( context, 0, sizeof( INTEGRATION_CONTEXT));
+   context->perturbers = perturbers;
+   context->n_extra_params = n_extra_params;
+   memcpy( context->solar_pressure, solar_pressure,
+                        MAX_N_NONGRAV_PARAMS * sizeof( double));
+   context->stepsize = 2.;
+   context->fixed_stepsize = -1.;
+   context->use_encke = -1;
+   context->pruning = -1.;
+   context->double_double = -1;
+   context->best_fit_planet = 0;
+   context->planet_hit = -1;
+   context->show_messages = show_runtime_messages;
+}
+
+/* If non-zero,  integrations give up (returning INTEGRATION_TIMED_OUT)
+once monotonic_nanoseconds( ) passes this. */
+
+int64_t integration_timeout = 0;
 
 #define STEP_INCREMENT 2
+
+/* With PRUNE_PERTURBERS set,  every PRUNING_INTERVAL accepted steps (or
+sooner,  if the step size has more than doubled since),  we check which of
+the planets in use would have a negligible effect if left out for the
+rest of the integration,  and drop them until the next check;  see
+find_negligible_perturbers( ) in 'runge.cpp'.  This isn't done with automatic perturbers,  which are
+already limited to whatever planet we're close to.
+
+   Checks are only made after an accepted step;  retrying a rejected step
+with a smaller one doesn't change what's ahead of us.  And there's some
+hysteresis:  a planet in use is only dropped if its effect is below
+PRUNING_HYSTERESIS times the tolerance,  while a dropped one is restored
+once its effect is above the tolerance.  Otherwise,  a planet near the
+threshold would flip in and out at every check,  and each change in the
+set of perturbers forces the multistep integrator to restart.  */
+
+#define PRUNING_INTERVAL 20
+#define PRUNING_HYSTERESIS .25
 #define INTEGRATION_TIMED_OUT       -3
 #define HIT_A_PLANET                -4
 
-int integrate_orbit( double *orbit, const double t0, const double t1)
+/* When dense output is requested,  we take the integrator's natural steps
+and,  after each step,  set the states for any of the 'dense_times' that
+fell within it.  If only one did,  we just take a step of the right size
+from the start of the step.  If there were several (the usual case for
+observations,  which tend to come in clusters),  we do that for the one
+nearest the middle of the step,  where the interpolation error is worst,
+and compare it to the interpolated state (see dense_interpolate( ) in
+'runge.cpp').  If they agree to within the integration tolerance (relative
+to the distance from the sun,  as for the step error),  the rest are
+interpolated;  otherwise,  each gets a step of its own.  Either way,  the
+natural steps aren't truncated at each time.
+
+   Only the RKF and PD89 integrators can do this,  since the extra steps
+start from the beginning of an accepted step.  The multistep integrator
+has no such single step,  so (like Encke and the symplectic integrator)
+it stops at each time instead.  The extra derivative evaluations and
+steps are taken after the step was accepted,  and mustn't change the
+planet-hit or Encke state it left behind,  so that's saved and restored. */
+
+static double take_step( INTEGRATION_CONTEXT *context, const double jd,
+            ELEMENTS *ref_orbit, const double *ival, double *ovals,
+            const int n_vals, const double step)
+{
+   assert( integration_method == 0 || integration_method == 2);
+   return( integration_method ?
+            take_pd89_step( context, jd, ref_orbit, ival, ovals, n_vals, step) :
+            take_rk_step( context, jd, ref_orbit, ival, ovals, n_vals, step));
+}
+
+static void set_dense_states( INTEGRATION_CONTEXT *context,
+            ELEMENTS *ref_orbit, const double t, const double new_t,
+            const double *ival, const double *oval, const int n_vals,
+            int *dense_idx)
+{
+   const double *times = context->dense_times;
+   const double step = new_t - t;
+   const int saved_planet_hit = context->planet_hit;
+   const int saved_best_fit_planet = context->best_fit_planet;
+   const double saved_best_fit_planet_dist = context->best_fit_planet_dist;
+   int i, end_idx, n_interior = 0, check_idx = -1, exact_idx = -1;
+   bool use_interpolation = false;
+   double ideriv[MAX_STM_N_VALS], oderiv[MAX_STM_N_VALS];
+
+   for( i = *dense_idx; i < context->n_dense
+                   && (times[i] - t) * (new_t - times[i]) >= 0.; i++)
+      if( times[i] != new_t)
+         {
+         n_interior++;
+         if( check_idx == -1 || fabs( times[i] - t - step / 2.)
+                              < fabs( times[check_idx] - t - step / 2.))
+            check_idx = i;
+         }
+   end_idx = i;
+   if( n_interior > 1)
+      {
+      double *check_state = context->dense_states + check_idx * n_vals;
+      double interpolated[MAX_STM_N_VALS], err2 = 0., r2 = 0.;
+      const double dt = times[check_idx] - t;
+
+      calc_derivatives( context, t, ival, ideriv, -1);
+      calc_derivatives( context, new_t, oval, oderiv, -1);
+      take_step( context, t, ref_orbit, ival, check_state, n_vals, dt);
+      exact_idx = check_idx;
+      dense_interpolate( ival, ideriv, oval, oderiv, n_vals, step,
+                              dt / step, interpolated);
+      for( i = 0; i < 6; i++)
+         err2 += (interpolated[i] - check_state[i])
+                    * (interpolated[i] - check_state[i]);
+      for( i = 0; i < 3; i++)
+         r2 += check_state[i] * check_state[i];
+      use_interpolation =
+               (err2 < integration_tolerance * integration_tolerance * r2);
+      }
+   for( i = *dense_idx; i < end_idx; i++)
+      {
+      double *state = context->dense_states + i * n_vals;
+      const double dt = times[i] - t;
+
+      if( times[i] == new_t)
+         memcpy( state, oval, n_vals * sizeof( double));
+      else if( i == exact_idx)
+         ;     /* already got this one */
+      else if( use_interpolation)
+         dense_interpolate( ival, ideriv, oval, oderiv, n_vals, step,
+                              dt / step, state);
+      else
+         take_step( context, t, ref_orbit, ival, state, n_vals, dt);
+      }
+   *dense_idx = end_idx;
+   context->planet_hit = saved_planet_hit;
+   context->best_fit_planet = saved_best_fit_planet;
+   context->best_fit_planet_dist = saved_best_fit_planet_dist;
+}
+
+int integrate_orbit_in_context( INTEGRATION_CONTEXT *context,
+            double *orbit, const double t0, const double t1)
 {
-   static double stepsize = 2.;
-   static double fixed_stepsize = -1.;
    const double chicken = .9;
    int reset_of_elements_needed = 1;
    const double step_increase = chicken * integration_tolerance
                  / pow( STEP_INCREMENT, (integration_method ? 9. : 5.));
-   static int use_encke = -1;
    double t = t0;
 #ifdef CONSOLE
    static time_t real_time = (time_t)0;
    double prev_t = t, last_err = 0.;
 #endif
-   int n_rejects = 0, rval;
-   unsigned saved_perturbers = perturbers;
+   int n_rejects = 0, rval, n_accepted = 0, next_pruning = 0;
+   bool last_step_rejected = false;
+   const unsigned saved_perturbers = context->perturbers;
    int n_steps = 0, prev_n_steps = 0;
    int going_backward = (t1 < t0);
-   static int n_changes;
+   const int n_vals = STM_N_VALS( context->n_stm_params);
+   double stepsize;
+   int dense_idx = 0;
+   double pruning_step = 0.;
    ELEMENTS ref_orbit;
 
    assert( fabs( t0) < 1e+9);
    assert( fabs( t1) < 1e+9);
-   if( use_encke == -1)
-      use_encke = atoi( get_environment_ptr( "ENCKE"));
+   if( context->use_encke == -1)
+      context->use_encke = get_settings( )->encke;
+   if( context->pruning < 0.)
+      context->pruning = get_settings( )->prune_perturbers;
+   if( context->n_dense && (context->use_encke || integration_method == 1
+                                             || integration_method == 3))
+      {           /* no dense output;  just integrate to each time in turn */
+      const int n_dense = context->n_dense;
+      double curr_t = t0;
+
+      context->n_dense = 0;
+      rval = 0;
+      while( dense_idx < n_dense && !rval)
+         {
+         const double next_t = context->dense_times[dense_idx];
+
+         rval = integrate_orbit_in_context( context, orbit, curr_t, next_t);
+         memcpy( context->dense_states + dense_idx * n_vals, orbit,
+                              n_vals * sizeof( double));
+         curr_t = next_t;
+         dense_idx++;
+         }
+      if( !rval && curr_t != t1)
+         rval = integrate_orbit_in_context( context, orbit, curr_t, t1);
+      context->n_dense = n_dense;
+      return( rval);
+      }
    if( t0 > maximum_jd || t1 > maximum_jd
                        || t0 < minimum_jd || t0 < minimum_jd)
       {
@@ -401,34 +562,58 @@ int integrate_orbit( double *orbit, const double t0, const double t1)
       return( -1);
       }
    ref_orbit.central_obj = -1;
-   if( fixed_stepsize < 0.)
-      fixed_stepsize = atof( get_environment_ptr( "FIXED_STEPSIZE"));
-   stepsize = fabs( stepsize);
-   if( fixed_stepsize > 0.)
-      stepsize = fixed_stepsize;
+   if( context->fixed_stepsize < 0.)
+      context->fixed_stepsize = get_settings( )->fixed_stepsize;
+   if( !context->min_stepsize)
+      context->min_stepsize = get_settings( )->min_stepsize;
+   stepsize = fabs( context->stepsize);
+   if( context->fixed_stepsize > 0.)
+      stepsize = context->fixed_stepsize;
    if( going_backward)
       stepsize = -stepsize;
+   while( dense_idx < context->n_dense && context->dense_times[dense_idx] == t0)
+      memcpy( context->dense_states + n_vals * dense_idx++, orbit,
+                              n_vals * sizeof( double));
    while( t != t1 && !rval)
       {
       double delta_t, new_t = ceil( (t - .5) / stepsize + .5) * stepsize + .5;
 
-      reset_auto_perturbers( t, orbit);
+      reset_auto_perturbers( context, t, orbit);
+      if( context->pruning > 0. && !(saved_perturbers & AUTOMATIC_PERTURBERS)
+                  && !last_step_rejected)
+         if( n_accepted >= next_pruning || fabs( stepsize) > 2. * pruning_step)
+            {
+            const double tol = context->pruning * integration_tolerance;
+            const unsigned pruned = saved_perturbers & ~context->perturbers;
+            const double horizon = t1 - t;
+            double span = PRUNING_INTERVAL * stepsize;
+
+            if( fabs( span) > fabs( horizon))
+               span = horizon;
+            context->perturbers = saved_perturbers
+                     & ~find_negligible_perturbers( t, orbit,
+                              saved_perturbers & ~pruned, span, horizon,
+                              tol * PRUNING_HYSTERESIS)
+                     & ~find_negligible_perturbers( t, orbit, pruned,
+                              span, horizon, tol);
+            pruning_step = fabs( stepsize);
+            next_pruning = n_accepted + PRUNING_INTERVAL;
+            }
       if( reset_of_elements_needed || !(n_steps % 50))
-         if( use_encke)
+         if( context->use_encke)
             {
-            extern int best_fit_planet;
-
-            find_relative_orbit( t, orbit, &ref_orbit, best_fit_planet);
+            find_relative_orbit( t, orbit, &ref_orbit,
+                                       context->best_fit_planet);
             reset_of_elements_needed = 0;
             }
       n_steps++;
 #ifdef CONSOLE
-      if( !(n_steps % 500) && show_runtime_messages && time( NULL) != real_time)
+      if( !(n_steps % 500) && context->show_messages
+                           && time( NULL) != real_time)
          {
          char buff[80];
-         extern int best_fit_planet, n_posns_cached;
+         extern int n_posns_cached;
          extern int64_t planet_ns;
-         extern double best_fit_planet_dist;
 // #define TEST_PLANET_CACHING_HASH_FUNCTION
 #ifdef TEST_PLANET_CACHING_HASH_FUNCTION
          extern long total_n_searches, total_n_probes, max_probes_required;
@@ -460,11 +645,12 @@ int integrate_orbit( double *orbit, const double t0, const double t1)
          prev_t = t;
          move_add_nstr( 11, 10, buff, -1);
          sprintf( buff, "%d steps; %d rejected", n_steps, n_rejects);
-         if( best_fit_planet_dist)
+         if( context->best_fit_planet_dist)
             {
             snprintf_append( buff, sizeof( buff), "; center %d, ",
-                            best_fit_planet);
-            format_dist_in_buff( buff + strlen( buff), best_fit_planet_dist);
+                            context->best_fit_planet);
+            format_dist_in_buff( buff + strlen( buff),
+                            context->best_fit_planet_dist);
             }
          if( planet_ns)
             sprintf( buff + strlen( buff), "  tp:%ld.%09ld",
@@ -473,9 +659,9 @@ int integrate_orbit( double *orbit, const double t0, const double t1)
          strcat( buff, "  ");
          move_add_nstr( 12, 10, buff, -1);
          sprintf( buff, "last err: %.3e/%.3e  n changes: %d  ",
-                        last_err, step_increase, n_changes);
+                        last_err, step_increase, context->n_changes);
          move_add_nstr( 13, 10, buff, -1);
-         if( use_encke)
+         if( context->use_encke)
             {
             sprintf( buff, "e = %.5f; q = ", ref_orbit.ecc);
             format_dist_in_buff( buff + strlen( buff), ref_orbit.q);
@@ -511,36 +697,45 @@ int integrate_orbit( double *orbit, const double t0, const double t1)
       switch( integration_method)
          {
          case 1:
-            symplectic_6( t, &ref_orbit, orbit, delta_t);
+            assert( !context->n_stm_params);
+            symplectic_6( context, t, &ref_orbit, orbit, delta_t);
+            n_accepted++;
             break;
          default:
             {
-            double new_vals[6];
-            static double min_stepsize;
-            const double err = (integration_method ?
-                   take_pd89_step( t, &ref_orbit, orbit, new_vals, 6, delta_t) :
-                   take_rk_step( t, &ref_orbit, orbit, new_vals, 6, delta_t));
+            double new_vals[MAX_STM_N_VALS], err;
+
+            if( integration_method == 3)
+               err = take_multistep_step( context, t, &ref_orbit,
+                                          orbit, new_vals, n_vals, delta_t);
+            else if( integration_method)
+               err = take_pd89_step( context, t, &ref_orbit, orbit, new_vals,
+                                                      n_vals, delta_t);
+            else
+               err = take_rk_step( context, t, &ref_orbit, orbit, new_vals,
+                                                      n_vals, delta_t);
 
-            if( !min_stepsize)
-               {
-               min_stepsize = atof( get_environment_ptr( "MIN_STEPSIZE"))
-                                             / seconds_per_day;
-               if( !min_stepsize)
-                  min_stepsize = 1e-5;   /* 1e-5 day = 0.864 seconds */
-               }
             if( !stepsize)
                exit( 0);
 //          if( err >= integration_tolerance && fabs( stepsize) < min_stepsize)
 //             debug_printf( "Err %f x tolerance; stepsize %f seconds\n",
 //                         err / integration_tolerance, delta_t * seconds_per_day);
-            if( err < integration_tolerance || fixed_stepsize > 0.
-                        || fabs( stepsize) < min_stepsize)  /* it's good! */
-               {
-               memcpy( orbit, new_vals, 6 * sizeof( double));
-               if( err < step_increase && !fixed_stepsize)
-                  if( fabs( delta_t - stepsize) < fabs( stepsize * .01))
+            last_step_rejected = !(err < integration_tolerance
+                        || context->fixed_stepsize > 0.
+                        || fabs( stepsize) < context->min_stepsize);
+            if( !last_step_rejected)
+               {                                      /* it's good! */
+               n_accepted++;
+               if( context->n_dense)
+                  set_dense_states( context, &ref_orbit, t, new_t, orbit,
+                                    new_vals, n_vals, &dense_idx);
+               memcpy( orbit, new_vals, n_vals * sizeof( double));
+               if( err < step_increase && !context->fixed_stepsize)
+                  if( fabs( delta_t - stepsize) < fabs( stepsize * .01)
+                        && (integration_method != 3      /* see runge.cpp */
+                        || multistep_step_can_grow( context, step_increase)))
                      {
-                     n_changes++;
+                     context->n_changes++;
                      stepsize *= STEP_INCREMENT;
                      }
                }
@@ -566,23 +761,18 @@ int integrate_orbit( double *orbit, const double t0, const double t1)
          debug_printf( "Stepsize %g\n", stepsize);
          }
       else if( integration_timeout && !(n_steps % 100))
-         if( clock( ) > integration_timeout)
+         if( monotonic_nanoseconds( ) > integration_timeout)
             rval = INTEGRATION_TIMED_OUT;
-      if( fail_on_hitting_planet)
-         {
-         extern int planet_hit;
-
-         if( planet_hit != -1)
-            rval = HIT_A_PLANET;
-         }
+      if( fail_on_hitting_planet && context->planet_hit != -1)
+         rval = HIT_A_PLANET;
 
       if( debug_level && n_steps % 10000 == 0)
          {
-         extern int best_fit_planet;
          ELEMENTS elems;
 
-         find_relative_orbit( t, orbit, &elems, best_fit_planet);
-         debug_printf( "At %f, step %g near planet %d\n", t, stepsize, best_fit_planet);
+         find_relative_orbit( t, orbit, &elems, context->best_fit_planet);
+         debug_printf( "At %f, step %g near planet %d\n", t, stepsize,
+                                    context->best_fit_planet);
          debug_printf( "q = %f km; e = %f\n", elems.q * AU_IN_KM, elems.ecc);
          debug_printf( "Posn: %f %f %f\n", orbit[0], orbit[1], orbit[2]);
          debug_printf( "Posn: %f %f %f\n", orbit[3], orbit[4], orbit[5]);
@@ -590,7 +780,490 @@ int integrate_orbit( double *orbit, const double t0, const double t1)
       }
    if( debug_level > 7)
       debug_printf( "Integration done: %d\n", rval);
-   perturbers = saved_perturbers;
+   context->perturbers = saved_perturbers;
+   context->stepsize = stepsize;
+   context->profile.n_steps += n_steps;
+   context->profile.n_rejected_steps += n_rejects;
+   harvest_force_profile( context);
+   return( rval);
+}
+
+/* The 'usual' integrate_orbit( ) uses a single,  process-wide context,
+refreshed from the current perturber and non-gravitational settings
+on each call.  The step size is carried over from call to call,  as
+the function-static 'stepsize' used to be.  */
+
+static INTEGRATION_CONTEXT *get_default_context( void)
+{
+   static INTEGRATION_CONTEXT context;
+   static bool context_initialized = false;
+
+   if( !context_initialized)
+      {
+      init_integration_context( &context);
+      context_initialized = true;
+      }
+   context.perturbers = perturbers;
+   context.n_extra_params = n_extra_params;
+   memcpy( context.solar_pressure, solar_pressure,
+                        MAX_N_NONGRAV_PARAMS * sizeof( double));
+   context.show_messages = show_runtime_messages;
+   return( &context);
+}
+
+/* After a fit,  the same orbit gets integrated over and over:  for the
+residuals,  elements,  ephemerides,  MOIDs,  pseudo-MPEC,  and so on,
+each starting from the epoch.  To avoid that,  integrate_orbit( ) keeps
+'checkpoints' (state vectors at the times it's integrated to) for the
+last few trajectories.  A trajectory is identified by the force model
+settings (perturbers,  non-gravs,  etc.),  and a checkpoint within it
+by a hash of those settings,  the time,  and the state vector.  If we're
+asked to integrate from a state that matches a checkpoint,  we instead
+start from whichever checkpoint on that trajectory is nearest the end
+time,  then add the result as a new checkpoint.  So integrating from
+the epoch to 2020,  then from the epoch to 2021,  only really integrates
+from 2020 to 2021;  and integrating the state we got for 2021 on to 2022
+is recognized as continuing the same trajectory.
+
+   Anything else that changes the force model has to be in the key,  too:
+J2 and GR multipliers,  asteroid masses,  and (via the settings generation
+number) GEO_TERMS,  GEO_GRID,  DRAG_SHUTOFF,  and so on.  Otherwise,  a
+trajectory computed with the old force model would be returned.
+
+   When a trajectory has MAX_CHECKPOINTS checkpoints,  the least recently
+used one (other than the starting one) is replaced;  so is the least
+recently used trajectory.  Fits that alternate between orbits thus keep
+the checkpoints they actually start from.
+
+   The number of trajectories kept is set by TRAJECTORY_CACHE in
+'environ.dat'.  Results can differ slightly (at about the integration
+tolerance) from integrating from the epoch,  so this is off by default. */
+
+#define MAX_CHECKPOINTS 64
+#define IDX_ASTEROIDS 20
+
+#define TRAJECTORY_KEY        struct trajectory_key
+#define TRAJECTORY_CHECKPOINT struct trajectory_checkpoint
+#define CACHED_TRAJECTORY     struct cached_trajectory
+
+TRAJECTORY_KEY
+   {
+   unsigned perturbers, excluded_perturbers;
+   int n_extra_params, integration_method;
+   double solar_pressure[MAX_N_NONGRAV_PARAMS];
+   double object_mass, tolerance;
+   double j2_multiplier, general_relativity_factor;
+   int settings_generation;         /* GEO_TERMS,  GEO_GRID,  etc. */
+   uint64_t asteroid_mass_hash;     /* see set_trajectory_key( ) */
+   };
+
+TRAJECTORY_CHECKPOINT
+   {
+   uint64_t hash;
+   double jd, state[6];
+   unsigned long last_used;
+   };
+
+CACHED_TRAJECTORY
+   {
+   TRAJECTORY_KEY key;
+   unsigned perturbers_found;
+   int n_checkpoints;
+   unsigned long last_used;
+   TRAJECTORY_CHECKPOINT checkpoints[MAX_CHECKPOINTS];
+   };
+
+static CACHED_TRAJECTORY *trajectories;
+static int n_cached_trajectories = 0, trajectory_cache_generation = -1;
+static unsigned long trajectory_use_count;
+
+      /* FNV-1a hash,  continued from 'hash' over 'n_bytes' more bytes */
+static uint64_t fnv_hash( uint64_t hash, const void *data, size_t n_bytes)
+{
+   const unsigned char *bytes = (const unsigned char *)data;
+
+   while( n_bytes--)
+      {
+      hash ^= (uint64_t)*bytes++;
+      hash *= (uint64_t)0x100000001b3;
+      }
+   return( hash);
+}
+
+static uint64_t checkpoint_hash( const TRAJECTORY_KEY *key,
+                     const double jd, const double *state)
+{
+   uint64_t hash = (uint64_t)0xcbf29ce484222325;
+
+   hash = fnv_hash( hash, key, sizeof( TRAJECTORY_KEY));
+   hash = fnv_hash( hash, &jd, sizeof( double));
+   return( fnv_hash( hash, state, 6 * sizeof( double)));
+}
+
+/* Asteroid masses can change between integrations:  an "m=N" fit tweaks
+one to get partials,  and then adjusts it.  Rather than put all of them
+in the key,  we put in a hash of them.  */
+
+static uint64_t asteroid_mass_hash( void)
+{
+   int n_masses;
+   const double *masses = get_asteroid_masses( &n_masses);
+
+   return( fnv_hash( (uint64_t)0xcbf29ce484222325, masses,
+                                 n_masses * sizeof( double)));
+}
+
+static void set_trajectory_key( TRAJECTORY_KEY *key,
+                     const INTEGRATION_CONTEXT *context)
+{
+   extern unsigned excluded_perturbers;
+   extern double object_mass;
+   extern double j2_multiplier, general_relativity_factor;
+
+   memset( key, 0, sizeof( TRAJECTORY_KEY));    /* zero any padding */
+   key->perturbers = context->perturbers;
+   key->excluded_perturbers = excluded_perturbers;
+   key->n_extra_params = context->n_extra_params;
+   key->integration_method = integration_method;
+   memcpy( key->solar_pressure, context->solar_pressure,
+                        MAX_N_NONGRAV_PARAMS * sizeof( double));
+   key->object_mass = object_mass;
+   key->tolerance = integration_tolerance;
+   key->j2_multiplier = j2_multiplier;
+   key->general_relativity_factor = general_relativity_factor;
+   key->settings_generation = get_settings( )->generation;
+   if( context->perturbers & (1 << IDX_ASTEROIDS))
+      key->asteroid_mass_hash = asteroid_mass_hash( );
+}
+
+static CACHED_TRAJECTORY *find_trajectory( const TRAJECTORY_KEY *key,
+                     const double jd, const double *state)
+{
+   const uint64_t hash = checkpoint_hash( key, jd, state);
+   int i, j;
+
+   for( i = 0; i < n_cached_trajectories; i++)
+      {
+      CACHED_TRAJECTORY *traj = trajectories + i;
+
+      for( j = 0; j < traj->n_checkpoints; j++)
+         {
+         const TRAJECTORY_CHECKPOINT *cptr = traj->checkpoints + j;
+
+         if( cptr->hash == hash && cptr->jd == jd
+               && !memcmp( cptr->state, state, 6 * sizeof( double))
+               && !memcmp( &traj->key, key, sizeof( TRAJECTORY_KEY)))
+            {
+            traj->last_used = ++trajectory_use_count;
+            return( traj);
+            }
+         }
+      }
+   return( NULL);
+}
+
+static const TRAJECTORY_CHECKPOINT *nearest_checkpoint(
+                     CACHED_TRAJECTORY *traj, const double jd)
+{
+   TRAJECTORY_CHECKPOINT *rval = traj->checkpoints;
+   int i;
+
+   for( i = 1; i < traj->n_checkpoints; i++)
+      if( fabs( traj->checkpoints[i].jd - jd) < fabs( rval->jd - jd))
+         rval = traj->checkpoints + i;
+   rval->last_used = ++trajectory_use_count;
+   return( rval);
+}
+
+static void add_checkpoint( CACHED_TRAJECTORY *traj, const double jd,
+                     const double *state)
+{
+   TRAJECTORY_CHECKPOINT *cptr;
+   int i;
+
+   for( i = 0; i < traj->n_checkpoints; i++)
+      if( traj->checkpoints[i].jd == jd)     /* already got it */
+         return;
+   if( traj->n_checkpoints < MAX_CHECKPOINTS)
+      cptr = traj->checkpoints + traj->n_checkpoints++;
+   else
+      {        /* replace least recently used,  but keep the first (epoch) */
+      cptr = traj->checkpoints + 1;
+      for( i = 2; i < MAX_CHECKPOINTS; i++)
+         if( traj->checkpoints[i].last_used < cptr->last_used)
+            cptr = traj->checkpoints + i;
+      }
+   cptr->last_used = ++trajectory_use_count;
+   cptr->jd = jd;
+   memcpy( cptr->state, state, 6 * sizeof( double));
+   cptr->hash = checkpoint_hash( &traj->key, jd, state);
+}
+
+static CACHED_TRAJECTORY *new_trajectory( const TRAJECTORY_KEY *key)
+{
+   CACHED_TRAJECTORY *rval = trajectories;
+   int i;
+
+   for( i = 1; i < n_cached_trajectories; i++)    /* replace least  */
+      if( trajectories[i].last_used < rval->last_used)  /* recently used */
+         rval = trajectories + i;
+   memset( rval, 0, sizeof( CACHED_TRAJECTORY));
+   rval->key = *key;
+   rval->last_used = ++trajectory_use_count;
+   return( rval);
+}
+
+int integrate_orbit( double *orbit, const double t0, const double t1)
+{
+   INTEGRATION_CONTEXT *context = get_default_context( );
+   const FIND_ORB_SETTINGS *settings = get_settings( );
+   CACHED_TRAJECTORY *traj = NULL;
+   TRAJECTORY_KEY key;
+   double start_t = t0, start_state[6];
+   int rval;
+
+   if( trajectory_cache_generation != settings->generation)
+      {        /* settings changed;  start over,  maybe with a new size */
+      if( trajectories)
+         free( trajectories);
+      trajectories = NULL;
+      n_cached_trajectories = settings->trajectory_cache;
+      if( n_cached_trajectories > 0)
+         {
+         trajectories = (CACHED_TRAJECTORY *)calloc( n_cached_trajectories,
+                                       sizeof( CACHED_TRAJECTORY));
+         assert( trajectories);
+         }
+      else
+         n_cached_trajectories = 0;
+      trajectory_cache_generation = settings->generation;
+      }
+   if( n_cached_trajectories)
+      {
+      set_trajectory_key( &key, context);
+      memcpy( start_state, orbit, 6 * sizeof( double));
+      traj = find_trajectory( &key, t0, orbit);
+      if( traj)
+         {
+         const TRAJECTORY_CHECKPOINT *cptr = nearest_checkpoint( traj, t1);
+
+         start_t = cptr->jd;
+         memcpy( orbit, cptr->state, 6 * sizeof( double));
+         perturbers_automatically_found |= traj->perturbers_found;
+         }
+      }
+   rval = integrate_orbit_in_context( context, orbit, start_t, t1);
+   if( n_cached_trajectories && !rval)
+      {
+      if( !traj)
+         {
+         traj = new_trajectory( &key);
+         add_checkpoint( traj, t0, start_state);
+         }
+      traj->perturbers_found |= context->perturbers_found;
+      add_checkpoint( traj, t1, orbit);
+      }
+   perturbers_automatically_found |= context->perturbers_found;
+   context->perturbers_found = 0;
+   return( rval);
+}
+
+/* integrate_orbits_in_lockstep( ) integrates a 'cloud' of n_orbits orbits
+(six doubles each,  one after another) from t0 to t1,  all taking the same
+steps;  see the batch integrators at the end of 'runge.cpp'.  If a step
+fails for any one of the orbits,  it's retried with a smaller step for all
+of them.  For clouds of Monte Carlo or statistical ranging variants of
+one orbit,  that costs very little,  since they'll all want about the
+same step sizes anyway.  With automatic perturbers,  the perturbers used
+are those any of the orbits would want.
+
+   The batch integrators work in plain double and don't do Encke,  so
+this is meant for the variant orbits only;  the nominal orbit should go
+through integrate_orbit( ) as usual.
+
+   An orbit that becomes unreasonable or hits a planet is dropped from
+the batch (left at wherever it had got to),  and the rest carry on.
+rvals[i] gets the usual integrate_orbit( ) return value for each orbit
+(zero if it got to t1),  and the number of orbits that didn't make it
+is returned.
+
+   The symplectic integrator isn't handled in batch form,  nor are times
+outside the range we can integrate over;  we just integrate each orbit
+in turn (and the latter will fail for each one).  */
+
+static void unpack_batch( double *orbits, const double *ivals,
+               const int *idx, const int n_active)
+{
+   int i, j;
+
+   for( i = 0; i < n_active; i++)
+      for( j = 0; j < 6; j++)
+         orbits[idx[i] * 6 + j] = ivals[j * n_active + i];
+}
+
+static void pack_batch( double *ivals, const double *orbits,
+               const int *idx, const int n_active)
+{
+   int i, j;
+
+   for( i = 0; i < n_active; i++)
+      for( j = 0; j < 6; j++)
+         ivals[j * n_active + i] = orbits[idx[i] * 6 + j];
+}
+
+int integrate_orbits_in_lockstep( INTEGRATION_CONTEXT *context,
+            double *orbits, const int n_orbits,
+            const double t0, const double t1, int *rvals)
+{
+   const double chicken = .9;
+   const double step_increase = chicken * integration_tolerance
+                 / pow( STEP_INCREMENT, (integration_method ? 9. : 5.));
+   const unsigned saved_perturbers = context->perturbers;
+   const int going_backward = (t1 < t0);
+   double t = t0, stepsize, *ivals, *new_vals;
+   void *scratch;
+   char *planet_hits;
+   int *idx;
+   int i, j, n_steps = 0, n_rejects = 0, n_failed = 0, n_active = 0;
+
+   assert( !context->n_stm_params);
+   if( integration_method == 1 || n_orbits == 1
+                       || t0 > maximum_jd || t1 > maximum_jd
+                       || t0 < minimum_jd || t1 < minimum_jd)
+      {
+      for( i = 0; i < n_orbits; i++)
+         {
+         rvals[i] = integrate_orbit_in_context( context, orbits + i * 6, t0, t1);
+         if( rvals[i])
+            n_failed++;
+         }
+      return( n_failed);
+      }
+   ivals = (double *)malloc( 2 * 6 * n_orbits * sizeof( double)
+                  + batch_scratch_size( n_orbits)
+                  + n_orbits * (sizeof( int) + sizeof( char)));
+   assert( ivals);
+   new_vals = ivals + 6 * n_orbits;
+   scratch = (void *)( new_vals + 6 * n_orbits);
+   idx = (int *)( (char *)scratch + batch_scratch_size( n_orbits));
+   planet_hits = (char *)( idx + n_orbits);
+   for( i = 0; i < n_orbits; i++)
+      if( (rvals[i] = is_unreasonable_orbit( orbits + i * 6)) != 0)
+         n_failed++;
+      else
+         idx[n_active++] = i;
+   pack_batch( ivals, orbits, idx, n_active);
+   if( context->fixed_stepsize < 0.)
+      context->fixed_stepsize = get_settings( )->fixed_stepsize;
+   if( !context->min_stepsize)
+      context->min_stepsize = get_settings( )->min_stepsize;
+   stepsize = fabs( context->stepsize);
+   if( context->fixed_stepsize > 0.)
+      stepsize = context->fixed_stepsize;
+   if( going_backward)
+      stepsize = -stepsize;
+   while( t != t1 && n_active)
+      {
+      const int n_vals = 6 * n_active;
+      double delta_t, err, new_t = ceil( (t - .5) / stepsize + .5) * stepsize + .5;
+      int n_dropped = 0;
+
+      if( saved_perturbers & AUTOMATIC_PERTURBERS)
+         {
+         unsigned all_perturbers = 0;
+
+         for( i = 0; i < n_active; i++)
+            {
+            double orbit[6];
+
+            for( j = 0; j < 6; j++)
+               orbit[j] = ivals[j * n_active + i];
+            reset_auto_perturbers( context, t, orbit);
+            all_perturbers |= context->perturbers;
+            }
+         context->perturbers = all_perturbers;
+         }
+      n_steps++;
+      if( (!going_backward && new_t > t1) || (going_backward && new_t < t1))
+         new_t = t1;
+      delta_t = new_t - t;
+      err = (integration_method ?
+              take_batch_pd89_step( context, t, n_active, ivals, new_vals,
+                                    delta_t, scratch, planet_hits) :
+              take_batch_rk_step( context, t, n_active, ivals, new_vals,
+                                    delta_t, scratch, planet_hits));
+      if( err < integration_tolerance || context->fixed_stepsize > 0.
+                        || fabs( stepsize) < context->min_stepsize)
+         {                                      /* it's good! */
+         memcpy( ivals, new_vals, n_vals * sizeof( double));
+         if( err < step_increase && !context->fixed_stepsize)
+            if( fabs( delta_t - stepsize) < fabs( stepsize * .01))
+               {
+               context->n_changes++;
+               stepsize *= STEP_INCREMENT;
+               }
+         }
+      else           /* failed:  try again with a smaller step */
+         {
+         n_rejects++;
+         new_t = t;
+         stepsize /= STEP_INCREMENT;
+         }
+      t = new_t;
+      for( i = 0; i < n_active; i++)
+         {
+         double orbit[6];
+
+         for( j = 0; j < 6; j++)
+            orbit[j] = ivals[j * n_active + i];
+         rvals[idx[i]] = is_unreasonable_orbit( orbit);
+         if( !rvals[idx[i]] && fail_on_hitting_planet && planet_hits[i])
+            rvals[idx[i]] = HIT_A_PLANET;
+         if( rvals[idx[i]])
+            n_dropped++;
+         }
+      if( n_dropped)       /* take the failed orbits out of the batch */
+         {
+         unpack_batch( orbits, ivals, idx, n_active);
+         for( i = j = 0; i < n_active; i++)
+            if( !rvals[idx[i]])
+               idx[j++] = idx[i];
+         n_active = j;
+         n_failed += n_dropped;
+         pack_batch( ivals, orbits, idx, n_active);
+         }
+      if( n_active && integration_timeout && !(n_steps % 100))
+         if( monotonic_nanoseconds( ) > integration_timeout)
+            {
+            for( i = 0; i < n_active; i++)
+               rvals[idx[i]] = INTEGRATION_TIMED_OUT;
+            n_failed += n_active;
+            break;
+            }
+      }
+   unpack_batch( orbits, ivals, idx, n_active);
+   free( ivals);
+   context->perturbers = saved_perturbers;
+   context->stepsize = stepsize;
+   context->profile.n_steps += n_steps;
+   context->profile.n_rejected_steps += n_rejects;
+   harvest_force_profile( context);
+   return( n_failed);
+}
+
+/* ...and the corresponding 'usual' function,  using the same process-wide
+context as integrate_orbit( ). */
+
+int integrate_orbits( double *orbits, const int n_orbits,
+                     const double t0, const double t1, int *rvals)
+{
+   INTEGRATION_CONTEXT *context = get_default_context( );
+   int rval;
+
+   rval = integrate_orbits_in_lockstep( context, orbits, n_orbits, t0, t1,
+                                             rvals);
+   perturbers_automatically_found |= context->perturbers_found;
+   context->perturbers_found = 0;
    return( rval);
 }
 
@@ -701,11 +1374,61 @@ NULL orbit2.                          */
 
 #define is_between( t1, t2, t3)  ((t2 - t1) * (t3 - t2) >= 0.)
 
-static int set_locs_extended( const double *orbit, const double epoch_jd,
+/* set_locs_extended( ) normally integrates using the default context
+(i.e.,  with plain integrate_orbit( )).  If it's being run on a worker
+thread,  or with tweaked non-gravitational parameters,  a context can be
+supplied instead.
+
+   If that context has n_stm_params set,  a state transition matrix is
+integrated along with the orbit (see 'runge.h').  'orbit2' then gets the
+state and matrix at epoch2,  and if 'stms' is non-NULL,  it gets the
+(heliocentric,  not light-time lagged) state and matrix at each
+observation time,  STM_N_VALS( n_stm_params) doubles per observation.  */
+
+static int integrate_for_locs( INTEGRATION_CONTEXT *context, double *orbit,
+                                 const double t0, const double t1)
+{
+   if( context)
+      return( integrate_orbit_in_context( context, orbit, t0, t1));
+   else
+      return( integrate_orbit( orbit, t0, t1));
+}
+
+/* As above,  but getting the states at each of n_times 'times' (the last
+of which is where the integration stops) using dense output.  */
+
+static int integrate_for_dense_locs( INTEGRATION_CONTEXT *context,
+               double *orbit, const double t0, const int n_times,
+               const double *times, double *states)
+{
+   const bool use_default_context = (context == NULL);
+   int rval;
+
+   if( use_default_context)
+      context = get_default_context( );
+   context->n_dense = n_times;
+   context->dense_times = times;
+   context->dense_states = states;
+   rval = integrate_orbit_in_context( context, orbit, t0, times[n_times - 1]);
+   context->n_dense = 0;
+   if( use_default_context)
+      {
+      perturbers_automatically_found |= context->perturbers_found;
+      context->perturbers_found = 0;
+      }
+   return( rval);
+}
+
+static void compute_ra_decs( OBSERVE FAR *obs, const int n_obs);
+
+static int set_locs_extended( INTEGRATION_CONTEXT *context,
+                       const double *orbit, const double epoch_jd,
                        OBSERVE FAR *obs, const int n_obs,
-                       const double epoch2, double *orbit2)
+                       const double epoch2, double *orbit2, double *stms)
 {
    int i, pass, rval = 0;
+   const int n_vals = (context ? STM_N_VALS( context->n_stm_params) : 6);
+   double *times = NULL, *states = NULL;
 
    if( is_unreasonable_orbit( orbit))
       {
@@ -714,6 +1437,12 @@ static int set_locs_extended( const double *orbit, const double epoch_jd,
                         obs->packed_id);
       return( -9);
       }
+   if( get_settings( )->dense_output && n_obs > 1)
+      {
+      times = (double *)malloc( n_obs * (n_vals + 1) * sizeof( double));
+      assert( times);
+      states = times + n_obs;
+      }
 
    for( i = 0; i < n_obs && obs[i].jd < epoch_jd; i++)
       ;
@@ -721,48 +1450,90 @@ static int set_locs_extended( const double *orbit, const double epoch_jd,
                /* set obs[0...i-1] on pass=0, obs[i...n_obs-1] on pass=1: */
    for( pass = 0; pass < 2; pass++)
       {
-      int j = (pass ? i : i - 1);
-      double curr_orbit[6];
+      int j = (pass ? i : i - 1), k;
+      double curr_orbit[MAX_STM_N_VALS];
       double curr_t = epoch_jd;
 
       memcpy( curr_orbit, orbit, 6 * sizeof( double));
-      while( j < n_obs && j >= 0)
+      memset( curr_orbit + 6, 0, (n_vals - 6) * sizeof( double));
+      for( k = 6; k < n_vals && k < 42; k += 7)   /* 6x6 identity matrix */
+         curr_orbit[k] = 1.;
+      while( j < n_obs && j >= 0 && !rval)
          {
-         double light_lagged_orbit[6];
-         OBSERVE FAR *optr = obs + j;
+         const int dir = (pass ? 1 : -1);
+         int n_run = 1;
 
-         if( orbit2 && is_between( curr_t, epoch2, optr->jd))
+         if( orbit2 && is_between( curr_t, epoch2, obs[j].jd))
             {
-            rval = integrate_orbit( curr_orbit, curr_t, epoch2);
+            rval = integrate_for_locs( context, curr_orbit, curr_t, epoch2);
             if( rval)
-               return( rval);
-            memcpy( orbit2, curr_orbit, 6 * sizeof( double));
+               break;
+            memcpy( orbit2, curr_orbit, n_vals * sizeof( double));
             curr_t = epoch2;
             }
-         rval = integrate_orbit( curr_orbit, curr_t, optr->jd);
+               /* With dense output,  we integrate through a run of    */
+               /* observations in one go,  stopping early only if we'd */
+               /* otherwise pass epoch2.                              */
+         if( times)
+            while( j + n_run * dir >= 0 && j + n_run * dir < n_obs
+                     && !(orbit2 && is_between( obs[j + (n_run - 1) * dir].jd,
+                                      epoch2, obs[j + n_run * dir].jd)))
+               n_run++;
+         if( n_run > 1)
+            {
+            for( k = 0; k < n_run; k++)
+               times[k] = obs[j + k * dir].jd;
+            rval = integrate_for_dense_locs( context, curr_orbit, curr_t,
+                                    n_run, times, states);
+            }
+         else
+            {
+            rval = integrate_for_locs( context, curr_orbit, curr_t, obs[j].jd);
+            if( states)
+               memcpy( states, curr_orbit, n_vals * sizeof( double));
+            }
          if( rval)
-            return( rval);
-         curr_t = optr->jd;
-         light_time_lag( curr_orbit, optr->obs_posn, light_lagged_orbit);
-         FMEMCPY( optr->obj_posn, light_lagged_orbit, 3 * sizeof( double));
-         FMEMCPY( optr->obj_vel, light_lagged_orbit + 3, 3 * sizeof( double));
-         j += (pass ? 1 : -1);
-         }
-      if( orbit2)
+            break;
+         for( k = 0; k < n_run; k++, j += dir)
+            {
+            double light_lagged_orbit[6];
+            OBSERVE FAR *optr = obs + j;
+            const double *state = (states ? states + k * n_vals : curr_orbit);
+
+            curr_t = optr->jd;
+            if( stms)
+               memcpy( stms + j * n_vals, state, n_vals * sizeof( double));
+            light_time_lag( state, optr->obs_posn, light_lagged_orbit);
+            FMEMCPY( optr->obj_posn, light_lagged_orbit, 3 * sizeof( double));
+            FMEMCPY( optr->obj_vel, light_lagged_orbit + 3, 3 * sizeof( double));
+            }
+         }
+      if( orbit2 && !rval)
          if( (!pass && curr_t >= epoch2) || (pass && curr_t <= epoch2))
             {
-            rval = integrate_orbit( curr_orbit, curr_t, epoch2);
-            if( rval)
-               return( rval);
-            memcpy( orbit2, curr_orbit, 6 * sizeof( double));
+            rval = integrate_for_locs( context, curr_orbit, curr_t, epoch2);
+            if( !rval)
+               memcpy( orbit2, curr_orbit, n_vals * sizeof( double));
             }
+      if( rval)
+         break;
       }
+   if( times)
+      free( times);
+   if( !rval)
+      compute_ra_decs( obs, n_obs);
+   return( rval);
+}
+
+            /* Once the object heliocentric positions and velocities */
+            /* are set,  in ecliptic J2000,  for each observation    */
+            /* time,  we go back and find observer-centric computed  */
+            /* RA/decs and distances to the object at those times.   */
+
+static void compute_ra_decs( OBSERVE FAR *obs, const int n_obs)
+{
+   int i;
 
-            /* We've now set the object heliocentric positions and */
-            /* velocities,  in ecliptic J2000,  for each observation */
-            /* time.  Now let's go back and find observer-centric */
-            /* computed RA/decs and distances to the object at those */
-            /* times. */
    for( i = 0; i < n_obs; i++)
       {
       double loc[3], ra, dec, temp, r = 0.;
@@ -796,13 +1567,12 @@ static int set_locs_extended( const double *orbit, const double epoch_jd,
       obs[i].computed_dec = dec;
       set_solar_r( obs + i);
       }
-   return( 0);
 }
 
 int set_locs( const double *orbit, const double t0, OBSERVE FAR *obs,
                        const int n_obs)
 {
-   return( set_locs_extended( orbit, t0, obs, n_obs, t0, NULL));
+   return( set_locs_extended( NULL, orbit, t0, obs, n_obs, t0, NULL, NULL));
 }
 
 double observation_rms( const OBSERVE FAR *obs)
@@ -915,7 +1685,6 @@ static int find_transfer_orbit( double *orbit, OBSERVE FAR *obs1,
    if( !already_have_approximate_orbit)
       {
       double speed_squared = 0., speed;
-      const int saved_perturbers = perturbers;
       double deriv2[6];
       unsigned pass;
 
@@ -935,13 +1704,15 @@ static int find_transfer_orbit( double *orbit, OBSERVE FAR *obs1,
          {
          OBSERVE FAR *obs = (pass ? obs2 : obs1);
          const double jd = (pass ? jd2 : jd1);
+         INTEGRATION_CONTEXT context;
 
          assert( fabs( jd) < 1e+9);
          for( i = 0; i < 3; i++)
             orbit[i] = obs->obj_posn[i];
-         reset_auto_perturbers( jd, orbit);
-         calc_derivatives( jd, orbit, (pass ? deriv2 : deriv), -1);
-         perturbers = saved_perturbers;
+         init_integration_context( &context);
+         reset_auto_perturbers( &context, jd, orbit);
+         calc_derivatives( &context, jd, orbit, (pass ? deriv2 : deriv), -1);
+         perturbers_automatically_found |= context.perturbers_found;
          }
       for( i = 0; i < 3; i++)
          orbit[3 + i] -= delta_t * (deriv[i + 3] / 3 + deriv2[i + 3] / 6.);
@@ -1451,32 +2222,46 @@ static inline void compute_sr_sigmas( const double *sr_orbits,
                const unsigned n_orbits, const double epoch,
                const double epoch_shown)
 {
-   unsigned i;
+   unsigned i, n_used = 0;
    double monte_data[MONTE_DATA_SIZE];
    double sigmas[MONTE_N_ENTRIES];
    FILE *monte_file;
    char filename[100];
    const int planet_orbiting = 0;      /* heliocentric only,  at least for now */
    ELEMENTS elem0;
-
+   double *orbits = (double *)malloc( n_orbits * 6 * sizeof( double));
+   int *rvals = (int *)calloc( n_orbits, sizeof( int));
+
+   assert( orbits);
+   assert( rvals);
+   for( i = 0; i < n_orbits; i++)      /* SR orbits are seven doubles each */
+      memcpy( orbits + 6 * i, sr_orbits + 7 * i, 6 * sizeof( double));
+            /* The first orbit is the nominal one,  and gets integrated */
+            /* as usual;  the variants can go in lockstep,  dropping    */
+            /* any that fail along the way.                             */
+   integrate_orbit( orbits, epoch, epoch_shown);
+   if( n_orbits > 1)
+      integrate_orbits( orbits + 6, (int)n_orbits - 1, epoch, epoch_shown,
+                                 rvals + 1);
    elem0.major_axis = elem0.ecc = 0.;     /* just to avoid uninitialized  */
    for( i = 0; i < n_orbits; i++)         /* variable warnings            */
-      {
-      double orbit[6];
-      ELEMENTS elem;
-
-      elem.gm = SOLAR_GM;
-      memcpy( orbit, sr_orbits + 7 * i, 6 * sizeof( double));
-      integrate_orbit( orbit, epoch, epoch_shown);
-      calc_classical_elements( &elem, orbit, epoch_shown, 1);
-      add_monte_orbit( monte_data, &elem, i);
-      if( !i)
-         elem0 = elem;
-      }
+      if( !i || !rvals[i])
+         {
+         ELEMENTS elem;
+
+         elem.gm = SOLAR_GM;
+         calc_classical_elements( &elem, orbits + 6 * i, epoch_shown, 1);
+         add_monte_orbit( monte_data, &elem, n_used);
+         if( !n_used)
+            elem0 = elem;
+         n_used++;
+         }
+   free( orbits);
+   free( rvals);
    monte_file = fopen_ext( get_file_name( filename, "monte.txt"), "fcwb");
 
-   fprintf( monte_file, "Computed from %u SR orbits\n", n_orbits);
-   compute_monte_sigmas( sigmas, monte_data, n_orbits);
+   fprintf( monte_file, "Computed from %u SR orbits\n", n_used);
+   compute_monte_sigmas( sigmas, monte_data, n_used);
    uncertainty_parameter = dump_monte_data_to_file( monte_file, sigmas,
                  elem0.major_axis, elem0.ecc, planet_orbiting);
    available_sigmas = SR_SIGMAS_AVAILABLE;
@@ -1787,6 +2572,18 @@ int herget_method( OBSERVE FAR *obs, int n_obs, double r1, double r2,
    return( 0);
 }
 
+/* Sets up a least-squares fit,  using QR or the normal equations as
+LSQUARE_QR says (see 'lsquare.cpp'). */
+
+static void *init_lsquare( const int n_params)
+{
+   void *rval = lsquare_init( n_params);
+
+   if( rval && get_settings( )->lsquare_qr)
+      lsquare_set_method( rval, 1);
+   return( rval);
+}
+
 #ifdef OBSOLETE
 
    /* The following code _used_ to be useful for determining
@@ -1815,7 +2612,7 @@ static int setup_parabolic( const double *iparams, double *orbit)
 void improve_parabolic( OBSERVE FAR *obs, int n_obs, double *orbit,
                                                               double epoch)
 {
-   void *lsquare = lsquare_init( 5);
+   void *lsquare;
    double *xresids = (double *)calloc( 2 * n_obs + 10 * n_obs, sizeof( double));
    double *yresids = xresids + n_obs;
    double *slopes = yresids + n_obs;
@@ -1869,6 +2666,7 @@ void improve_parabolic( OBSERVE FAR *obs, int n_obs, double *orbit,
          }
       }
 
+   lsquare = init_lsquare( 5);
    for( i = 0; i < n_obs; i++)
       if( obs[i].is_included)
          {
@@ -2121,8 +2919,6 @@ no re-weighting will occur.         */
 double overobserving_time_span = 0.;
 unsigned overobserving_ceiling = 4;
 
-#define IDX_ASTEROIDS 20
-
 static double reweight_for_overobserving( const OBSERVE FAR *obs,
             const unsigned n_obs, const unsigned idx)
 {
@@ -2329,6 +3125,408 @@ int get_residual_data( const OBSERVE *obs, double *xresid, double *yresid)
    return( n_residuals);
 }
 
+/* Adds the included observations to 'lsquare' all at once,  weighted
+for blunders and over-observing,  and returns the sum of their weighted
+squared residuals (plus one for each),  as used for 'sigma_squared'.  */
+
+static double add_obs_to_lsquare( void *lsquare, const OBSERVE FAR *obs,
+            const int n_obs, const double *xresids, const double *yresids,
+            const double *slopes, const int n_params)
+{
+   double *resids = (double *)malloc( n_obs * (4 + 2 * n_params)
+                                                * sizeof( double));
+   double *weights = resids + 2 * n_obs, *rows = weights + 2 * n_obs;
+   double rval = 0.;
+   int i, n_rows = 0;
+
+   assert( resids);
+   for( i = 0; i < n_obs; i++)
+      if( obs[i].is_included)
+         {
+         double weight = 1.;
+         const double xresid = xresids[i];
+         const double yresid = yresids[i];      /* all in _radians_ */
+         const double resid2 = xresid * xresid + yresid * yresid;
+
+         if( use_blunder_method == 2 && probability_of_blunder)
+            weight = reweight_for_blunders( resid2, weight);
+         if( overobserving_time_span)
+            weight *= reweight_for_overobserving( obs, n_obs, i);
+         FMEMCPY( rows + n_rows * n_params, slopes + i * 2 * n_params,
+                                         2 * n_params * sizeof( double));
+         resids[n_rows] = xresid;
+         resids[n_rows + 1] = yresid;
+         weights[n_rows] = weights[n_rows + 1] = weight;
+         n_rows += 2;
+         rval += weight * weight * (resid2 + 1.);
+         }
+   lsquare_add_observations( lsquare, n_rows, resids, weights, rows);
+   free( resids);
+   return( rval);
+}
+
+/* Finding the partial derivatives is most of the work in a full step.
+For each parameter,  we tweak it,  integrate the tweaked orbit to every
+observation (twice,  with symmetric derivatives),  and adjust the tweak
+until it changes the residuals by about a sigma.  The parameters don't
+depend on one another,  so each gets a PARTIAL_JOB with its own
+integration context,  non-grav parameters,  and slope outputs,  and the
+jobs can be run on separate threads.  What they share is in the
+(read-only) PARTIALS_SETUP,  plus the 'delta_vals' array (of which each
+job only touches its own element).
+
+   Tweaking an asteroid mass means changing a value shared by everybody,
+so that case is always run on a single thread.  */
+
+#define PARTIALS_SETUP struct partials_setup
+#define PARTIAL_JOB struct partial_job
+
+PARTIALS_SETUP
+   {
+   const double *orbit, *central_obj_state, *elements_in_array;
+   const double *constraint;
+   double **unit_vectors, *delta_vals, *asteroid_mass;
+   const OBSERVE *orig_obs;         /* NULL if using symmetric derivs */
+   const double *stms, *epoch2_stm; /* NULL unless using variational eqns */
+   const char *limited_orbit;
+   double epoch, epoch2, integration_length, max_allowed_error, r_mult;
+   int n_params, n_obs, n_constraints, planet_orbiting;
+   int showing_deltas_in_debug_file;
+   };
+
+PARTIAL_JOB
+   {
+   const PARTIALS_SETUP *setup;
+   INTEGRATION_CONTEXT context;
+   OBSERVE *obs;        /* caller's array,  or a per-thread copy */
+   double *slopes, *element_slopes;
+   double constraint_slope[MAX_CONSTRAINTS], r_constraint_slope;
+   char *message;       /* progress text;  NULL on worker threads */
+   int param, rval;
+   };
+
+/* With variational equations (STM_PARTIALS=1 in 'environ.dat'),  the
+nominal orbit is integrated once,  along with its state transition matrix
+(see 'runge.h').  Then a 'tweaked' orbit doesn't need integrating at all:
+to first order,  its state at each observation is the nominal state plus
+the matrix times the change in parameters.  That's all we need for the
+slopes,  and it means the parameter tweaks can't cause integration
+failures (so there's no need to retry with smaller ones). */
+
+static void apply_stm( const double *stm, const int n_params,
+                           const double *dparams, double *state)
+{
+   int i, j;
+
+   for( i = 0; i < 6; i++)
+      {
+      state[i] = stm[i];
+      for( j = 0; j < n_params; j++)
+         state[i] += stm[6 + j * 6 + i] * dparams[j];
+      }
+}
+
+static void set_locs_from_stm( const PARTIALS_SETUP *setup,
+            const double *dparams, OBSERVE FAR *obs, double *orbit2)
+{
+   const int n_vals = STM_N_VALS( setup->n_params);
+   double state[6], light_lagged_orbit[6];
+   int i;
+
+   for( i = 0; i < setup->n_obs; i++)
+      {
+      apply_stm( setup->stms + i * n_vals, setup->n_params, dparams, state);
+      light_time_lag( state, obs[i].obs_posn, light_lagged_orbit);
+      FMEMCPY( obs[i].obj_posn, light_lagged_orbit, 3 * sizeof( double));
+      FMEMCPY( obs[i].obj_vel, light_lagged_orbit + 3, 3 * sizeof( double));
+      }
+   compute_ra_decs( obs, setup->n_obs);
+   apply_stm( setup->epoch2_stm, setup->n_params, dparams, orbit2);
+}
+
+static int compute_partials_for_param( PARTIAL_JOB *job)
+{
+   const PARTIALS_SETUP *setup = job->setup;
+   const int i = job->param, n_params = setup->n_params;
+   const int n_obs = setup->n_obs;
+   double *asteroid_mass = setup->asteroid_mass;
+   double *solar_pressure = job->context.solar_pressure;
+   const double *orbit = setup->orbit;
+   OBSERVE *obs = job->obs;
+   int n_iterations = 0, j;
+   const int max_iterations = 100;
+   double worst_error_in_sigmas;
+   ELEMENTS elem;
+
+   do
+      {
+      double tweaked_orbit[6];
+      const double original_asteroid_mass = (asteroid_mass ? *asteroid_mass : 0.);
+      double delta_val = setup->delta_vals[i]
+                  / (setup->integration_length * setup->integration_length);
+      double worst_error_squared = 0;
+      double original_solar_pressure[3];
+      double *slope_ptr;
+      double rel_orbit[6], dparams[MAX_STM_PARAMS];
+      int set_locs_rval;
+
+               /* for asteroid mass computations,  on first pass, */
+               /* try to set a "reasonable" delta :   */
+      if( i == 6 && asteroid_mass && !n_iterations)
+         delta_val = 1.e-15 + original_asteroid_mass / 100.;
+      memcpy( original_solar_pressure, solar_pressure, 3 * sizeof( double));
+      do
+         {
+         memcpy( tweaked_orbit, orbit, 6 * sizeof( double));
+         memcpy( solar_pressure, original_solar_pressure, 3 * sizeof( double));
+         for( j = 0; j < 6; j++)  /* adjust position/velocity */
+            tweaked_orbit[j] -= setup->unit_vectors[i][j] * delta_val;
+         if( asteroid_mass)
+            *asteroid_mass -= delta_val * setup->unit_vectors[i][6];
+         else
+            for( j = 6; j < n_params; j++)
+               solar_pressure[j - 6] -= setup->unit_vectors[i][j] * delta_val;
+         if( job->message)
+            sprintf( job->message, "Evaluating %d of %d : iter %d   ", i + 1,
+                                 n_params, n_iterations);
+         if( debug_level > 4)
+            debug_printf( "About to set locs #2: delta_val %f\n", delta_val);
+         if( setup->stms)
+            {
+            for( j = 0; j < n_params; j++)
+               dparams[j] = -setup->unit_vectors[i][j] * delta_val;
+            set_locs_from_stm( setup, dparams, obs, rel_orbit);
+            set_locs_rval = 0;
+            }
+         else
+            set_locs_rval = set_locs_extended( &job->context, tweaked_orbit,
+                    setup->epoch, obs, n_obs, setup->epoch2, rel_orbit, NULL);
+         if( debug_level > 4)
+            debug_printf( "Second set done: %d\n", set_locs_rval);
+         if( set_locs_rval == INTEGRATION_TIMED_OUT)
+            return( -4);
+         if( set_locs_rval)      /* gonna have to try again, */
+            {                    /* with a smaller tweak */
+            delta_val /= 2.;
+            setup->delta_vals[i] /= 2.;
+            }
+         }
+         while( set_locs_rval);
+      slope_ptr = job->slopes + i;
+      for( j = 0; j < n_obs; j++, slope_ptr += 2 * n_params)
+         get_residual_data( obs + j, slope_ptr, slope_ptr + n_params);
+
+      for( j = 0; j < 6; j++)
+         rel_orbit[j] -= setup->central_obj_state[j];
+               /* evaluate elements of 'rel_orbit',  then  put */
+               /* into an array form: */
+      elem.gm = get_planet_mass( setup->planet_orbiting);
+      calc_classical_elements( &elem, rel_orbit, setup->epoch2, 1);
+
+      put_orbital_elements_in_array_form( &elem, job->element_slopes);
+      for( j = 0; j < MONTE_N_ENTRIES; j++)
+         {
+         job->element_slopes[j] -= setup->elements_in_array[j];
+         job->element_slopes[j] /= delta_val;
+         }
+      if( setup->limited_orbit)
+         {
+         double constraint2[MAX_CONSTRAINTS];
+
+         evaluate_limited_orbit( rel_orbit, setup->planet_orbiting,
+                        setup->epoch2, setup->limited_orbit, constraint2);
+         for( j = 0; j < setup->n_constraints; j++)
+            job->constraint_slope[j] =
+                    (constraint2[j] - setup->constraint[j]) / delta_val;
+         if( *setup->limited_orbit == 'R')
+            {
+            const double tconstraint = setup->r_mult * (dotted_dist(
+                     obs + n_obs - 1) - atof( setup->limited_orbit + 2));
+
+            job->r_constraint_slope =
+                     (setup->constraint[0] - tconstraint) / delta_val;
+            }
+         }
+      if( !setup->orig_obs)         /* symmetric derivatives */
+         {
+         for( j = 0; j < 6; j++)
+            tweaked_orbit[j] = 2. * orbit[j] - tweaked_orbit[j];
+         if( asteroid_mass)
+            *asteroid_mass = 2. * original_asteroid_mass - *asteroid_mass;
+         else
+            for( j = 0; j < job->context.n_extra_params; j++)
+               solar_pressure[j] = 2. * original_solar_pressure[j] -
+                                 solar_pressure[j];
+         if( job->message)
+            sprintf( job->message, "Evaluating %d of %d rev   ",
+                                 i + 1, n_params);
+         if( setup->stms)
+            {
+            for( j = 0; j < n_params; j++)
+               dparams[j] = -dparams[j];
+            set_locs_from_stm( setup, dparams, obs, rel_orbit);
+            }
+         else
+            set_locs_extended( &job->context, tweaked_orbit, setup->epoch,
+                                 obs, n_obs, setup->epoch, NULL, NULL);
+         }
+      else
+         memcpy( obs, setup->orig_obs, n_obs * sizeof( OBSERVE));
+      slope_ptr = job->slopes + i;
+      for( j = 0; j < n_obs; j++, slope_ptr += 2 * n_params)
+         if( obs[j].is_included)
+            {
+            double xresidual, yresidual;
+
+            get_residual_data( obs + j, &xresidual, &yresidual);
+
+            slope_ptr[0] -= xresidual;
+            slope_ptr[n_params] -= yresidual;
+//          if( obs[j].note2 != 'R')
+               {
+               const double error_squared = slope_ptr[0] * slope_ptr[0]
+                        + slope_ptr[n_params] * slope_ptr[n_params];
+
+               if( worst_error_squared < error_squared)
+                  worst_error_squared = error_squared;
+               }
+            slope_ptr[0]        /= delta_val;
+            slope_ptr[n_params] /= delta_val;
+            if( !setup->orig_obs)      /* delta is actually twice */
+               {                       /* the 'specified' value:  */
+               slope_ptr[0]        /= 2.;
+               slope_ptr[n_params] /= 2.;
+               }
+            }
+      worst_error_in_sigmas = sqrt( worst_error_squared);
+      if( setup->showing_deltas_in_debug_file)
+         debug_printf( "Iter %d, Change param %d: %f sigmas; delta %.3e (%.3e)\n",
+            n_iterations,
+            i, worst_error_in_sigmas, delta_val, setup->delta_vals[i]);
+                     /* Attempt to keep the error at 1.5 sigmas: */
+      if( worst_error_in_sigmas)
+         {
+//       double rescale = 1.5 / worst_error_in_sigmas;
+         double rescale = 1.0 / worst_error_in_sigmas;
+         const double max_rescale = (n_iterations ? 2. : 10.);
+
+         if( rescale > max_rescale)
+            rescale = max_rescale;
+         else if( rescale < 1. / max_rescale)
+            rescale = 1. / max_rescale;
+         setup->delta_vals[i] *= rescale;
+         }
+      else
+         setup->delta_vals[i] *= 2.;
+      memcpy( solar_pressure, original_solar_pressure, 3 * sizeof( double));
+      if( asteroid_mass)
+         *asteroid_mass = original_asteroid_mass;
+      if( n_iterations++ >= max_iterations)
+         {
+         debug_printf( "Ran over iteration limit! %s\n", obs->packed_id);
+         debug_printf( "Worst err %f sigmas\n", worst_error_in_sigmas);
+         return( -4);
+         }
+      }
+      while( worst_error_in_sigmas > setup->max_allowed_error
+                       || worst_error_in_sigmas < .3);
+   return( 0);
+}
+
+/* PARTIALS_THREADS in 'environ.dat' sets the number of threads used
+for the above;  it defaults to 1,  and 0 means 'one per processor'.
+Either way,  we don't use more threads than there are parameters.  */
+
+static int get_n_partials_threads( const int n_params)
+{
+   int rval = 1;
+
+#ifdef FIND_ORB_THREADS
+   rval = get_settings( )->partials_threads;
+   if( rval <= 0)
+      rval = (int)sysconf( _SC_NPROCESSORS_ONLN);
+#endif
+   if( rval > n_params)
+      rval = n_params;
+   if( rval < 1)
+      rval = 1;
+   return( rval);
+}
+
+#ifdef FIND_ORB_THREADS
+
+#define PARTIALS_THREAD struct partials_thread
+
+PARTIALS_THREAD
+   {
+   PARTIAL_JOB *jobs;
+   int n_jobs, first_job, job_step;
+   pthread_t thread;
+   };
+
+/* Thread n handles jobs n,  n + n_threads,  n + 2 * n_threads...  */
+
+static void *partials_thread_func( void *arg)
+{
+   PARTIALS_THREAD *tptr = (PARTIALS_THREAD *)arg;
+   int i;
+
+   for( i = tptr->first_job; i < tptr->n_jobs; i += tptr->job_step)
+      tptr->jobs[i].rval = compute_partials_for_param( tptr->jobs + i);
+   return( NULL);
+}
+#endif
+
+/* Runs the jobs and returns zero,  or the first non-zero return code.
+Without threads,  we stop at the first failure,  as the original
+single-threaded loop did.  If a thread can't be created,  its jobs
+are simply run on the calling thread.   */
+
+static int run_partials_jobs( PARTIAL_JOB *jobs, const int n_jobs,
+                                       const int n_threads)
+{
+   int i, rval = 0;
+
+#ifdef FIND_ORB_THREADS
+   if( n_threads > 1)
+      {
+      PARTIALS_THREAD *threads = (PARTIALS_THREAD *)calloc( n_threads,
+                                          sizeof( PARTIALS_THREAD));
+      bool *started = (bool *)calloc( n_threads, sizeof( bool));
+
+      assert( threads && started);
+      for( i = 0; i < n_threads; i++)
+         {
+         threads[i].jobs = jobs;
+         threads[i].n_jobs = n_jobs;
+         threads[i].first_job = i;
+         threads[i].job_step = n_threads;
+         started[i] = !pthread_create( &threads[i].thread, NULL,
+                                    partials_thread_func, threads + i);
+         }
+      for( i = 0; i < n_threads; i++)
+         if( started[i])
+            pthread_join( threads[i].thread, NULL);
+         else
+            partials_thread_func( threads + i);
+      free( started);
+      free( threads);
+      for( i = 0; !rval && i < n_jobs; i++)
+         rval = jobs[i].rval;
+      return( rval);
+      }
+#endif
+   for( i = 0; !rval && i < n_jobs; i++)
+      rval = jobs[i].rval = compute_partials_for_param( jobs + i);
+   return( rval);
+}
+
+static const double default_delta_vals[9] =
+//                  { 1e-12, 1e-12, 1e-12, 1e-11, 1e-11, 1e-11,
+//                  .001, .001, .1 };
+                   { 1e-4, 1e-4, 1e-5, 1e-5, 1e-3, 1e-3,
+                    .001, .001, .1 };
+
 /* Describing what 'full_improvement()' does requires an entire separate
 file of commentary: see 'full.txt'.  Note,  though,  that this should be
 given an orbit that is somewhere within the arc of observations,  for
@@ -2360,18 +3558,12 @@ int full_improvement( OBSERVE FAR *obs, int n_obs, double *orbit,
    double central_obj_state[6], tvect[6];
    static double **unit_vectors = NULL;
    static int unit_vector_dimension = 0;
-   const double default_delta_vals[9] =
-//                  { 1e-12, 1e-12, 1e-12, 1e-11, 1e-11, 1e-11,
-//                  .001, .001, .1 };
-                   { 1e-4, 1e-4, 1e-5, 1e-5, 1e-3, 1e-3,
-                    .001, .001, .1 };
    static double delta_vals[9];
    double **new_unit_vectors = NULL;
    double constraint[MAX_CONSTRAINTS];
    double sigma_squared = 0.;       /* see Danby, p. 243, (7.5.20) */
    double scale_factor = 1.;
    double integration_length;
-   double worst_error_in_sigmas;
    double before_rms;
    int planet_orbiting = forced_central_body, n_constraints = 0;
    int i, j, n_skipped_obs = 0, err_code = 0;
@@ -2383,10 +3575,15 @@ int full_improvement( OBSERVE FAR *obs, int n_obs, double *orbit,
    ELEMENTS elem;
    OBSERVE *orig_obs = NULL;
    const int showing_deltas_in_debug_file =
-                      atoi( get_environment_ptr( "DEBUG_DELTAS"));
+                      get_settings( )->debug_deltas;
    const double r_mult = 1e+2;
-   double orbit2[6];
+   double orbit2[MAX_STM_N_VALS], epoch2_stm[MAX_STM_N_VALS];
    double max_allowed_error;
+   PARTIALS_SETUP setup;
+   PARTIAL_JOB *jobs;
+   OBSERVE *thread_obs = NULL;
+   int n_threads, set_locs_rval;
+   double *stms = NULL;
 
    perturbers_automatically_found = 0;
    if( asteroid_mass)                    /* If computing an asteroid mass, */
@@ -2476,8 +3673,31 @@ int full_improvement( OBSERVE FAR *obs, int n_obs, double *orbit,
       }
 
    sprintf( tstr, "fi/setting locs: %f  ", JD_TO_YEAR( epoch));
-   if( set_locs_extended( orbit, epoch, obs, n_obs, epoch2, orbit2))
+            /* Variational equations can't (yet) handle asteroid masses, */
+            /* or the symplectic integrator,  or some parameters being    */
+            /* held fixed.  In those cases,  finite differences are used. */
+   if( get_settings( )->stm_partials && !asteroid_mass
+               && integration_method != 1 && n_params >= 6
+               && n_params == 6 + n_extra_params)
+      {
+      INTEGRATION_CONTEXT context;
+
+      init_integration_context( &context);
+      context.n_stm_params = n_params;
+      stms = (double *)malloc( n_obs * STM_N_VALS( n_params) * sizeof( double));
+      assert( stms);
+      set_locs_rval = set_locs_extended( &context, orbit, epoch, obs, n_obs,
+                                    epoch2, orbit2, stms);
+      perturbers_automatically_found |= context.perturbers_found;
+      memcpy( epoch2_stm, orbit2, STM_N_VALS( n_params) * sizeof( double));
+      }
+   else
+      set_locs_rval = set_locs_extended( NULL, orbit, epoch, obs, n_obs,
+                                    epoch2, orbit2, NULL);
+   if( set_locs_rval)
       {
+      if( stms)
+         free( stms);
       runtime_message = NULL;
       return( -4);
       }
@@ -2545,202 +3765,91 @@ int full_improvement( OBSERVE FAR *obs, int n_obs, double *orbit,
       }
 
    max_allowed_error = maximum_deltas( n_obs, obs);
+   setup.orbit = orbit;
+   setup.central_obj_state = central_obj_state;
+   setup.elements_in_array = elements_in_array;
+   setup.constraint = constraint;
+   setup.unit_vectors = unit_vectors;
+   setup.delta_vals = delta_vals;
+   setup.asteroid_mass = asteroid_mass;
+   setup.orig_obs = orig_obs;
+   setup.stms = stms;
+   setup.epoch2_stm = epoch2_stm;
+   setup.limited_orbit = limited_orbit;
+   setup.epoch = epoch;
+   setup.epoch2 = epoch2;
+   setup.integration_length = integration_length;
+   setup.max_allowed_error = max_allowed_error;
+   setup.r_mult = r_mult;
+   setup.n_params = n_params;
+   setup.n_obs = n_obs;
+   setup.n_constraints = n_constraints;
+   setup.planet_orbiting = planet_orbiting;
+   setup.showing_deltas_in_debug_file = showing_deltas_in_debug_file;
+   n_threads = ((asteroid_mass || stms) ? 1 : get_n_partials_threads( n_params));
+   jobs = (PARTIAL_JOB *)calloc( n_params, sizeof( PARTIAL_JOB));
+   assert( jobs);
+   if( n_threads > 1)
+      {
+      thread_obs = (OBSERVE *)calloc( n_threads * n_obs, sizeof( OBSERVE));
+      assert( thread_obs);
+      for( i = 0; i < n_threads; i++)
+         memcpy( thread_obs + i * n_obs, obs, n_obs * sizeof( OBSERVE));
+      }
    for( i = 0; i < n_params; i++)
       {
-      int n_iterations = 0;
-      const int max_iterations = 100;
-
-      do
+      jobs[i].setup = &setup;
+      init_integration_context( &jobs[i].context);
+      jobs[i].slopes = slopes;
+      jobs[i].element_slopes = element_slopes[i];
+      jobs[i].param = i;
+      if( thread_obs)
          {
-         double tweaked_orbit[6];
-         const double original_asteroid_mass = (asteroid_mass ? *asteroid_mass : 0.);
-         double delta_val =
-                      delta_vals[i] / (integration_length * integration_length);
-         double worst_error_squared = 0;
-         double original_solar_pressure[3];
-         double *slope_ptr;
-         double rel_orbit[6];
-         int set_locs_rval;
-
-                  /* for asteroid mass computations,  on first pass, */
-                  /* try to set a "reasonable" delta :   */
-         if( i == 6 && asteroid_mass && !n_iterations)
-            delta_val = 1.e-15 + original_asteroid_mass / 100.;
-         memcpy( original_solar_pressure, solar_pressure,
-                                3 * sizeof( double));
-         do
-            {
-            memcpy( tweaked_orbit, orbit, 6 * sizeof( double));
-            memcpy( solar_pressure, original_solar_pressure,
-                                3 * sizeof( double));
-            for( j = 0; j < 6; j++)  /* adjust position/velocity */
-               tweaked_orbit[j] -= unit_vectors[i][j] * delta_val;
-            if( asteroid_mass)
-               *asteroid_mass -= delta_val * unit_vectors[i][6];
-            else
-               for( j = 6; j < n_params; j++)
-                  solar_pressure[j - 6] -= unit_vectors[i][j] * delta_val;
-            sprintf( tstr, "Evaluating %d of %d : iter %d   ", i + 1,
-                                    n_params, n_iterations);
-            if( debug_level > 4)
-               debug_printf( "About to set locs #2: delta_val %f\n", delta_val);
-            set_locs_rval = set_locs_extended( tweaked_orbit, epoch, obs,
-                       n_obs, epoch2, rel_orbit);
-            if( debug_level > 4)
-               debug_printf( "Second set done: %d\n", set_locs_rval);
-            if( set_locs_rval == INTEGRATION_TIMED_OUT)
-               {
-               free( xresids);
-               memcpy( orbit, original_orbit, 6 * sizeof( double));
-               memcpy( solar_pressure, original_params, 3 * sizeof( double));
-               runtime_message = NULL;
-               return( -4);
-               }
-            if( set_locs_rval)      /* gonna have to try again, */
-               {                    /* with a smaller tweak */
-               delta_val /= 2.;
-               delta_vals[i] /= 2.;
-               }
-            }
-            while( set_locs_rval);
-         slope_ptr = slopes + i;
-         for( j = 0; j < n_obs; j++, slope_ptr += 2 * n_params)
-            get_residual_data( obs + j, slope_ptr, slope_ptr + n_params);
-
-         for( j = 0; j < 6; j++)
-            rel_orbit[j] -= central_obj_state[j];
-                  /* evaluate elements of 'rel_orbit',  then  put */
-                  /* into an array form: */
-         elem.gm = get_planet_mass( planet_orbiting);
-         calc_classical_elements( &elem, rel_orbit, epoch2, 1);
-
-         put_orbital_elements_in_array_form( &elem, element_slopes[i]);
-         for( j = 0; j < MONTE_N_ENTRIES; j++)
-            {
-            element_slopes[i][j] -= elements_in_array[j];
-            element_slopes[i][j] /= delta_val;
-            }
-         if( limited_orbit)
-            {
-            double constraint2[MAX_CONSTRAINTS];
-
-            evaluate_limited_orbit( rel_orbit, planet_orbiting, epoch2,
-                                      limited_orbit, constraint2);
-            for( j = 0; j < n_constraints; j++)
-               constraint_slope[j][i] =
-                       (constraint2[j] - constraint[j]) / delta_val;
-            if( *limited_orbit == 'R')
-               {
-               const double tconstraint =
-                     r_mult * (dotted_dist( obs + n_obs - 1) - atof( limited_orbit + 2));
-
-               constraint_slope[0][j] = (constraint[0] - tconstraint) / delta_val;
-               }
-            }
-         if( really_use_symmetric_derivatives)
-            {
-            for( j = 0; j < 6; j++)
-               tweaked_orbit[j] = 2. * orbit[j] - tweaked_orbit[j];
-            if( asteroid_mass)
-               *asteroid_mass = 2. * original_asteroid_mass - *asteroid_mass;
-            else
-               for( j = 0; j < n_extra_params; j++)
-                  solar_pressure[j] = 2. * original_solar_pressure[j] -
-                                    solar_pressure[j];
-            sprintf( tstr, "Evaluating %d of %d rev   ", i + 1, n_params);
-            set_locs( tweaked_orbit, epoch, obs, n_obs);
-            }
-         else
-            memcpy( obs, orig_obs, n_obs * sizeof( OBSERVE));
-         slope_ptr = slopes + i;
-         for( j = 0; j < n_obs; j++, slope_ptr += 2 * n_params)
-            if( obs[j].is_included)
-               {
-               double xresidual, yresidual;
-
-               get_residual_data( obs + j, &xresidual, &yresidual);
-
-               slope_ptr[0] -= xresidual;
-               slope_ptr[n_params] -= yresidual;
-//             if( obs[j].note2 != 'R')
-                  {
-                  const double error_squared = slope_ptr[0] * slope_ptr[0]
-                           + slope_ptr[n_params] * slope_ptr[n_params];
-
-                  if( worst_error_squared < error_squared)
-                     worst_error_squared = error_squared;
-                  }
-               slope_ptr[0]        /= delta_val;
-               slope_ptr[n_params] /= delta_val;
-               if( really_use_symmetric_derivatives)      /* delta is actually twice */
-                  {                                /* the 'specified' value:  */
-                  slope_ptr[0]        /= 2.;
-                  slope_ptr[n_params] /= 2.;
-                  }
-               }
-         worst_error_in_sigmas = sqrt( worst_error_squared);
-         if( showing_deltas_in_debug_file)
-            debug_printf( "Iter %d, Change param %d: %f sigmas; delta %.3e (%.3e)\n",
-               n_iterations,
-               i, worst_error_in_sigmas, delta_val, delta_vals[i]);
-                        /* Attempt to keep the error at 1.5 sigmas: */
-         if( worst_error_in_sigmas)
-            {
-//          double rescale = 1.5 / worst_error_in_sigmas;
-            double rescale = 1.0 / worst_error_in_sigmas;
-            const double max_rescale = (n_iterations ? 2. : 10.);
-
-            if( rescale > max_rescale)
-               rescale = max_rescale;
-            else if( rescale < 1. / max_rescale)
-               rescale = 1. / max_rescale;
-            delta_vals[i] *= rescale;
-            }
-         else
-            delta_vals[i] *= 2.;
-         memcpy( solar_pressure, original_solar_pressure,
-                                3 * sizeof( double));
-         if( asteroid_mass)
-            *asteroid_mass = original_asteroid_mass;
-         if( n_iterations++ >= max_iterations)
-            {
-            debug_printf( "Ran over iteration limit! %s\n", obs->packed_id);
-            debug_printf( "Worst err %f sigmas\n", worst_error_in_sigmas);
-            free( xresids);
-            memcpy( orbit, original_orbit, 6 * sizeof( double));
-            memcpy( solar_pressure, original_params, 3 * sizeof( double));
-            runtime_message = NULL;
-            return( -4);
-            }
+         jobs[i].obs = thread_obs + (i % n_threads) * n_obs;
+         jobs[i].context.show_messages = 0;
+         }
+      else
+         {
+         jobs[i].obs = obs;
+         jobs[i].message = tstr;
          }
-         while( worst_error_in_sigmas > max_allowed_error
-                          || worst_error_in_sigmas < .3);
       }
+   err_code = run_partials_jobs( jobs, n_params, n_threads);
+   for( i = 0; i < n_params; i++)
+      perturbers_automatically_found |= jobs[i].context.perturbers_found;
+   if( !err_code && limited_orbit)
+      for( i = 0; i < n_params; i++)
+         {
+         for( j = 0; j < n_constraints; j++)
+            constraint_slope[j][i] = jobs[i].constraint_slope[j];
+         if( *limited_orbit == 'R')
+            constraint_slope[0][n_constraints] = jobs[i].r_constraint_slope;
+         }
+            /* Leave 'obs' as the single-threaded loop would have left it: */
+   if( thread_obs && !orig_obs)
+      memcpy( obs, jobs[n_params - 1].obs, n_obs * sizeof( OBSERVE));
+   free( jobs);
+   if( thread_obs)
+      free( thread_obs);
+   if( stms)
+      free( stms);
    if( orig_obs)
       free( orig_obs);
+   if( err_code)
+      {
+      free( xresids);
+      memcpy( orbit, original_orbit, 6 * sizeof( double));
+      memcpy( solar_pressure, original_params, 3 * sizeof( double));
+      runtime_message = NULL;
+      return( -4);
+      }
 
-   lsquare = lsquare_init( n_params);
+   lsquare = init_lsquare( n_params);
    assert( lsquare);
    if( debug_level > 1)
       debug_printf( "Adding obs to lsquare\n");
-   for( i = 0; i < n_obs; i++)
-      if( obs[i].is_included)
-         {
-         double loc_vals[22], weight = 1.;
-         const double xresid = xresids[i];
-         const double yresid = yresids[i];      /* all in _radians_ */
-         const double resid2 = xresid * xresid + yresid * yresid;
-
-         if( use_blunder_method == 2 && probability_of_blunder)
-            weight = reweight_for_blunders( resid2, weight);
-         if( overobserving_time_span)
-            weight *= reweight_for_overobserving( obs, n_obs, i);
-         FMEMCPY( loc_vals, slopes + i * 2 * n_params,
-                                         2 * n_params * sizeof( double));
-         lsquare_add_observation( lsquare, xresid, weight, loc_vals);
-         lsquare_add_observation( lsquare, yresid, weight, loc_vals + n_params);
-         sigma_squared += weight * weight * (resid2 + 1.);
-         }
+   sigma_squared = add_obs_to_lsquare( lsquare, obs, n_obs, xresids,
+                                 yresids, slopes, n_params);
    i = n_included_observations * 2 - n_params;
    if( i > 0)
       sigma_squared /= (double)i;
@@ -3026,7 +4135,7 @@ int full_improvement( OBSERVE FAR *obs, int n_obs, double *orbit,
          set_locs( orbit, epoch, obs - n_skipped_obs, n_total_obs);
       else
          set_locs( orbit, epoch, obs, n_obs);
-      if( *get_environment_ptr( "HALF_STEPS"))
+      if( get_settings( )->half_steps)
          {
          const double after_rms = compute_rms( obs, n_obs);
 
@@ -3060,6 +4169,235 @@ int full_improvement( OBSERVE FAR *obs, int n_obs, double *orbit,
    return( err_code);
 }
 
+/* full_improvement_multi( ) takes a full step for several objects at once,
+each with its own orbit (a state vector at its own epoch),  plus the mass
+of the asteroid given by 'limited_orbit' as "m=(number)",  shared by all
+of them.  It's the "m=" case of full_improvement( ),  but with many test
+particles all constraining the one mass.
+
+   Each object's residuals and partials are found much as they would be
+by full_improvement( ) for that object alone,  for the six state vector
+components and the mass.  The least-squares problems then share only
+the mass,  and are solved together with lsquare_block_solve( ),  so the
+cost goes up linearly with the number of objects.  To keep things
+simple,  unit vectors are always the identity,  symmetric derivatives are
+always used,  and no covariance file is written;  if 'mass_sigma' isn't
+NULL,  it's set to the formal uncertainty in the mass.
+
+   If 'excluded_asteroids' isn't NULL,  it gives,  for each object,  the
+asteroid that shouldn't perturb it (the object itself,  if it's one of the
+perturbing asteroids),  or zero;  as load_object( ) would have set
+'excluded_asteroid_number' for it.  That's set for each object in turn,
+and restored when we're done.  Each object must have an arc of nonzero
+length,  with at least three included observations.
+
+   The partials for the six state vector components are computed in
+parallel,  as in full_improvement( ).  The partial for the mass changes
+the mass,  which all integrations use,  so that's done separately,  after
+the others are finished.
+
+   Returns zero on success.  On failure,  the orbits and mass are left
+as they were.  */
+
+#define N_MULTI_PARAMS     7
+
+static int add_object_to_multi_fit( void *lsquare, OBSERVE FAR *obs,
+                  int n_obs, const double *orbit, const double epoch,
+                  double *asteroid_mass, double **unit_vectors,
+                  PARTIAL_JOB *jobs, double *step_limits)
+{
+   const int n_params = N_MULTI_PARAMS;
+   const double central_obj_state[6] = { 0., 0., 0., 0., 0., 0. };
+   double orbit2[6], elements_in_array[MONTE_N_ENTRIES];
+   double element_slopes[N_MULTI_PARAMS][MONTE_N_ENTRIES];
+   double delta_vals[N_MULTI_PARAMS];
+   double *xresids, *yresids, *slopes;
+   int i, n_included = 0, n_threads, rval;
+   PARTIALS_SETUP setup, state_setup;
+   OBSERVE *thread_obs = NULL;
+   ELEMENTS elem;
+
+               /* Drop unincluded observations from the ends of the arc: */
+   while( n_obs && !obs->is_included)
+      {
+      obs++;
+      n_obs--;
+      }
+   while( n_obs && !obs[n_obs - 1].is_included)
+      n_obs--;
+   for( i = 0; i < n_obs; i++)
+      if( obs[i].is_included)
+         n_included++;
+   if( n_included < 3 || obs[n_obs - 1].jd == obs->jd)
+      return( -3);
+   if( set_locs_extended( NULL, orbit, epoch, obs, n_obs, epoch, orbit2, NULL))
+      return( -4);
+   elem.gm = get_planet_mass( 0);
+   calc_classical_elements( &elem, orbit2, epoch, 1);
+   put_orbital_elements_in_array_form( &elem, elements_in_array);
+   xresids = (double *)calloc( (2 + 2 * n_params) * n_obs, sizeof( double));
+   assert( xresids);
+   yresids = xresids + n_obs;
+   slopes = yresids + n_obs;
+   for( i = 0; i < n_obs; i++)
+      get_residual_data( obs + i, xresids + i, yresids + i);
+   memcpy( delta_vals, default_delta_vals, n_params * sizeof( double));
+   memset( &setup, 0, sizeof( PARTIALS_SETUP));
+   setup.orbit = orbit;
+   setup.central_obj_state = central_obj_state;
+   setup.elements_in_array = elements_in_array;
+   setup.unit_vectors = unit_vectors;
+   setup.delta_vals = delta_vals;
+   setup.asteroid_mass = asteroid_mass;
+   setup.epoch = setup.epoch2 = epoch;
+   setup.integration_length = fabs( epoch - obs[n_obs - 1].jd);
+   if( setup.integration_length < fabs( epoch - obs->jd))
+      setup.integration_length = fabs( epoch - obs->jd);
+   setup.max_allowed_error = maximum_deltas( n_obs, obs);
+   setup.n_params = n_params;
+   setup.n_obs = n_obs;
+   setup.showing_deltas_in_debug_file = get_settings( )->debug_deltas;
+   state_setup = setup;             /* state vector partials leave */
+   state_setup.asteroid_mass = NULL;      /* the mass alone */
+   n_threads = get_n_partials_threads( 6);
+   if( n_threads > 1)
+      {
+      thread_obs = (OBSERVE *)calloc( n_threads * n_obs, sizeof( OBSERVE));
+      assert( thread_obs);
+      for( i = 0; i < n_threads; i++)
+         memcpy( thread_obs + i * n_obs, obs, n_obs * sizeof( OBSERVE));
+      }
+   for( i = 0; i < n_params; i++)
+      {
+      jobs[i].setup = (i < 6 ? &state_setup : &setup);
+      init_integration_context( &jobs[i].context);
+      jobs[i].slopes = slopes;
+      jobs[i].element_slopes = element_slopes[i];
+      jobs[i].param = i;
+      if( thread_obs && i < 6)
+         {
+         jobs[i].obs = thread_obs + (i % n_threads) * n_obs;
+         jobs[i].context.show_messages = 0;
+         }
+      else
+         {
+         jobs[i].obs = obs;
+         jobs[i].message = runtime_message;
+         }
+      }
+   rval = run_partials_jobs( jobs, 6, n_threads);
+   if( !rval)
+      rval = run_partials_jobs( jobs + 6, 1, 1);
+   for( i = 0; i < n_params; i++)
+      perturbers_automatically_found |= jobs[i].context.perturbers_found;
+   if( thread_obs)
+      free( thread_obs);
+   if( !rval)
+      add_obs_to_lsquare( lsquare, obs, n_obs, xresids, yresids,
+                                                slopes, n_params);
+   free( xresids);
+            /* Limits on the step in position and velocity,  as */
+            /* full_improvement( ) sets them (the arc is of     */
+            /* nonzero length;  see above) :                    */
+   step_limits[0] = obs->r * .7;
+   step_limits[1] = step_limits[0] / ((obs[n_obs - 1].jd - obs->jd) * .5);
+   return( rval);
+}
+
+int full_improvement_multi( const int n_objects, OBSERVE FAR **obs,
+                 const int *n_obs, double **orbits, const double *epochs,
+                 const int *excluded_asteroids, const char *limited_orbit,
+                 double *mass_sigma)
+{
+   extern int excluded_asteroid_number;
+   const int saved_excluded_asteroid = excluded_asteroid_number;
+   double *asteroid_mass = ((limited_orbit && *limited_orbit == 'm') ?
+               get_asteroid_mass( atoi( limited_orbit + 2)) : NULL);
+   void **lsquares;
+   double **unit_vectors, *differences, *step_limits;
+   double original_mass, mass_variance = 0., scale_factor = 1.;
+   int i, j, k, err_code = 0;
+   char tstr[80];
+   PARTIAL_JOB *jobs;
+
+   if( !asteroid_mass || n_objects < 1)
+      return( -1);
+   perturbers |= (1 << IDX_ASTEROIDS);
+   original_mass = *asteroid_mass;
+   lsquares = (void **)calloc( n_objects, sizeof( void *));
+   differences = (double *)calloc( n_objects * 8 + 1, sizeof( double));
+   jobs = (PARTIAL_JOB *)calloc( N_MULTI_PARAMS, sizeof( PARTIAL_JOB));
+   unit_vectors = (double **)calloc_double_dimension_array(
+                     N_MULTI_PARAMS, N_MULTI_PARAMS, sizeof( double));
+   assert( lsquares && differences && jobs && unit_vectors);
+   step_limits = differences + n_objects * 6 + 1;
+   for( i = 0; i < N_MULTI_PARAMS; i++)
+      unit_vectors[i][i] = 1.;
+   runtime_message = tstr;
+   for( k = 0; !err_code && k < n_objects; k++)
+      {
+      sprintf( tstr, "Object %d of %d   ", k + 1, n_objects);
+      if( excluded_asteroids)
+         excluded_asteroid_number = excluded_asteroids[k];
+      lsquares[k] = init_lsquare( N_MULTI_PARAMS);
+      assert( lsquares[k]);
+      err_code = add_object_to_multi_fit( lsquares[k], obs[k], n_obs[k],
+                  orbits[k], epochs[k], asteroid_mass, unit_vectors,
+                  jobs, step_limits + k * 2);
+      }
+   if( !err_code)
+      err_code = lsquare_block_solve( lsquares, n_objects, 1, differences,
+                                       &mass_variance);
+   for( k = 0; !err_code && k < n_objects; k++)
+      for( j = 0; j < 6; j++)
+         {
+         const double ratio = fabs( differences[k * 6 + j]
+                                    / step_limits[k * 2 + j / 3]);
+
+         if( ratio > scale_factor)
+            scale_factor = ratio;
+         }
+            /* Make sure none of the new orbits "blew up" before */
+            /* changing anything:                                */
+   for( k = 0; !err_code && k < n_objects; k++)
+      {
+      double new_orbit[6];
+
+      for( j = 0; j < 6; j++)
+         new_orbit[j] = orbits[k][j] + differences[k * 6 + j] / scale_factor;
+      err_code = is_unreasonable_orbit( new_orbit);
+      }
+   if( !err_code)
+      {
+      for( k = 0; k < n_objects; k++)
+         for( j = 0; j < 6; j++)
+            orbits[k][j] += differences[k * 6 + j] / scale_factor;
+      *asteroid_mass += differences[n_objects * 6] / scale_factor;
+      if( mass_sigma)
+         *mass_sigma = (mass_variance > 0. ? sqrt( mass_variance) : 0.);
+      }
+   else
+      {
+      debug_printf( "Failed multi-object step: %d\n", err_code);
+      *asteroid_mass = original_mass;
+      }
+   for( k = 0; k < n_objects; k++)
+      {
+      if( lsquares[k])
+         lsquare_free( lsquares[k]);
+      if( excluded_asteroids)
+         excluded_asteroid_number = excluded_asteroids[k];
+      set_locs( orbits[k], epochs[k], obs[k], n_obs[k]);
+      }
+   excluded_asteroid_number = saved_excluded_asteroid;
+   free( lsquares);
+   free( differences);
+   free( jobs);
+   free( unit_vectors);
+   runtime_message = NULL;
+   return( err_code);
+}
+
 static inline double dot_product( const double *a, const double *b)
 {
    return( a[0] * b[0] + a[1] * b[1] + a[2] * b[2]);
@@ -3578,7 +4916,8 @@ double initial_orbit( OBSERVE FAR *obs, int n_obs, double *orbit)
       return( 0.);
    writing_sr_elems = false;
    if( max_time)
-      integration_timeout = clock( ) + (clock_t)( max_time * CLOCKS_PER_SEC);
+      integration_timeout = monotonic_nanoseconds( )
+                                    + (int64_t)( max_time * 1e+9);
    if( obs[n_obs - 1].jd - obs[0].jd < MAX_SR_SPAN)
       n_sr_orbits = get_sr_orbits( sr_orbits, obs, n_obs, 0, max_n_sr_orbits, .5, 0.);
    else
@@ -0,0 +1,161 @@
+/* pl_bm.cpp: benchmark for the planet position caches
+
+Copyright (C) 2010, Project Pluto
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+02110-1301, USA.    */
+
+/* Requests all the planets and the moon at the times an RKF integration
+would (seven stages per step),  first getting them one at a time with
+planet_posn( ) as the force model used to,  then all at once from
+planet_posns( ).  Each is done twice:  once with an empty cache,  then
+again at the same times,  as happens when an orbit is re-integrated in
+each least-squares iteration.  As a check,  the difference between the
+sums of all positions found by the two methods is shown;  it should be
+zero,  or nearly so.
+
+   Usage is
+
+pl_bm (-n steps) (-s stepsize) (-t jd)
+
+   Defaults are 100000 two-day steps from J2000.  Build with
+'make pl_bm'.  */
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include "watdefs.h"
+#include "pl_cache.h"
+
+extern int debug_level;
+
+int debug_level = 0;
+
+int earth_lunar_posn( const double jd, double FAR *earth_loc,
+                              double FAR *lunar_loc);   /* mpc_obs.cpp */
+int inquire( const char *prompt, char *buff, const int max_len,
+                     const int color);          /* pl_bm.cpp */
+void refresh_console( void);                    /* pl_bm.cpp */
+void move_add_nstr( const int col, const int row, const char *msg,
+                     const int n_bytes);        /* pl_bm.cpp */
+
+int inquire( const char *prompt, char *buff, const int max_len,
+                     const int color)
+{
+   printf( "%s\n", prompt);
+   return( 0);
+}
+
+void refresh_console( void)
+{
+}
+
+void move_add_nstr( const int col, const int row, const char *msg, const int n_bytes)
+{
+}
+
+#define N_STAGES 7
+
+static const double stages[N_STAGES] = { 0., 2. / 9., 1. / 3., .75, 1.,
+                                          5. / 6., 1. };
+
+static double one_at_a_time( const double jd0, const double step,
+                  const long n_steps, double *checksum)
+{
+   const clock_t t_start = clock( );
+   long i;
+   int j, planet;
+
+   for( i = 0; i < n_steps; i++)
+      for( j = 0; j < N_STAGES; j++)
+         {
+         const double jd = jd0 + ((double)i + stages[j]) * step;
+         double earth_loc[3], lunar_loc[3], loc[3];
+
+         earth_lunar_posn( jd, earth_loc, lunar_loc);
+         *checksum += earth_loc[0] + lunar_loc[0];
+         for( planet = 1; planet < 10; planet++)
+            if( planet != 3)
+               {
+               planet_posn( planet, jd, loc);
+               *checksum += loc[0];
+               }
+         }
+   return( (double)( clock( ) - t_start) / (double)CLOCKS_PER_SEC);
+}
+
+static double all_at_once( const double jd0, const double step,
+                  const long n_steps, double *checksum)
+{
+   const clock_t t_start = clock( );
+   const double earth_moon_barycenter_factor = 82.300679;
+   long i;
+   int j, planet;
+
+   for( i = 0; i < n_steps; i++)
+      for( j = 0; j < N_STAGES; j++)
+         {
+         const double jd = jd0 + ((double)i + stages[j]) * step;
+         double locs[33], earth_x;
+
+         planet_posns( 0x7fe, jd, locs);
+         earth_x = locs[9] - locs[30] / earth_moon_barycenter_factor;
+         *checksum += earth_x + earth_x + locs[30];
+         for( planet = 1; planet < 10; planet++)
+            if( planet != 3)
+               *checksum += locs[planet * 3];
+         }
+   return( (double)( clock( ) - t_start) / (double)CLOCKS_PER_SEC);
+}
+
+int main( const int argc, const char **argv)
+{
+   long n_steps = 100000;
+   double step = 2., jd0 = 2451545.0;
+   double checksum1 = 0., checksum2 = 0., t_cold, t_warm;
+   int i;
+
+   for( i = 1; i < argc - 1; i++)
+      if( argv[i][0] == '-')
+         switch( argv[i][1])
+            {
+            case 'n':
+               n_steps = atol( argv[++i]);
+               break;
+            case 's':
+               step = atof( argv[++i]);
+               break;
+            case 't':
+               jd0 = atof( argv[++i]);
+               break;
+            default:
+               printf( "Unrecognized option '%s'\n", argv[i]);
+               return( -1);
+            }
+   printf( "%ld steps of %.3f days;  %ld times\n", n_steps, step,
+                                 n_steps * N_STAGES);
+   printf( "Method          cold (s)  warm (s)\n");
+   t_cold = one_at_a_time( jd0, step, n_steps, &checksum1);
+   t_warm = one_at_a_time( jd0, step, n_steps, &checksum1);
+   printf( "planet_posn( )  %8.3f  %8.3f\n", t_cold, t_warm);
+   planet_posn( -1, 0., NULL);      /* empty the caches */
+   t_cold = all_at_once( jd0, step, n_steps, &checksum2);
+   t_warm = all_at_once( jd0, step, n_steps, &checksum2);
+   printf( "planet_posns( ) %8.3f  %8.3f\n", t_cold, t_warm);
+   printf( "Checksum difference %.3e AU\n", checksum1 - checksum2);
+   return( 0);
+}
@@ -36,6 +36,16 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
 #include "lunar.h"
 #include "afuncs.h"
 #include "jpleph.h"
+#include "threads.h"
+
+#if defined( __linux) || defined( __unix__) || defined( __APPLE__)
+   #define JPL_MMAP
+   #include <sys/mman.h>
+   #include <sys/stat.h>
+   #include <sys/file.h>
+   #include <fcntl.h>
+   #include <unistd.h>
+#endif
 
 const char *get_environment_ptr( const char *env_ptr);     /* mpc_obs.cpp */
 int debug_printf( const char *format, ...);                /* runge.cpp */
@@ -57,14 +67,510 @@ int asteroid_position_raw( const int astnum, const double jd,
 int64_t nanoseconds_since_1970( void);                      /* mpc_obs.c */
 int format_jpl_ephemeris_info( char *buff);                 /* pl_cache.c */
 
+/* The JPL ephemeris,  if any,  is shared by planet_posn_raw( ) and
+planet_posns( ) (below).  */
+
+static const char *jpl_filename = NULL;
+static void *jpl_eph = NULL;
+
+/* On *nix boxes,  the JPL DE file is also mapped into memory read-only,
+and positions are evaluated from the Chebyshev coefficients right in the
+mapping (unless JPL_MMAP=0 in 'environ.dat').  The stdio-based reader in
+the JPL library keeps the current record,  file pointer and so on in the
+'jpl_eph' structure,  so only one thread can use it at a time.  The mapped
+reader has no state that changes after it's set up,  so any number of
+threads can use it at once;  and threads and forked 'fo' processes all
+share the one copy of the file in the page cache.
+
+   The DE binary format is that described in 'jpleph.cpp' :  the first
+record gives the time span and step,  the number of constants,  the AU in
+km,  and (in 'ipt') where each body's coefficients are in a data record
+and how many coefficients and sub-intervals there are.  The second record
+holds the constants,  and data records follow,  each starting with the
+JDs it covers.  Positions are barycentric,  equatorial J2000,  in km,
+except for the moon,  which is geocentric.  The file may be in either
+byte order.  */
+
+#define MAPPED_EPHEM struct mapped_ephem
+
+MAPPED_EPHEM
+   {
+   const char *data;             /* NULL if no file is mapped */
+   const char *records;          /* start of first data record */
+   size_t n_bytes, record_size;
+   long n_records;
+   double start_jd, end_jd, step, au_in_km;
+   int ipt[11][3];               /* Mercury...Pluto,  moon,  sun */
+   int de_version;
+   bool swap_bytes;
+   };
+
+static MAPPED_EPHEM mapped_ephem;
+
+static double mapped_double( const char *ptr, const bool swap_bytes)
+{
+   double rval;
+
+   if( swap_bytes)
+      {
+      char tbuff[8];
+      int i;
+
+      for( i = 0; i < 8; i++)
+         tbuff[i] = ptr[7 - i];
+      memcpy( &rval, tbuff, 8);
+      }
+   else
+      memcpy( &rval, ptr, 8);
+   return( rval);
+}
+
+static int32_t mapped_int32( const char *ptr, const bool swap_bytes)
+{
+   int32_t rval;
+
+   if( swap_bytes)
+      {
+      char tbuff[4];
+      int i;
+
+      for( i = 0; i < 4; i++)
+         tbuff[i] = ptr[3 - i];
+      memcpy( &rval, tbuff, 4);
+      }
+   else
+      memcpy( &rval, ptr, 4);
+   return( rval);
+}
+
+#define DE_HEADER_SS_OFFSET      2652
+#define DE_HEADER_AU_OFFSET      2680
+#define DE_HEADER_IPT_OFFSET     2696
+#define DE_HEADER_NUMDE_OFFSET   2840
+#define DE_HEADER_LPT_OFFSET     2844
+#define DE_MAX_COEFFS            40
+
+static void unmap_jpl_ephemeris( MAPPED_EPHEM *eph)
+{
+#ifdef JPL_MMAP
+   if( eph->data)
+      munmap( (void *)eph->data, eph->n_bytes);
+#endif
+   memset( eph, 0, sizeof( MAPPED_EPHEM));
+}
+
+/* Sets up 'mapped_eph'.  The record size follows from the 'ipt' table,
+as in 'jpleph.cpp';  but some ephemerides (DE-430t and later) carry more
+in each record than that accounts for.  So we check it against the data
+records,  which should start at start_jd and step by 'step',  and if need
+be,  look for the size that makes that so.   */
+
+static int map_jpl_ephemeris( const char *filename, MAPPED_EPHEM *mapped_eph)
+{
+#ifdef JPL_MMAP
+   MAPPED_EPHEM eph;
+   struct stat file_info;
+   const char *hdr;
+   int fd, i, j;
+   long n_coeffs, max_coeffs;
+   void *addr;
+
+   fd = open( filename, O_RDONLY);
+   if( fd < 0)
+      return( -1);
+   if( fstat( fd, &file_info) || file_info.st_size < 3000)
+      {
+      close( fd);
+      return( -2);
+      }
+   addr = mmap( NULL, (size_t)file_info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+   close( fd);             /* the mapping stays valid */
+   if( addr == MAP_FAILED)
+      return( -3);
+   memset( &eph, 0, sizeof( MAPPED_EPHEM));
+   eph.data = hdr = (const char *)addr;
+   eph.n_bytes = (size_t)file_info.st_size;
+   i = mapped_int32( hdr + DE_HEADER_NUMDE_OFFSET, false);
+   eph.swap_bytes = (i < 0 || i > 65536);
+   eph.de_version = mapped_int32( hdr + DE_HEADER_NUMDE_OFFSET, eph.swap_bytes);
+   eph.start_jd = mapped_double( hdr + DE_HEADER_SS_OFFSET, eph.swap_bytes);
+   eph.end_jd = mapped_double( hdr + DE_HEADER_SS_OFFSET + 8, eph.swap_bytes);
+   eph.step = mapped_double( hdr + DE_HEADER_SS_OFFSET + 16, eph.swap_bytes);
+   eph.au_in_km = mapped_double( hdr + DE_HEADER_AU_OFFSET, eph.swap_bytes);
+   n_coeffs = 2;        /* each record starts with the JDs it covers */
+   for( i = 0; i < 12; i++)
+      {
+      int ipt[3];
+
+      for( j = 0; j < 3; j++)
+         ipt[j] = mapped_int32( hdr + DE_HEADER_IPT_OFFSET + (i * 3 + j) * 4,
+                                 eph.swap_bytes);
+      if( i < 11)
+         memcpy( eph.ipt[i], ipt, 3 * sizeof( int));
+      n_coeffs += ipt[1] * ipt[2] * (i == 11 ? 2 : 3);   /* nutations: 2 */
+      }
+   n_coeffs += mapped_int32( hdr + DE_HEADER_LPT_OFFSET + 4, eph.swap_bytes)
+            *  mapped_int32( hdr + DE_HEADER_LPT_OFFSET + 8, eph.swap_bytes) * 3;
+   for( i = 0; i < 11; i++)
+      if( eph.ipt[i][1] < 1 || eph.ipt[i][1] > DE_MAX_COEFFS
+                            || eph.ipt[i][2] < 1)
+         eph.step = 0.;     /* flag as bad */
+   if( eph.step <= 0. || eph.end_jd <= eph.start_jd || eph.au_in_km <= 0.)
+      {
+      munmap( addr, eph.n_bytes);
+      return( -4);
+      }
+   max_coeffs = (long)( eph.n_bytes / 32);   /* need at least four records */
+   while( n_coeffs < max_coeffs && (mapped_double( hdr + n_coeffs * 16,
+                              eph.swap_bytes) != eph.start_jd
+               || mapped_double( hdr + n_coeffs * 24, eph.swap_bytes)
+                              != eph.start_jd + eph.step))
+      n_coeffs++;
+   if( n_coeffs >= max_coeffs)
+      {
+      munmap( addr, eph.n_bytes);
+      return( -5);
+      }
+   eph.record_size = (size_t)n_coeffs * 8;
+   eph.n_records = (long)( eph.n_bytes / eph.record_size) - 2;
+   eph.records = eph.data + 2 * eph.record_size;
+   *mapped_eph = eph;
+   if( debug_level)
+      debug_printf( "Mapped %s: %ld records of %ld coeffs\n", filename,
+                  eph.n_records, n_coeffs);
+   return( 0);
+#else
+   return( -1);
+#endif
+}
+
+/* Evaluates body 'body' (0-10 in JPL's order:  Mercury,  Venus,  EMB,
+Mars,  ... Pluto,  geocentric moon,  sun) at 'jd',  in AU and AU/day,
+equatorial J2000,  relative to the solar system barycenter (except for the
+moon).  'vel' can be NULL.  Touches nothing but the mapping and the
+output arrays,  so it's safe to call from any number of threads.  */
+
+static int mapped_body_state( const int body, const double jd,
+                              double *posn, double *vel)
+{
+   const MAPPED_EPHEM *eph = &mapped_ephem;
+   const int n_coeffs = eph->ipt[body][1], n_sub = eph->ipt[body][2];
+   double t, tc, cheby[DE_MAX_COEFFS], dcheby[DE_MAX_COEFFS];
+   long record = (long)floor( (jd - eph->start_jd) / eph->step);
+   const char *rec_ptr, *coeff_ptr;
+   int sub, i, j;
+
+   if( jd < eph->start_jd || jd > eph->end_jd || !n_coeffs)
+      return( -1);         /* outside time span,  or body not in file */
+   if( record >= eph->n_records)      /* jd == end_jd */
+      record = eph->n_records - 1;
+   rec_ptr = eph->records + record * eph->record_size;
+   t = (jd - mapped_double( rec_ptr, eph->swap_bytes)) / eph->step;
+   sub = (int)( t * (double)n_sub);
+   if( sub >= n_sub)
+      sub = n_sub - 1;
+   if( sub < 0)
+      sub = 0;
+   tc = 2. * (t * (double)n_sub - (double)sub) - 1.;
+   cheby[0] = 1.;
+   cheby[1] = tc;
+   dcheby[0] = 0.;
+   dcheby[1] = 1.;
+   for( i = 2; i < n_coeffs; i++)
+      {
+      cheby[i] = 2. * tc * cheby[i - 1] - cheby[i - 2];
+      dcheby[i] = 2. * tc * dcheby[i - 1] + 2. * cheby[i - 1] - dcheby[i - 2];
+      }
+   coeff_ptr = rec_ptr + 8 * ((eph->ipt[body][0] - 1) + sub * n_coeffs * 3);
+   for( i = 0; i < 3; i++)
+      {
+      double sum = 0., dsum = 0.;
+
+      for( j = n_coeffs - 1; j >= 0; j--)
+         {
+         const double coeff = mapped_double( coeff_ptr
+                        + 8 * (i * n_coeffs + j), eph->swap_bytes);
+
+         sum += coeff * cheby[j];
+         dsum += coeff * dcheby[j];
+         }
+      posn[i] = sum / eph->au_in_km;
+      if( vel)
+         vel[i] = dsum * 2. * (double)n_sub / (eph->step * eph->au_in_km);
+      }
+   return( 0);
+}
+
+/* Fills 'state' with the position (and,  if calc_vel is set,  velocity)
+of planet_no as planet_posn_raw( ) numbers them:  1-9 for Mercury-Pluto
+(3 being the Earth-Moon barycenter) relative to the sun,  or 10 for the
+geocentric moon.  Equatorial J2000,  AU and AU/day.  */
+
+static int mapped_planet_state( const int planet_no, const double jd,
+                                 double *state, const int calc_vel)
+{
+   double sun[6];
+   int i;
+
+   assert( planet_no >= 1 && planet_no <= 10);
+   if( mapped_body_state( planet_no - 1, jd, state,
+                           calc_vel ? state + 3 : NULL))
+      return( -1);
+   if( planet_no < 10)
+      {
+      mapped_body_state( 10, jd, sun, calc_vel ? sun + 3 : NULL);
+      for( i = 0; i < (calc_vel ? 6 : 3); i++)
+         state[i] -= sun[i];
+      }
+   return( 0);
+}
+
+/* A full DE file covers centuries,  and opening it means reading its
+header (and,  on first use,  pulling records in from disk) before
+anything else happens.  For 'fo_serve.cgi' and small batch runs,  that
+can take longer than the actual work.  So 'de_sub' (see 'de_sub.cpp')
+can extract just the records covering a given span of JDs,  and just the
+bodies wanted,  into an 'ephemeris subset' file.  If EPHEM_SUBSET in
+'environ.dat' names such a file,  it's mapped in place of the DE file,
+and the DE file is only opened if we need a position the subset lacks.
+
+   The subset file is a short header (below),  followed by the DE data
+records for the span,  each still starting with the two JDs it covers,
+but with the coefficients for bodies left out removed.  In the header's
+'ipt' table,  omitted bodies have zero coefficients.  Everything is in
+the byte order of the machine that made the file;  the magic string and
+'byte_order' value let us reject a file made on a machine with the other
+byte order.  */
+
+#define EPHEM_SUBSET_HEADER struct ephem_subset_header
+
+EPHEM_SUBSET_HEADER
+   {
+   char magic[8];
+   int32_t byte_order, de_version;
+   int32_t n_records, n_coeffs;        /* n_coeffs per record */
+   int32_t ipt[11][3];
+   int32_t reserved;
+   double start_jd, end_jd, step, au_in_km;
+   };
+
+#define EPHEM_SUBSET_MAGIC       "FO_sub1"
+#define EPHEM_SUBSET_BYTE_ORDER  0x01020304
+
+static int map_ephemeris_subset( const char *filename, MAPPED_EPHEM *mapped_eph)
+{
+#ifdef JPL_MMAP
+   EPHEM_SUBSET_HEADER hdr;
+   MAPPED_EPHEM eph;
+   struct stat file_info;
+   void *addr;
+   int fd, i;
+
+   fd = open( filename, O_RDONLY);
+   if( fd < 0)
+      return( -1);
+   if( fstat( fd, &file_info)
+            || (size_t)file_info.st_size < sizeof( EPHEM_SUBSET_HEADER))
+      {
+      close( fd);
+      return( -2);
+      }
+   addr = mmap( NULL, (size_t)file_info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+   close( fd);
+   if( addr == MAP_FAILED)
+      return( -3);
+   memcpy( &hdr, addr, sizeof( EPHEM_SUBSET_HEADER));
+   memset( &eph, 0, sizeof( MAPPED_EPHEM));
+   eph.data = (const char *)addr;
+   eph.n_bytes = (size_t)file_info.st_size;
+   eph.records = eph.data + sizeof( EPHEM_SUBSET_HEADER);
+   eph.record_size = (size_t)hdr.n_coeffs * 8;
+   eph.n_records = hdr.n_records;
+   eph.start_jd = hdr.start_jd;
+   eph.end_jd = hdr.end_jd;
+   eph.step = hdr.step;
+   eph.au_in_km = hdr.au_in_km;
+   eph.de_version = hdr.de_version;
+   memcpy( eph.ipt, hdr.ipt, sizeof( eph.ipt));
+   for( i = 0; i < 11; i++)
+      if( eph.ipt[i][1] < 0 || eph.ipt[i][1] > DE_MAX_COEFFS
+               || (eph.ipt[i][1] && (eph.ipt[i][2] < 1 || eph.ipt[i][0] < 3
+               || eph.ipt[i][0] - 1 + eph.ipt[i][1] * eph.ipt[i][2] * 3
+                                    > hdr.n_coeffs)))
+         eph.step = 0.;     /* flag as bad */
+   if( memcmp( hdr.magic, EPHEM_SUBSET_MAGIC, 8)
+            || hdr.byte_order != EPHEM_SUBSET_BYTE_ORDER
+            || hdr.n_records < 1 || hdr.n_coeffs < 3
+            || eph.step <= 0. || eph.end_jd <= eph.start_jd
+            || eph.records + eph.n_records * eph.record_size
+                                    > eph.data + eph.n_bytes)
+      {
+      munmap( addr, eph.n_bytes);
+      return( -4);
+      }
+   *mapped_eph = eph;
+   if( debug_level)
+      debug_printf( "Mapped subset %s: DE-%d,  JD %.1f to %.1f\n", filename,
+                  eph.de_version, eph.start_jd, eph.end_jd);
+   return( 0);
+#else
+   return( -1);
+#endif
+}
+
+/* Writes records of the DE file 'de_filename' covering jd_start to jd_end
+to the subset file 'subset_filename'.  'body_mask' has bit n set for
+each planet n (numbered as for planet_posn( ):  1-9 for Mercury-Pluto,
+3 being the Earth-Moon barycenter,  10 for the geocentric moon) to be
+included.  The sun is always included,  since the planets are found
+relative to it.  Returns the number of records written,  or a negative
+value on error.  */
+
+long extract_ephemeris_subset( const char *de_filename,
+            const char *subset_filename, const double jd_start,
+            const double jd_end, const unsigned body_mask)
+{
+   MAPPED_EPHEM eph;
+   EPHEM_SUBSET_HEADER hdr;
+   FILE *ofile;
+   double *record;
+   long first, last, rec;
+   int i, j, n_coeffs = 2;
+
+   if( map_jpl_ephemeris( de_filename, &eph))
+      return( -1);
+   first = (long)floor( (jd_start - eph.start_jd) / eph.step);
+   last = (long)floor( (jd_end - eph.start_jd) / eph.step);
+   if( first < 0)
+      first = 0;
+   if( last >= eph.n_records)
+      last = eph.n_records - 1;
+   if( first > last)
+      {
+      unmap_jpl_ephemeris( &eph);
+      return( -2);
+      }
+   memset( &hdr, 0, sizeof( EPHEM_SUBSET_HEADER));
+   memcpy( hdr.magic, EPHEM_SUBSET_MAGIC, 8);
+   hdr.byte_order = EPHEM_SUBSET_BYTE_ORDER;
+   hdr.de_version = eph.de_version;
+   hdr.n_records = (int32_t)( last - first + 1);
+   hdr.start_jd = eph.start_jd + (double)first * eph.step;
+   hdr.end_jd = eph.start_jd + (double)( last + 1) * eph.step;
+   if( hdr.end_jd > eph.end_jd)
+      hdr.end_jd = eph.end_jd;
+   hdr.step = eph.step;
+   hdr.au_in_km = eph.au_in_km;
+   for( i = 0; i < 11; i++)
+      if( i == 10 || ((body_mask >> (i + 1)) & 1))
+         {
+         hdr.ipt[i][0] = n_coeffs + 1;          /* one-based,  as in DE */
+         hdr.ipt[i][1] = eph.ipt[i][1];
+         hdr.ipt[i][2] = eph.ipt[i][2];
+         n_coeffs += eph.ipt[i][1] * eph.ipt[i][2] * 3;
+         }
+   hdr.n_coeffs = n_coeffs;
+   ofile = fopen( subset_filename, "wb");
+   if( !ofile)
+      {
+      unmap_jpl_ephemeris( &eph);
+      return( -3);
+      }
+   fwrite( &hdr, sizeof( EPHEM_SUBSET_HEADER), 1, ofile);
+   record = (double *)malloc( n_coeffs * sizeof( double));
+   assert( record);
+   for( rec = first; rec <= last; rec++)
+      {
+      const char *iptr = eph.records + rec * eph.record_size;
+
+      record[0] = mapped_double( iptr, eph.swap_bytes);
+      record[1] = mapped_double( iptr + 8, eph.swap_bytes);
+      for( i = 0; i < 11; i++)
+         if( hdr.ipt[i][1])
+            for( j = 0; j < hdr.ipt[i][1] * hdr.ipt[i][2] * 3; j++)
+               record[hdr.ipt[i][0] - 1 + j] = mapped_double(
+                        iptr + 8 * (eph.ipt[i][0] - 1 + j), eph.swap_bytes);
+      fwrite( record, sizeof( double), n_coeffs, ofile);
+      }
+   free( record);
+   unmap_jpl_ephemeris( &eph);
+   if( fclose( ofile))
+      return( -4);
+   return( last - first + 1);
+}
+
+/* With a subset mapped,  we don't open the DE file unless asked for a
+position the subset can't supply.  'full_de_tried' records that we have
+(whether or not it worked),  so we don't keep trying.  */
+
+static bool using_subset = false, full_de_tried = false;
+
+static void load_full_jpl_ephemeris( void)
+{
+   FILE *ifile;
+   const bool map_it = !using_subset
+                        && atoi( get_environment_ptr( "JPL_MMAP"));
+
+   full_de_tried = true;
+   if( *jpl_filename)
+      {
+      jpl_eph = jpl_init_ephemeris( jpl_filename, NULL, NULL);
+      if( jpl_eph && map_it)
+         map_jpl_ephemeris( jpl_filename, &mapped_ephem);
+      }
+   if( !jpl_eph)
+      if( (ifile = fopen_ext( "jpl_eph.txt", "fcrb")) != NULL)
+         {
+         char buff[100];
+
+         while( !jpl_eph && fgets_trimmed( buff, sizeof( buff), ifile))
+            if( *buff && *buff != ';')
+               jpl_eph = jpl_init_ephemeris( buff, NULL, NULL);
+         if( debug_level)
+            debug_printf( "Ephemeris file %s\n", buff);
+         if( jpl_eph && map_it)
+            map_jpl_ephemeris( buff, &mapped_ephem);
+         fclose( ifile);
+         }
+   if( debug_level && jpl_eph)
+      {
+      debug_printf( "\nEphemeris time span years %.3f to %.3f\n",
+            (jpl_get_double( jpl_eph, JPL_EPHEM_START_JD) - J0) / 365.25,
+            (jpl_get_double( jpl_eph, JPL_EPHEM_END_JD)   - J0) / 365.25);
+      debug_printf( "Ephemeris version %d\n", jpl_get_long( jpl_eph, JPL_EPHEM_EPHEMERIS_VERSION));
+      debug_printf( "Kernel size %d, record size %d, swap_bytes %d\n",
+            jpl_get_long( jpl_eph, JPL_EPHEM_KERNEL_SIZE),
+            jpl_get_long( jpl_eph, JPL_EPHEM_KERNEL_RECORD_SIZE),
+            jpl_get_long( jpl_eph, JPL_EPHEM_KERNEL_SWAP_BYTES));
+      debug_printf( "ncon = %d AU=%f emrat = %f\n",
+            jpl_get_long( jpl_eph, JPL_EPHEM_N_CONSTANTS),
+            jpl_get_double( jpl_eph, JPL_EPHEM_AU_IN_KM),
+            jpl_get_double( jpl_eph, JPL_EPHEM_EARTH_MOON_RATIO));
+      }
+}
+
+static void load_jpl_ephemeris( void)
+{
+   const char *subset_filename = get_environment_ptr( "EPHEM_SUBSET");
+
+#if defined (_WIN32) || defined( __WATCOMC__)
+   jpl_filename = get_environment_ptr( "JPL_FILENAME");
+#else
+   jpl_filename = get_environment_ptr( "LINUX_JPL_FILENAME");
+#endif
+   if( *subset_filename
+            && !map_ephemeris_subset( subset_filename, &mapped_ephem))
+      using_subset = true;
+   else
+      load_full_jpl_ephemeris( );
+}
+
 static int planet_posn_raw( int planet_no, const double jd,
                             double *vect_2000)
 {
    static void *ps_1996_data[10];
    const int jpl_center = 11;         /* default to heliocentric */
    int i, rval = 0;
-   static const char *jpl_filename = NULL;
-   static void *jpl_eph = NULL;
    const int bc405_start = 100;
    const int calc_vel = (planet_no & PLANET_POSN_VELOCITY_FLAG) ? 1 : 0;
 
@@ -78,6 +584,12 @@ static int planet_posn_raw( int planet_no, const double jd,
          vect_2000[1] = jpl_get_double( jpl_eph, JPL_EPHEM_START_JD);
          vect_2000[2] = jpl_get_double( jpl_eph, JPL_EPHEM_END_JD);
          }
+      else if( !jd && using_subset)
+         {
+         vect_2000[0] = (double)mapped_ephem.de_version;
+         vect_2000[1] = mapped_ephem.start_jd;
+         vect_2000[2] = mapped_ephem.end_jd;
+         }
       return( 0);
       }
 
@@ -94,62 +606,35 @@ static int planet_posn_raw( int planet_no, const double jd,
       }
 
    if( !jpl_filename)
-      {
-      FILE *ifile;
-
-#if defined (_WIN32) || defined( __WATCOMC__)
-      jpl_filename = get_environment_ptr( "JPL_FILENAME");
-#else
-      jpl_filename = get_environment_ptr( "LINUX_JPL_FILENAME");
-#endif
-      if( *jpl_filename)
-         jpl_eph = jpl_init_ephemeris( jpl_filename, NULL, NULL);
-      if( !jpl_eph)
-         if( (ifile = fopen_ext( "jpl_eph.txt", "fcrb")) != NULL)
-            {
-            char buff[100];
-
-            while( !jpl_eph && fgets_trimmed( buff, sizeof( buff), ifile))
-               if( *buff && *buff != ';')
-                  jpl_eph = jpl_init_ephemeris( buff, NULL, NULL);
-            if( debug_level)
-               debug_printf( "Ephemeris file %s\n", buff);
-            fclose( ifile);
-            }
-      if( debug_level && jpl_eph)
-         {
-         debug_printf( "\nEphemeris time span years %.3f to %.3f\n",
-               (jpl_get_double( jpl_eph, JPL_EPHEM_START_JD) - J0) / 365.25,
-               (jpl_get_double( jpl_eph, JPL_EPHEM_END_JD)   - J0) / 365.25);
-         debug_printf( "Ephemeris version %d\n", jpl_get_long( jpl_eph, JPL_EPHEM_EPHEMERIS_VERSION));
-         debug_printf( "Kernel size %d, record size %d, swap_bytes %d\n",
-               jpl_get_long( jpl_eph, JPL_EPHEM_KERNEL_SIZE),
-               jpl_get_long( jpl_eph, JPL_EPHEM_KERNEL_RECORD_SIZE),
-               jpl_get_long( jpl_eph, JPL_EPHEM_KERNEL_SWAP_BYTES));
-         debug_printf( "ncon = %d AU=%f emrat = %f\n",
-               jpl_get_long( jpl_eph, JPL_EPHEM_N_CONSTANTS),
-               jpl_get_double( jpl_eph, JPL_EPHEM_AU_IN_KM),
-               jpl_get_double( jpl_eph, JPL_EPHEM_EARTH_MOON_RATIO));
-         }
-      }
+      load_jpl_ephemeris( );
 
-   if( jpl_eph)
+   if( jpl_eph || using_subset)
       {
       double state[6];            /* DE gives both posn & velocity */
-      int failure_code;
+      int failure_code = -1;
 
       if( planet_no < 0)          /* flag to unload everything */
          {
-         jpl_close_ephemeris( jpl_eph);
+         unmap_jpl_ephemeris( &mapped_ephem);
+         if( jpl_eph)
+            jpl_close_ephemeris( jpl_eph);
          jpl_eph = NULL;
          jpl_filename = NULL;
+         using_subset = full_de_tried = false;
          return( 0);
          }
-      else if( planet_no == 10)
-         failure_code = jpl_pleph( jpl_eph, jd, 10, 3, state, calc_vel);
-      else
-         failure_code = jpl_pleph( jpl_eph, jd,
+      if( mapped_ephem.data && planet_no <= 10)
+         failure_code = mapped_planet_state( planet_no, jd, state, calc_vel);
+      if( failure_code && using_subset && !full_de_tried)
+         load_full_jpl_ephemeris( );      /* outside the subset */
+      if( failure_code && jpl_eph)      /* not mapped,  or outside it */
+         {
+         if( planet_no == 10)
+            failure_code = jpl_pleph( jpl_eph, jd, 10, 3, state, calc_vel);
+         else
+            failure_code = jpl_pleph( jpl_eph, jd,
               (planet_no == 3) ? 13 : planet_no, jpl_center, state, calc_vel);
+         }
       if( !failure_code)         /* we're done */
          {
          if( debug_level > 8)
@@ -257,7 +742,8 @@ POSN_NODE
    {
    double min_jd;
    int used;
-   POSN_CACHE *data;
+   POSN_CACHE *data;          /* NULL if the node has been evicted */
+   bool referenced;           /* used since the clock hand last passed */
    };
 
 #define node_size                     1659
@@ -267,6 +753,10 @@ POSN_NODE
    /* node if it's less than half full : */
 #define spillover_size    (node_size / 2)
 int n_posns_cached = 0;
+   /* Statistics for the force model profiler (see 'runge.cpp').  Any  */
+   /* thread may use the cache,  so these are bumped with ATOMIC_ADD( ). */
+long planet_cache_hits = 0, planet_cache_misses = 0;
+long planet_cache_evictions = 0;
 
 /* Hash the JD and planet number.  It seems a fair bit of time is
 spent in this function,  so I spent a good bit of time trying to make
@@ -423,10 +913,19 @@ mildly wasteful,  but I don't think the performance benefit of expanding
 the cache and adding everything we've got back in would be worthwhile.
 (It wouldn't be hard to do,  though.)
 
-   If the cache gets above some limit (currently set to a million cached
-positions,  or about 36 MBytes),  we stop growing the cache.  So if you
-had a _really_ long integration,  the cache gets dumped,  rebuilt to the
-same size,  dumped again,  built to the same size,  etc.
+   The memory used is limited by PLANET_CACHE_MB in 'environ.dat'.  Once
+that many MBytes of nodes are in use,  we evict nodes using the 'clock'
+approximation to least-recently-used:  each node is marked as referenced
+when it's used,  and a 'clock hand' sweeps through the nodes,  clearing
+that mark,  until it finds a node that hasn't been used since it was last
+swept past.  That node's data is freed,  but the node itself stays put,
+covering the same span of JDs;  if positions in that span are requested
+again,  it just starts filling up again.  (Runs of empty nodes are merged
+now and then.)  Integrations usually sweep along in time,  so the nodes
+evicted are those for times we've not been near lately,  and a long
+integration no longer causes the whole cache to be dumped.  Hits,  misses,
+and evictions are counted in 'planet_cache_hits',  '_misses',  and
+'_evictions',  and shown in force model profiles (see 'runge.cpp').
 
    Previously,  the data was stored using a balanced tree.  I don't know
 what possessed me to do something that dumb.  (At the very least,  had
@@ -436,23 +935,107 @@ Just Fine.)    */
 
 #define MAX_N_NODES 10000
 
-int planet_posn( const int planet_no, const double jd, double *vect_2000)
+static int n_nodes_with_data = 0, clock_hand = 0;
+
+static POSN_CACHE *node_data( POSN_NODE *node)
+{
+   if( !node->data)
+      {
+      node->data = (POSN_CACHE *)calloc( node_size, sizeof( POSN_CACHE));
+      assert( node->data);
+      node->used = 0;
+      n_nodes_with_data++;
+      }
+   return( node->data);
+}
+
+static void evict_nodes( POSN_NODE *nodes, const int n_nodes,
+                                 const int max_nodes_with_data)
+{
+   int n_swept = 0;
+
+   while( n_nodes_with_data > max_nodes_with_data && n_swept < 2 * n_nodes)
+      {
+      POSN_NODE *node;
+
+      if( clock_hand >= n_nodes)
+         clock_hand = 0;
+      node = nodes + clock_hand;
+      if( node->data)
+         {
+         if( node->referenced)
+            node->referenced = false;
+         else
+            {
+            n_posns_cached -= node->used;
+            free( node->data);
+            node->data = NULL;
+            node->used = 0;
+            n_nodes_with_data--;
+            ATOMIC_ADD( &planet_cache_evictions, 1);
+            }
+         }
+      clock_hand++;
+      n_swept++;
+      }
+}
+
+/* An evicted node next to another evicted node can be merged into it;
+the left one's JD range just extends to cover the right one's.  */
+
+static int merge_empty_nodes( POSN_NODE *nodes, const int n_nodes)
+{
+   int i, j;
+
+   for( i = j = 1; i < n_nodes; i++)
+      if( nodes[i].data || nodes[j - 1].data)
+         nodes[j++] = nodes[i];
+   clock_hand = 0;
+   return( j);
+}
+
+static int max_cached_nodes( void)
+{
+   const double n_bytes = atof( get_environment_ptr( "PLANET_CACHE_MB"))
+                                       * 1024. * 1024.;
+   int rval = (int)( n_bytes / (double)( node_size * sizeof( POSN_CACHE)));
+
+   if( rval < 4)
+      rval = 4;
+   if( n_bytes <= 0. || rval > MAX_N_NODES)
+      rval = MAX_N_NODES;
+   return( rval);
+}
+
+/* cached_planet_posn( ) does the actual work of planet_posn( ),  and
+must be called with 'cache_mutex' locked,  since the cache (and the
+JPL/PS-1996 readers underneath it) may be shared among threads.  */
+
+FIND_ORB_MUTEX( cache_mutex);
+
+static void free_snapshots( void);
+
+static int cached_planet_posn( const int planet_no, const double jd,
+                                        double *vect_2000)
 {
    static POSN_NODE *nodes = NULL;
    static int n_nodes = 0, n_nodes_alloced = 0, curr_node = 0;
+   static int max_nodes_with_data = 0;
    int loc, rval = 0;
 #ifdef TIMING_ON
    int64_t t_start;
 #endif
    POSN_CACHE *cache;
 
-   assert( fabs( jd) < 1e+9);
-   if( !planet_no)            /* the sun */
+   if( !max_nodes_with_data)
+      max_nodes_with_data = max_cached_nodes( );
+   if( n_nodes_with_data > max_nodes_with_data)
+      evict_nodes( nodes, n_nodes, max_nodes_with_data);
+   if( n_nodes >= MAX_N_NODES)
       {
-      vect_2000[0] = vect_2000[1] = vect_2000[2] = 0.;
-      return( 0);
+      n_nodes = merge_empty_nodes( nodes, n_nodes);
+      curr_node = 0;
       }
-
    if( planet_no < 0 || n_nodes >= MAX_N_NODES)
       {                                  /* flag to unload everything */
       int i;
@@ -463,37 +1046,17 @@ int planet_posn( const int planet_no, const double jd, double *vect_2000)
       if( nodes)
          free( nodes);
       nodes = NULL;
-      n_posns_cached = 0;
+      n_posns_cached = n_nodes_with_data = clock_hand = 0;
       n_nodes = n_nodes_alloced = curr_node = 0;
       }
 
    if( planet_no < 0)
       {
+      free_snapshots( );
       planet_posn_raw( -1, 0., NULL);
       return( 0);
       }
 
-   if( planet_no == PLANET_POSN_EARTH || planet_no == PLANET_POSN_MOON)
-      {
-      double moon_loc[3];
-
-      rval = planet_posn( 3, jd, vect_2000);   /* first,  get Earth-Moon */
-      if( !rval)                               /* barycenter posn,  then */
-         rval = planet_posn( 10, jd, moon_loc);    /* lunar offset vect  */
-      if( !rval)
-         {
-         unsigned i;
-         const double EARTH_MOON_BARYCENTER_FACTOR = 82.300679;
-         const double factor = (planet_no == PLANET_POSN_EARTH ?
-                     -1. / EARTH_MOON_BARYCENTER_FACTOR :
-                 1. - 1. / EARTH_MOON_BARYCENTER_FACTOR);
-
-         for( i = 0; i < 3; i++)
-            vect_2000[i] += moon_loc[i] * factor;
-         }
-      return( rval);
-      }
-
    if( !nodes || n_nodes == n_nodes_alloced - 1)
       {
       const unsigned new_n_alloced = 100 + 3 * n_nodes_alloced / 2;
@@ -504,8 +1067,8 @@ int planet_posn( const int planet_no, const double jd, double *vect_2000)
          {
          n_nodes = 1;
          nodes[0].min_jd = -1e+10;
-         nodes[0].used = 0;
-         nodes[0].data = (POSN_CACHE *)calloc( node_size, sizeof( POSN_CACHE));
+         nodes[0].data = NULL;
+         node_data( nodes);
          }
       n_nodes_alloced = new_n_alloced;
       }
@@ -518,7 +1081,8 @@ int planet_posn( const int planet_no, const double jd, double *vect_2000)
    assert( jd >= nodes[curr_node].min_jd);
    assert( curr_node == n_nodes - 1 || jd < nodes[curr_node + 1].min_jd);
 
-   cache = nodes[curr_node].data;
+   cache = node_data( nodes + curr_node);
+   nodes[curr_node].referenced = true;
    loc = find_within_node( planet_no, jd, cache);
 
 #ifdef TIMING_ON
@@ -532,9 +1096,11 @@ int planet_posn( const int planet_no, const double jd, double *vect_2000)
       nodes[curr_node].used++;
       rval = planet_posn_raw( planet_no, jd, cache[loc].vect);
       n_posns_cached++;
+      ATOMIC_ADD( &planet_cache_misses, 1);
       }
    else
       {
+      ATOMIC_ADD( &planet_cache_hits, 1);
       assert( cache[loc].planet_no == planet_no);
       assert( cache[loc].jd == jd);
       memcpy( vect_2000, cache[loc].vect, 3 * sizeof( double));
@@ -579,14 +1145,16 @@ int planet_posn( const int planet_no, const double jd, double *vect_2000)
          {
          memmove( nodes + curr_node + 2, nodes + curr_node + 1,
                   (n_nodes - curr_node - 1) * sizeof( POSN_NODE));
-         nodes[curr_node + 1].data = (POSN_CACHE *)calloc( node_size, sizeof( POSN_CACHE));
-         nodes[curr_node + 1].used = 0;
+         nodes[curr_node + 1].data = NULL;
+         nodes[curr_node + 1].referenced = true;
          if( debug_level > 5)
             debug_printf( "Splitting node %d\n", curr_node);
          n_nodes++;
          }
       while( tcache[size1].jd == tcache[size1 - 1].jd)
          size1--;
+      node_data( nodes + curr_node);      /* a neighbor we're spilling */
+      node_data( nodes + curr_node + 1);  /* into may have been evicted */
       for( i = 0; i < splitting_size; i++)
          {
          const int n = curr_node + (i < size1 ? 0 : 1);
@@ -606,15 +1174,369 @@ int planet_posn( const int planet_no, const double jd, double *vect_2000)
    return( rval);
 }
 
-      /* In the following,  we get the earth's position for a particular    */
-      /* instant,  just to ensure that JPL ephemerides (if any) are loaded. */
+int planet_posn( const int planet_no, const double jd, double *vect_2000)
+{
+   int rval;
+
+   assert( fabs( jd) < 1e+9);
+   if( !planet_no)            /* the sun */
+      {
+      vect_2000[0] = vect_2000[1] = vect_2000[2] = 0.;
+      return( 0);
+      }
+
+   if( planet_no == PLANET_POSN_EARTH || planet_no == PLANET_POSN_MOON)
+      {
+      double moon_loc[3];
+
+      rval = planet_posn( 3, jd, vect_2000);   /* first,  get Earth-Moon */
+      if( !rval)                               /* barycenter posn,  then */
+         rval = planet_posn( 10, jd, moon_loc);    /* lunar offset vect  */
+      if( !rval)
+         {
+         unsigned i;
+         const double EARTH_MOON_BARYCENTER_FACTOR = 82.300679;
+         const double factor = (planet_no == PLANET_POSN_EARTH ?
+                     -1. / EARTH_MOON_BARYCENTER_FACTOR :
+                 1. - 1. / EARTH_MOON_BARYCENTER_FACTOR);
+
+         for( i = 0; i < 3; i++)
+            vect_2000[i] += moon_loc[i] * factor;
+         }
+      return( rval);
+      }
+
+   LOCK_MUTEX( cache_mutex);
+   rval = cached_planet_posn( planet_no, jd, vect_2000);
+   UNLOCK_MUTEX( cache_mutex);
+   return( rval);
+}
+
+/* The force model wants the positions of every perturbing planet at
+each time it's evaluated.  Looking them up one at a time means a hash
+probe (and now and then a node split) in the above cache per planet,
+and,  on a miss,  a trip into the JPL reader per planet,  each of which
+has to find the right Chebyshev record and evaluate the sun as well.
+
+   planet_posns( ) instead gets all the planets and the moon for a given
+JD at once.  With JPL ephemerides,  one call to jpl_state( ) evaluates the
+lot from a single record (or,  if the file is mapped,  we evaluate them
+from the mapping,  without holding 'cache_mutex');  that's cheap enough
+that we always do all of them,  and later requests for other planets at that JD come for free.
+The results go into a 'snapshot' table of all planets at one JD,  with
+one hash lookup per JD.  The table is direct-mapped:  a new JD simply
+replaces whatever was in its slot,  so there are no splits.  Without
+JPL ephemerides,  or outside their time span,  we get just the planets
+requested,  from the usual cache.
+
+   'mask' has bit n set for each planet n (1 to 10) wanted.  Positions
+are as from planet_posn( ) (so planet 3 is the Earth-moon barycenter,
+and 10 the geocentric moon),  stored in vect_2000[3 * n...3 * n + 2].  */
+
+#define PLANET_SNAPSHOT struct planet_snapshot
+
+PLANET_SNAPSHOT
+   {
+   double jd;
+   unsigned planets_found;       /* bit n set if vect[n] is filled in */
+   double vect[11][3];
+   };
+
+#define N_SNAPSHOTS_LOG2      15
+#define N_SNAPSHOTS           (1 << N_SNAPSHOTS_LOG2)
+#define ALL_SNAPSHOT_PLANETS  0x7fe
+
+static PLANET_SNAPSHOT *snapshots = NULL;
+
+static void free_snapshots( void)
+{
+   if( snapshots)
+      free( snapshots);
+   snapshots = NULL;
+}
+
+static inline unsigned snapshot_hash( const double jd, const int n_bits)
+{
+   uint32_t dword_ptr[2];
+
+   memcpy( dword_ptr, &jd, sizeof( double));
+   return( ((dword_ptr[0] ^ dword_ptr[1]) * 2654435761u) >> (32 - n_bits));
+}
+
+/* Returns the table slot for 'jd',  emptied if it held some other JD. */
+
+static PLANET_SNAPSHOT *find_snapshot( const double jd)
+{
+   PLANET_SNAPSHOT *snap;
+
+   if( !snapshots)
+      {
+      snapshots = (PLANET_SNAPSHOT *)calloc( N_SNAPSHOTS,
+                                          sizeof( PLANET_SNAPSHOT));
+      assert( snapshots);
+      }
+   snap = snapshots + snapshot_hash( jd, N_SNAPSHOTS_LOG2);
+   if( snap->jd != jd || !snap->planets_found)
+      {
+      snap->jd = jd;
+      snap->planets_found = 0;
+      }
+   return( snap);
+}
+
+static bool jpl_snapshot( const double jd, PLANET_SNAPSHOT *snap)
+{
+   int list[14], i;
+   double pv[13][6], nutations[4];
+
+   if( !jpl_eph)
+      return( false);
+   memset( list, 0, sizeof( list));
+   for( i = 0; i < 10; i++)      /* Mercury...Pluto,  geocentric moon */
+      list[i] = 1;
+   if( jpl_state( jpl_eph, jd, list, pv, nutations, 0))
+      return( false);            /* outside the ephemeris time span */
+   for( i = 1; i <= 10; i++)
+      {
+      memcpy( snap->vect[i], pv[i - 1], 3 * sizeof( double));
+      equatorial_to_ecliptic( snap->vect[i]);
+      }
+   snap->planets_found = ALL_SNAPSHOT_PLANETS;
+   return( true);
+}
+
+/* With the DE file mapped,  a snapshot can be computed without holding
+'cache_mutex',  so other threads can use the cache meanwhile.  */
+
+static bool mapped_snapshot( const double jd, PLANET_SNAPSHOT *snap)
+{
+   int i;
+
+   for( i = 1; i <= 10; i++)
+      {
+      if( mapped_planet_state( i, jd, snap->vect[i], 0))
+         return( false);
+      equatorial_to_ecliptic( snap->vect[i]);
+      }
+   snap->jd = jd;
+   snap->planets_found = ALL_SNAPSHOT_PLANETS;
+   return( true);
+}
+
+/* If SHARED_PLANET_CACHE in 'environ.dat' gives a file name,  complete
+snapshots computed from JPL ephemerides are also published to a table in
+that file,  mapped shared into memory.  Each 'fo' worker process (and each
+thread) looks there before computing a snapshot itself,  so neighboring
+objects,  which tend to share epochs and observation dates,  reuse one
+another's planet positions.  The file persists,  so a restarted run begins
+with a warm cache.  The header records which ephemeris the positions came
+from;  if that doesn't match,  the file is cleared and started afresh.
+(Don't do that while other processes are using it.)
+
+   Like the in-process table,  it's direct-mapped,  so it never fills up;
+new JDs just replace old ones.  Each slot has a sequence number that is
+odd while the slot is being written.  A writer claims the slot by making
+the number odd (with an atomic compare-and-swap;  if someone else has it,
+we just don't publish),  writes,  and makes it even again.  A reader
+checks that the number is even,  copies the slot,  and checks that the
+number hasn't changed;  if it has,  it's treated as a miss.  So there are
+no locks,  and a process dying mid-write costs us,  at worst,  that slot. */
+
+#define SHARED_SNAPSHOT struct shared_snapshot
+
+SHARED_SNAPSHOT
+   {
+   uint32_t sequence;            /* odd while being written */
+   uint32_t reserved;
+   double jd;
+   double vect[11][3];
+   };
+
+#define SHARED_CACHE_HEADER struct shared_cache_header
+
+SHARED_CACHE_HEADER
+   {
+   char magic[8];
+   int32_t de_version, n_slots_log2;
+   double jd_start, jd_end;
+   };
+
+#define N_SHARED_SNAPSHOTS_LOG2     18
+#define SHARED_CACHE_MAGIC          "FO_plc1"
+
+static SHARED_SNAPSHOT *shared_snapshots = NULL;
+static bool shared_cache_checked = false;
+
+static void open_shared_cache( void)
+{
+#ifdef JPL_MMAP
+   const char *filename = get_environment_ptr( "SHARED_PLANET_CACHE");
+   const size_t n_bytes = sizeof( SHARED_CACHE_HEADER)
+            + ((size_t)1 << N_SHARED_SNAPSHOTS_LOG2) * sizeof( SHARED_SNAPSHOT);
+   SHARED_CACHE_HEADER header, old_header;
+   struct stat file_info;
+   void *addr;
+   int fd;
+
+   shared_cache_checked = true;
+   if( !*filename || !jpl_eph)
+      return;
+   memset( &header, 0, sizeof( header));
+   strcpy( header.magic, SHARED_CACHE_MAGIC);
+   header.de_version = (int32_t)jpl_get_long( jpl_eph,
+                                    JPL_EPHEM_EPHEMERIS_VERSION);
+   header.n_slots_log2 = N_SHARED_SNAPSHOTS_LOG2;
+   header.jd_start = jpl_get_double( jpl_eph, JPL_EPHEM_START_JD);
+   header.jd_end = jpl_get_double( jpl_eph, JPL_EPHEM_END_JD);
+   fd = open( filename, O_RDWR | O_CREAT, 0644);
+   if( fd < 0)
+      {
+      debug_printf( "Couldn't open shared planet cache '%s'\n", filename);
+      return;
+      }
+   flock( fd, LOCK_EX);       /* so only one process sets up the file */
+   if( fstat( fd, &file_info) || (size_t)file_info.st_size != n_bytes
+            || pread( fd, &old_header, sizeof( old_header), 0)
+                                    != (ssize_t)sizeof( old_header)
+            || memcmp( &old_header, &header, sizeof( header)))
+      {
+      if( ftruncate( fd, 0) || ftruncate( fd, (off_t)n_bytes)
+            || pwrite( fd, &header, sizeof( header), 0)
+                                    != (ssize_t)sizeof( header))
+         {
+         flock( fd, LOCK_UN);
+         close( fd);
+         return;
+         }
+      }
+   addr = mmap( NULL, n_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   flock( fd, LOCK_UN);
+   close( fd);                /* the mapping stays valid */
+   if( addr != MAP_FAILED)
+      shared_snapshots = (SHARED_SNAPSHOT *)
+                  ((char *)addr + sizeof( SHARED_CACHE_HEADER));
+#endif
+}
+
+static bool get_shared_snapshot( const double jd, PLANET_SNAPSHOT *snap)
+{
+#ifdef JPL_MMAP
+   const SHARED_SNAPSHOT *slot = shared_snapshots
+                        + snapshot_hash( jd, N_SHARED_SNAPSHOTS_LOG2);
+   const uint32_t sequence = __atomic_load_n( &slot->sequence,
+                                                   __ATOMIC_ACQUIRE);
+   double slot_jd;
+
+   if( sequence & 1)
+      return( false);
+   memcpy( &slot_jd, &slot->jd, sizeof( double));
+   memcpy( snap->vect, slot->vect, sizeof( snap->vect));
+   __atomic_thread_fence( __ATOMIC_ACQUIRE);
+   if( slot_jd != jd || __atomic_load_n( &slot->sequence,
+                              __ATOMIC_RELAXED) != sequence)
+      return( false);
+   snap->jd = jd;
+   snap->planets_found = ALL_SNAPSHOT_PLANETS;
+   return( true);
+#else
+   return( false);
+#endif
+}
+
+static void publish_shared_snapshot( const PLANET_SNAPSHOT *snap)
+{
+#ifdef JPL_MMAP
+   SHARED_SNAPSHOT *slot = shared_snapshots
+                        + snapshot_hash( snap->jd, N_SHARED_SNAPSHOTS_LOG2);
+   uint32_t sequence = __atomic_load_n( &slot->sequence, __ATOMIC_RELAXED);
+
+   if( (sequence & 1) || !__atomic_compare_exchange_n( &slot->sequence,
+               &sequence, sequence + 1, false,
+               __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+      return;           /* someone else is writing to this slot */
+   slot->jd = snap->jd;
+   memcpy( slot->vect, snap->vect, sizeof( slot->vect));
+   __atomic_store_n( &slot->sequence, sequence + 2, __ATOMIC_RELEASE);
+#endif
+}
+
+int planet_posns( const unsigned mask, const double jd, double *vect_2000)
+{
+   PLANET_SNAPSHOT *snap, mapped;
+   unsigned needed;
+   int i, rval = 0;
+   bool use_mapped = false;
+
+   assert( fabs( jd) < 1e+9);
+   assert( !(mask & ~ALL_SNAPSHOT_PLANETS));
+   LOCK_MUTEX( cache_mutex);
+   if( !jpl_filename)
+      load_jpl_ephemeris( );
+   if( !shared_cache_checked)
+      open_shared_cache( );
+   snap = find_snapshot( jd);
+   needed = mask & ~snap->planets_found;
+   if( needed && !snap->planets_found && shared_snapshots)
+      if( get_shared_snapshot( jd, snap))
+         needed = 0;
+   if( needed && !snap->planets_found && mapped_ephem.data)
+      {
+      UNLOCK_MUTEX( cache_mutex);
+      use_mapped = mapped_snapshot( jd, &mapped);
+      LOCK_MUTEX( cache_mutex);
+      snap = find_snapshot( jd);
+      if( use_mapped)
+         *snap = mapped;
+      needed = mask & ~snap->planets_found;
+      }
+   if( !needed)
+      {
+      if( use_mapped)
+         {
+         ATOMIC_ADD( &planet_cache_misses, 1);
+         if( shared_snapshots)
+            publish_shared_snapshot( snap);
+         }
+      else
+         ATOMIC_ADD( &planet_cache_hits, 1);
+      }
+   else if( !snap->planets_found && (!mapped_ephem.data || using_subset)
+                                 && jpl_snapshot( jd, snap))
+      {
+      ATOMIC_ADD( &planet_cache_misses, 1);
+      if( shared_snapshots)
+         publish_shared_snapshot( snap);
+      }
+   else
+      for( i = 1; i <= 10; i++)
+         if( (needed >> i) & 1)
+            {
+            const int err = cached_planet_posn( i, jd, snap->vect[i]);
+
+            if( err && !rval)
+               rval = err;
+            snap->planets_found |= (1u << i);
+            }
+   for( i = 1; i <= 10; i++)
+      if( (mask >> i) & 1)
+         memcpy( vect_2000 + 3 * i, snap->vect[i], 3 * sizeof( double));
+   UNLOCK_MUTEX( cache_mutex);
+   return( rval);
+}
+
+      /* In the following,  we ensure that JPL ephemerides (if any) are    */
+      /* loaded.  (Asking for a position,  as we used to,  could make us   */
+      /* open the full DE file for no reason if an EPHEM_SUBSET is used.)  */
       /* Then we call with planet = JD = 0,  which causes the info about    */
       /* the JPL ephemerides to be put into the 'state vector'.             */
 int get_jpl_ephemeris_info( int *de_version, double *jd_start, double *jd_end)
 {
    double vect_2000[3];
 
-   planet_posn_raw( 3, J2000, vect_2000);
+   LOCK_MUTEX( cache_mutex);
+   if( !jpl_filename)
+      load_jpl_ephemeris( );
+   UNLOCK_MUTEX( cache_mutex);
    planet_posn_raw( 0, 0., vect_2000);
    *de_version = (int)vect_2000[0];
    if( jd_start)
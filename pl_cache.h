@@ -21,8 +21,13 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
 02110-1301, USA.    */
 
 int planet_posn( const int planet_no, const double jd, double *vect_2000);
+int planet_posns( const unsigned mask, const double jd,
+                                 double *vect_2000);   /* pl_cache.cpp */
 int format_jpl_ephemeris_info( char *buff);           /* pl_cache.cpp */
 int get_jpl_ephemeris_info( int *de_version, double *jd_start, double *jd_end);
+long extract_ephemeris_subset( const char *de_filename,
+            const char *subset_filename, const double jd_start,
+            const double jd_end, const unsigned body_mask); /* pl_cache.cpp */
 
 #define PLANET_POSN_VELOCITY_FLAG 0x8000
 
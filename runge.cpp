@@ -22,7 +22,9 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
 #include <string.h>
 #include <stdarg.h>
 #include <math.h>
+#include <time.h>
 #include <assert.h>
+#include <float.h>
 #ifndef __GNUC__
 // #include <conio.h>
 // #include <io.h>
@@ -34,6 +36,9 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
 #include "afuncs.h"
 #include "comets.h"
 #include "afuncs.h"
+#include "runge.h"
+#include "threads.h"
+#include "environ.h"
 
 #define PI 3.1415926535897932384626433832795028841971693993751058209749445923
 #define J2000 2451545.
@@ -46,41 +51,36 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
 #define sqrtl sqrt
 #endif
 
-/* perturbers
+/* State that varies from one integration to the next (perturbers,
+   n_extra_params,  solar_pressure,  best_fit_planet,  planet_hit) is
+   in the INTEGRATION_CONTEXT;  see 'runge.h'.  Global state still used:
    excluded_perturbers = -1;
    general_relativity_factor
    integration_method
    integration_tolerance
-   n_extra_params
    planet_mass[],  sort of
-   solar_pressure
-   best_fit_planet;
-   best_fit_planet_dist;
    j2_multiplier
    debug_level
-   approx_planet_orientation
    object_mass
    (implicitly) planet_posn cache
+   The lazily-set caches in calc_approx_planet_orientation( ) and
+   comet_g_func( ) are per-thread;  the geopotential grid is loaded
+   under a mutex.
 */
 
 double object_mass = 0.;
 double j2_multiplier = 1.;
-extern unsigned perturbers;
 
 extern int debug_level;
 int debug_printf( const char *format, ...);                /* runge.cpp */
 int planet_posn( const int planet_no, const double jd, double *vect_2000);
                                                 /* mpc_obs.cpp */
 int earth_lunar_posn( const double jd, double FAR *earth_loc, double FAR *lunar_loc);
+int planet_posns( const unsigned mask, const double jd,
+                                 double *vect_2000);   /* pl_cache.cpp */
 const char *get_environment_ptr( const char *env_ptr);     /* mpc_obs.cpp */
-double take_rk_step( const double jd, ELEMENTS *ref_orbit,
-                 const double *ival, double *ovals,
-                 const int n_vals, const double step);      /* runge.cpp */
-double take_pd89_step( const double jd, ELEMENTS *ref_orbit,
-                 const double *ival, double *ovals,
-                 const int n_vals, const double step);      /* runge.cpp */
-int symplectic_6( double jd, ELEMENTS *ref_orbit, double *vect,
-                                          const double dt);
+int64_t nanoseconds_since_1970( void);                      /* mpc_obs.c */
+FILE *fopen_ext( const char *filename, const char *permits);   /* miscell.cpp */
 static int get_planet_posn_vel( const double jd, const int planet_no,
                      double *posn, double *vel);         /* runge.cpp */
 int find_best_fit_planet( const double jd, const double *ivect,
@@ -95,6 +95,8 @@ void calc_approx_planet_orientation( const int planet,        /* runge.cpp */
          const int system_number, const double jde, double *matrix);
 double geo_potential_in_au( const double x, const double y, const double z,
                  double *derivs, const int n_terms);    /* geo_pot.c */
+double geo_accel_pines( const double x, const double y, const double z,
+                 double *accel, int max_degree);        /* geo_pot.c */
 
 #define N_PERTURB 19
 #define IDX_MERCURY    1
@@ -189,81 +191,41 @@ double geo_potential_in_au( const double x, const double y, const double z,
 #define NEPTUNE_J3 0.
 #define NEPTUNE_J4 (J4_IN_NEPTUNE_UNITS * NEPTUNE_R2 * NEPTUNE_R2)
 
-   /* One can compute the acceleration due to the first (J2) oblateness
-      term analytically,  and the following function does that.  However,
-      the expressions for computing the accelerations due to J3 and J4
-      get ugly,  and it becomes simpler to write a function for the _potential_
-      and get the accelerations via numerical differentiation.  I'm keeping
-      the numerical J2 acceleration version around just for reference. */
+/* For an input planetocentric location in AU,  and a GM in AU^3/day^2,
+computes the planetocentric acceleration due to J2,  J3,  and J4,  in
+AU/day^2.
 
-static double jn_potential( const double *loc, const double j3,
-                                        const double j4)
-{
-   const double r2 = loc[0] * loc[0] + loc[1] * loc[1] + loc[2] * loc[2];
-   const double r = sqrt( r2);
-   const double mu = loc[2] / r;
-   const double mu2 = mu * mu;
-   const double p3 = mu * (2.5 * mu2 - 1.5);
-   const double p4 = (35. * mu2 * mu2 - 30. * mu2 + 3.) / 8.;
-// const double p2 = 1.5 * mu2 - .5;     /* Danby, p. 115 */
+   A zonal term Jn with potential Jn * Pn(mu) / r^(n+1),  mu = z/r,  has
+gradient
 
-//    return( (j2 * p2 + j3 * p3 / r + j4 * p4 / r2) / (r * r2));
-      return( (          j3 * p3 / r + j4 * p4 / r2) / (r * r2));
-}
+Jn * (Pn'(mu) * grad(mu) - (n + 1) * Pn(mu) * loc / r^2) / r^(n+1)
 
-/* For an input planetocentric location in AU,  and a GM in AU^3/day^2,
-computes the planetocentric acceleration due to J2,  J3,  and J4,  in
-AU/day^2.  For the Earth,  the GGM03 model can be used;  see 'geo_pot.cpp'. */
+   where grad(mu) = (-mu * x / r^2, -mu * y / r^2, (1 - mu^2) / r).  We
+used to get the J3 and J4 parts by numerically differentiating the
+potential,  which took six evaluations of it and wasn't as accurate. */
 
-static void numerical_gradient( double *grad, const double *loc,
+static void zonal_gradient( double *grad, const double *loc,
                    const double planet_gm,
                    const double j2, const double j3, const double j4)
 {
    const double r2 = loc[0] * loc[0] + loc[1] * loc[1] + loc[2] * loc[2];
-   const double r = sqrt( r2), delta = r * 0.01;
-   const double r7 = r2 * r2 * r2 * sqrt( r2);
-   const double tval = (1.5 * r2 - 7.5 * loc[2] * loc[2]) / r7;
-   int i;
-
-   if( j3 == EARTH_J3)
-      {
-      static int n_terms = -9999;
-                                    /* height in units of earth radii */
-      if( n_terms == -9999)
-         {
-         n_terms = atoi( get_environment_ptr( "GEO_TERMS"));
-         if( !n_terms)
-            n_terms = 3;
-         }
-      if( n_terms > 0)     /* n_term <= 0 -> use "usual" J2 & J3 & J4 */
-         {
-         double ht_above_ground = (r / EARTH_R) - 1.;
-
-         if( ht_above_ground < 0.04)         /* less than about 250 km */
-            ht_above_ground = 0.04;
-         geo_potential_in_au( loc[0], loc[1], loc[2], grad,
-                      (int)( (double)n_terms / ht_above_ground) + 3);
-         return;
-         }
-      }
-   grad[0] = j2 * loc[0] * tval;   /* compute J2 accel analytically */
-   grad[1] = j2 * loc[1] * tval;
-   grad[2] = j2 * loc[2] * (3. * r2 / r7 + tval);
-   for( i = 0; i < 3; i++)         /* then do J3 & J4 numerically */
-      {
-      double tval, tloc[3];
-      int j;
-
-      for( j = 0; j < 3; j++)
-         tloc[j] = loc[j];
-      tloc[i] += delta;
-      tval = jn_potential( tloc, j3, j4);
-      tloc[i] -= delta + delta;
-      tval -= jn_potential( tloc, j3, j4);
-
-      grad[i] += tval / (delta * 2.);
-      grad[i] *= planet_gm;
-      }
+   const double r = sqrt( r2), r3 = r * r2;
+   const double mu = loc[2] / r;
+   const double mu2 = mu * mu;
+   const double p2 = 1.5 * mu2 - .5;     /* Danby, p. 115 */
+   const double p3 = mu * (2.5 * mu2 - 1.5);
+   const double p4 = (35. * mu2 * mu2 - 30. * mu2 + 3.) / 8.;
+   const double dp2 = 3. * mu;           /* derivatives of the above */
+   const double dp3 = 7.5 * mu2 - 1.5;
+   const double dp4 = mu * (17.5 * mu2 - 7.5);
+   const double dsum = (j2 * dp2 + j3 * dp3 / r + j4 * dp4 / r2) / r3;
+   const double psum = (3. * j2 * p2 + 4. * j3 * p3 / r
+                                     + 5. * j4 * p4 / r2) / (r3 * r2);
+   const double xy_factor = planet_gm * (-mu * dsum / r2 - psum);
+
+   grad[0] = loc[0] * xy_factor;
+   grad[1] = loc[1] * xy_factor;
+   grad[2] = planet_gm * (dsum * (1. - mu2) / r - psum * loc[2]);
 #ifdef OLD_DEBUGGING_CODE
    if( j3 == EARTH_J3)
       {
@@ -273,7 +235,7 @@ static void numerical_gradient( double *grad, const double *loc,
                loc[0] / EARTH_R,
                loc[1] / EARTH_R,
                loc[2] / EARTH_R, r / EARTH_R);
-      debug_printf( "Gradient (numerical): %e %e %e\n",
+      debug_printf( "Gradient (zonal):     %e %e %e\n",
                   grad[0], grad[1], grad[2]);
 
       geo_potential_in_au( loc[0], loc[1], loc[2], grad2,
@@ -289,6 +251,476 @@ static void numerical_gradient( double *grad, const double *loc,
 #endif
 }
 
+/* For fits of many objects in low or medium earth orbit,  evaluating the
+geopotential series at every step adds up.  If GEO_GRID is set in
+'environ.dat' (see 'environ.def'),  then within the given range of
+altitudes,  the acceleration is instead interpolated from a grid of
+precomputed values.
+
+   The grid is Cartesian,  in the same earth-fixed frame the series is
+evaluated in,  with a given spacing,  and is interpolated tricubically
+(Lagrange interpolation on the surrounding 4x4x4 nodes).  The nodes hold
+the series acceleration _minus_ that due to J2,  which is added back
+after interpolating.  J2 is by far the largest part and is cheap to
+compute directly;  the remainder is small and smooth enough that
+interpolation errors are tiny and floats suffice to store it.
+
+   Nodes are stored in columns along z.  Each column covers only the
+nodes within the outer radius of the shell,  plus enough to allow for
+the interpolation stencil.  (Nodes inside the inner radius are stored
+as well,  just to keep the columns contiguous,  but are left as zero.)
+The series is evaluated to the degree that oblateness_gradient( ) would
+use at the bottom of the shell.
+
+   Since the columns fill the whole sphere,  there are about 4.2 *
+(r_outer / spacing)^3 nodes at twelve bytes each.  For 200 to 2000 km at
+the default 100-km spacing,  that's 2.8 million nodes (35 MBytes,  built
+in a few seconds);  out to 20000 km,  it'd be 80 million (about 1 GByte,
+and minutes to build).  Grids of more than GEO_GRID_MAX_NODES aren't
+built,  and the series is used instead.
+
+   The grid is saved to 'geo_grid.dat',  with a header recording how it
+was made;  if that doesn't match the current settings,  it's rebuilt (see
+load_geo_grid( )).  On *nix,  it's memory-mapped;  elsewhere,  read into
+memory.  Each time it's loaded,  the actual interpolation error is checked
+at quasi-random points in the shell and logged to 'debug.txt'.  If the
+largest error found exceeds the limit given in GEO_GRID,  the grid is
+dropped and the series is used instead.  */
+
+#define GEO_GRID_MAGIC  "GeoGrd1"
+#define GEO_GRID_MAX_NODES   30000000L
+
+#define GEO_GRID_HEADER struct geo_grid_header
+
+GEO_GRID_HEADER
+   {
+   char magic[8];
+   int32_t n_side, max_degree;
+   double r_min, r_max, spacing, origin;     /* all in AU */
+   double planet_gm, j2;
+   };
+
+const void *map_whole_file( FILE *fp, size_t *n_bytes);     /* bc405.cpp */
+void unmap_whole_file( const void *addr, const size_t n_bytes); /* bc405.cpp */
+FILE *lock_data_file( const char *filename);                /* bc405.cpp */
+void unlock_data_file( FILE *fp);                           /* bc405.cpp */
+FILE *create_temp_data_file( const char *filename, char *temp_name);
+FILE *replace_data_file( FILE *locked_fp, const char *filename,
+                                 const char *temp_name);    /* bc405.cpp */
+
+/* A loaded grid,  for a given settings generation.  'hdr' is NULL if there
+is no grid (none asked for,  or it couldn't be built).  When the settings
+change,  a new one is made and published with ATOMIC_STORE( ),  so threads
+integrating at the time can keep using the old one.  Old grids are never
+unmapped or freed,  since we can't know when the last such thread is done
+with them;  settings don't change often enough for that to matter.  */
+
+#define GEO_GRID struct geo_grid
+
+GEO_GRID
+   {
+   const GEO_GRID_HEADER *hdr;
+   size_t n_bytes;
+   long n_nodes;
+   const int32_t *col_lo, *col_n, *col_start;
+   const float *nodes;
+   int generation;
+   bool is_mapped;
+   double max_err;         /* interpolation error found,  in m/s^2 */
+   };
+
+static const GEO_GRID *curr_geo_grid = NULL;
+
+FIND_ORB_MUTEX( geo_grid_mutex);
+
+static int geo_degree_at( const double r, const int geo_terms)
+{
+   double ht_above_ground = (r / EARTH_R) - 1.;   /* in earth radii */
+
+   if( ht_above_ground < 0.04)         /* less than about 250 km */
+      ht_above_ground = 0.04;
+   return( (int)( (double)geo_terms / ht_above_ground) + 2);
+}
+
+/* The accelerations stored in the grid,  as described above.  */
+
+static void geo_grid_node_value( const GEO_GRID_HEADER *hdr,
+                                 const double *loc, double *accel)
+{
+   double j2_accel[3];
+   int i;
+
+   geo_accel_pines( loc[0], loc[1], loc[2], accel, hdr->max_degree);
+   zonal_gradient( j2_accel, loc, hdr->planet_gm, hdr->j2, 0., 0.);
+   for( i = 0; i < 3; i++)
+      accel[i] -= j2_accel[i];
+}
+
+/* Interpolates the acceleration (including J2) at 'loc'.  Returns false
+if 'loc' is outside the shell covered by the grid.  */
+
+static bool interpolate_geo_grid( const GEO_GRID *grid, const double *loc,
+                                    double *accel)
+{
+   const GEO_GRID_HEADER *hdr = grid->hdr;
+   const double r = sqrt( loc[0] * loc[0] + loc[1] * loc[1] + loc[2] * loc[2]);
+   double weights[3][4], sum[3], j2_accel[3];
+   int idx[3], i, j, k;
+
+   if( r < hdr->r_min || r > hdr->r_max)
+      return( false);
+   for( i = 0; i < 3; i++)
+      {
+      const double pos = (loc[i] - hdr->origin) / hdr->spacing;
+      const double t = pos - floor( pos);
+
+      idx[i] = (int)floor( pos) - 1;
+      weights[i][0] = -t * (t - 1.) * (t - 2.) / 6.;
+      weights[i][1] = (t + 1.) * (t - 1.) * (t - 2.) / 2.;
+      weights[i][2] = -(t + 1.) * t * (t - 2.) / 2.;
+      weights[i][3] = (t + 1.) * t * (t - 1.) / 6.;
+      sum[i] = 0.;
+      }
+   for( i = 0; i < 4; i++)
+      for( j = 0; j < 4; j++)
+         {
+         const int32_t col = (idx[0] + i) * hdr->n_side + idx[1] + j;
+         const int32_t offset = idx[2] - grid->col_lo[col];
+         const double wxy = weights[0][i] * weights[1][j];
+         const float *node = grid->nodes
+                     + 3 * ((size_t)grid->col_start[col] + (size_t)offset);
+
+         if( offset < 0 || offset + 4 > grid->col_n[col])
+            return( false);      /* shouldn't happen */
+         for( k = 0; k < 4; k++, node += 3)
+            {
+            const double wt = wxy * weights[2][k];
+
+            sum[0] += wt * (double)node[0];
+            sum[1] += wt * (double)node[1];
+            sum[2] += wt * (double)node[2];
+            }
+         }
+   zonal_gradient( j2_accel, loc, hdr->planet_gm, hdr->j2, 0., 0.);
+   for( i = 0; i < 3; i++)
+      accel[i] = sum[i] + j2_accel[i];
+   return( true);
+}
+
+/* Computes and writes the grid column by column to 'ofile',  and closes
+it.  Returns the number of nodes,  or -1 on error.  */
+
+static long build_geo_grid( FILE *ofile, const GEO_GRID_HEADER *hdr)
+{
+   const int32_t n_side = hdr->n_side;
+   const int32_t n_cols = n_side * n_side;
+   const double pad = 3.5 * hdr->spacing;   /* > 2 * sqrt( 3) * spacing */
+   const double r_outer = hdr->r_max + pad;
+   const double r_inner = hdr->r_min - pad;
+   int32_t *col_lo = (int32_t *)calloc( 3 * (size_t)n_cols, sizeof( int32_t));
+   int32_t *col_n = col_lo + n_cols, *col_start = col_n + n_cols;
+   float *column = (float *)malloc( 3 * (size_t)n_side * sizeof( float));
+   long n_nodes = 0;
+   int32_t i, j, k;
+
+   if( !col_lo || !column)
+      {
+      fclose( ofile);
+      free( col_lo);
+      free( column);
+      return( -1);
+      }
+   for( i = 0; i < n_side; i++)
+      for( j = 0; j < n_side; j++)
+         {
+         const double x = hdr->origin + (double)i * hdr->spacing;
+         const double y = hdr->origin + (double)j * hdr->spacing;
+         const double rho2 = x * x + y * y;
+         const int32_t col = i * n_side + j;
+
+         col_start[col] = (int32_t)n_nodes;
+         if( rho2 < r_outer * r_outer)
+            {
+            const double z_max = sqrt( r_outer * r_outer - rho2);
+            int32_t k_lo = (int32_t)floor( (-z_max - hdr->origin) / hdr->spacing);
+            int32_t k_hi = (int32_t)ceil( (z_max - hdr->origin) / hdr->spacing);
+
+            if( k_lo < 0)
+               k_lo = 0;
+            if( k_hi > n_side - 1)
+               k_hi = n_side - 1;
+            col_lo[col] = k_lo;
+            col_n[col] = k_hi - k_lo + 1;
+            n_nodes += col_n[col];
+            }
+         }
+   fwrite( hdr, sizeof( GEO_GRID_HEADER), 1, ofile);
+   fwrite( col_lo, sizeof( int32_t), 3 * (size_t)n_cols, ofile);
+   for( i = 0; i < n_cols; i++)
+      {
+      for( k = 0; k < col_n[i]; k++)
+         {
+         double loc[3], accel[3];
+         int axis;
+
+         loc[0] = hdr->origin + (double)( i / n_side) * hdr->spacing;
+         loc[1] = hdr->origin + (double)( i % n_side) * hdr->spacing;
+         loc[2] = hdr->origin + (double)( col_lo[i] + k) * hdr->spacing;
+         if( vector3_length( loc) > r_inner)
+            geo_grid_node_value( hdr, loc, accel);
+         else
+            accel[0] = accel[1] = accel[2] = 0.;
+         for( axis = 0; axis < 3; axis++)
+            column[k * 3 + axis] = (float)accel[axis];
+         }
+      if( col_n[i])
+         fwrite( column, 3 * sizeof( float), (size_t)col_n[i], ofile);
+      }
+   if( fclose( ofile))
+      n_nodes = -1;
+   free( col_lo);
+   free( column);
+   return( n_nodes);
+}
+
+/* Unmaps or frees a grid that nobody else has been given.  */
+
+static void release_geo_grid( GEO_GRID *grid)
+{
+   if( grid->is_mapped)
+      unmap_whole_file( grid->hdr, grid->n_bytes);
+   else
+      free( (void *)grid->hdr);
+   grid->hdr = NULL;
+}
+
+/* Maps (or reads) the grid file and sets up the pointers into it.  Returns
+false,  with grid->hdr NULL,  if that fails or the file is the wrong size.
+(Nobody else can have the grid yet,  so it's safe to unmap it here.)  */
+
+static bool map_geo_grid( FILE *ifile, GEO_GRID *grid)
+{
+   int32_t n_cols;
+   size_t expected_bytes;
+
+   grid->hdr = (const GEO_GRID_HEADER *)map_whole_file( ifile, &grid->n_bytes);
+   grid->is_mapped = (grid->hdr != NULL);
+   if( !grid->hdr)
+      {
+      fseek( ifile, 0L, SEEK_END);
+      grid->n_bytes = (size_t)ftell( ifile);
+      fseek( ifile, 0L, SEEK_SET);
+      grid->hdr = (const GEO_GRID_HEADER *)malloc( grid->n_bytes);
+      if( grid->hdr && fread( (void *)grid->hdr, 1, grid->n_bytes, ifile)
+                                          != grid->n_bytes)
+         {
+         free( (void *)grid->hdr);
+         grid->hdr = NULL;
+         }
+      }
+   if( !grid->hdr)
+      return( false);
+   n_cols = grid->hdr->n_side * grid->hdr->n_side;
+   expected_bytes = sizeof( GEO_GRID_HEADER)
+                           + 3 * (size_t)n_cols * sizeof( int32_t);
+   if( grid->n_bytes >= expected_bytes)
+      {
+      grid->col_lo = (const int32_t *)( grid->hdr + 1);
+      grid->col_n = grid->col_lo + n_cols;
+      grid->col_start = grid->col_n + n_cols;
+      grid->nodes = (const float *)( grid->col_start + n_cols);
+      grid->n_nodes = (long)grid->col_start[n_cols - 1]
+                              + grid->col_n[n_cols - 1];
+      expected_bytes += 3 * (size_t)grid->n_nodes * sizeof( float);
+      }
+   if( grid->n_bytes != expected_bytes)
+      release_geo_grid( grid);
+   return( grid->hdr != NULL);
+}
+
+/* Compares interpolated accelerations to those from the series at points
+scattered through the shell,  logs the largest difference,  and returns
+it (in m/s^2).  The points come from a simple quasi-random sequence,
+rather than rand( ),  so we don't disturb anything else using the latter. */
+
+static double check_geo_grid_error( const GEO_GRID *grid)
+{
+   const GEO_GRID_HEADER *hdr = grid->hdr;
+   const double to_mks = AU_IN_KM * 1000. / (seconds_per_day * seconds_per_day);
+   double max_err = 0., max_rel_err = 0.;
+   int i, j;
+
+   for( i = 0; i < 10000; i++)
+      {
+      const double z = 2. * fmod( (double)i * 0.7548776662466927, 1.) - 1.;
+      const double lon = 2. * PI * fmod( (double)i * 0.5698402909980532, 1.);
+      const double r = hdr->r_min + (hdr->r_max - hdr->r_min)
+                              * fmod( (double)i * 0.6180339887498949, 1.);
+      double loc[3], accel[3], interp[3], diff[3];
+
+      loc[0] = r * sqrt( 1. - z * z) * cos( lon);
+      loc[1] = r * sqrt( 1. - z * z) * sin( lon);
+      loc[2] = r * z;
+      geo_grid_node_value( hdr, loc, accel);
+      zonal_gradient( diff, loc, hdr->planet_gm, hdr->j2, 0., 0.);
+      for( j = 0; j < 3; j++)
+         accel[j] += diff[j];
+      if( interpolate_geo_grid( grid, loc, interp))
+         {
+         for( j = 0; j < 3; j++)
+            diff[j] = interp[j] - accel[j];
+         if( max_err < vector3_length( diff))
+            max_err = vector3_length( diff);
+         if( max_rel_err < vector3_length( diff) / vector3_length( accel))
+            max_rel_err = vector3_length( diff) / vector3_length( accel);
+         }
+      }
+   debug_printf( "Geopotential grid: %ld nodes, degree %d\n",
+                           grid->n_nodes, (int)hdr->max_degree);
+   debug_printf( "   Max interpolation error %.3e m/s^2 (%.3e relative)\n",
+                           max_err * to_mks, max_rel_err);
+   return( max_err * to_mks);
+}
+
+/* Returns the grid for the current settings,  building the file if need
+be.  If the grid parameters haven't changed since 'old_grid' was loaded,
+that's reused.  Called with geo_grid_mutex locked.  The file is checked,
+and if need be rebuilt,  with a lock held on it,  and a rebuilt file is
+written under a temporary name and renamed,  so other processes (with
+'fo -p') never see a partly-built or truncated grid;  see lock_data_file( )
+in 'bc405.cpp'.  */
+
+static GEO_GRID *load_geo_grid( const FIND_ORB_SETTINGS *settings,
+                  const double planet_gm, const GEO_GRID *old_grid)
+{
+   const char *filename = "geo_grid.dat";
+   GEO_GRID *rval = (GEO_GRID *)calloc( 1, sizeof( GEO_GRID));
+   GEO_GRID_HEADER hdr, old_hdr;
+   FILE *ifile;
+
+   assert( rval);
+   rval->generation = settings->generation;
+   if( settings->geo_grid_max <= settings->geo_grid_min)
+      return( rval);
+   memset( &hdr, 0, sizeof( GEO_GRID_HEADER));
+   memcpy( hdr.magic, GEO_GRID_MAGIC, 8);
+   hdr.spacing = settings->geo_grid_spacing / AU_IN_KM;
+   hdr.r_min = EARTH_R + settings->geo_grid_min / AU_IN_KM;
+   hdr.r_max = EARTH_R + settings->geo_grid_max / AU_IN_KM;
+   hdr.n_side = 2 * (int32_t)ceil( hdr.r_max / hdr.spacing) + 9;
+   hdr.origin = -(double)( hdr.n_side / 2) * hdr.spacing;
+   hdr.max_degree = geo_degree_at( hdr.r_min, settings->geo_terms);
+   if( hdr.max_degree > 50)      /* GGM03C terms in 'geo_pot.cpp' stop there */
+      hdr.max_degree = 50;
+   hdr.planet_gm = planet_gm;
+   hdr.j2 = EARTH_J2;
+   if( old_grid && old_grid->hdr
+               && !memcmp( old_grid->hdr, &hdr, sizeof( hdr))
+               && old_grid->max_err <= settings->geo_grid_max_err)
+      {
+      *rval = *old_grid;
+      rval->generation = settings->generation;
+      return( rval);
+      }
+   if( 4.2 * pow( (hdr.r_max + 3.5 * hdr.spacing) / hdr.spacing, 3.)
+                        > (double)GEO_GRID_MAX_NODES)
+      {
+      debug_printf( "Geopotential grid would be too big;  not used\n");
+      return( rval);
+      }
+   ifile = lock_data_file( filename);
+   if( !ifile)
+      return( rval);
+   if( fread( &old_hdr, sizeof( old_hdr), 1, ifile) != 1
+               || memcmp( &old_hdr, &hdr, sizeof( hdr))
+               || !map_geo_grid( ifile, rval))
+      {              /* new,  or made with other settings */
+      char temp_name[255];
+      FILE *ofile = create_temp_data_file( filename, temp_name);
+
+      debug_printf( "Building geopotential grid\n");
+      if( !ofile || build_geo_grid( ofile, &hdr) < 0)
+         {
+         unlock_data_file( ifile);
+         fclose( ifile);
+         if( ofile)
+            remove( temp_name);
+         return( rval);
+         }
+      ifile = replace_data_file( ifile, filename, temp_name);
+      if( ifile && !map_geo_grid( ifile, rval))
+         debug_printf( "'%s' is the wrong size\n", filename);
+      }
+   if( ifile)
+      {
+      unlock_data_file( ifile);
+      fclose( ifile);
+      }
+   if( rval->hdr)
+      {
+      rval->max_err = check_geo_grid_error( rval);
+      if( rval->max_err > settings->geo_grid_max_err)
+         {        /* nobody else has it yet,  so we can release it */
+         debug_printf( "   Above the %.3e m/s^2 limit;  grid not used\n",
+                        settings->geo_grid_max_err);
+         release_geo_grid( rval);
+         }
+      }
+   return( rval);
+}
+
+/* Gets the acceleration from the grid if we're using one and 'loc' is
+inside it.  Returns false if the series must be used instead.  The grid
+is only ever replaced by a newer one,  never by one for older settings
+(which a thread that fetched its settings just before they changed might
+otherwise ask for).  */
+
+static bool geo_grid_accel( double *grad, const double *loc,
+                                    const double planet_gm)
+{
+   const FIND_ORB_SETTINGS *settings = get_settings( );
+   const GEO_GRID *grid = ATOMIC_LOAD( &curr_geo_grid);
+
+   if( !settings->geo_grid_max && !grid)
+      return( false);
+   if( !grid || grid->generation < settings->generation)
+      {
+      LOCK_MUTEX( geo_grid_mutex);
+      grid = curr_geo_grid;
+      if( !grid || grid->generation < settings->generation)
+         {
+         grid = load_geo_grid( settings, planet_gm, grid);
+         ATOMIC_STORE( &curr_geo_grid, grid);
+         }
+      UNLOCK_MUTEX( geo_grid_mutex);
+      }
+   return( grid->hdr && interpolate_geo_grid( grid, loc, grad));
+}
+
+/* As zonal_gradient( ),  but for the Earth,  the GGM03 model (see
+'geo_pot.cpp') can be used,  or the grid made from it (see above). */
+
+static void oblateness_gradient( double *grad, const double *loc,
+                   const double planet_gm,
+                   const double j2, const double j3, const double j4)
+{
+   if( j3 == EARTH_J3)
+      {
+      const int n_terms = get_settings( )->geo_terms;
+
+      if( n_terms > 0)     /* n_term <= 0 -> use "usual" J2 & J3 & J4 */
+         {
+         const double r = vector3_length( loc);
+
+         if( !geo_grid_accel( grad, loc, planet_gm))
+            geo_accel_pines( loc[0], loc[1], loc[2], grad,
+                                 geo_degree_at( r, n_terms));
+         return;
+         }
+      }
+   zonal_gradient( grad, loc, planet_gm, j2, j3, j4);
+}
+
    /* For testing purposes,  one can multiply the relativistic effect by */
    /* a constant 'general_relativity_factor'.  Set to zero,  this disables */
    /* GR;  set to one,  it mirrors the actual universe.  I've used this    */
@@ -363,8 +795,8 @@ alpha to the inverse of that.
 
 static inline double comet_g_func( const double r)
 {
-   static int formula_to_use = -1;
-   static double alpha = 0.;
+   static THREAD_LOCAL int formula_to_use = -1;
+   static THREAD_LOCAL double alpha = 0.;
 
    if( formula_to_use == -1)
       formula_to_use = atoi( get_environment_ptr( "2009BD"));
@@ -376,11 +808,11 @@ static inline double comet_g_func( const double r)
 
    if( !formula_to_use)    /* default, Marsden/Sekanina formula */
       {
-      static double r0 = 2.808;         /* AU */
-      static double m = 2.15;
-      static double n = 5.093;
-      static double k = 4.6142;
-      static bool first_time = true;
+      static THREAD_LOCAL double r0 = 2.808;         /* AU */
+      static THREAD_LOCAL double m = 2.15;
+      static THREAD_LOCAL double n = 5.093;
+      static THREAD_LOCAL double k = 4.6142;
+      static THREAD_LOCAL bool first_time = true;
       double r_over_r0;
 
       if( first_time)
@@ -515,9 +947,9 @@ perhaps with a table of omega values. */
 void calc_approx_planet_orientation( const int planet,
          const int system_number, const double jde, double *matrix)
 {
-   static double cached_matrix[9];
-   static double cached_jde = 0.;
-   static int cached_planet = -1;
+   static THREAD_LOCAL double cached_matrix[9];
+   static THREAD_LOCAL double cached_jde = 0.;
+   static THREAD_LOCAL int cached_planet = -1;
    const double range = 1.;
    const double new_jde = floor( jde / range + .5) * range;
 
@@ -548,7 +980,8 @@ up the mass thrown into the sun linearly.  The reason for this is to avoid
 a discontinuity,  and to instead have a gradual,  linear increase in the
 mass we use for the sun.         */
 
-static double include_thrown_in_planets( const double r)
+static double include_thrown_in_planets( const double r,
+                                 const unsigned perturbers)
 {
    const int n_radii = 9;
    const double radii[9] = { 0., .38709927, .72333566, 1.00000261,
@@ -568,6 +1001,100 @@ static double include_thrown_in_planets( const double r)
    return( rval);
 }
 
+/* Adaptive perturber pruning (see PRUNE_PERTURBERS in 'environ.def' and
+integrate_orbit_in_context( ) in 'orb_func.cpp').  If we drop planet i,
+the acceleration changes by the planet's direct and indirect terms,  less
+whatever include_thrown_in_planets( ) then puts into the sun for it.  We
+evaluate that at the current position;  at the position 'span' days from
+now,  extrapolating the object in a straight line and interpolating the
+planet;  and at the closest approach in between,  so that a planet we're
+heading toward is kept.
+
+   Leaving out an acceleration a for a time T shifts the object by about
+a*T^2/2,  and that error keeps growing for as long as the planet stays
+dropped;  it doesn't go away at the next check.  So what has to be below
+'tolerance' is the largest of those accelerations times horizon^2/2,
+where 'horizon' is how long the planet may stay dropped (in practice,
+the rest of the integration).  (Comparing with the error over a single
+step instead lets errors of thousands of times the tolerance build up
+over a few decades.)  Planets meeting this are set in the returned mask.
+
+   Only planets are considered.  The earth and moon are left alone,  since
+their handling depends on each other (see below),  as are the satellites
+(which are only turned on near their primaries anyway) and asteroids. */
+
+static double pruning_accel( const int planet, const double *obj_loc,
+                                 const double *planet_loc)
+{
+   const double r = vector3_length( obj_loc);
+   const double r_planet = vector3_length( planet_loc);
+   const double thrown_in =
+            include_thrown_in_planets( r, ~(1u << planet)) - 1.;
+   double delta[3], accel[3], dist;
+   int i;
+
+   for( i = 0; i < 3; i++)
+      delta[i] = obj_loc[i] - planet_loc[i];
+   dist = vector3_length( delta);
+   for( i = 0; i < 3; i++)
+      accel[i] = SOLAR_GM * (thrown_in * obj_loc[i] / (r * r * r)
+               - planet_mass[planet] * (delta[i] / (dist * dist * dist)
+                                + planet_loc[i] / (r_planet * r_planet * r_planet)));
+   return( vector3_length( accel));
+}
+
+extern unsigned excluded_perturbers;
+
+unsigned find_negligible_perturbers( const double jd, const double *state,
+            const unsigned candidates, const double span,
+            const double horizon, const double tolerance)
+{
+   const double max_accel = 2. * tolerance / (horizon * horizon);
+   unsigned rval = 0;
+   int i, j;
+
+   for( i = 1; i < 10; i++)
+      if( ((candidates >> i) & 1) && i != IDX_EARTH
+                        && !((excluded_perturbers >> i) & 1))
+         {
+         double loc0[3], loc1[3], obj_loc[3], planet_loc[3];
+         double dvel[3], dvel2 = 0., dot = 0., fraction;
+         bool negligible;
+
+         planet_posn( i, jd, loc0);
+         planet_posn( i, jd + span, loc1);
+         for( j = 0; j < 3; j++)
+            {
+            dvel[j] = state[j + 3] * span - (loc1[j] - loc0[j]);
+            dvel2 += dvel[j] * dvel[j];
+            dot += dvel[j] * (state[j] - loc0[j]);
+            }
+         fraction = (dvel2 ? -dot / dvel2 : 0.);
+         if( fraction < 0.)
+            fraction = 0.;
+         if( fraction > 1.)
+            fraction = 1.;
+         negligible = (pruning_accel( i, state, loc0) < max_accel);
+         for( j = 0; j < 3; j++)
+            {
+            obj_loc[j] = state[j] + state[j + 3] * span;
+            planet_loc[j] = loc1[j];
+            }
+         if( negligible)
+            negligible = (pruning_accel( i, obj_loc, planet_loc) < max_accel);
+         for( j = 0; j < 3; j++)
+            {
+            obj_loc[j] = state[j] + state[j + 3] * span * fraction;
+            planet_loc[j] = loc0[j] + (loc1[j] - loc0[j]) * fraction;
+            }
+         if( negligible)
+            negligible = (pruning_accel( i, obj_loc, planet_loc) < max_accel);
+         if( negligible)
+            rval |= (1u << i);
+         }
+   return( rval);
+}
+
 /* Returns a passable estimate of the atmospheric density,  in kg/m^3,
 as a function of height above sea level.  This just does an interpolation
 within a table giving the atmospheric density,  at ten-kilometer intervals,
@@ -660,8 +1187,6 @@ static double atmospheric_density( const double ht_in_km)
 #define TITAN_LIMIT .03
 
 unsigned excluded_perturbers = (unsigned)-1;
-int best_fit_planet;
-double best_fit_planet_dist;
 
 /* The Earth and Moon pose a special problem in the following function.
 The way we want things to work is this:  if the earth's perturbations are
@@ -711,48 +1236,217 @@ static double compute_accel_multiplier( double fraction)
 
 #define FUDGE_FACTOR .9
 
-int planet_hit = -1;
+static const double planet_radius[11] = {
+                     SUN_R * FUDGE_FACTOR, MERCURY_R * FUDGE_FACTOR,
+                     VENUS_R * FUDGE_FACTOR, EARTH_R * FUDGE_FACTOR,
+                     MARS_R * FUDGE_FACTOR, JUPITER_R * FUDGE_FACTOR,
+                     SATURN_R * FUDGE_FACTOR, URANUS_R * FUDGE_FACTOR,
+                     NEPTUNE_R * FUDGE_FACTOR, PLUTO_R * FUDGE_FACTOR,
+                     MOON_R * FUDGE_FACTOR };
+
+/* The force model profiler.  With 'force_profiling' set (see
+reset_force_profile( )),  calc_orbit_derivatives( ) times each term of
+the force model and adds it to the context's profile.  Planets are timed
+one at a time,  not counting any geopotential (J2 and up) or atmospheric
+drag computed for them,  which are timed separately.  At the end of each
+integration,  the context profile is 'harvested' into a process-wide
+total.  dump_force_profile( ) writes that out as one tab-separated line
+per object,  along with the planet position cache hits/misses/evictions
+(counted in 'pl_cache.cpp' with ATOMIC_ADD( ),  since they're bumped by
+whichever thread uses the cache),  then resets it.
+
+   The file is appended to,  with a header line when it's created.  When
+columns are added,  they go at the end,  and FORCE_PROFILE_FORMAT is
+bumped;  if the last header already in the file doesn't match,  the format
+number and new header are written,  so each block of lines is preceded by
+its own header.  The file is only scanned for that last header on a
+process' first dump to it;  after that,  we know it's ours.  (Otherwise,
+dumping after each object of a batch would take time quadratic in the
+number of objects.)   */
+
+#define FORCE_PROFILE_FORMAT 2
+
+static const char *force_profile_header =
+               "#object\tperturbers\tn_evals\ttotal_ns"
+               "\tplanet_n\tplanet_ns\tasteroid_n\tasteroid_ns"
+               "\tgeopot_n\tgeopot_ns\trelativity_n\trelativity_ns"
+               "\tnongrav_n\tnongrav_ns\tdrag_n\tdrag_ns"
+               "\tcache_hits\tcache_misses\tsteps\trejected_steps"
+               "\tcache_evictions\n";
+
+bool force_profiling = false;
+static FORCE_PROFILE total_profile;
+extern long planet_cache_hits, planet_cache_misses;   /* pl_cache.cpp */
+extern long planet_cache_evictions;                   /* pl_cache.cpp */
+
+FIND_ORB_MUTEX( profile_mutex);
+
+static int64_t profile_ns( void)
+{
+#ifdef FIND_ORB_THREADS
+   struct timespec t;
+
+   clock_gettime( CLOCK_MONOTONIC, &t);
+   return( (int64_t)t.tv_sec * (int64_t)1000000000 + (int64_t)t.tv_nsec);
+#else
+   return( nanoseconds_since_1970( ));
+#endif
+}
+
+static void profile_term( FORCE_PROFILE *profile, const int term,
+                                    const int64_t ns)
+{
+   profile->n_calls[term]++;
+   profile->ns[term] += ns;
+}
+
+void harvest_force_profile( INTEGRATION_CONTEXT *context)
+{
+   if( force_profiling)
+      {
+      const FORCE_PROFILE *pptr = &context->profile;
+      int i;
+
+      LOCK_MUTEX( profile_mutex);
+      for( i = 0; i < N_PROFILE_TERMS; i++)
+         {
+         total_profile.n_calls[i] += pptr->n_calls[i];
+         total_profile.ns[i] += pptr->ns[i];
+         }
+      total_profile.n_evaluations += pptr->n_evaluations;
+      total_profile.n_steps += pptr->n_steps;
+      total_profile.n_rejected_steps += pptr->n_rejected_steps;
+      total_profile.total_ns += pptr->total_ns;
+      UNLOCK_MUTEX( profile_mutex);
+      }
+   memset( &context->profile, 0, sizeof( FORCE_PROFILE));
+}
+
+/* Profiling is turned on by setting FORCE_PROFILE in 'environ.dat' to
+the name of the file to which profiles should be appended. */
+
+void reset_force_profile( void)
+{
+   static bool setting_checked = false;
+
+   if( !setting_checked)
+      {
+      force_profiling = (*get_environment_ptr( "FORCE_PROFILE") != '\0');
+      setting_checked = true;
+      }
+   LOCK_MUTEX( profile_mutex);
+   memset( &total_profile, 0, sizeof( FORCE_PROFILE));
+   ATOMIC_STORE( &planet_cache_hits, 0L);
+   ATOMIC_STORE( &planet_cache_misses, 0L);
+   ATOMIC_STORE( &planet_cache_evictions, 0L);
+   UNLOCK_MUTEX( profile_mutex);
+}
+
+int dump_force_profile( const char *object_name)
+{
+   extern unsigned perturbers;
+   static char checked_file_name[255];
+   const char *file_name = get_environment_ptr( "FORCE_PROFILE");
+   FILE *ofile;
+   char last_header[400], buff[400];
+   int i;
+
+   if( !force_profiling)
+      return( 0);
+   ofile = fopen_ext( file_name, "ca+");
+   if( !ofile)
+      return( -1);
+   LOCK_MUTEX( profile_mutex);
+   if( strcmp( checked_file_name, file_name))
+      {        /* scan for the last header only on our first dump to the file */
+      *last_header = '\0';
+      fseek( ofile, 0L, SEEK_SET);
+      while( fgets( buff, sizeof( buff), ofile))
+         if( *buff == '#')
+            strcpy( last_header, buff);
+      if( strcmp( last_header, force_profile_header))
+         {        /* new file,  or one of another format */
+         fseek( ofile, 0L, SEEK_END);
+         fprintf( ofile, "#FORCE_PROFILE format %d\n", FORCE_PROFILE_FORMAT);
+         fputs( force_profile_header, ofile);
+         }
+      strncpy( checked_file_name, file_name, sizeof( checked_file_name) - 1);
+      }
+   fprintf( ofile, "%s\t%x\t%ld\t%lld", object_name, perturbers,
+               total_profile.n_evaluations, (long long)total_profile.total_ns);
+   for( i = 0; i < N_PROFILE_TERMS; i++)
+      fprintf( ofile, "\t%ld\t%lld", total_profile.n_calls[i],
+                        (long long)total_profile.ns[i]);
+   fprintf( ofile, "\t%ld\t%ld\t%ld\t%ld\t%ld\n",
+               ATOMIC_LOAD( &planet_cache_hits),
+               ATOMIC_LOAD( &planet_cache_misses), total_profile.n_steps,
+               total_profile.n_rejected_steps,
+               ATOMIC_LOAD( &planet_cache_evictions));
+   UNLOCK_MUTEX( profile_mutex);
+   fclose( ofile);
+   reset_force_profile( );
+   return( 0);
+}
+
+/* Gets the heliocentric positions of the planets and moon in 'mask' with
+a single planet_posns( ) call (see 'pl_cache.cpp'),  into locs[3 * n...].
+If the moon is wanted,  so is the earth,  and the two are separated out
+of the barycenter just as earth_lunar_posn( ) does.  Otherwise,  'earth'
+is the Earth-Moon barycenter.  */
 
-int calc_derivatives( const double jd, const double *ival, double *oval,
-                           const int reference_planet)
+static void get_perturber_locs( const double jd, unsigned mask, double *locs)
+{
+   int j;
+
+   if( (mask >> IDX_MOON) & 1)
+      mask |= (1 << IDX_EARTH);
+   planet_posns( mask, jd, locs);
+   if( (mask >> IDX_MOON) & 1)
+      for( j = 0; j < 3; j++)
+         {
+         const double earth_moon_barycenter_factor = 82.300679;
+
+         locs[3 * IDX_EARTH + j] -= locs[3 * IDX_MOON + j]
+                                       / earth_moon_barycenter_factor;
+         locs[3 * IDX_MOON + j] += locs[3 * IDX_EARTH + j];
+         }
+}
+
+static int calc_orbit_derivatives( INTEGRATION_CONTEXT *context,
+            const double jd, const double *ival, double *oval,
+            const int reference_planet)
 {
    double r, r2 = 0., solar_accel = 1. + object_mass;
    int i, j;
-   unsigned local_perturbers = perturbers;
-   double lunar_loc[3], jupiter_loc[3], saturn_loc[3];
+   unsigned local_perturbers = context->perturbers;
+   double planet_locs[3 * (IDX_MOON + 1)], jupiter_loc[3], saturn_loc[3];
    double relativistic_accel[3];
-   extern int n_extra_params;
+   const int n_extra_params = context->n_extra_params;
+   const double *solar_pressure = context->solar_pressure;
    static const double sphere_of_influence_radius[10] = {
             10000., 0.00075, 0.00412, 0.00618,   /* sun, mer, ven, ear */
             0.00386, 0.32229, 0.36466, 0.34606,  /* mar, jup, sat, ura */
             0.57928, 0.02208 };                  /* nep, plu */
-   static const double planet_radius[11] = {
-                        SUN_R * FUDGE_FACTOR, MERCURY_R * FUDGE_FACTOR,
-                        VENUS_R * FUDGE_FACTOR, EARTH_R * FUDGE_FACTOR,
-                        MARS_R * FUDGE_FACTOR, JUPITER_R * FUDGE_FACTOR,
-                        SATURN_R * FUDGE_FACTOR, URANUS_R * FUDGE_FACTOR,
-                        NEPTUNE_R * FUDGE_FACTOR, PLUTO_R * FUDGE_FACTOR,
-                        MOON_R * FUDGE_FACTOR };
+   const bool profiling = force_profiling;
+   const int64_t t_eval_start = (profiling ? profile_ns( ) : 0);
+   int64_t t_start = 0;
 
    assert( fabs( jd) < 1e+9);
+   context->n_evaluations++;
    oval[0] = ival[3];
    oval[1] = ival[4];
    oval[2] = ival[5];
-   best_fit_planet = 0;
-   planet_hit = -1;
+   context->best_fit_planet = 0;
+   context->planet_hit = -1;
    for( i = 0; i < 3; i++)
       r2 += ival[i] * ival[i];
    r = sqrt( r2);
    if( n_extra_params == 1)  /* straightforward radiation pressure */
-      {
-      extern double solar_pressure[];
-
       solar_accel -= solar_pressure[0];
-      }
    if( r < planet_radius[0])     /* special fudge to keep acceleration from reaching */
       {                          /* infinity inside the sun;  see above notes        */
       solar_accel *= compute_accel_multiplier( r / planet_radius[0]);
-      planet_hit = 0;
+      context->planet_hit = 0;
       if( debug_level)
          debug_printf( "Inside the sun: %f km\n", r * AU_IN_KM);
       if( !solar_accel)
@@ -765,13 +1459,20 @@ int calc_derivatives( const double jd, const double *ival, double *oval,
 
    solar_accel *= -SOLAR_GM / (r2 * r);
 
-   if( perturbers)
+   if( local_perturbers)
+      {
+      if( profiling)
+         t_start = profile_ns( );
       set_relativistic_accel( relativistic_accel, ival);
+      if( profiling)
+         profile_term( &context->profile, PROFILE_RELATIVITY,
+                                    profile_ns( ) - t_start);
+      }
    else                           /* shut off relativity if no perturbers */
       for( i = 0; i < 3; i++)
          relativistic_accel[i] = 0.;
 
-   solar_accel *= include_thrown_in_planets( r);
+   solar_accel *= include_thrown_in_planets( r, local_perturbers);
 
    for( i = 0; i < 3; i++)
       oval[i + 3] = solar_accel * ival[i]
@@ -779,13 +1480,22 @@ int calc_derivatives( const double jd, const double *ival, double *oval,
 
    if( (local_perturbers >> IDX_ASTEROIDS) & 1)
       if( r < 11.5 && r > 1.)
+         {
+         if( profiling)
+            t_start = profile_ns( );
          detect_perturbers( jd, ival, oval);        /* bc405.cpp */
+         if( profiling)
+            profile_term( &context->profile, PROFILE_ASTEROIDS,
+                                    profile_ns( ) - t_start);
+         }
 
 
+   if( profiling && n_extra_params == 1)    /* SRP is nearly free,  but */
+      profile_term( &context->profile, PROFILE_NONGRAV, 0);   /* count it */
    if( n_extra_params == 2 || n_extra_params == 3)
       {                  /* Marsden & Sekanina comet formula */
+      const int64_t t_nongrav = (profiling ? profile_ns( ) : 0);
       const double g = comet_g_func( r);
-      extern double solar_pressure[];
       double transverse[3], dot_prod = 0.;
 
       memcpy( transverse, ival + 3, 3 * sizeof( double));
@@ -806,15 +1516,23 @@ int calc_derivatives( const double jd, const double *ival, double *oval,
          for( i = 0; i < 3; i++)
             oval[i + 3] += g * solar_pressure[2] * out_of_plane[i] / dot_prod;
          }
+      if( profiling)
+         profile_term( &context->profile, PROFILE_NONGRAV,
+                                    profile_ns( ) - t_nongrav);
       }
 
-   if( perturbers)
+   if( local_perturbers & 0x7fe)
+      get_perturber_locs( jd, (local_perturbers & ~excluded_perturbers & 0x7fe)
+                              | (local_perturbers & (1 << IDX_MOON)), planet_locs);
+   if( context->perturbers)
       for( i = 1; i < N_PERTURB + 1; i++)
          if( ((local_perturbers >> i) & 1)
                    && !((excluded_perturbers >> i) & 1))
             {
             double planet_loc[15], accel[3], mass_to_use = planet_mass[i];
             double accel_multiplier = 1.;
+            const int64_t t_planet = (profiling ? profile_ns( ) : 0);
+            int64_t nested_ns = 0;    /* time spent on geopotential & drag */
 
             r = r2 = 0.;
             if( i >= IDX_IO)       /* Galileans,  Titan */
@@ -853,17 +1571,7 @@ int calc_derivatives( const double jd, const double *ival, double *oval,
                }
             else
                {
-               if( local_perturbers & 1024)   /* if the moon is included */
-                  {
-                  if( i == 3)
-                     earth_lunar_posn( jd, planet_loc, lunar_loc);
-                  else if( i == 10)
-                     memcpy( planet_loc, lunar_loc, 3 * sizeof( double));
-                  else
-                     planet_posn( i, jd, planet_loc);
-                  }
-               else
-                  planet_posn( i, jd, planet_loc);
+               memcpy( planet_loc, planet_locs + 3 * i, 3 * sizeof( double));
 
                for( j = 0; j < 3; j++)
                   r2 += planet_loc[j] * planet_loc[j];
@@ -903,7 +1611,7 @@ int calc_derivatives( const double jd, const double *ival, double *oval,
             if( r < planet_radius[i])
                {
                accel_multiplier = compute_accel_multiplier( r / planet_radius[i]);
-               planet_hit = i;
+               context->planet_hit = i;
                }
             if( i >= IDX_EARTH && i <= IDX_NEPTUNE && r < .015 && j2_multiplier
                                  && accel_multiplier)
@@ -916,6 +1624,8 @@ int calc_derivatives( const double jd, const double *ival, double *oval,
                const double j4[6] = { EARTH_J4, MARS_J4, JUPITER_J4,
                         SATURN_J4, URANUS_J4, NEPTUNE_J4 };
                const double total_j_mul = j2_multiplier * accel_multiplier;
+               const int64_t t_geopot = (profiling ? profile_ns( ) : 0);
+               int64_t drag_ns = 0;
 
                calc_approx_planet_orientation( i, 0, jd, matrix);
                            /* Remembering the 'accels' are 'deltas' now... */
@@ -926,7 +1636,7 @@ int calc_derivatives( const double jd, const double *ival, double *oval,
                precess_vector( matrix, delta_j2000, delta_planet);
 
                if( total_j_mul)
-                  numerical_gradient( grad, delta_planet,
+                  oblateness_gradient( grad, delta_planet,
                         planet_mass[i] * SOLAR_GM,
                         j2[i - 3], j3[i - 3], j4[i - 3]);
                else     /* inside the planet */
@@ -940,9 +1650,8 @@ int calc_derivatives( const double jd, const double *ival, double *oval,
                for( j = 0; j < 3; j++)
                   oval[j + 3] -= total_j_mul * delta_j2000[j];
                if( i == IDX_EARTH && r < ATMOSPHERIC_LIMIT && n_extra_params == 1
-                           && !*get_environment_ptr( "DRAG_SHUTOFF"))
+                           && !get_settings( )->drag_shutoff)
                   {
-                  extern double solar_pressure[];
                   const double SRP1AU = 2.3e-7;   /* kg*AU^3 / (m^2*d^2) */
                   const double amr_drag = solar_pressure[0] * SOLAR_GM / SRP1AU;
                   const double rho_cos_phi = sqrt( delta_planet[0] * delta_planet[0]
@@ -957,6 +1666,7 @@ int calc_derivatives( const double jd, const double *ival, double *oval,
                   double speed;        /* magnitude of the vel[] vector */
                   double drag[3];     /* drag acceleration,  in m/s^2 */
                   double accel_coeff;
+                  const int64_t t_drag = (profiling ? profile_ns( ) : 0);
 
                   parallax_to_lat_alt( rho_cos_phi, rho_sin_phi, NULL,
                                     &ht_in_meters, i);
@@ -986,6 +1696,17 @@ int calc_derivatives( const double jd, const double *ival, double *oval,
 //                            ht_in_meters / meters_per_km, speed, vector3_length( drag));
                   for( j = 0; j < 3; j++)
                      oval[j + 3] += drag[j] * seconds_per_day * seconds_per_day / AU_IN_METERS;
+                  if( profiling)
+                     {
+                     drag_ns = profile_ns( ) - t_drag;
+                     profile_term( &context->profile, PROFILE_DRAG, drag_ns);
+                     }
+                  }
+               if( profiling)
+                  {
+                  nested_ns = profile_ns( ) - t_geopot;
+                  profile_term( &context->profile, PROFILE_GEOPOTENTIAL,
+                                    nested_ns - drag_ns);
                   }
                }
 
@@ -1000,8 +1721,8 @@ int calc_derivatives( const double jd, const double *ival, double *oval,
             if( i < 10 && r < sphere_of_influence_radius[i]
                                 && reference_planet != -1)
                {
-               best_fit_planet = i;
-               best_fit_planet_dist = r;
+               context->best_fit_planet = i;
+               context->best_fit_planet_dist = r;
                }
 
             if( accel_multiplier)
@@ -1038,22 +1759,145 @@ int calc_derivatives( const double jd, const double *ival, double *oval,
                for( j = 0; j < 3; j++)
                   oval[j + 3] += r * planet_loc[j + 12];
                }
+            if( profiling)
+               profile_term( &context->profile, PROFILE_PLANETS,
+                                    profile_ns( ) - t_planet - nested_ns);
+            }
+   if( profiling)
+      {
+      context->profile.n_evaluations++;
+      context->profile.total_ns += profile_ns( ) - t_eval_start;
+      }
+   return( context->planet_hit);
+}
+
+/* With context->n_stm_params = N > 0,  the state vector is followed by
+a 6xN state transition matrix Phi (see 'runge.h').  Its time derivative is
+
+   d(Phi)/dt = A * Phi + B
+
+   where A is the Jacobian of the equations of motion with respect to the
+state,  and B is zero except in the non-gravitational columns,  where it's
+the partial of the acceleration with respect to that parameter.  The top
+half of A just says 'position changes at the rate given by velocity'.  The
+bottom half,  the partials of acceleration with respect to position and
+velocity,  would be a real chore to work out analytically for every term
+in the force model (planets,  J2-J4,  relativity,  drag...),  so we get it
+with forward differences of the plain orbit derivatives.  The position
+step is scaled to the distance from the sun or from the nearest planet
+(or the moon) being included as a perturber,  whichever is closer;  the
+acceleration varies on that scale,  so during a close approach the step
+shrinks with the distance.  The non-grav accelerations are linear in
+their parameters,  so B comes out essentially exact.
+
+   The nominal derivatives are computed first,  and the 'outputs' set in
+the context (best_fit_planet,  planet_hit,  etc.) are restored from them,
+so they're the same as they would be without the extra evaluations.   */
+
+static int calc_variational_derivatives( INTEGRATION_CONTEXT *context,
+            const double jd, const double *ival, double *oval,
+            const int reference_planet)
+{
+   const int n_params = context->n_stm_params;
+   const int n_nongravs = n_params - 6;
+   const int rval = calc_orbit_derivatives( context, jd, ival, oval,
+                                       reference_planet);
+   const int best_fit_planet = context->best_fit_planet;
+   const double best_fit_planet_dist = context->best_fit_planet_dist;
+   const unsigned planets = context->perturbers & ~excluded_perturbers & 0x7fe;
+   double accel_jacobian[3][6], accel_partials[MAX_N_NONGRAV_PARAMS][3];
+   double tweaked[6], tweaked_oval[6], r = 0., v = 0.;
+   int i, j, k;
+   const double *phi = ival + 6;
+   double *dphi = oval + 6;
+
+   for( i = 0; i < 3; i++)
+      {
+      r += ival[i] * ival[i];
+      v += ival[i + 3] * ival[i + 3];
+      }
+   r = sqrt( r);
+   v = sqrt( v);
+   if( planets)         /* these are cache hits after the above call */
+      {
+      double planet_locs[3 * (IDX_MOON + 1)];
+
+      get_perturber_locs( jd, planets, planet_locs);
+      for( j = 1; j <= IDX_MOON; j++)
+         if( (planets >> j) & 1)
+            {
+            const double dist = vector3_dist( ival, planet_locs + 3 * j);
+
+            if( r > dist)
+               r = dist;
             }
-   return( planet_hit);
+      }
+   for( k = 0; k < 6; k++)
+      {
+      double delta = 1e-7 * (k < 3 ? r : v);
+
+      if( !delta)
+         delta = 1e-12;
+      memcpy( tweaked, ival, 6 * sizeof( double));
+      tweaked[k] += delta;
+      calc_orbit_derivatives( context, jd, tweaked, tweaked_oval,
+                                       reference_planet);
+      for( i = 0; i < 3; i++)
+         accel_jacobian[i][k] = (tweaked_oval[i + 3] - oval[i + 3]) / delta;
+      }
+   for( k = 0; k < n_nongravs; k++)
+      {
+      const double saved_param = context->solar_pressure[k];
+      const double delta = 1e-6;
+
+      context->solar_pressure[k] += delta;
+      calc_orbit_derivatives( context, jd, ival, tweaked_oval,
+                                       reference_planet);
+      context->solar_pressure[k] = saved_param;
+      for( i = 0; i < 3; i++)
+         accel_partials[k][i] = (tweaked_oval[i + 3] - oval[i + 3]) / delta;
+      }
+   context->best_fit_planet = best_fit_planet;
+   context->best_fit_planet_dist = best_fit_planet_dist;
+   context->planet_hit = rval;
+
+   for( j = 0; j < n_params; j++, phi += 6, dphi += 6)
+      for( i = 0; i < 3; i++)
+         {
+         double tval = (j >= 6 ? accel_partials[j - 6][i] : 0.);
+
+         dphi[i] = phi[i + 3];
+         for( k = 0; k < 6; k++)
+            tval += accel_jacobian[i][k] * phi[k];
+         dphi[i + 3] = tval;
+         }
+   return( rval);
+}
+
+int calc_derivatives( INTEGRATION_CONTEXT *context, const double jd,
+            const double *ival, double *oval, const int reference_planet)
+{
+   if( context->n_stm_params)
+      return( calc_variational_derivatives( context, jd, ival, oval,
+                                       reference_planet));
+   else
+      return( calc_orbit_derivatives( context, jd, ival, oval,
+                                       reference_planet));
 }
 
-int calc_derivativesl( const ldouble jd, const ldouble *ival, ldouble *oval,
-                           const int reference_planet)
+int calc_derivativesl( INTEGRATION_CONTEXT *context, const ldouble jd,
+            const ldouble *ival, ldouble *oval, const int reference_planet)
 {
-   unsigned i;
-   int rval;
-   double ival1[6], oval1[6];
+   int i, rval;
+   const int n_vals = STM_N_VALS( context->n_stm_params);
+   double ival1[MAX_STM_N_VALS] = { 0. }, oval1[MAX_STM_N_VALS];
 
    assert( fabs( (double)jd) < 1e+9);
-   for( i = 0; i < 6; i++)
+   for( i = 0; i < n_vals; i++)
       ival1[i] = (double)ival[i];
-   rval = calc_derivatives( (double)jd, ival1, oval1, reference_planet);
-   for( i = 0; i < 6; i++)
+   rval = calc_derivatives( context, (double)jd, ival1, oval1,
+                                             reference_planet);
+   for( i = 0; i < n_vals; i++)
       oval[i] = (ldouble)oval1[i];
    return( rval);
 }
@@ -1320,9 +2164,9 @@ static void compute_ref_state( ELEMENTS *ref_orbit, double *ref_state,
 #define N_EVALS 13
 #define N_EVALS_PLUS_ONE 14
 
-double take_pd89_step( const double jd, ELEMENTS *ref_orbit,
-                 const double *ival, double *ovals,
-                 const int n_vals, const double step)
+double take_pd89_step( INTEGRATION_CONTEXT *context, const double jd,
+            ELEMENTS *ref_orbit, const double *ival, double *ovals,
+            const int n_vals, const double step)
 {
    double *ivals[N_EVALS_PLUS_ONE], *ivals_p[N_EVALS], rval = 0.;
    int i, j, k;
@@ -1339,8 +2183,10 @@ double take_pd89_step( const double jd, ELEMENTS *ref_orbit,
        B_12_1, B_12_2, B_12_3, B_12_4, B_12_5, B_12_6, B_12_7, B_12_8, B_12_9, B_12_10, B_12_11,
        B_13_1, B_13_2, B_13_3, B_13_4, B_13_5, B_13_6, B_13_7, B_13_8, B_13_9, B_13_10, B_13_11, B_13_12,
        CHAT_1, CHAT_2, CHAT_3, CHAT_4, CHAT_5, CHAT_6, CHAT_7, CHAT_8, CHAT_9, CHAT_10, CHAT_11, CHAT_12, CHAT_13 };
-   const double avals[N_EVALS_PLUS_ONE] = { 0, A_1, A_2, A_3, A_4, A_5,
-             A_6, A_7, A_8, A_9, A_10, A_11, A_12, A_13 };
+         /* Stage j is evaluated at jd + step * A_(j+1);  the final */
+         /* 'stage' just assembles the result at the end of the step. */
+   const double avals[N_EVALS_PLUS_ONE] = { A_1, A_2, A_3, A_4, A_5,
+             A_6, A_7, A_8, A_9, A_10, A_11, A_12, A_13, 1. };
    const double *bptr = bvals;
 
    ivals[0] = (double *)calloc( (2 * N_EVALS + 1) * n_vals, sizeof( double));
@@ -1355,16 +2201,16 @@ double take_pd89_step( const double jd, ELEMENTS *ref_orbit,
 
    for( j = 0; j <= N_EVALS; j++)
       {
-      double ref_state_j[9], state_j[6];
+      double ref_state_j[9], state_j[MAX_STM_N_VALS];
       const double jd_j = jd + step * avals[j];
 
       compute_ref_state( ref_orbit, ref_state_j, jd_j);
       if( !j)
          {
-         memcpy( state_j, ival, 6 * sizeof( double));
+         memcpy( state_j, ival, n_vals * sizeof( double));
                /* subtract the analytic posn/vel from the numeric: */
          for( i = 0; i < n_vals; i++)
-            ivals[0][i] = ival[i] - ref_state_j[i];
+            ivals[0][i] = ival[i] - (i < 6 ? ref_state_j[i] : 0.);
          }
       else
          for( i = 0; i < n_vals; i++)
@@ -1374,13 +2220,14 @@ double take_pd89_step( const double jd, ELEMENTS *ref_orbit,
             for( k = 0; k < j; k++)
                tval += bptr[k] * ivals_p[k][i];
             ivals[j][i] = tval * step + ivals[0][i];
-            state_j[i] = ivals[j][i] + ref_state_j[i];
+            state_j[i] = ivals[j][i] + (i < 6 ? ref_state_j[i] : 0.);
             }
       bptr += j;
       if( j != N_EVALS)
          {
          assert( fabs( jd_j) < 1e+9);
-         calc_derivatives( jd_j, state_j, ivals_p[j], ref_orbit->central_obj);
+         calc_derivatives( context, jd_j, state_j, ivals_p[j],
+                                             ref_orbit->central_obj);
          for( k = 0; k < 6; k++)
             ivals_p[j][k] -= ref_state_j[k + 3];
          }
@@ -1388,7 +2235,9 @@ double take_pd89_step( const double jd, ELEMENTS *ref_orbit,
          memcpy( ovals, state_j, n_vals * sizeof( double));
       }
 
-   for( i = 0; i < n_vals; i++)
+            /* Only the orbit itself is used for the error estimate;  a */
+            /* state transition matrix (if any) goes along for the ride. */
+   for( i = 0; i < 6; i++)
       {
       double tval = 0.;
       const double err_coeff[N_EVALS] = { CHAT_1 - C_1, CHAT_2 - C_2,
@@ -1400,6 +2249,7 @@ double take_pd89_step( const double jd, ELEMENTS *ref_orbit,
          tval += err_coeff[k] * ivals_p[k][i];
       rval += tval * tval;
       }
+   free( ivals[0]);
    return( sqrt( rval * step * step));
 }
 
@@ -1479,9 +2329,9 @@ double take_pd89_step( const double jd, ELEMENTS *ref_orbit,
 #define RKF_A6            .875
 #endif
 
-ldouble take_rk_stepl( const ldouble jd, ELEMENTS *ref_orbit,
-                 const ldouble *ival, ldouble *ovals,
-                 const int n_vals, const ldouble step)
+ldouble take_rk_stepl( INTEGRATION_CONTEXT *context, const ldouble jd,
+            ELEMENTS *ref_orbit, const ldouble *ival, ldouble *ovals,
+            const int n_vals, const ldouble step)
 {
    ldouble *ivals[7], *ivals_p[6], rval = 0.;
    int i, j, k;
@@ -1513,7 +2363,7 @@ ldouble take_rk_stepl( const ldouble jd, ELEMENTS *ref_orbit,
 
    for( j = 0; j < 7; j++)
       {
-      ldouble ref_state_j[9], state_j[6];
+      ldouble ref_state_j[9], state_j[MAX_STM_N_VALS];
       const ldouble jd_j = jd + step * avals[j];
       double temp_array[9];
 
@@ -1522,10 +2372,10 @@ ldouble take_rk_stepl( const ldouble jd, ELEMENTS *ref_orbit,
          ref_state_j[i] = (ldouble)temp_array[i];
       if( !j)
          {
-         memcpy( state_j, ival, 6 * sizeof( ldouble));
+         memcpy( state_j, ival, n_vals * sizeof( ldouble));
                /* subtract the analytic posn/vel from the numeric: */
          for( i = 0; i < n_vals; i++)
-            ivals[0][i] = ival[i] - ref_state_j[i];
+            ivals[0][i] = ival[i] - (i < 6 ? ref_state_j[i] : 0.);
          }
       else
          for( i = 0; i < n_vals; i++)
@@ -1535,7 +2385,7 @@ ldouble take_rk_stepl( const ldouble jd, ELEMENTS *ref_orbit,
             for( k = 0; k < j; k++)
                tval += bptr[k] * ivals_p[k][i];
             ivals[j][i] = tval * step + ivals[0][i];
-            state_j[i] = ivals[j][i] + ref_state_j[i];
+            state_j[i] = ivals[j][i] + (i < 6 ? ref_state_j[i] : 0.);
             }
       bptr += j;
       if( j != 6)
@@ -1543,7 +2393,8 @@ ldouble take_rk_stepl( const ldouble jd, ELEMENTS *ref_orbit,
 #ifndef __WATCOMC__
          assert( fabsl( jd_j) < 1e+9);
 #endif
-         calc_derivativesl( jd_j, state_j, ivals_p[j], ref_orbit->central_obj);
+         calc_derivativesl( context, jd_j, state_j, ivals_p[j],
+                                             ref_orbit->central_obj);
          for( k = 0; k < 6; k++)
             ivals_p[j][k] -= ref_state_j[k + 3];
          }
@@ -1551,7 +2402,9 @@ ldouble take_rk_stepl( const ldouble jd, ELEMENTS *ref_orbit,
          memcpy( ovals, state_j, n_vals * sizeof( ldouble));
       }
 
-   for( i = 0; i < n_vals; i++)
+            /* As with take_pd89_step( ),  the error estimate is */
+            /* for the orbit only,  not any state transition matrix: */
+   for( i = 0; i < 6; i++)
       {
       ldouble tval = 0.;
       static const ldouble err_coeffs[6] = {
@@ -1568,24 +2421,471 @@ ldouble take_rk_stepl( const ldouble jd, ELEMENTS *ref_orbit,
    return( sqrtl( rval * step * step));
 }
 
-double take_rk_step( const double jd, ELEMENTS *ref_orbit,
-                 const double *ival, double *ovals,
-                 const int n_vals, const double step)
+/* take_rk_stepl( ) gets its extra precision from x87 long doubles,  which
+are slow (they can't be vectorized,  and every operation goes through the
+x87 stack) and aren't any more precise than doubles on some compilers.
+take_rk_step_dd( ) does the same step with 'double-double' arithmetic:  a
+value is held as the unevaluated sum hi + lo of two doubles,  giving about
+106 bits of mantissa,  using only ordinary double operations.  See Dekker,
+"A floating-point technique for extending the available precision",
+Numer. Math. 18 (1971),  and Hida,  Li and Bailey's QD library.
+
+   As with the long double version,  the force model is evaluated in
+double precision;  the extra bits are for the state,  and for summing up
+the stages.  (That's where the rounding error goes when many small steps
+are taken,  as in close approaches.)  Coefficients and derivatives are
+doubles,  so we only need double-double by double products.
+
+   The error-free transformations below assume each double operation is
+rounded to double.  That isn't so when intermediate values are kept in
+x87 registers (FLT_EVAL_METHOD != 0,  as in older 32-bit builds),  nor
+with -ffast-math;  in the first case,  we always use long doubles.  */
+
+#define DDOUBLE struct ddouble
+
+DDOUBLE
+   {
+   double hi, lo;
+   };
+
+static inline DDOUBLE dd_two_sum( const double a, const double b)
 {
-   ldouble ivall[6], ovalsl[6], rvall;
-   unsigned i;
+   DDOUBLE rval;
+   const double bb = (rval.hi = a + b) - a;
+
+   rval.lo = (a - (rval.hi - bb)) + (b - bb);
+   return( rval);
+}
 
+static inline DDOUBLE dd_quick_two_sum( const double a, const double b)
+{
+   DDOUBLE rval;
+
+   rval.hi = a + b;
+   rval.lo = b - (rval.hi - a);
+   return( rval);
+}
+
+static inline DDOUBLE dd_two_prod( const double a, const double b)
+{
+   DDOUBLE rval;
+
+   rval.hi = a * b;
+#ifdef FP_FAST_FMA
+   rval.lo = fma( a, b, -rval.hi);
+#else
+   {
+   const double splitter = 134217729.;    /* 2^27 + 1 */
+   double t = splitter * a;
+   const double a_hi = t - (t - a), a_lo = a - a_hi;
+   double b_hi, b_lo;
+
+   t = splitter * b;
+   b_hi = t - (t - b);
+   b_lo = b - b_hi;
+   rval.lo = ((a_hi * b_hi - rval.hi) + a_hi * b_lo + a_lo * b_hi)
+                     + a_lo * b_lo;
+   }
+#endif
+   return( rval);
+}
+
+static inline DDOUBLE dd_add( const DDOUBLE a, const DDOUBLE b)
+{
+   DDOUBLE s = dd_two_sum( a.hi, b.hi);
+   const DDOUBLE t = dd_two_sum( a.lo, b.lo);
+
+   s.lo += t.hi;
+   s = dd_quick_two_sum( s.hi, s.lo);
+   s.lo += t.lo;
+   return( dd_quick_two_sum( s.hi, s.lo));
+}
+
+static inline DDOUBLE dd_mul_d( const DDOUBLE a, const double b)
+{
+   DDOUBLE p = dd_two_prod( a.hi, b);
+
+   p.lo += a.lo * b;
+   return( dd_quick_two_sum( p.hi, p.lo));
+}
+
+double take_rk_step_dd( INTEGRATION_CONTEXT *context, const double jd,
+            ELEMENTS *ref_orbit, const double *ival, double *ovals,
+            const int n_vals, const double step)
+{
+   DDOUBLE ivals[7][MAX_STM_N_VALS], ivals_p[6][MAX_STM_N_VALS];
+   double rval = 0.;
+   int i, j, k;
+   const double bvals[21] = { RKF_B21,
+            RKF_B31, RKF_B32,
+            RKF_B41, RKF_B42, RKF_B43,
+            RKF_B51, RKF_B52, RKF_B53, RKF_B54,
+            RKF_B61, RKF_B62, RKF_B63, RKF_B64, RKF_B65,
+            RKF_CHAT1, RKF_CHAT2, RKF_CHAT3,
+            RKF_CHAT4, RKF_CHAT5, RKF_CHAT6 };
+   const double avals[7] = { RKF_A1, RKF_A2, RKF_A3, RKF_A4, RKF_A5, RKF_A6, 1.};
+   const double *bptr = bvals;
+
+   assert( n_vals <= MAX_STM_N_VALS);
+   for( j = 0; j < 7; j++)
+      {
+      double ref_state_j[9], state_j[MAX_STM_N_VALS];
+      const double jd_j = jd + step * avals[j];
+
+      compute_ref_state( ref_orbit, ref_state_j, jd_j);
+      if( !j)
+         {
+         memcpy( state_j, ival, n_vals * sizeof( double));
+               /* subtract the analytic posn/vel from the numeric: */
+         for( i = 0; i < n_vals; i++)
+            ivals[0][i] = dd_two_sum( ival[i], (i < 6 ? -ref_state_j[i] : 0.));
+         }
+      else
+         for( i = 0; i < n_vals; i++)
+            {
+            DDOUBLE tval = { 0., 0. };
+
+            for( k = 0; k < j; k++)
+               tval = dd_add( tval, dd_mul_d( ivals_p[k][i], bptr[k]));
+            ivals[j][i] = dd_add( dd_mul_d( tval, step), ivals[0][i]);
+            if( i < 6)
+               {
+               const DDOUBLE ref = { ref_state_j[i], 0. };
+
+               state_j[i] = dd_add( ivals[j][i], ref).hi;
+               }
+            else
+               state_j[i] = ivals[j][i].hi;
+            }
+      bptr += j;
+      if( j != 6)
+         {
+         double deriv[MAX_STM_N_VALS];
+
+         assert( fabs( jd_j) < 1e+9);
+         calc_derivatives( context, jd_j, state_j, deriv,
+                                             ref_orbit->central_obj);
+         for( k = 0; k < n_vals; k++)
+            ivals_p[j][k] = dd_two_sum( deriv[k],
+                                 (k < 6 ? -ref_state_j[k + 3] : 0.));
+         }
+      else     /* on last iteration,  we have our answer: */
+         memcpy( ovals, state_j, n_vals * sizeof( double));
+      }
+
+            /* As with take_pd89_step( ),  the error estimate is */
+            /* for the orbit only,  not any state transition matrix: */
    for( i = 0; i < 6; i++)
+      {
+      double tval = 0.;
+      static const double err_coeffs[6] = {
+            RKF_CHAT1 - RKF_C1, RKF_CHAT2 - RKF_C2, RKF_CHAT3 - RKF_C3,
+            RKF_CHAT4 - RKF_C4, RKF_CHAT5 - RKF_C5, RKF_CHAT6 - RKF_C6 };
+
+      for( k = 0; k < 6; k++)
+         tval += err_coeffs[k] * ivals_p[k][i].hi;
+      rval += tval * tval;
+      }
+   return( sqrt( rval * step * step));
+}
+
+/* The RKF integrator uses double-double arithmetic unless DOUBLE_DOUBLE=0
+in 'environ.dat',  or we're on a platform where it wouldn't work (see above),
+in which case it uses long doubles as it always has.  */
+
+double take_rk_step( INTEGRATION_CONTEXT *context, const double jd,
+            ELEMENTS *ref_orbit, const double *ival, double *ovals,
+            const int n_vals, const double step)
+{
+   ldouble ivall[MAX_STM_N_VALS], ovalsl[MAX_STM_N_VALS], rvall;
+   int i;
+
+   if( context->double_double == -1)
+      context->double_double = get_settings( )->double_double;
+#if !defined( FLT_EVAL_METHOD) || FLT_EVAL_METHOD == 0
+   if( context->double_double)
+      return( take_rk_step_dd( context, jd, ref_orbit, ival, ovals,
+                                    n_vals, step));
+#endif
+   assert( n_vals <= MAX_STM_N_VALS);
+   for( i = 0; i < n_vals; i++)
       ivall[i] = (ldouble)ival[i];
-   rvall = take_rk_stepl( (long double)jd, ref_orbit, ivall,
+   rvall = take_rk_stepl( context, (long double)jd, ref_orbit, ivall,
                ovalsl, n_vals, (long double)step);
-   for( i = 0; i < 6; i++)
+   for( i = 0; i < n_vals; i++)
       ovals[i] = (double)ovalsl[i];
    return( (double)rvall);
 }
 
-int symplectic_6( double jd, ELEMENTS *ref_orbit, double *vect,
-                                          const double dt)
+/* integration_method = 3 selects an eighth-order Adams-Bashforth-Moulton
+predictor-corrector.  Once it's running,  each step costs two force
+evaluations (predict,  evaluate,  correct,  evaluate),  compared to twelve
+for PD89.  It's best suited to long stretches of smooth heliocentric
+motion,  such as integrating a numbered asteroid back to the 1800s.  At
+a given tolerance,  it takes longer steps than PD89 (whose error estimate
+is rather pessimistic) and makes larger errors;  'integ_bm' compares the
+two at matched accuracy.
+
+   The method needs the derivatives at the eight previous times.  Those
+are kept,  along with their times,  in the context's MULTISTEP_STATE.  If
+they're evenly spaced at the current step size,  the usual fixed
+coefficients are used.  If not -- after the step size changes,  or after
+a step cut short to stop at an observation -- the coefficients come from
+integrating the polynomial through the eight derivatives over the step
+(by four-point Gauss-Legendre quadrature,  exact for the degree-seven
+Lagrange polynomials).  So step size changes don't cost a restart.
+
+   A step is only added to the history when the next step starts from its
+result,  at the same time and with the same state:  i.e.,  it was
+accepted.  If the next step starts from where the last one did,  that one
+was rejected and is just forgotten.  Anything else (a new integration from
+some other time or state,  a change in perturbers,  Encke,  a reversal of
+direction) means a restart,  taking PD89 steps until the history has
+been filled in.  integrate_orbit_in_context( ) keeps the step size fixed
+until then,  and won't increase it until the history is evenly spaced
+again (see multistep_step_can_grow( )).  Since the history is kept in the context,  an integration
+that picks up where the last left off,  as set_locs( ) does when stopping
+at each observation,  doesn't restart.
+
+   The error estimate is Milne's:  the difference between predictor and
+corrector,  scaled by the ratio of their error constants,  gives the
+error in the corrector.  Error constants are those for order 8,  from
+Hairer,  Norsett & Wanner,  _Solving Ordinary Differential Equations I_,
+section III.1:  -33953/3628800 for the corrector,  1070017/3628800 for
+the predictor,  so the ratio is -33953 / (1070017 + 33953).  (Strictly,
+that's only true for evenly spaced steps,  but it's close enough for
+step size control.) */
+
+#define MILNE_FACTOR (33953. / (1070017. + 33953.))
+
+/* Sets weights[] so that the sum of weights[i] * f(nodes[i]) is the
+integral of f( ) from 0 to 1,  for f( ) a polynomial of degree seven or
+less;  i.e.,  the integrals of the Lagrange polynomials for the nodes. */
+
+static void adams_weights( const double *nodes, double *weights)
+{
+   static const double gauss_x[4] = { .0694318442029737, .3300094782075719,
+                                      .6699905217924281, .9305681557970263 };
+   static const double gauss_w[4] = { .1739274225687269, .3260725774312731,
+                                      .3260725774312731, .1739274225687269 };
+   int i, j, k;
+
+   for( i = 0; i < MULTISTEP_ORDER; i++)
+      {
+      weights[i] = 0.;
+      for( j = 0; j < 4; j++)
+         {
+         double prod = gauss_w[j];
+
+         for( k = 0; k < MULTISTEP_ORDER; k++)
+            if( k != i)
+               prod *= (gauss_x[j] - nodes[k]) / (nodes[i] - nodes[k]);
+         weights[i] += prod;
+         }
+      }
+}
+
+#define SAME_STEP( a, b)  (fabs( (a) - (b)) <= fabs( a) * 1e-9)
+
+/* Called when a step starts from the result of the last one:  that result
+goes into the history as derivs[0]. */
+
+static void add_to_multistep_history( MULTISTEP_STATE *ms, const double jd)
+{
+   const double spacing = jd - ms->jd[0];
+   int j;
+
+   if( ms->n_back < MULTISTEP_ORDER)
+      ms->n_back++;
+   for( j = ms->n_back - 1; j; j--)
+      {
+      ms->jd[j] = ms->jd[j - 1];
+      memcpy( ms->derivs[j], ms->derivs[j - 1], ms->n_vals * sizeof( double));
+      }
+   ms->jd[0] = jd;
+   memcpy( ms->derivs[0], ms->next_deriv, ms->n_vals * sizeof( double));
+   memcpy( ms->state, ms->next_state, ms->n_vals * sizeof( double));
+   if( ms->n_uniform > 1 && SAME_STEP( spacing, ms->step))
+      {
+      ms->n_uniform++;
+      if( ms->max_err < ms->next_err)
+         ms->max_err = ms->next_err;
+      }
+   else
+      {
+      ms->n_uniform = 2;
+      ms->max_err = ms->next_err;
+      }
+   if( ms->n_uniform > ms->n_back)
+      ms->n_uniform = ms->n_back;
+   ms->step = spacing;
+}
+
+/* integrate_orbit_in_context( ) only lets the step grow once the history
+holds MULTISTEP_ORDER derivatives spaced at the current step size,  the
+step just taken is of that size too,  and all those steps had errors
+below 'max_err'.  Otherwise,  the error estimate (and the error) would
+jump around as the history fills in,  and one estimate that happened to
+be small could let the step grow.  */
+
+int multistep_step_can_grow( const INTEGRATION_CONTEXT *context,
+                                    const double max_err)
+{
+   const MULTISTEP_STATE *ms = &context->multistep;
+
+   return( ms->n_uniform == MULTISTEP_ORDER
+            && SAME_STEP( ms->next_jd - ms->jd[0], ms->step)
+            && ms->max_err < max_err && ms->next_err < max_err);
+}
+
+double take_multistep_step( INTEGRATION_CONTEXT *context, const double jd,
+            ELEMENTS *ref_orbit, const double *ival, double *ovals,
+            const int n_vals, const double step)
+{
+   static const double ab_coeffs[MULTISTEP_ORDER] = { 434241., -1152169.,
+            2183877., -2664477., 2102243., -1041723., 295767., -36799. };
+   static const double am_coeffs[MULTISTEP_ORDER] = { 36799., 139849.,
+            -121797., 123133., -88547., 41499., -11351., 1375. };
+   MULTISTEP_STATE *ms = &context->multistep;
+   const size_t n_bytes = n_vals * sizeof( double);
+   double predicted[MAX_STM_N_VALS];
+   double rval = 0.;
+   int i, j;
+
+   assert( n_vals <= MAX_STM_N_VALS);
+   if( ms->n_back && n_vals == ms->n_vals
+                  && SAME_STEP( jd - ms->jd[0], ms->next_jd - ms->jd[0])
+                  && !memcmp( ival, ms->next_state, n_bytes))
+      add_to_multistep_history( ms, jd);     /* last step was accepted */
+   else if( !ms->n_back || n_vals != ms->n_vals || jd != ms->jd[0]
+                  || memcmp( ival, ms->state, n_bytes))
+      ms->n_back = 0;         /* not where we left off:  restart */
+   if( context->perturbers != ms->perturbers || ref_orbit->central_obj != -1
+                  || (ms->n_back > 1 && (ms->jd[0] - ms->jd[1]) * step < 0.))
+      ms->n_back = 0;
+   if( !ms->n_back)
+      {
+      ms->n_vals = n_vals;
+      ms->perturbers = context->perturbers;
+      ms->jd[0] = jd;
+      memcpy( ms->state, ival, n_bytes);
+      calc_derivatives( context, jd, ival, ms->derivs[0],
+                                             ref_orbit->central_obj);
+      ms->n_back = ms->n_uniform = 1;
+      }
+   if( ms->n_back < MULTISTEP_ORDER)     /* (re)starting */
+      {
+      rval = take_pd89_step( context, jd, ref_orbit, ival, ovals,
+                                             n_vals, step);
+      calc_derivatives( context, jd + step, ovals, ms->next_deriv,
+                                             ref_orbit->central_obj);
+      }
+   else
+      {
+      const bool uniform = (ms->n_uniform == MULTISTEP_ORDER
+                                 && SAME_STEP( step, ms->step));
+      double weights[MULTISTEP_ORDER], nodes[MULTISTEP_ORDER];
+
+      if( uniform)
+         for( j = 0; j < MULTISTEP_ORDER; j++)
+            weights[j] = ab_coeffs[j] / 120960.;
+      else
+         {
+         for( j = 0; j < MULTISTEP_ORDER; j++)
+            nodes[j] = (ms->jd[j] - jd) / step;
+         adams_weights( nodes, weights);
+         }
+      for( i = 0; i < n_vals; i++)
+         {
+         double tval = 0.;
+
+         for( j = 0; j < MULTISTEP_ORDER; j++)
+            tval += weights[j] * ms->derivs[j][i];
+         predicted[i] = ival[i] + step * tval;
+         }
+      calc_derivatives( context, jd + step, predicted, ms->next_deriv,
+                                             ref_orbit->central_obj);
+      if( uniform)
+         for( j = 0; j < MULTISTEP_ORDER; j++)
+            weights[j] = am_coeffs[j] / 120960.;
+      else
+         {        /* same nodes,  shifted to include the new one */
+         for( j = MULTISTEP_ORDER - 1; j; j--)
+            nodes[j] = nodes[j - 1];
+         nodes[0] = 1.;
+         adams_weights( nodes, weights);
+         }
+      for( i = 0; i < n_vals; i++)
+         {
+         double tval = weights[0] * ms->next_deriv[i];
+
+         for( j = 1; j < MULTISTEP_ORDER; j++)
+            tval += weights[j] * ms->derivs[j - 1][i];
+         ovals[i] = ival[i] + step * tval;
+         }
+      for( i = 0; i < 6; i++)
+         rval += (ovals[i] - predicted[i]) * (ovals[i] - predicted[i]);
+      rval = sqrt( rval) * MILNE_FACTOR;
+      calc_derivatives( context, jd + step, ovals, ms->next_deriv,
+                                             ref_orbit->central_obj);
+      }
+   ms->next_jd = jd + step;
+   ms->next_err = rval;
+   memcpy( ms->next_state, ovals, n_bytes);
+   return( rval);
+}
+
+/* Dense output:  given the state vectors 'ival' and 'oval' at the start
+and end of a step,  and their derivatives,  we can interpolate the state
+at any fraction 0 < fraction < 1 of the way through the step.  Since we
+know position,  velocity,  and acceleration at both ends,  positions are
+fitted with a quintic Hermite polynomial,  and velocities are its
+derivative.  The error in position goes as step^6 times the sixth
+derivative of the motion,  so this is only good to integration tolerance
+over fairly short steps;  integrate_orbit_in_context( ) checks that at
+one point within the step before relying on it.
+
+   A state transition matrix,  if present,  is interpolated the same way,
+one column at a time;  each column is (position, velocity) partials and
+its derivative is (velocity, acceleration) partials,  just as for the
+state vector itself.  */
+
+void dense_interpolate( const double *ival, const double *ideriv,
+            const double *oval, const double *oderiv, const int n_vals,
+            const double step, const double fraction, double *result)
+{
+   const double t = fraction, t2 = t * t, t3 = t2 * t;
+   const double t4 = t3 * t, t5 = t4 * t;
+   const double h0 = 1. - 10. * t3 + 15. * t4 - 6. * t5;
+   const double h1 = t - 6. * t3 + 8. * t4 - 3. * t5;
+   const double h2 = (t2 - 3. * t3 + 3. * t4 - t5) * .5;
+   const double h3 = (t3 - 2. * t4 + t5) * .5;
+   const double h4 = -4. * t3 + 7. * t4 - 3. * t5;
+   const double h5 = 1. - h0;
+                  /* ...and their derivatives with respect to 'fraction' : */
+   const double dh0 = -30. * t2 + 60. * t3 - 30. * t4;
+   const double dh1 = 1. - 18. * t2 + 32. * t3 - 15. * t4;
+   const double dh2 = (2. * t - 9. * t2 + 12. * t3 - 5. * t4) * .5;
+   const double dh3 = (3. * t2 - 8. * t3 + 5. * t4) * .5;
+   const double dh4 = -12. * t2 + 28. * t3 - 15. * t4;
+   int i, j;
+
+   for( j = 0; j < n_vals; j += 6)
+      for( i = j; i < j + 3; i++)
+         {
+         const double x0 = ival[i], x1 = oval[i];
+         const double v0 = ival[i + 3], v1 = oval[i + 3];
+         const double a0 = ideriv[i + 3], a1 = oderiv[i + 3];
+
+         result[i] = h0 * x0 + h5 * x1 + step * (h1 * v0 + h4 * v1)
+                     + step * step * (h2 * a0 + h3 * a1);
+         result[i + 3] = dh0 * (x0 - x1) / step + dh1 * v0 + dh4 * v1
+                     + step * (dh2 * a0 + dh3 * a1);
+         }
+}
+
+int symplectic_6( INTEGRATION_CONTEXT *context, double jd,
+            ELEMENTS *ref_orbit, double *vect, const double dt)
 {
    int i, j;
 #ifdef FOR_REFERENCE_ONLY
@@ -1617,7 +2917,7 @@ int symplectic_6( double jd, ELEMENTS *ref_orbit, double *vect,
       if( i != 7)
          {
          assert( fabs( jd) < 1e+9);
-         calc_derivatives( jd, vect, deriv, ref_orbit->central_obj);
+         calc_derivatives( context, jd, vect, deriv, ref_orbit->central_obj);
          for( j = 3; j < 6; j++)
             vect[j] += dt * d6[i] * deriv[j];
          }
@@ -1625,3 +2925,265 @@ int symplectic_6( double jd, ELEMENTS *ref_orbit, double *vect,
    return( 0);
 }
 
+
+/* The following functions integrate a whole batch of orbits (Monte Carlo
+or statistical ranging clones,  for example) in lockstep,  all with the
+same steps.  State vectors are in 'structure of arrays' form:  x for each
+object,  then y for each object,  and so on through vz.  That way,  the
+planet positions are looked up once per evaluation for the whole batch,
+and the inner loops run over objects and can be vectorized.
+
+   calc_batch_derivatives( ) handles the usual case for a cloud of clones
+of a heliocentric object:  the sun,  planets and moon as point masses,
+with the planets not being integrated thrown into the sun (as for a
+single object),  plus relativity.  Objects for which more is needed --
+close to a planet (inside .015 AU,  where J2 and such come in,  or near
+Jupiter's or Saturn's satellites),  inside the sun,  in the asteroid
+belt with asteroid perturbers on,  or if there are non-gravitational
+parameters or satellites being included -- are handed off,  one at a
+time,  to the usual calc_derivatives( ).  Those are always integrated
+with the method of Cowell;  the batch integrator doesn't do Encke.
+
+   The caller allocates the scratch space once per batch (its size is
+given by batch_scratch_size( )),  and gets back a flag for each object
+that hit the sun or a planet during the step,  so that object can be
+dropped without failing the rest of the batch.  */
+
+#define J2_LIMIT .015
+
+static void calc_batch_derivatives( INTEGRATION_CONTEXT *context,
+            const double jd, const int n_objects, const double *ival,
+            double *oval, char *use_full_model, char *planet_hits)
+{
+   const unsigned perturbers = context->perturbers;
+   const double *x = ival, *y = ival + n_objects, *z = ival + 2 * n_objects;
+   double *ax = oval + 3 * n_objects, *ay = oval + 4 * n_objects;
+   double *az = oval + 5 * n_objects;
+   double planet_locs[3 * (IDX_MOON + 1)];
+   int i, j, planet;
+   bool all_need_full_model = (context->n_extra_params != 0);
+
+   assert( !context->n_stm_params);
+   memset( use_full_model, 0, n_objects);
+   for( planet = IDX_IO; planet <= IDX_IAPETUS; planet++)
+      if( ((perturbers >> planet) & 1) && !((excluded_perturbers >> planet) & 1))
+         all_need_full_model = true;
+   memcpy( oval, ival + 3 * n_objects, 3 * n_objects * sizeof( double));
+   for( i = 0; i < n_objects; i++)
+      {
+      const double r2 = x[i] * x[i] + y[i] * y[i] + z[i] * z[i];
+      const double r = sqrt( r2);
+      double solar_accel = -SOLAR_GM * (1. + object_mass) / (r2 * r);
+      double state[6], relativistic_accel[3];
+
+      if( all_need_full_model || r < planet_radius[0])
+         use_full_model[i] = 1;
+      if( ((perturbers >> IDX_ASTEROIDS) & 1) && r < 11.5 && r > 1.)
+         use_full_model[i] = 1;
+      for( j = 0; j < 6; j++)
+         state[j] = ival[j * n_objects + i];
+      if( perturbers)
+         set_relativistic_accel( relativistic_accel, state);
+      else
+         relativistic_accel[0] = relativistic_accel[1] =
+                     relativistic_accel[2] = 0.;
+      solar_accel *= include_thrown_in_planets( r, perturbers);
+      ax[i] = solar_accel * x[i] + SOLAR_GM * relativistic_accel[0];
+      ay[i] = solar_accel * y[i] + SOLAR_GM * relativistic_accel[1];
+      az[i] = solar_accel * z[i] + SOLAR_GM * relativistic_accel[2];
+      }
+
+   if( perturbers & 0x7fe)
+      get_perturber_locs( jd, (perturbers & ~excluded_perturbers & 0x7fe)
+                              | (perturbers & (1 << IDX_MOON)), planet_locs);
+   for( planet = 1; planet <= IDX_MOON; planet++)
+      if( ((perturbers >> planet) & 1) && !((excluded_perturbers >> planet) & 1))
+         {
+         double loc[3], mass = planet_mass[planet], limit = planet_radius[planet];
+         double indirect[3], r;
+
+         memcpy( loc, planet_locs + 3 * planet, 3 * sizeof( double));
+         if( planet == IDX_EARTH)
+            if( !((perturbers >> IDX_MOON) & 1) ||
+                 ((excluded_perturbers >> IDX_MOON) & 1))
+               mass += planet_mass[IDX_MOON];
+         if( planet == IDX_JUPITER)
+            {
+            mass = MASS_JUPITER_SYSTEM;
+            limit = GALILEAN_LIMIT;
+            }
+         if( planet == IDX_SATURN)
+            {
+            mass = MASS_SATURN_SYSTEM;
+            limit = TITAN_LIMIT;
+            }
+         if( planet >= IDX_EARTH && planet <= IDX_NEPTUNE && j2_multiplier
+                     && limit < J2_LIMIT)
+            limit = J2_LIMIT;
+         r = vector3_length( loc);
+         for( j = 0; j < 3; j++)
+            indirect[j] = -SOLAR_GM * mass * loc[j] / (r * r * r);
+         for( i = 0; i < n_objects; i++)
+            {
+            const double dx = x[i] - loc[0];
+            const double dy = y[i] - loc[1];
+            const double dz = z[i] - loc[2];
+            const double d2 = dx * dx + dy * dy + dz * dz;
+            const double d = sqrt( d2);
+            const double factor = -SOLAR_GM * mass / (d2 * d);
+
+            if( d < limit)
+               use_full_model[i] = 1;
+            ax[i] += factor * dx + indirect[0];
+            ay[i] += factor * dy + indirect[1];
+            az[i] += factor * dz + indirect[2];
+            }
+         }
+
+            /* Anything inside the sun or a planet is within 'limit' and
+            goes through calc_derivatives( ),  which sets planet_hit;  flag
+            each object that hit something.   */
+   for( i = 0; i < n_objects; i++)
+      if( use_full_model[i])
+         {
+         double state[6], deriv[6];
+
+         for( j = 0; j < 6; j++)
+            state[j] = ival[j * n_objects + i];
+         context->planet_hit = -1;
+         calc_derivatives( context, jd, state, deriv, -1);
+         if( context->planet_hit != -1)
+            planet_hits[i] = 1;
+         for( j = 0; j < 6; j++)
+            oval[j * n_objects + i] = deriv[j];
+         }
+   context->planet_hit = -1;
+}
+
+/* Both the Runge-Kutta-Fehlberg and PD89 integrators are explicit RK
+methods;  the only difference is the tableau.  For each stage,  we need
+its time (as a fraction of the step) and its coefficients,  stored as a
+triangle:  none for the first stage,  one for the second,  two for the
+third,  etc.  These are followed by the weights giving the final result,
+and the ones giving the error estimate.  As with the single-orbit
+integrators,  the error returned is that for the worst object.  */
+
+size_t batch_scratch_size( const int n_objects)
+{
+   const size_t n_bytes = (N_EVALS + 1) * 6 * n_objects * sizeof( double)
+                              + n_objects;
+
+         /* Rounded up,  so anything the caller puts after the scratch */
+         /* area is still aligned for ints or doubles :                */
+   return( (n_bytes + sizeof( double) - 1) / sizeof( double) * sizeof( double));
+}
+
+static double take_batch_tableau_step( INTEGRATION_CONTEXT *context,
+            const double jd, const int n_objects, const double *ival,
+            double *ovals, const double step, const int n_stages,
+            const double *stage_times, const double *bvals,
+            const double *err_coeffs, void *scratch, char *planet_hits)
+{
+   const int n_vals = 6 * n_objects;
+   double *derivs = (double *)scratch;
+   double *state = derivs + n_stages * n_vals;
+   char *use_full_model = (char *)( state + n_vals);
+   double rval = 0.;
+   const double *bptr = bvals;
+   int i, j, k;
+
+   assert( n_stages <= N_EVALS);
+   memset( planet_hits, 0, n_objects);
+   for( j = 0; j < n_stages; j++)
+      {
+      if( j)
+         {
+         memcpy( state, ival, n_vals * sizeof( double));
+         for( k = 0; k < j; k++)
+            {
+            const double mul = bptr[k] * step;
+            const double *dptr = derivs + k * n_vals;
+
+            if( mul)
+               for( i = 0; i < n_vals; i++)
+                  state[i] += mul * dptr[i];
+            }
+         }
+      calc_batch_derivatives( context, jd + step * stage_times[j], n_objects,
+                  (j ? state : ival), derivs + j * n_vals,
+                  use_full_model, planet_hits);
+      bptr += j;
+      }
+   memcpy( ovals, ival, n_vals * sizeof( double));
+   for( k = 0; k < n_stages; k++)
+      if( bptr[k])
+         for( i = 0; i < n_vals; i++)
+            ovals[i] += bptr[k] * step * derivs[k * n_vals + i];
+
+   memset( state, 0, n_vals * sizeof( double));
+   for( k = 0; k < n_stages; k++)
+      if( err_coeffs[k])
+         for( i = 0; i < n_vals; i++)
+            state[i] += err_coeffs[k] * derivs[k * n_vals + i];
+   for( i = 0; i < n_objects; i++)
+      {
+      double err2 = 0.;
+
+      for( j = 0; j < 6; j++)
+         err2 += state[j * n_objects + i] * state[j * n_objects + i];
+      if( rval < err2)
+         rval = err2;
+      }
+   return( sqrt( rval * step * step));
+}
+
+double take_batch_rk_step( INTEGRATION_CONTEXT *context, const double jd,
+            const int n_objects, const double *ival, double *ovals,
+            const double step, void *scratch, char *planet_hits)
+{
+   static const double stage_times[6] = { RKF_A1, RKF_A2, RKF_A3,
+            RKF_A4, RKF_A5, RKF_A6 };
+   static const double bvals[21] = { RKF_B21,
+            RKF_B31, RKF_B32,
+            RKF_B41, RKF_B42, RKF_B43,
+            RKF_B51, RKF_B52, RKF_B53, RKF_B54,
+            RKF_B61, RKF_B62, RKF_B63, RKF_B64, RKF_B65,
+            RKF_CHAT1, RKF_CHAT2, RKF_CHAT3,
+            RKF_CHAT4, RKF_CHAT5, RKF_CHAT6 };
+   static const double err_coeffs[6] = {
+            RKF_CHAT1 - RKF_C1, RKF_CHAT2 - RKF_C2, RKF_CHAT3 - RKF_C3,
+            RKF_CHAT4 - RKF_C4, RKF_CHAT5 - RKF_C5, RKF_CHAT6 - RKF_C6 };
+
+   return( take_batch_tableau_step( context, jd, n_objects, ival, ovals,
+                  step, 6, stage_times, bvals, err_coeffs,
+                  scratch, planet_hits));
+}
+
+double take_batch_pd89_step( INTEGRATION_CONTEXT *context, const double jd,
+            const int n_objects, const double *ival, double *ovals,
+            const double step, void *scratch, char *planet_hits)
+{
+   static const double stage_times[N_EVALS] = { A_1, A_2, A_3, A_4, A_5,
+             A_6, A_7, A_8, A_9, A_10, A_11, A_12, A_13 };
+   static const double bvals[91] = { B_2_1,
+       B_3_1, B_3_2,
+       B_4_1, B_4_2, B_4_3,
+       B_5_1, B_5_2, B_5_3, B_5_4,
+       B_6_1, B_6_2, B_6_3, B_6_4, B_6_5,
+       B_7_1, B_7_2, B_7_3, B_7_4, B_7_5, B_7_6,
+       B_8_1, B_8_2, B_8_3, B_8_4, B_8_5, B_8_6, B_8_7,
+       B_9_1, B_9_2, B_9_3, B_9_4, B_9_5, B_9_6, B_9_7, B_9_8,
+       B_10_1, B_10_2, B_10_3, B_10_4, B_10_5, B_10_6, B_10_7, B_10_8, B_10_9,
+       B_11_1, B_11_2, B_11_3, B_11_4, B_11_5, B_11_6, B_11_7, B_11_8, B_11_9, B_11_10,
+       B_12_1, B_12_2, B_12_3, B_12_4, B_12_5, B_12_6, B_12_7, B_12_8, B_12_9, B_12_10, B_12_11,
+       B_13_1, B_13_2, B_13_3, B_13_4, B_13_5, B_13_6, B_13_7, B_13_8, B_13_9, B_13_10, B_13_11, B_13_12,
+       CHAT_1, CHAT_2, CHAT_3, CHAT_4, CHAT_5, CHAT_6, CHAT_7, CHAT_8, CHAT_9, CHAT_10, CHAT_11, CHAT_12, CHAT_13 };
+   static const double err_coeffs[N_EVALS] = { CHAT_1 - C_1, CHAT_2 - C_2,
+            CHAT_3  -  C_3, CHAT_4  -  C_4, CHAT_5  -  C_5, CHAT_6 - C_6,
+            CHAT_7  -  C_7, CHAT_8  -  C_8, CHAT_9  -  C_9, CHAT_10 - C_10,
+            CHAT_11 - C_11, CHAT_12 - C_12, CHAT_13 - C_13 };
+
+   return( take_batch_tableau_step( context, jd, n_objects, ival, ovals,
+                  step, N_EVALS, stage_times, bvals, err_coeffs,
+                  scratch, planet_hits));
+}
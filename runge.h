@@ -0,0 +1,167 @@
+/* runge.h: numerical integration context and single-step integrators
+
+Copyright (C) 2010, Project Pluto
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+02110-1301, USA.    */
+
+/* Everything the force model and step-size control used to keep in
+globals or function-static variables now lives in an INTEGRATION_CONTEXT.
+Two integrations using different contexts share no mutable state of
+their own (the planet position cache and the like are another matter),
+so several orbits can be integrated at once.
+
+   The process-wide 'perturbers',  'n_extra_params' and 'solar_pressure[]'
+are still where the user interface stores its settings.  A context is
+seeded from them with init_integration_context( );  plain integrate_orbit( )
+does that for you,  using one process-wide default context.  */
+
+#define MAX_N_NONGRAV_PARAMS     3
+
+/* If n_stm_params = N is non-zero,  the 'state vector' being integrated
+is the usual six-element position/velocity,  followed by a 6xN state
+transition matrix,  stored column by column.  Column k is the partial
+derivative of the state with respect to parameter k.  Parameters 0-5 are
+the initial position/velocity;  any after that are the non-gravitational
+parameters,  solar_pressure[0...].  So the matrix starts out as a 6x6
+identity matrix followed by zeroes.  See 'runge.cpp'.  */
+
+#define MAX_STM_PARAMS     (6 + MAX_N_NONGRAV_PARAMS)
+#define STM_N_VALS( n_params)   (6 + 6 * (n_params))
+#define MAX_STM_N_VALS     STM_N_VALS( MAX_STM_PARAMS)
+
+/* If FORCE_PROFILE is set in 'environ.dat',  calc_derivatives( ) keeps
+track of how often each part of the force model was evaluated,  and how
+much time was spent on it.  Each context accumulates its own profile;
+integrate_orbit_in_context( ) adds that to a process-wide total,  which
+'fo' and 'find_orb' write out for each object.  See 'runge.cpp'.  */
+
+#define PROFILE_PLANETS          0
+#define PROFILE_ASTEROIDS        1
+#define PROFILE_GEOPOTENTIAL     2
+#define PROFILE_RELATIVITY       3
+#define PROFILE_NONGRAV          4
+#define PROFILE_DRAG             5
+#define N_PROFILE_TERMS          6
+
+#define FORCE_PROFILE struct force_profile
+
+FORCE_PROFILE
+   {
+   long n_calls[N_PROFILE_TERMS];
+   int64_t ns[N_PROFILE_TERMS];
+   long n_evaluations, n_steps, n_rejected_steps;
+   int64_t total_ns;
+   };
+
+/* History kept by the multistep integrator,  in the context so that it
+carries over from one integrate_orbit_in_context( ) call to the next;  see
+take_multistep_step( ) in 'runge.cpp'.  Set n_back = 0 to (re)start it. */
+
+#define MULTISTEP_ORDER       8
+#define MULTISTEP_STATE struct multistep_state
+
+MULTISTEP_STATE
+   {
+   int n_back;                   /* number of derivs[] filled in */
+   int n_uniform;                /* how many of those are 'step' apart */
+   int n_vals;
+   unsigned perturbers;          /* perturbers used for derivs[] */
+   double step;
+   double max_err;               /* largest error since 'step' changed */
+   double jd[MULTISTEP_ORDER];   /* times of derivs[],  [0] = most recent */
+   double derivs[MULTISTEP_ORDER][MAX_STM_N_VALS];
+   double state[MAX_STM_N_VALS];       /* state at jd[0] */
+         /* Result of the last step taken,  added to the history */
+         /* if the next step starts from it (i.e.,  it was accepted) */
+   double next_jd, next_err;
+   double next_state[MAX_STM_N_VALS], next_deriv[MAX_STM_N_VALS];
+   };
+
+#define INTEGRATION_CONTEXT struct integration_context
+
+INTEGRATION_CONTEXT
+   {
+   unsigned perturbers;          /* bitmask of planets/moons/asteroids */
+   unsigned perturbers_found;    /* set by automatic perturber detection */
+   int n_extra_params;           /* 1=SRP/AMR,  2 or 3=comet A1,A2(,A3) */
+   double solar_pressure[MAX_N_NONGRAV_PARAMS];
+         /* Step size control,  carried from one integrate_orbit( ) call */
+         /* to the next.  Negative/-1 values mean 'not yet set from     */
+         /* environ.dat'.                                                */
+   double stepsize, fixed_stepsize, min_stepsize;
+   int use_encke, n_changes;
+   double pruning;               /* PRUNE_PERTURBERS factor;  -1 = not read */
+   int double_double;            /* RKF arithmetic;  see take_rk_step( ) */
+   int show_messages;            /* console progress display;  off for  */
+                                 /* integrations run on worker threads  */
+   int n_stm_params;             /* 0 = just integrate the orbit */
+         /* If n_dense is non-zero,  integrate_orbit_in_context( ) also  */
+         /* sets dense_states[] (n_vals doubles each) to the state at    */
+         /* each of the n_dense dense_times[],  which must be in order   */
+         /* of integration and end at t1.  See 'orb_func.cpp'.           */
+   int n_dense;
+   const double *dense_times;
+   double *dense_states;
+   long n_evaluations;           /* force model evaluations so far */
+   FORCE_PROFILE profile;        /* only used if force_profiling is set */
+   MULTISTEP_STATE multistep;    /* only used with integration_method 3 */
+         /* Outputs from calc_derivatives( ) : */
+   int best_fit_planet, planet_hit;
+   double best_fit_planet_dist;
+   };
+
+void init_integration_context( INTEGRATION_CONTEXT *context);
+int integrate_orbit_in_context( INTEGRATION_CONTEXT *context,
+            double *orbit, const double t0, const double t1);  /* orb_func.c */
+int calc_derivatives( INTEGRATION_CONTEXT *context, const double jd,
+            const double *ival, double *oval,
+            const int reference_planet);                       /* runge.cpp */
+double take_rk_step( INTEGRATION_CONTEXT *context, const double jd,
+            ELEMENTS *ref_orbit, const double *ival, double *ovals,
+            const int n_vals, const double step);              /* runge.cpp */
+double take_rk_step_dd( INTEGRATION_CONTEXT *context, const double jd,
+            ELEMENTS *ref_orbit, const double *ival, double *ovals,
+            const int n_vals, const double step);              /* runge.cpp */
+double take_pd89_step( INTEGRATION_CONTEXT *context, const double jd,
+            ELEMENTS *ref_orbit, const double *ival, double *ovals,
+            const int n_vals, const double step);              /* runge.cpp */
+double take_multistep_step( INTEGRATION_CONTEXT *context, const double jd,
+            ELEMENTS *ref_orbit, const double *ival, double *ovals,
+            const int n_vals, const double step);              /* runge.cpp */
+int multistep_step_can_grow( const INTEGRATION_CONTEXT *context,
+                                    const double max_err);     /* runge.cpp */
+void dense_interpolate( const double *ival, const double *ideriv,
+            const double *oval, const double *oderiv, const int n_vals,
+            const double step, const double fraction,
+            double *result);                                    /* runge.cpp */
+int symplectic_6( INTEGRATION_CONTEXT *context, double jd,
+            ELEMENTS *ref_orbit, double *vect, const double dt); /* runge.cpp */
+size_t batch_scratch_size( const int n_objects);             /* runge.cpp */
+double take_batch_rk_step( INTEGRATION_CONTEXT *context, const double jd,
+            const int n_objects, const double *ival, double *ovals,
+            const double step, void *scratch,
+            char *planet_hits);                                 /* runge.cpp */
+double take_batch_pd89_step( INTEGRATION_CONTEXT *context, const double jd,
+            const int n_objects, const double *ival, double *ovals,
+            const double step, void *scratch,
+            char *planet_hits);                                 /* runge.cpp */
+int integrate_orbits_in_lockstep( INTEGRATION_CONTEXT *context,
+            double *orbits, const int n_orbits,
+            const double t0, const double t1, int *rvals);     /* orb_func.c */
+void harvest_force_profile( INTEGRATION_CONTEXT *context);     /* runge.cpp */
+unsigned find_negligible_perturbers( const double jd, const double *state,
+            const unsigned candidates, const double span,
+            const double horizon, const double tolerance);     /* runge.cpp */
@@ -0,0 +1,58 @@
+/* threads.h: minimal wrappers for the bits of threading Find_Orb uses
+
+Copyright (C) 2010, Project Pluto
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+02110-1301, USA.    */
+
+/* Threads are only used on *nix boxes (the same ones on which 'fo' can
+fork() itself),  via POSIX threads.  Elsewhere,  FIND_ORB_THREADS isn't
+defined,  the mutex macros do nothing,  and everything runs in a single
+thread just as it always has.
+
+   Code shared between threads either keeps its state in an
+INTEGRATION_CONTEXT (see 'runge.h'),  or is guarded by one of these
+mutexes,  or (for small lazily-computed caches) uses THREAD_LOCAL
+storage so each thread has its own copy.  Data that's rebuilt now and
+then (settings,  the geopotential grid) is built off to one side,  then
+published by swapping a pointer with ATOMIC_STORE( );  readers get the
+pointer with ATOMIC_LOAD( ),  and so see either the old or new version,
+never a half-built one.  Counters bumped from several threads (cache
+statistics and such) use ATOMIC_ADD( ).   */
+
+#if defined( __linux) || defined( __unix__) || defined( __APPLE__)
+   #define FIND_ORB_THREADS
+#endif
+
+#ifdef FIND_ORB_THREADS
+   #include <pthread.h>
+
+   #define FIND_ORB_MUTEX( name) \
+                  static pthread_mutex_t name = PTHREAD_MUTEX_INITIALIZER
+   #define LOCK_MUTEX( name)      pthread_mutex_lock( &name)
+   #define UNLOCK_MUTEX( name)    pthread_mutex_unlock( &name)
+   #define THREAD_LOCAL           __thread
+   #define ATOMIC_LOAD( ptr)      __atomic_load_n( ptr, __ATOMIC_ACQUIRE)
+   #define ATOMIC_STORE( ptr, val) __atomic_store_n( ptr, val, __ATOMIC_RELEASE)
+   #define ATOMIC_ADD( ptr, val)  __atomic_add_fetch( ptr, val, __ATOMIC_RELAXED)
+#else
+   #define FIND_ORB_MUTEX( name)  static int name = 0
+   #define LOCK_MUTEX( name)      (void)name
+   #define UNLOCK_MUTEX( name)    (void)name
+   #define THREAD_LOCAL
+   #define ATOMIC_LOAD( ptr)      (*(ptr))
+   #define ATOMIC_STORE( ptr, val) (*(ptr) = (val))
+   #define ATOMIC_ADD( ptr, val)  (*(ptr) += (val))
+#endif